@@ -0,0 +1,262 @@
+#!/usr/bin/env ruby
+#
+# DevIL-Ruby benchmark suite.
+#
+# Times the common load/encode/convert/ILU paths over synthetic images
+# and writes the results as JSON, so runs against different DevIL or
+# extension builds can be compared.  Build the extension first:
+#
+#   ruby extconf.rb && make
+#   ruby bench/bench.rb -o base.json                # record a baseline
+#   ruby bench/bench.rb -b base.json -o new.json    # run and compare
+#   ruby bench/bench.rb compare base.json new.json  # compare two runs
+#
+# Comparisons flag every result whose median time grew by more than the
+# threshold (default 10%) and exit with status 1 if there are any.
+#
+
+$LOAD_PATH.unshift File.expand_path('..', File.dirname(__FILE__))
+
+require 'json'
+require 'optparse'
+require 'rbconfig'
+
+SIZES    = [256, 1024, 4096, 8192]
+FORMATS  = %w(png jpg tga dds)
+CONTENTS = %w(photo flat alpha deep hdr)
+
+def parse_options(argv)
+  opts = {
+    :sizes      => SIZES,
+    :formats    => FORMATS,
+    :contents   => CONTENTS,
+    :iterations => nil,
+    :min_time   => 1.0,
+    :threshold  => 10.0,
+  }
+
+  OptionParser.new do |o|
+    o.banner = "usage: #{$0} [options]\n       #{$0} compare BASELINE RESULTS [options]"
+    o.on('-s', '--sizes LIST', Array, "image sizes (default #{SIZES.join(',')})") { |v| opts[:sizes] = v.map { |s| Integer(s) } }
+    o.on('-f', '--formats LIST', Array, "formats (default #{FORMATS.join(',')})") { |v| opts[:formats] = v }
+    o.on('-c', '--contents LIST', Array, "image contents (default #{CONTENTS.join(',')})") { |v| opts[:contents] = v }
+    o.on('-n', '--iterations N', Integer, 'fixed number of timed runs per case') { |v| opts[:iterations] = v }
+    o.on('-t', '--min-time SECS', Float, 'time each case for at least this long (default 1)') { |v| opts[:min_time] = v }
+    o.on('-o', '--output FILE', 'write results as JSON to FILE (default stdout)') { |v| opts[:output] = v }
+    o.on('-b', '--baseline FILE', 'compare the results against FILE') { |v| opts[:baseline] = v }
+    o.on('--threshold PCT', Float, 'regression threshold in percent (default 10)') { |v| opts[:threshold] = v }
+  end.parse!(argv)
+
+  opts
+end
+
+#
+# Synthetic images
+#
+
+# smooth noise with some fine grain, like a photograph
+def photo(size, bpp)
+  im = DevIL::Image.new
+  im.tex_image(size, size, 1, bpp, bpp == 4 ? DevIL::IL::RGBA : DevIL::IL::RGB,
+               DevIL::IL::UNSIGNED_BYTE, Random.new(size).bytes(size * size * bpp))
+  im.blur_avg(3)
+  im
+end
+
+# large flat areas of a few colours, like UI graphics or diagrams
+def flat(size)
+  colours = [[255, 255, 255], [32, 64, 160], [230, 40, 40], [20, 20, 20], [250, 200, 0]]
+  block = [size / 16, 1].max
+  rows = (0...5).map do |i|
+    (0...size).map { |x| colours[(x / block + i) % colours.size] }.flatten.pack('C*')
+  end
+  data = (0...size).map { |y| rows[(y / block) % rows.size] }.join
+
+  im = DevIL::Image.new
+  im.tex_image(size, size, 1, 3, DevIL::IL::RGB, DevIL::IL::UNSIGNED_BYTE, data)
+  im
+end
+
+# a photo with wider channels, so the kernels see non-byte layouts
+def wide(size, bpp, format, type)
+  im = photo(size, bpp)
+  im.convert_image(format, type)
+  im
+end
+
+def make_image(content, size)
+  case content
+  when 'photo' then photo(size, 3)
+  when 'flat'  then flat(size)
+  when 'alpha' then photo(size, 4)
+  when 'deep'  then wide(size, 3, DevIL::IL::RGB, DevIL::IL::UNSIGNED_SHORT)
+  when 'hdr'   then wide(size, 4, DevIL::IL::RGBA, DevIL::IL::FLOAT)
+  else raise ArgumentError, "unknown content: #{content}"
+  end
+end
+
+#
+# Timing
+#
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# run setup + block until min_time (or n runs) has passed; times only the block
+def measure(opts, setup = nil)
+  setup.call if setup
+  yield # warm up
+
+  times = []
+  started = now
+  loop do
+    setup.call if setup
+    t = now
+    yield
+    times << now - t
+    break if opts[:iterations] ? times.size >= opts[:iterations] : (now - started >= opts[:min_time] && times.size >= 3)
+  end
+
+  times.sort!
+  {
+    'runs'   => times.size,
+    'min'    => times.first,
+    'median' => times[times.size / 2],
+    'mean'   => times.inject(:+) / times.size,
+  }
+end
+
+def format_type(name)
+  { 'png' => DevIL::IL::PNG, 'jpg' => DevIL::IL::JPG, 'tga' => DevIL::IL::TGA, 'dds' => DevIL::IL::DDS }.fetch(name) do
+    raise ArgumentError, "unknown format: #{name}"
+  end
+end
+
+def run(opts)
+  results = []
+  record = lambda do |op, content, size, format, stats|
+    stats.merge!('op' => op, 'content' => content, 'size' => size, 'format' => format,
+                 'mpix_per_s' => size * size / 1e6 / stats['median'])
+    results << stats
+    $stderr.printf("%-16s %-6s %5d %-4s %10.3f ms  %8.1f MP/s\n",
+                   op, content, size, format || '-', stats['median'] * 1000, stats['mpix_per_s'])
+  end
+
+  opts[:contents].each do |content|
+    opts[:sizes].each do |size|
+      src = make_image(content, size)
+      fmt = src.format
+      work = DevIL::Image.new
+
+      opts[:formats].each do |format|
+        type = format_type(format)
+        encoded = src.save_l(type)
+        next $stderr.puts("#{format}: cannot encode #{content} #{size}") unless encoded
+
+        record.call('save_l', content, size, format, measure(opts) { src.save_l(type) })
+        record.call('load_l', content, size, format, measure(opts) { work.load_l(type, encoded) })
+      end
+
+      dxtc = ''
+      record.call('get_dxtc_data', content, size, nil, measure(opts) { src.get_dxtc_data(dxtc, DevIL::IL::DXT5) })
+
+      dest = fmt == DevIL::IL::RGB ? DevIL::IL::RGBA : DevIL::IL::RGB
+      reset = lambda { work.copy_image(src.name) }
+      record.call('convert_image', content, size, nil,
+                  measure(opts, reset) { work.convert_image(dest, DevIL::IL::UNSIGNED_BYTE) })
+      record.call('scale', content, size, nil, measure(opts, reset) { work.scale(size / 2, size / 2, 1) })
+      record.call('resample', content, size, nil, measure(opts, reset) { work.resample(size / 2, size / 2) })
+      record.call('blur_gaussian', content, size, nil, measure(opts, reset) { work.blur_gaussian(1) })
+      record.call('blur', content, size, nil, measure(opts, reset) { work.blur(10) })
+      record.call('pipeline', content, size, nil, measure(opts, reset) {
+        DevIL::Pipeline.new(work).contrast(1.2).gamma_correct(1.8).scale_colors(1, 0.9, 0.9).negative.run
+      })
+      record.call('build_mipmaps', content, size, nil, measure(opts, reset) { work.build_mipmaps })
+      record.call('mipmap_chain', content, size, nil, measure(opts, reset) { work.mipmap_chain })
+
+      other = src.dup
+      other.blur_avg(3)
+      record.call('compare_image', content, size, nil, measure(opts) { src.compare_image(other.name) })
+      record.call('compare', content, size, nil, measure(opts) { src.compare(other, 2) })
+      other.delete
+
+      pixels = src.pixel_buffer
+      back = pixels.to_image
+      abort "#{content} #{size}: pixel_buffer round trip changed the image" unless
+        back.pixel_buffer.to_s == pixels.to_s && back.get_integer(DevIL::IL::IMAGE_CHANNELS) == pixels.channels
+      back.delete
+      record.call('pixel_buffer', content, size, nil, measure(opts) { src.pixel_buffer })
+
+      record.call('colors_used', content, size, nil, measure(opts) { src.colors_used })
+      record.call('histogram', content, size, nil, measure(opts) { src.histogram })
+      record.call('stats', content, size, nil, measure(opts) { src.stats })
+
+      src.delete
+      work.delete
+      GC.start
+    end
+  end
+
+  {
+    'meta' => {
+      'time'          => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+      'ruby'          => RUBY_DESCRIPTION,
+      'host'          => RbConfig::CONFIG['host'],
+      'il_version'    => DevIL::IL.get_integer(DevIL::IL::VERSION_NUM),
+      'devil_version' => DevIL::DEVIL_VERSION,
+    },
+    'results' => results,
+  }
+end
+
+#
+# Comparison
+#
+
+def key(r)
+  [r['op'], r['content'], r['size'], r['format']]
+end
+
+def compare(base, current, threshold)
+  old = {}
+  base['results'].each { |r| old[key(r)] = r }
+
+  regressions = 0
+  current['results'].each do |r|
+    next unless (b = old[key(r)])
+    change = (r['median'] / b['median'] - 1) * 100
+    flag = change > threshold ? 'REGRESSION' : (change < -threshold ? 'faster' : '')
+    regressions += 1 if change > threshold
+    printf("%-16s %-6s %5d %-4s %10.3f -> %10.3f ms  %+7.1f%%  %s\n",
+           r['op'], r['content'], r['size'], r['format'] || '-',
+           b['median'] * 1000, r['median'] * 1000, change, flag)
+  end
+
+  puts "#{regressions} regression(s) above #{threshold}%"
+  regressions
+end
+
+if ARGV.first == 'compare'
+  ARGV.shift
+  opts = parse_options(ARGV)
+  abort "usage: #{$0} compare BASELINE RESULTS" unless ARGV.size == 2
+  base, current = ARGV.map { |f| JSON.parse(File.read(f)) }
+  exit(compare(base, current, opts[:threshold]) > 0 ? 1 : 0)
+end
+
+require 'devil'
+
+opts = parse_options(ARGV)
+results = run(opts)
+
+json = JSON.pretty_generate(results)
+if opts[:output]
+  File.write(opts[:output], json)
+else
+  puts json
+end
+
+if opts[:baseline]
+  exit(compare(JSON.parse(File.read(opts[:baseline])), results, opts[:threshold]) > 0 ? 1 : 0)
+end
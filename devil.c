@@ -1,6 +1,46 @@
 #include <ruby.h>
+#include <ruby/encoding.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
+#ifdef HAVE_RUBY_RACTOR_H
+#include <ruby/ractor.h>
+#endif
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
 #include <IL/il.h>
 #include <IL/ilu.h>
+#include "devil_plugin.h"
+
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(s) (RSTRING(s)->ptr)
+#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
 
 #define DEVIL_VERSION "0.1.0"
 #define UNUSED(a) ((void) (a))
@@ -18,778 +58,9874 @@
   } while (0)
 
 /* utility functions */
-static char *get_ext(char *str);
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  unsigned char buf[64];
+} sha256_ctx;
+
+static const char *get_ext(const char *str);
+static void sha256_init(sha256_ctx *c);
+static void sha256_update(sha256_ctx *c, const void *data, size_t len);
+static void sha256_final(sha256_ctx *c, unsigned char *out);
 
 static VALUE mDevil,
              mIl,
              mIlu,
+             mBatch,
+             cPool,
+             cCache,
+             cPipeline,
+             cImage,
              load_procs,
-             save_procs;
+             save_procs,
+             data_views;
+
+/****************/
+/* DevIL worker */
+/****************/
 
 /*
- * Set the active image.
+ * DevIL keeps all of its state (the bound image, registered loaders,
+ * error stack, etc) in globals, so calls into IL and ILU have to be
+ * serialized.  Slow operations (loading, saving, conversions and ILU
+ * filters) are queued to a single native thread which owns the IL/ILU
+ * state and runs them while the calling Ruby thread waits with the GVL
+ * released.  Quick accessors run inline once the queue has drained;
+ * since jobs can only be queued by a thread holding the GVL, the worker
+ * stays idle until the accessor returns.
  *
- * Aliases:
- *   DevIL::IL::active_image
- *   DevIL::IL::ActiveImage
+ * A job which needs Ruby (reading from an IO, say) posts a callback
+ * with devil_call_ruby(); the waiting thread runs it with the GVL and
+ * hands the result back to the worker.  The worker is blocked until the
+ * callback returns, so DevIL calls made from the callback run inline.
+ * Any Ruby thread or fiber waiting on the worker from the thread which
+ * queued the job may run the callback, so a job never waits on a fiber
+ * which the scheduler has parked while another one blocks the thread.
  *
- * Examples:
- *   DevIL::IL::active_image im_id
- *   DevIL::IL::ActiveImage im_id
- * 
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00008.htm
- * 
+ * Jobs queued by the async bindings (load_async and friends) under a
+ * Fiber::Scheduler also signal an eventfd (or pipe) when they finish
+ * or post a callback, and their fiber waits on it through the
+ * scheduler, so other fibers keep running meanwhile.
+ *
+ * The worker also tracks which image is bound (see devil_select), so
+ * DevIL::Image methods only call ilBindImage when the binding changes.
  */
-static VALUE il_active_im(VALUE self, VALUE num) {
-  return ilActiveImage(NUM2INT(num)) ? Qtrue : Qfalse;
-}
+typedef struct devil_job {
+  void *(*func)(void *);
+  void *arg,
+       *ret;
+  void *(*call)(void *);    /* ruby callback requested by the job */
+  void *call_arg,
+       *call_ret;
+  const void *owner;        /* the queueing thread's devil_owner */
+  ILuint bind;              /* image to bind first, or BIND_NONE */
+  int done,
+      serving,              /* a callback is being run */
+      state,                /* tag of an exception raised by a callback */
+      notify;               /* written when done or calling, or -1 */
+  struct devil_job *next;
+} devil_job;
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t  queued,   /* job added to queue */
+                  finished, /* job completed or callback posted */
+                  called;   /* callback completed */
+  pthread_t thread;
+  devil_job *head,
+            *tail,
+            *current;
+  int started,
+      pending;              /* queued + running jobs */
+} worker = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+};
 
 /*
- * Set the active layer.
- *
- * Aliases:
- *   DevIL::IL::active_layer
- *   DevIL::IL::ActiveLayer
- *
- * Examples:
- *   DevIL::IL::active_layer layer_id
- *   DevIL::IL::ActiveLayer layer_id
+ * Argument block for the simple jobs below: one slot per DevIL
+ * argument, converted from Ruby values before the job is queued.
+ */
+typedef union {
+  ILint i;
+  ILuint u;
+  ILfloat f;
+  void *p;
+} devil_arg;
+
+/*
+ * Define a worker job which evaluates a single DevIL call.  The call
+ * reads its arguments from the devil_arg array "a".
+ */
+#define DEVIL_JOB(name, call)                 \
+  static void *name(void *ptr) {              \
+    devil_arg *a = ptr;                       \
+    UNUSED(a);                                \
+    return (void *) (size_t) (call);          \
+  }
+
+/*
+ * Bind elision.  devil_bound mirrors the image bound in DevIL, or is
+ * BIND_NONE after anything which may have changed the binding (or the
+ * bound image's active sub-image) behind our back.  A DevIL::Image
+ * method sets devil_want (per thread, as the binding may let other
+ * threads run before it queues its job) and calls the binding; the next
+ * job carries it to the worker, which binds it before running the job
+ * unless it is already bound, so the bind and the operation run as one
+ * unit.  Inline calls do the same after devil_sync.
  *
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00190.htm
- * 
+ * Images collected by the GC can't be deleted from the collector, so
+ * their names go on the dead list and are deleted before the next job.
  */
-static VALUE il_active_layer(VALUE self, VALUE num) {
-  return ilActiveLayerr(NUM2INT(num)) ? Qtrue : Qfalse;
+#define BIND_NONE ((ILuint) -1)
+
+static ILuint devil_bound = BIND_NONE;
+static __thread ILuint devil_want = BIND_NONE;
+static __thread int devil_calling;      /* running a callback for the worker */
+static __thread int devil_async;        /* next job waits through the scheduler */
+static __thread char devil_owner;       /* its address tags this thread's jobs */
+
+static struct {
+  ILuint *names;
+  long len,
+       capa;
+} dead;
+
+/* on the thread running DevIL: bind name unless it is bound already */
+static void devil_select(ILuint name) {
+  if (name == BIND_NONE || name == devil_bound)
+    return;
+
+  ilBindImage(name);
+  devil_bound = name;
 }
 
 /*
- * Set the active mipmap.
- *
- * Aliases:
- *   DevIL::IL::active_mipmap
- *   DevIL::IL::ActiveMipmap
- *
- * Examples:
- *   DevIL::IL::active_mipmap mm_id
- *   DevIL::IL::ActiveMipmap mm_id
- * 
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00009.htm
- * 
+ * Recycled images.  Deleted images (delete_images, DevIL::Image#delete
+ * and collected Images) are kept, up to recycle.limit of them, and
+ * handed out again by gen_images and checkout_image instead of having
+ * DevIL free and allocate image structs.  Each entry remembers the
+ * image's layout, so checkout_image can pick one which already has the
+ * requested layout and keep its pixel buffer as it is.  Pixel buffers
+ * are only kept while they total at most recycle.max_bytes; past that
+ * an image is shrunk to 1x1 before it is kept.  Like the rest of
+ * DevIL's state, the list is only touched by the thread running DevIL.
  */
-static VALUE il_active_mipmap(VALUE self, VALUE num) {
-  return ilActiveMipmap(NUM2INT(num)) ? Qtrue : Qfalse;
+#define RECYCLE_BYTES (64 << 20)
+
+typedef struct {
+  ILuint name,
+         width, height, depth, channels,
+         format, type,
+         size;                /* bytes of pixel data kept */
+} recycled_image;
+
+static struct {
+  recycled_image *images;
+  long len,
+       limit;
+  size_t bytes,
+         max_bytes;
+} recycle;
+
+/* take entry i off the list, returning its name */
+static ILuint recycle_take(long i) {
+  ILuint name = recycle.images[i].name;
+
+  recycle.bytes -= recycle.images[i].size;
+  recycle.images[i] = recycle.images[--recycle.len];
+
+  return name;
+}
+
+/* whether name was deleted and is parked on the list */
+static int devil_parked(ILuint name) {
+  long i;
+
+  for (i = 0; i < recycle.len; i++)
+    if (recycle.images[i].name == name)
+      return 1;
+
+  return 0;
+}
+
+/* ilIsImage, minus the names parked for reuse */
+static int devil_is_image(ILuint name) {
+  return ilIsImage(name) && !devil_parked(name);
+}
+
+static int devil_recycle(ILuint name) {
+  recycled_image *img;
+
+  if (!name || recycle.len >= recycle.limit || !ilIsImage(name))
+    return 0;
+
+  devil_select(name);
+  img = &recycle.images[recycle.len++];
+  img->name = name;
+  img->width = ilGetInteger(IL_IMAGE_WIDTH);
+  img->height = ilGetInteger(IL_IMAGE_HEIGHT);
+  img->depth = ilGetInteger(IL_IMAGE_DEPTH);
+  img->channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  img->format = ilGetInteger(IL_IMAGE_FORMAT);
+  img->type = ilGetInteger(IL_IMAGE_TYPE);
+  img->size = ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
+
+  /* sub-images would survive a reuse as is; force a ilTexImage */
+  if (ilGetInteger(IL_NUM_MIPMAPS) || ilGetInteger(IL_NUM_LAYERS) || ilGetInteger(IL_NUM_IMAGES))
+    img->width = 0;
+
+  /* over budget: keep the image struct but not its pixels */
+  if (recycle.bytes + img->size > recycle.max_bytes) {
+    ilTexImage(1, 1, 1, 1, IL_LUMINANCE, IL_UNSIGNED_BYTE, NULL);
+    img->width = 0;
+    img->size = 0;
+  }
+  recycle.bytes += img->size;
+
+  return 1;
 }
 
 /*
- * Apply pal to current image.
- *
- * Aliases:
- *   DevIL::IM::apply_pal
- *   DevIL::IM::ApplyPal
- *
- * Examples:
- *   DevIL::IL::apply_path path/to/pal
- *   DevIL::IL::ApplyPath path/to/pal
- *
+ * Delete (or recycle) images.  As with ilDeleteImages, deleting the
+ * bound image leaves the default image bound; otherwise the binding is
+ * kept.
  */
-static VALUE il_apply_pal(VALUE self, VALUE path) {
-  return ilApplyPal(RSTRING(path)->ptr) ? Qtrue : Qfalse;
+static void devil_delete_images(ILsizei n, ILuint *names) {
+  ILuint prev = devil_bound;
+  ILsizei i, k = 0;
+  int hit = 0;
+
+  if (prev == BIND_NONE)
+    prev = ilGetInteger(IL_CUR_IMAGE);
+
+  for (i = 0; i < n; i++) {
+    hit |= (names[i] == prev);
+    /* deleting a parked name again must not park or free it twice */
+    if (!devil_parked(names[i]) && !devil_recycle(names[i]))
+      names[k++] = names[i];
+  }
+
+  if (k)
+    ilDeleteImages(k, names);
+
+  if (hit) {
+    ilBindImage(0);
+    devil_bound = 0;
+  } else if (k < n) {
+    devil_select(prev);
+  }
 }
 
 /*
- * Apply color profile to current image.
- *
- * Aliases:
- *   DevIL::IL::apply_profile
- *   DevIL::IL::ApplyProfile
- *
- * Examples:
- *   DevIL::IL::apply_profile in_p, out_p
- *   DevIL::IL::ApplyProfile in_p, out_p
- *   
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00208.htm
- *
+ * Hand out a recycled image (reset to a fresh 1x1 image), or 0 if
+ * there are none.
  */
-static VALUE il_apply_profile(VALUE self, VALUE in, VALUE out) {
-  return ilApplyProfile(RSTRING(in)->ptr, RSTRING(out)->ptr) ? Qtrue : Qfalse;
+static ILuint devil_reuse(void) {
+  ILuint name;
+
+  if (!recycle.len)
+    return 0;
+
+  name = recycle_take(recycle.len - 1);
+  devil_select(name);
+  ilTexImage(1, 1, 1, 1, IL_LUMINANCE, IL_UNSIGNED_BYTE, NULL);
+
+  return name;
+}
+
+/* on the thread running DevIL: delete dead images (worker.mutex held) */
+static void devil_reap_dead(void) {
+  if (!dead.len)
+    return;
+
+  devil_delete_images(dead.len, dead.names);
+  dead.len = 0;
+}
+
+/* wake a job's async waiter, if it has one (worker.mutex held) */
+static void devil_notify(devil_job *job) {
+  uint64_t one = 1;
+  ssize_t n;
+
+  /* a full pipe already has a wakeup in it */
+  if (job->notify >= 0)
+    n = write(job->notify, &one, sizeof(one));
+  UNUSED(n);
+}
+
+static void *devil_worker_main(void *ptr) {
+  devil_job *job;
+  sigset_t set;
+
+  /* leave signal handling to ruby */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&worker.mutex);
+  for (;;) {
+    while (!worker.head)
+      pthread_cond_wait(&worker.queued, &worker.mutex);
+
+    job = worker.head;
+    if (!(worker.head = job->next))
+      worker.tail = NULL;
+    worker.current = job;
+    devil_reap_dead();
+    pthread_mutex_unlock(&worker.mutex);
+
+    devil_select(job->bind);
+    job->ret = job->func(job->arg);
+
+    pthread_mutex_lock(&worker.mutex);
+    worker.current = NULL;
+    job->done = 1;
+    __atomic_sub_fetch(&worker.pending, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&worker.finished);
+    devil_notify(job);
+  }
+
+  return NULL;
+}
+
+static void devil_worker_start(void) {
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  worker.started = !pthread_create(&worker.thread, &attr, devil_worker_main, NULL);
+  pthread_attr_destroy(&attr);
 }
 
 /*
- * Select the image to work on.
- *
- * Aliases:
- *   DevIL::IL::bind_image
- *   DevIL::IL::BindImage
- *
- * Examples:
- *   DevIL::IL::bind_image 4
- *   DevIL::IL::BindImage 4
- *
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00013.htm
- *
+ * The running job if it posted a callback which this thread may run
+ * and nobody is running yet (worker.mutex held).
  */
-static VALUE il_bind_im(VALUE self, VALUE num) {
-  ilBindImage(NUM2INT(num));
-  return Qnil;
+static devil_job *devil_posted(void) {
+  devil_job *job = worker.current;
+  return job && job->call && !job->serving && job->owner == &devil_owner ? job : NULL;
 }
 
 /*
- * Blit (copy) from one image to another.
- *
- * Aliases:
- *   DevIL::IL::blit
- *   DevIL::IL::Blit
- *
- * Example:
- *   DevIL::IL::blit src_im, dest_x, dest_y,
- *                   src_x, src_y, src_z,
- *                   width, height, depth
- *
+ * Wait until job is done (or, for NULL, the worker is idle) or there is
+ * a callback to run.
  */
-static VALUE il_blit(VALUE self, VALUE source, VALUE dest_x, VALUE dest_y, VALUE dest_z, VALUE src_x, VALUE src_y, VALUE src_z, VALUE width, VALUE height, VALUE depth) {
-  return ilBlit(NUM2INT(source), NUM2INT(dest_x), NUM2INT(dest_y), NUM2INT(dest_z), NUM2INT(src_x), NUM2INT(src_y), NUM2INT(src_z), NUM2INT(width), NUM2INT(height), NUM2INT(depth)) ? Qtrue : Qfalse;
+static void *devil_wait_job(void *ptr) {
+  devil_job *job = ptr;
+
+  pthread_mutex_lock(&worker.mutex);
+  while (!(job ? job->done : !worker.pending) && !devil_posted())
+    pthread_cond_wait(&worker.finished, &worker.mutex);
+  pthread_mutex_unlock(&worker.mutex);
+
+  return NULL;
 }
 
 /*
- * Set the current clearing color
- *
- * Aliases:
- *   DevIL::IL::clear_color
- *   DevIL::IL::ClearColor
- *   DevIL::IL::clear_colour
- *   DevIL::IL::ClearColour
- *
- * Example:
- *   DevIL::IL::clear_color 128, 128, 128, 128
- *
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00124.htm
- *
+ * Detach the pixel views handed out by get_data.  Called before
+ * anything which may change or free image data; reading a released
+ * view raises instead of touching freed memory.
  */
-static VALUE il_clear_color(VALUE self, VALUE red, VALUE blue, VALUE green, VALUE alpha) {
-  ilClearColor(NUM2DBL(red), NUM2DBL(blue), NUM2DBL(green), NUM2DBL(alpha));
-  return Qnil;
+static void devil_release_views(void) {
+#ifdef HAVE_RB_IO_BUFFER_NEW
+  long i;
+
+  if (!data_views || !RARRAY_LEN(data_views))
+    return;
+
+  for (i = 0; i < RARRAY_LEN(data_views); i++)
+    rb_io_buffer_free(RARRAY_PTR(data_views)[i]);
+  rb_ary_clear(data_views);
+#endif
 }
 
-/* 
- * Clear the current image.
- * 
- * Aliases:
- *   DevIL::IL::clear_image
- *   DevIL::IL::ClearImage
- *
- * Example:
- *   DevIL::IL::clear_image
- * 
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00014.htm
- *
+static VALUE devil_call_protect(VALUE ptr) {
+  devil_job *job = (devil_job*) ptr;
+  return (VALUE) job->call(job->call_arg);
+}
+
+/*
+ * Called from a job: run func(arg) on the Ruby thread waiting for the
+ * job, with the GVL held, and return its result.  If the callback
+ * raises, NULL is returned (as it is for every later callback) and the
+ * exception is re-raised once the job finishes.
  */
-static VALUE il_clear_im(VALUE self) {
-  return ilClearImage() ? Qtrue : Qfalse;
+static void *devil_call_ruby(void *(*func)(void *), void *arg) {
+  devil_job *job = worker.current;
+
+  if (!job || !pthread_equal(pthread_self(), worker.thread))
+    return func(arg);
+
+  pthread_mutex_lock(&worker.mutex);
+  job->call = func;
+  job->call_arg = arg;
+  pthread_cond_broadcast(&worker.finished);
+  devil_notify(job);
+  while (job->call)
+    pthread_cond_wait(&worker.called, &worker.mutex);
+  pthread_mutex_unlock(&worker.mutex);
+
+  return job->call_ret;
 }
 
-/* 
- * Clone (copy) the current image.
- * 
- * Aliases:
- *   DevIL::IL::clone_image
- *   DevIL::IL::CloneImage
- *
- * Example:
- *   new_im = DevIL::IL::clone_image
- * 
- * See Also:
- *   http://openil.sourceforge.net/docs/il/f00192.htm
- *
+/*
+ * Run a callback posted by one of this thread's jobs, if there is one
+ * nobody is running yet.  If it raises, the job's later callbacks are
+ * skipped and the exception is re-raised by its own devil_run.
  */
-static VALUE il_clone_cur_im(VALUE self) {
-  return INT2FIX(ilCloneCurImage());
+static void devil_serve(void) {
+  devil_job *job;
+
+  pthread_mutex_lock(&worker.mutex);
+  if ((job = devil_posted()) != NULL)
+    job->serving = 1;
+  pthread_mutex_unlock(&worker.mutex);
+
+  if (!job)
+    return;
+
+  job->call_ret = NULL;
+  if (!job->state) {
+    devil_calling++;
+    job->call_ret = (void*) rb_protect(devil_call_protect, (VALUE) job, &job->state);
+    devil_calling--;
+  }
+
+  pthread_mutex_lock(&worker.mutex);
+  job->call = NULL;
+  job->serving = 0;
+  pthread_cond_signal(&worker.called);
+  pthread_mutex_unlock(&worker.mutex);
+}
+
+static int devil_job_done(devil_job *job) {
+  int done;
+
+  pthread_mutex_lock(&worker.mutex);
+  done = job->done;
+  pthread_mutex_unlock(&worker.mutex);
+
+  return done;
+}
+
+/*
+ * Async waits.  A waiter is an eventfd (or a pipe where there is none)
+ * which the worker writes to when the job finishes or posts a callback,
+ * wrapped in an IO for the scheduler to io_wait on.
+ */
+typedef struct {
+  int rfd,
+      wfd;
+  VALUE io;
+} devil_waiter;
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_IO_WAIT
+/* open a waiter if the calling fiber has a scheduler; returns the fd to notify, or -1 */
+static int devil_waiter_open(devil_waiter *w) {
+  int fds[2];
+
+  if (NIL_P(rb_fiber_scheduler_current()))
+    return -1;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  if ((fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    return -1;
+#else
+  if (pipe(fds))
+    return -1;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+  w->rfd = fds[0];
+  w->wfd = fds[1];
+  w->io = rb_funcall(rb_cIO, rb_intern("for_fd"), 2, INT2FIX(w->rfd), rb_str_new_cstr("r"));
+
+  return w->wfd;
+}
+
+static VALUE devil_waiter_wait(VALUE ptr) {
+  devil_waiter *w = (devil_waiter*) ptr;
+  return rb_fiber_scheduler_io_wait(rb_fiber_scheduler_current(), w->io,
+                                    RB_UINT2NUM(RUBY_IO_READABLE), Qnil);
+}
+
+/*
+ * Yield to the scheduler until the waiter is signalled.  Returns the tag
+ * of an exception raised into the fiber meanwhile, or 0.
+ */
+static int devil_waiter_wait_async(devil_waiter *w) {
+  char buf[64];
+  ssize_t n;
+  int state = 0;
+
+  rb_protect(devil_waiter_wait, (VALUE) w, &state);
+
+  /* drain the wakeups; the job's state is rechecked under the mutex */
+  while ((n = read(w->rfd, buf, sizeof(buf))) > 0 && w->rfd != w->wfd)
+    ;
+
+  return state;
 }
 
-static VALUE il_compress_func(VALUE self, VALUE num) {
-  return ilCompressFunc(NUM2INT(num)) ? Qtrue : Qfalse;
+static void devil_waiter_close(devil_waiter *w) {
+  rb_io_close(w->io);
+  if (w->wfd != w->rfd)
+    close(w->wfd);
+}
+#else
+static int devil_waiter_open(devil_waiter *w) {
+  UNUSED(w);
+  return -1;
+}
+
+static int devil_waiter_wait_async(devil_waiter *w) {
+  UNUSED(w);
+  return 0;
+}
+
+static void devil_waiter_close(devil_waiter *w) {
+  UNUSED(w);
+}
+#endif
+
+/*
+ * Run func(arg) on the worker thread and return its result.  The GVL
+ * is released while waiting.  Jobs cannot be interrupted, so anything
+ * run here must finish in bounded time.  Exceptions raised by Ruby
+ * callbacks (see devil_call_ruby) propagate once the job is done.
+ *
+ * If devil_async is set and the calling fiber has a scheduler, the
+ * fiber waits through the scheduler instead.  An exception raised into
+ * it meanwhile (a timeout, say) is held back until the job is done,
+ * since the job lives on this fiber's stack.
+ */
+static void *devil_run(void *(*func)(void *), void *arg) {
+  devil_job job;
+  devil_waiter w;
+  int async = devil_async,
+      raised = 0;
+
+  devil_async = 0;
+  devil_release_views();
+
+  job.bind = devil_want;
+  devil_want = BIND_NONE;
+
+  if (!worker.started && !devil_calling)
+    devil_worker_start();
+  if (!worker.started || devil_calling) {
+    devil_select(job.bind);
+    return func(arg);
+  }
+
+  job.func = func;
+  job.arg = arg;
+  job.ret = NULL;
+  job.call = NULL;
+  job.owner = &devil_owner;
+  job.done = job.serving = job.state = 0;
+  job.notify = async ? devil_waiter_open(&w) : -1;
+  job.next = NULL;
+
+  pthread_mutex_lock(&worker.mutex);
+  if (worker.tail)
+    worker.tail->next = &job;
+  else
+    worker.head = &job;
+  worker.tail = &job;
+  __atomic_add_fetch(&worker.pending, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&worker.queued);
+  pthread_mutex_unlock(&worker.mutex);
+
+  for (;;) {
+    if (job.notify >= 0 && !raised) {
+      raised = devil_waiter_wait_async(&w);
+    } else {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      rb_thread_call_without_gvl(devil_wait_job, &job, NULL, NULL);
+#else
+      devil_wait_job(&job);
+#endif
+    }
+
+    /* run a callback posted by this job, or by another fiber's */
+    devil_serve();
+    if (devil_job_done(&job))
+      break;
+  }
+
+  if (job.notify >= 0)
+    devil_waiter_close(&w);
+  if (raised)
+    rb_jump_tag(raised);
+  if (job.state)
+    rb_jump_tag(job.state);
+
+  return job.ret;
+}
+
+/*
+ * Wait for queued jobs to finish before touching DevIL state from the
+ * calling thread.  This is a single atomic load when the worker is idle.
+ */
+static void devil_sync(void) {
+  /* other threads may queue more work while we wait without the GVL */
+  while (!devil_calling && __atomic_load_n(&worker.pending, __ATOMIC_ACQUIRE)) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(devil_wait_job, NULL, NULL, NULL);
+#else
+    devil_wait_job(NULL);
+#endif
+    devil_serve();
+  }
+
+  if (dead.len) {
+    /* a view may still point into a dead image's pixels */
+    devil_release_views();
+    pthread_mutex_lock(&worker.mutex);
+    devil_reap_dead();
+    pthread_mutex_unlock(&worker.mutex);
+  }
+
+  if (devil_want != BIND_NONE) {
+    devil_select(devil_want);
+    devil_want = BIND_NONE;
+  }
+}
+
+/*
+ * Forking.  Ruby's fork goes through Process._fork, which is hooked to
+ * devil_sync first: that waits for queued jobs with the GVL released and
+ * serves their callbacks, and once it returns no Ruby thread can queue
+ * another.  The pthread_atfork handler only gives the child a fresh,
+ * unstarted worker (threads do not survive fork); it never waits, as a
+ * job may be waiting on the forking thread.  A fork from native code
+ * while a job runs leaves that job's DevIL state half done in the child.
+ */
+static VALUE devil_fork(VALUE self) {
+  devil_sync();
+  return rb_call_super(0, NULL);
+}
+
+static void devil_atfork_child(void) {
+  pthread_mutex_init(&worker.mutex, NULL);
+  pthread_cond_init(&worker.queued, NULL);
+  pthread_cond_init(&worker.finished, NULL);
+  pthread_cond_init(&worker.called, NULL);
+  worker.head = worker.tail = worker.current = NULL;
+  worker.started = worker.pending = 0;
+}
+
+/******************/
+/* helper threads */
+/******************/
+
+/*
+ * Helper threads for pixel loops which split an image into strips
+ * (resample and the like).  A job on the DevIL worker calls par_for,
+ * which wakes the helpers and works through the ranges alongside them,
+ * returning once every range is done.  Only the thread running DevIL
+ * calls par_for, so there is one loop in flight at most.  The helpers
+ * are started on first use: one per CPU besides the caller, or as set
+ * with DevIL.threads=.
+ */
+#define PAR_MAX 64
+
+typedef void (*par_fn)(void *arg, long i);
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t  work,     /* a loop was started */
+                  done;     /* last helper left the loop */
+  pthread_t threads[PAR_MAX];
+  int started,              /* helpers running */
+      want,                 /* helpers to start; -1 for one per CPU */
+      busy,                 /* helpers still in the current loop */
+      quit;
+  unsigned long gen;        /* loop count, to wake the helpers once per loop */
+  par_fn fn;
+  void *arg;
+  long next,
+       n;
+} par = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  { 0 },
+  0, -1,
+};
+
+/* take indices of the current loop until there are none left */
+static void par_work(void) {
+  long i;
+
+  while ((i = __atomic_fetch_add(&par.next, 1, __ATOMIC_RELAXED)) < par.n)
+    par.fn(par.arg, i);
+}
+
+static void *par_main(void *ptr) {
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&par.mutex);
+  for (;;) {
+    while (par.gen == seen && !par.quit)
+      pthread_cond_wait(&par.work, &par.mutex);
+    if (par.quit)
+      break;
+    seen = par.gen;
+    pthread_mutex_unlock(&par.mutex);
+
+    par_work();
+
+    pthread_mutex_lock(&par.mutex);
+    if (!--par.busy)
+      pthread_cond_signal(&par.done);
+  }
+  pthread_mutex_unlock(&par.mutex);
+
+  return NULL;
+}
+
+static void par_start(void) {
+  sigset_t set, old;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = par.want >= 0 ? par.want : cpus > 1 ? cpus - 1 : 0;
+
+  if (n > PAR_MAX)
+    n = PAR_MAX;
+
+  /* leave signals to the Ruby threads */
+  sigfillset(&set);
+  pthread_sigmask(SIG_SETMASK, &set, &old);
+  for (par.started = 0; par.started < n; par.started++)
+    if (pthread_create(&par.threads[par.started], NULL, par_main, NULL))
+      break;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void par_stop(void) {
+  int i;
+
+  pthread_mutex_lock(&par.mutex);
+  par.quit = 1;
+  pthread_cond_broadcast(&par.work);
+  pthread_mutex_unlock(&par.mutex);
+
+  for (i = 0; i < par.started; i++)
+    pthread_join(par.threads[i], NULL);
+  par.started = par.quit = 0;
+}
+
+/* number of threads a par_for runs on, the caller included */
+static int par_threads(void) {
+  if (!par.started && par.want)
+    par_start();
+  return par.started + 1;
+}
+
+/* call fn(arg, i) for i in 0...n, spread over the helper threads */
+static void par_for(long n, par_fn fn, void *arg) {
+  long i;
+
+  if (n <= 1 || par_threads() == 1) {
+    for (i = 0; i < n; i++)
+      fn(arg, i);
+    return;
+  }
+
+  pthread_mutex_lock(&par.mutex);
+  par.fn = fn;
+  par.arg = arg;
+  par.next = 0;
+  par.n = n;
+  par.busy = par.started;
+  par.gen++;
+  pthread_cond_broadcast(&par.work);
+  pthread_mutex_unlock(&par.mutex);
+
+  par_work();
+
+  pthread_mutex_lock(&par.mutex);
+  while (par.busy)
+    pthread_cond_wait(&par.done, &par.mutex);
+  pthread_mutex_unlock(&par.mutex);
+}
+
+/* none of the helpers survive fork */
+static void par_atfork_child(void) {
+  pthread_mutex_init(&par.mutex, NULL);
+  pthread_cond_init(&par.work, NULL);
+  pthread_cond_init(&par.done, NULL);
+  par.started = par.busy = par.quit = 0;
+}
+
+/*
+ * Number of threads used by multithreaded operations such as
+ * DevIL::ILU.resample, including the thread running DevIL.
+ */
+static VALUE devil_threads(VALUE self) {
+  devil_sync();
+  return INT2NUM(par_threads());
+}
+
+/*
+ * Set the number of threads used by multithreaded operations; 1 runs
+ * them on the DevIL thread alone, nil uses one per CPU.
+ */
+static VALUE devil_set_threads(VALUE self, VALUE num) {
+  int n = NIL_P(num) ? 0 : NUM2INT(num);
+
+  if (!NIL_P(num) && (n < 1 || n > PAR_MAX + 1))
+    rb_raise(rb_eArgError, "threads must be between 1 and %d", PAR_MAX + 1);
+
+  devil_sync();
+  par_stop();
+  par.want = NIL_P(num) ? -1 : n - 1;
+
+  return num;
+}
+
+/***************/
+/* memory pool */
+/***************/
+
+/*
+ * Pool allocator for DevIL.
+ *
+ * Every block carries a small header recording its size class, and
+ * its address goes into a hash set so mem_free can tell pool blocks
+ * from ones DevIL got from malloc before the pool was installed
+ * without touching memory it does not own.  Freed blocks are kept on a per-class free list (up to cache_limit bytes in
+ * total) and handed back out for the next request of the same class,
+ * so steady-state loads and saves stop churning malloc.  Classes split
+ * each power of two into four steps, which bounds the slack at 25%.
+ * Blocks of MEM_MAP_MIN bytes or more are mmap'd; when trimming is on
+ * their pages are returned to the kernel with MADV_DONTNEED while they
+ * sit on a free list, keeping the mapping for reuse but not the RSS.
+ */
+#define MEM_HDR       16
+#define MEM_MIN_SHIFT 6                       /* smallest class: 64 bytes */
+#define MEM_MAX_SHIFT 31                      /* larger blocks are not cached */
+#define MEM_CLASSES   ((MEM_MAX_SHIFT - MEM_MIN_SHIFT) * 4 + 1)
+#define MEM_MAP_MIN   (1 << 20)
+
+typedef struct mem_block {
+  uint64_t size;                /* usable size of the class, plus header */
+  uint64_t pad;                 /* keeps the payload 16-byte aligned */
+} mem_block;
+
+static struct {
+  pthread_mutex_t mutex;
+  int installed,
+      enabled,
+      trim;
+  size_t cache_limit,
+         cached,
+         live,
+         peak;
+  unsigned long allocs,
+                frees,
+                hits,
+                sys_allocs;
+  void *free_list[MEM_CLASSES];
+  const void **blocks;          /* open-addressed set of live pool blocks */
+  size_t nblocks,
+         blocks_cap;            /* power of two, at most half full */
+} mem = {
+  PTHREAD_MUTEX_INITIALIZER,
+  0, 0, 0,
+  256 << 20,
+};
+
+/*
+ * Map a request (including header) to its class index and rounded
+ * size.  Returns -1 for requests too large to cache.
+ */
+static int mem_class(size_t size, size_t *rounded) {
+  int shift, step;
+
+  if (size <= (1 << MEM_MIN_SHIFT)) {
+    *rounded = 1 << MEM_MIN_SHIFT;
+    return 0;
+  }
+
+  for (shift = MEM_MIN_SHIFT; shift < MEM_MAX_SHIFT && (size - 1) >> (shift + 1); shift++);
+  if (shift >= MEM_MAX_SHIFT) {
+    *rounded = size;
+    return -1;
+  }
+
+  step = ((size - 1) >> (shift - 2)) & 3;
+  *rounded = ((size_t) 1 << shift) + ((size_t) (step + 1) << (shift - 2));
+  return (shift - MEM_MIN_SHIFT) * 4 + step + 1;
+}
+
+/* the mem_tab_* functions are called with mem.mutex held */
+static size_t mem_tab_slot(const void *ptr) {
+  uint64_t h = (uintptr_t) ptr >> 4;
+
+  h *= 0x9e3779b97f4a7c15ULL;
+  return (size_t) (h >> 32) & (mem.blocks_cap - 1);
+}
+
+static int mem_tab_has(const void *ptr) {
+  size_t i;
+
+  if (!mem.blocks_cap)
+    return 0;
+
+  for (i = mem_tab_slot(ptr); mem.blocks[i]; i = (i + 1) & (mem.blocks_cap - 1))
+    if (mem.blocks[i] == ptr)
+      return 1;
+
+  return 0;
+}
+
+static int mem_tab_add(const void *ptr) {
+  const void **old = mem.blocks;
+  size_t i, j, cap = mem.blocks_cap;
+
+  if ((mem.nblocks + 1) * 2 > cap) {
+    const void **tab = calloc(cap ? cap * 2 : 256, sizeof(void*));
+
+    if (!tab)
+      return 0;
+    mem.blocks = tab;
+    mem.blocks_cap = cap ? cap * 2 : 256;
+    for (j = 0; j < cap; j++)
+      if (old[j]) {
+        for (i = mem_tab_slot(old[j]); mem.blocks[i]; i = (i + 1) & (mem.blocks_cap - 1));
+        mem.blocks[i] = old[j];
+      }
+    free(old);
+  }
+
+  for (i = mem_tab_slot(ptr); mem.blocks[i]; i = (i + 1) & (mem.blocks_cap - 1));
+  mem.blocks[i] = ptr;
+  mem.nblocks++;
+  return 1;
+}
+
+static void mem_tab_del(const void *ptr) {
+  size_t i, j, k, mask = mem.blocks_cap - 1;
+
+  for (i = mem_tab_slot(ptr); mem.blocks[i] != ptr; i = (i + 1) & mask)
+    if (!mem.blocks[i])
+      return;
+
+  /* backward-shift the rest of the probe run into the hole */
+  for (j = (i + 1) & mask; mem.blocks[j]; j = (j + 1) & mask) {
+    k = mem_tab_slot(mem.blocks[j]);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      mem.blocks[i] = mem.blocks[j];
+      i = j;
+    }
+  }
+  mem.blocks[i] = NULL;
+  mem.nblocks--;
+}
+
+static void *mem_sys_alloc(size_t size) {
+  void *ptr;
+
+  if (size >= MEM_MAP_MIN) {
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+  }
+
+  return malloc(size);
+}
+
+static void mem_sys_free(void *ptr, size_t size) {
+  if (size >= MEM_MAP_MIN)
+    munmap(ptr, size);
+  else
+    free(ptr);
+}
+
+static void *ILAPIENTRY mem_alloc(const ILsizei want) {
+  mem_block *blk = NULL;
+  size_t size;
+  int cls;
+
+  cls = mem_class(want + MEM_HDR, &size);
+
+  pthread_mutex_lock(&mem.mutex);
+  if (cls >= 0 && (blk = mem.free_list[cls]) != NULL) {
+    mem.free_list[cls] = *((void**) (blk + 1));
+    mem.cached -= size;
+    mem.hits++;
+  }
+  pthread_mutex_unlock(&mem.mutex);
+
+  if (!blk) {
+    if ((blk = mem_sys_alloc(size)) == NULL)
+      return NULL;
+    blk->size = size;
+
+    pthread_mutex_lock(&mem.mutex);
+    if (!mem_tab_add(blk + 1)) {
+      pthread_mutex_unlock(&mem.mutex);
+      mem_sys_free(blk, size);
+      return NULL;
+    }
+    mem.sys_allocs++;
+    pthread_mutex_unlock(&mem.mutex);
+  }
+
+  pthread_mutex_lock(&mem.mutex);
+  mem.allocs++;
+  if ((mem.live += size) > mem.peak)
+    mem.peak = mem.live;
+  pthread_mutex_unlock(&mem.mutex);
+
+  return blk + 1;
+}
+
+static void ILAPIENTRY mem_free(const void *ptr) {
+  mem_block *blk;
+  size_t size;
+  int cls;
+
+  if (!ptr)
+    return;
+
+  pthread_mutex_lock(&mem.mutex);
+  if (!mem_tab_has(ptr)) {
+    /* allocated before the pool was installed */
+    pthread_mutex_unlock(&mem.mutex);
+    free((void*) ptr);
+    return;
+  }
+
+  blk = ((mem_block*) ptr) - 1;
+  size = blk->size;
+  cls = mem_class(size, &size);
+
+  mem.frees++;
+  mem.live -= size;
+  if (mem.enabled && cls >= 0 && mem.cached + size <= mem.cache_limit) {
+    if (mem.trim && size >= MEM_MAP_MIN) {
+      /* keep the first page (header and free list link) resident */
+      long page = sysconf(_SC_PAGESIZE);
+      madvise((char*) blk + page, size - page, MADV_DONTNEED);
+    }
+    *((void**) (blk + 1)) = mem.free_list[cls];
+    mem.free_list[cls] = blk;
+    mem.cached += size;
+    blk = NULL;
+  } else {
+    mem_tab_del(ptr);
+  }
+  pthread_mutex_unlock(&mem.mutex);
+
+  if (blk)
+    mem_sys_free(blk, size);
+}
+
+/*
+ * Release every cached block.  Returns the number of bytes released.
+ */
+static size_t mem_trim(void) {
+  void *list[MEM_CLASSES];
+  size_t ret, size;
+  mem_block *blk;
+  int i;
+
+  pthread_mutex_lock(&mem.mutex);
+  memcpy(list, mem.free_list, sizeof(list));
+  memset(mem.free_list, 0, sizeof(mem.free_list));
+  ret = mem.cached;
+  mem.cached = 0;
+  for (i = 0; i < MEM_CLASSES; i++)
+    for (blk = list[i]; blk; blk = *((void**) (blk + 1)))
+      mem_tab_del(blk + 1);
+  pthread_mutex_unlock(&mem.mutex);
+
+  for (i = 0; i < MEM_CLASSES; i++)
+    while ((blk = list[i]) != NULL) {
+      list[i] = *((void**) (blk + 1));
+      mem_class(blk->size, &size);
+      mem_sys_free(blk, size);
+    }
+
+  return ret;
+}
+
+/*******************/
+/* call statistics */
+/*******************/
+
+/*
+ * Optional per-method instrumentation.  While enabled, a C call event
+ * hook times every call to a method of DevIL::IL, DevIL::ILU,
+ * DevIL::Image, DevIL::Pool and DevIL::Batch, keeping a call count,
+ * total time and a log-linear latency histogram (16 steps per power of
+ * two, so percentiles are within ~6%) per method.  Load and save
+ * bindings also report the bytes they read and wrote.  When disabled
+ * the hook is removed and the byte counters cost one branch.
+ *
+ * The hook runs with the GVL held, so the tables need no locking;
+ * each thread keeps its own stack of calls in flight.  Fibers waiting
+ * in async calls return out of order, so each frame is tagged with
+ * its fiber and a return closes that fiber's innermost frame.
+ */
+#define STATS_SUB     16
+#define STATS_BUCKETS (STATS_SUB + 60 * STATS_SUB)
+#define STATS_DEPTH   32
+
+typedef struct {
+  VALUE owner;
+  ID mid;
+  uint64_t calls,
+           total,           /* ns */
+           max,
+           bytes_in,
+           bytes_out;
+  uint32_t hist[STATS_BUCKETS];
+} stats_entry;
+
+static struct {
+  int enabled;
+  unsigned gen;             /* bumped on enable, to drop stale frames */
+  VALUE batch_s,            /* singleton classes of Batch and Image */
+        image_s;
+  stats_entry **entries;
+  long len,
+       capa;
+} stats;
+
+static __thread struct {
+  stats_entry *entry;
+  VALUE fiber;
+  uint64_t start;
+  unsigned gen;
+} stats_frames[STATS_DEPTH];
+static __thread int stats_depth,
+                    stats_overflow;     /* calls too deep for a frame */
+
+static uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_bucket(uint64_t ns) {
+  int e;
+
+  if (ns < STATS_SUB)
+    return ns;
+
+  e = 63 - __builtin_clzll(ns);
+  return STATS_SUB + (e - 4) * STATS_SUB + ((ns >> (e - 4)) & (STATS_SUB - 1));
+}
+
+/* lower bound of a bucket, in ns */
+static uint64_t stats_bucket_value(int i) {
+  int e;
+
+  if (i < STATS_SUB)
+    return i;
+
+  e = (i - STATS_SUB) / STATS_SUB + 4;
+  return ((uint64_t) (STATS_SUB + (i - STATS_SUB) % STATS_SUB)) << (e - 4);
+}
+
+static int stats_owned(VALUE klass) {
+  return klass == mIl || klass == mIlu || klass == cImage || klass == cPool ||
+         klass == cCache || klass == cPipeline ||
+         klass == stats.batch_s || klass == stats.image_s;
+}
+
+static stats_entry *stats_lookup(VALUE owner, ID mid) {
+  stats_entry **entries;
+  long i;
+
+  for (i = 0; i < stats.len; i++)
+    if (stats.entries[i]->mid == mid && stats.entries[i]->owner == owner)
+      return stats.entries[i];
+
+  if (stats.len == stats.capa) {
+    entries = realloc(stats.entries, (stats.capa ? stats.capa * 2 : 64) * sizeof(stats_entry*));
+    if (!entries)
+      return NULL;
+    stats.entries = entries;
+    stats.capa = stats.capa ? stats.capa * 2 : 64;
+  }
+
+  if (!(stats.entries[stats.len] = calloc(1, sizeof(stats_entry))))
+    return NULL;
+  stats.entries[stats.len]->owner = owner;
+  stats.entries[stats.len]->mid = mid;
+
+  return stats.entries[stats.len++];
+}
+
+/* innermost frame of the current fiber, or -1 */
+static int stats_frame(void) {
+  VALUE fiber = rb_fiber_current();
+  int d;
+
+  for (d = stats_depth - 1; d >= 0; d--)
+    if (stats_frames[d].fiber == fiber)
+      return d;
+
+  return -1;
+}
+
+static void stats_hook(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass) {
+  stats_entry *entry;
+  uint64_t ns, start;
+  unsigned gen;
+  int d;
+
+  if (!stats_owned(klass))
+    return;
+
+  if (event == RUBY_EVENT_C_CALL) {
+    if ((d = stats_depth) < STATS_DEPTH) {
+      stats_frames[d].entry = stats_lookup(klass, mid);
+      stats_frames[d].fiber = rb_fiber_current();
+      stats_frames[d].gen = stats.gen;
+      stats_frames[d].start = stats_now();
+      stats_depth++;
+    } else {
+      stats_overflow++;
+    }
+    return;
+  }
+
+  if (stats_overflow) {
+    stats_overflow--;
+    return;
+  }
+  if ((d = stats_frame()) < 0)
+    return;
+  entry = stats_frames[d].entry;
+  start = stats_frames[d].start;
+  gen = stats_frames[d].gen;
+  memmove(&stats_frames[d], &stats_frames[d + 1], (stats_depth - d - 1) * sizeof(stats_frames[0]));
+  stats_depth--;
+  if (gen != stats.gen || !entry)
+    return;
+
+  ns = stats_now() - start;
+  entry->calls++;
+  entry->total += ns;
+  if (ns > entry->max)
+    entry->max = ns;
+  entry->hist[stats_bucket(ns)]++;
+}
+
+/* attribute bytes read or written to the innermost timed call */
+static void stats_bytes(uint64_t in, uint64_t out) {
+  int d = stats_frame();
+
+  if (d < 0 || stats_frames[d].gen != stats.gen || !stats_frames[d].entry)
+    return;
+
+  stats_frames[d].entry->bytes_in += in;
+  stats_frames[d].entry->bytes_out += out;
+}
+
+#define STATS_IN(n)  do { if (stats.enabled) stats_bytes((n), 0); } while (0)
+#define STATS_OUT(n) do { if (stats.enabled) stats_bytes(0, (n)); } while (0)
+
+/* size of a file, for byte counts of path based loads and saves */
+static uint64_t stats_file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) ? 0 : st.st_size;
+}
+
+static double stats_percentile(const stats_entry *e, double p) {
+  uint64_t want = e->calls * p,
+           seen = 0;
+  int i;
+
+  for (i = 0; i < STATS_BUCKETS; i++)
+    if ((seen += e->hist[i]) > want)
+      return stats_bucket_value(i) / 1e9;
+
+  return e->max / 1e9;
+}
+
+/*
+ * Turn call statistics on or off.  Enabling starts from the counts
+ * collected so far; see DevIL.reset_stats.
+ *
+ * Examples:
+ *   DevIL.stats_enabled = true
+ *
+ */
+static VALUE devil_set_stats(VALUE self, VALUE enable) {
+  if (RTEST(enable) && !stats.enabled) {
+    stats.gen++;
+    stats.enabled = 1;
+    stats.batch_s = rb_singleton_class(mBatch);
+    stats.image_s = rb_singleton_class(cImage);
+    rb_add_event_hook(stats_hook, RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN, Qnil);
+  } else if (!RTEST(enable) && stats.enabled) {
+    stats.enabled = 0;
+    rb_remove_event_hook(stats_hook);
+  }
+
+  return enable;
+}
+
+static VALUE devil_stats_p(VALUE self) {
+  return stats.enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * Return the statistics collected so far, as a Hash from method name
+ * ("DevIL::IL.load_l", "DevIL::Image#scale", ...) to a Hash of :calls,
+ * :total, :mean, :p50, :p90, :p99, :p999 and :max (times in seconds)
+ * plus :bytes_in and :bytes_out.
+ *
+ * Examples:
+ *   DevIL.stats.sort_by { |_, s| -s[:total] }.first(5)
+ *
+ */
+static VALUE devil_stats(VALUE self) {
+  VALUE ret = rb_hash_new(),
+        name, hash;
+  stats_entry *e;
+  long i;
+
+  for (i = 0; i < stats.len; i++) {
+    e = stats.entries[i];
+    if (!e->calls)
+      continue;
+
+    if (e->owner == cImage || e->owner == cPool || e->owner == cCache ||
+        e->owner == cPipeline)
+      name = rb_sprintf("%"PRIsVALUE"#%"PRIsVALUE, rb_class_name(e->owner), rb_id2str(e->mid));
+    else if (e->owner == mIl || e->owner == mIlu)
+      name = rb_sprintf("%"PRIsVALUE".%"PRIsVALUE, rb_class_name(e->owner), rb_id2str(e->mid));
+    else
+      name = rb_sprintf("%"PRIsVALUE".%"PRIsVALUE,
+                        rb_class_name(e->owner == stats.image_s ? cImage : mBatch),
+                        rb_id2str(e->mid));
+
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULL2NUM(e->calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("total")), rb_float_new(e->total / 1e9));
+    rb_hash_aset(hash, ID2SYM(rb_intern("mean")), rb_float_new(e->total / 1e9 / e->calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p50")), rb_float_new(stats_percentile(e, 0.5)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p90")), rb_float_new(stats_percentile(e, 0.9)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p99")), rb_float_new(stats_percentile(e, 0.99)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p999")), rb_float_new(stats_percentile(e, 0.999)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max")), rb_float_new(e->max / 1e9));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_in")), ULL2NUM(e->bytes_in));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_out")), ULL2NUM(e->bytes_out));
+    rb_hash_aset(ret, name, hash);
+  }
+
+  return ret;
+}
+
+/*
+ * Clear the statistics collected so far.
+ */
+static VALUE devil_reset_stats(VALUE self) {
+  long i;
+
+  for (i = 0; i < stats.len; i++) {
+    VALUE owner = stats.entries[i]->owner;
+    ID mid = stats.entries[i]->mid;
+
+    memset(stats.entries[i], 0, sizeof(stats_entry));
+    stats.entries[i]->owner = owner;
+    stats.entries[i]->mid = mid;
+  }
+
+  return Qnil;
+}
+
+/********************/
+/* pixel conversion */
+/********************/
+
+/*
+ * Fast paths for convert_image.  The common byte layout changes
+ * (RGB <-> RGBA, RGBA <-> BGRA, RGB <-> BGR) and UNSIGNED_BYTE <-> FLOAT
+ * at the same format are done by the kernels below, picked for the CPU
+ * when the extension is loaded: AVX2 or SSE2 where the processor has
+ * them, plain loops everywhere else.  Any other pair goes to
+ * ilConvertImage.
+ *
+ * Each pair is checked against ilConvertImage the first time it is
+ * used, on a small image holding every byte value (and a spread of
+ * floats, in and out of range).  A pair whose output differs in any
+ * bit is handed to DevIL from then on, so the results are DevIL's
+ * whichever library version is linked in.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CONVERT_X86 1
+#endif
+
+typedef void (*convert_fn)(const void *src, void *dst, size_t n, int swap);
+
+typedef struct {
+  ILenum src_fmt, src_type,
+         dst_fmt, dst_type;
+  int channels,     /* of the destination */
+      swap,         /* exchange red and blue */
+      checked;      /* 0 untested, 1 matches DevIL, -1 doesn't */
+  convert_fn *fn;
+} convert_pair;
+
+static convert_fn convert_expand,     /* 3 -> 4 bytes, alpha 255 */
+                  convert_shrink,     /* 4 -> 3 bytes */
+                  convert_swap32,     /* RGBA <-> BGRA */
+                  convert_swap24,     /* RGB <-> BGR */
+                  convert_to_float,   /* n values, not pixels */
+                  convert_to_ubyte;
+
+static int convert_enabled = 1;
+
+static void expand_c(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+  int r = swap ? 2 : 0;
+
+  for (; n; n--, s += 3, d += 4) {
+    d[0] = s[r];
+    d[1] = s[1];
+    d[2] = s[2 - r];
+    d[3] = 255;
+  }
+}
+
+static void shrink_c(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+  int r = swap ? 2 : 0;
+
+  for (; n; n--, s += 4, d += 3) {
+    d[0] = s[r];
+    d[1] = s[1];
+    d[2] = s[2 - r];
+  }
+}
+
+static void swap32_c(const void *src, void *dst, size_t n, int swap) {
+  const uint32_t *s = src;
+  uint32_t *d = dst;
+
+  /* byte order doesn't matter: red and blue are bytes 0 and 2 */
+  for (; n; n--)
+    *d++ = (*s & 0xff00ff00) | (*s >> 16 & 0xff) | (*s & 0xff) << 16, s++;
+}
+
+static void swap24_c(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+
+  for (; n; n--, s += 3, d += 3) {
+    d[0] = s[2];
+    d[1] = s[1];
+    d[2] = s[0];
+  }
+}
+
+static void to_float_c(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILfloat *d = dst;
+
+  for (; n; n--)
+    *d++ = *s++ / 255.0f;
+}
+
+static void to_ubyte_c(const void *src, void *dst, size_t n, int swap) {
+  const ILfloat *s = src;
+  ILubyte *d = dst;
+  ILfloat v;
+
+  for (; n; n--) {
+    v = *s++;
+    v = v < 0.0f ? 0.0f : v;
+    v = v > 1.0f ? 1.0f : v;
+    *d++ = (ILubyte) (v * 255.0f);
+  }
+}
+
+#ifdef CONVERT_X86
+#ifdef __SSE2__
+static void swap32_sse2(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+  const __m128i ga = _mm_set1_epi32(0xff00ff00),
+                rb = _mm_set1_epi32(0xff);
+  __m128i v;
+
+  for (; n >= 4; n -= 4, s += 16, d += 16) {
+    v = _mm_loadu_si128((const __m128i *) s);
+    v = _mm_or_si128(_mm_and_si128(v, ga),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), rb),
+                                  _mm_slli_epi32(_mm_and_si128(v, rb), 16)));
+    _mm_storeu_si128((__m128i *) d, v);
+  }
+  swap32_c(s, d, n, swap);
+}
+
+static void to_float_sse2(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILfloat *d = dst;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 k = _mm_set1_ps(255.0f);
+  __m128i v, lo, hi;
+
+  for (; n >= 16; n -= 16, s += 16, d += 16) {
+    v = _mm_loadu_si128((const __m128i *) s);
+    lo = _mm_unpacklo_epi8(v, zero);
+    hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_ps(d, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), k));
+    _mm_storeu_ps(d + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), k));
+    _mm_storeu_ps(d + 8, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), k));
+    _mm_storeu_ps(d + 12, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), k));
+  }
+  to_float_c(s, d, n, swap);
+}
+
+static __m128i to_ubyte4_sse2(const ILfloat *s) {
+  __m128 v = _mm_loadu_ps(s);
+  v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  return _mm_cvttps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+}
+
+static void to_ubyte_sse2(const void *src, void *dst, size_t n, int swap) {
+  const ILfloat *s = src;
+  ILubyte *d = dst;
+  __m128i lo, hi;
+
+  for (; n >= 16; n -= 16, s += 16, d += 16) {
+    lo = _mm_packs_epi32(to_ubyte4_sse2(s), to_ubyte4_sse2(s + 4));
+    hi = _mm_packs_epi32(to_ubyte4_sse2(s + 8), to_ubyte4_sse2(s + 12));
+    _mm_storeu_si128((__m128i *) d, _mm_packus_epi16(lo, hi));
+  }
+  to_ubyte_c(s, d, n, swap);
+}
+#endif
+
+__attribute__((target("avx2")))
+static void expand_avx2(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+  const __m256i alpha = _mm256_set1_epi32(0xff000000),
+                mask = swap ? _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                               2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                            : _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                               0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m256i v;
+
+  /* each 16 byte load carries four pixels; the second one reads 28 bytes in */
+  for (; n >= 10; n -= 8, s += 24, d += 32) {
+    v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) s)),
+                                _mm_loadu_si128((const __m128i *) (s + 12)), 1);
+    v = _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha);
+    _mm256_storeu_si256((__m256i *) d, v);
+  }
+  expand_c(s, d, n, swap);
+}
+
+__attribute__((target("avx2")))
+static void shrink_avx2(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+  const __m256i mask = swap ? _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                               2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+                            : _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                               0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  __m256i v;
+
+  /* each 16 byte store carries four pixels; the second one writes 28 bytes out */
+  for (; n >= 10; n -= 8, s += 32, d += 24) {
+    v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) s), mask);
+    _mm_storeu_si128((__m128i *) d, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (d + 12), _mm256_extracti128_si256(v, 1));
+  }
+  shrink_c(s, d, n, swap);
+}
+
+__attribute__((target("avx2")))
+static void swap32_avx2(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILubyte *d = dst;
+  const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+  for (; n >= 8; n -= 8, s += 32, d += 32)
+    _mm256_storeu_si256((__m256i *) d,
+                        _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) s), mask));
+  swap32_c(s, d, n, swap);
+}
+
+__attribute__((target("avx2")))
+static void to_float_avx2(const void *src, void *dst, size_t n, int swap) {
+  const ILubyte *s = src;
+  ILfloat *d = dst;
+  const __m256 k = _mm256_set1_ps(255.0f);
+  __m256i v;
+
+  for (; n >= 8; n -= 8, s += 8, d += 8) {
+    v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) s));
+    _mm256_storeu_ps(d, _mm256_div_ps(_mm256_cvtepi32_ps(v), k));
+  }
+  to_float_c(s, d, n, swap);
+}
+
+__attribute__((target("avx2")))
+static void to_ubyte_avx2(const void *src, void *dst, size_t n, int swap) {
+  const ILfloat *s = src;
+  ILubyte *d = dst;
+  const __m256 zero = _mm256_setzero_ps(),
+               one = _mm256_set1_ps(1.0f),
+               k = _mm256_set1_ps(255.0f);
+  __m256i v;
+  __m128i w;
+
+  for (; n >= 8; n -= 8, s += 8, d += 8) {
+    v = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(s), zero), one), k));
+    w = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storel_epi64((__m128i *) d, _mm_packus_epi16(w, w));
+  }
+  to_ubyte_c(s, d, n, swap);
+}
+#endif
+
+static void convert_init(void) {
+  convert_expand = expand_c;
+  convert_shrink = shrink_c;
+  convert_swap32 = swap32_c;
+  convert_swap24 = swap24_c;
+  convert_to_float = to_float_c;
+  convert_to_ubyte = to_ubyte_c;
+
+#ifdef CONVERT_X86
+#ifdef __SSE2__
+  convert_swap32 = swap32_sse2;
+  convert_to_float = to_float_sse2;
+  convert_to_ubyte = to_ubyte_sse2;
+#endif
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    convert_expand = expand_avx2;
+    convert_shrink = shrink_avx2;
+    convert_swap32 = swap32_avx2;
+    convert_to_float = to_float_avx2;
+    convert_to_ubyte = to_ubyte_avx2;
+  }
+#endif
+}
+
+#define UB IL_UNSIGNED_BYTE
+#define FL IL_FLOAT
+
+static convert_pair convert_pairs[] = {
+  { IL_RGB,  UB, IL_RGBA, UB, 4, 0, 0, &convert_expand },
+  { IL_BGR,  UB, IL_BGRA, UB, 4, 0, 0, &convert_expand },
+  { IL_RGB,  UB, IL_BGRA, UB, 4, 1, 0, &convert_expand },
+  { IL_BGR,  UB, IL_RGBA, UB, 4, 1, 0, &convert_expand },
+  { IL_RGBA, UB, IL_RGB,  UB, 3, 0, 0, &convert_shrink },
+  { IL_BGRA, UB, IL_BGR,  UB, 3, 0, 0, &convert_shrink },
+  { IL_RGBA, UB, IL_BGR,  UB, 3, 1, 0, &convert_shrink },
+  { IL_BGRA, UB, IL_RGB,  UB, 3, 1, 0, &convert_shrink },
+  { IL_RGBA, UB, IL_BGRA, UB, 4, 1, 0, &convert_swap32 },
+  { IL_BGRA, UB, IL_RGBA, UB, 4, 1, 0, &convert_swap32 },
+  { IL_RGB,  UB, IL_BGR,  UB, 3, 1, 0, &convert_swap24 },
+  { IL_BGR,  UB, IL_RGB,  UB, 3, 1, 0, &convert_swap24 },
+  { IL_LUMINANCE,       UB, IL_LUMINANCE,       FL, 1, 0, 0, &convert_to_float },
+  { IL_LUMINANCE_ALPHA, UB, IL_LUMINANCE_ALPHA, FL, 2, 0, 0, &convert_to_float },
+  { IL_RGB,             UB, IL_RGB,             FL, 3, 0, 0, &convert_to_float },
+  { IL_BGR,             UB, IL_BGR,             FL, 3, 0, 0, &convert_to_float },
+  { IL_RGBA,            UB, IL_RGBA,            FL, 4, 0, 0, &convert_to_float },
+  { IL_BGRA,            UB, IL_BGRA,            FL, 4, 0, 0, &convert_to_float },
+  { IL_LUMINANCE,       FL, IL_LUMINANCE,       UB, 1, 0, 0, &convert_to_ubyte },
+  { IL_LUMINANCE_ALPHA, FL, IL_LUMINANCE_ALPHA, UB, 2, 0, 0, &convert_to_ubyte },
+  { IL_RGB,             FL, IL_RGB,             UB, 3, 0, 0, &convert_to_ubyte },
+  { IL_BGR,             FL, IL_BGR,             UB, 3, 0, 0, &convert_to_ubyte },
+  { IL_RGBA,            FL, IL_RGBA,            UB, 4, 0, 0, &convert_to_ubyte },
+  { IL_BGRA,            FL, IL_BGRA,            UB, 4, 0, 0, &convert_to_ubyte },
+};
+
+#undef UB
+#undef FL
+
+#define CONVERT_PAIRS ((int) (sizeof(convert_pairs) / sizeof(convert_pairs[0])))
+
+static int convert_channels(ILenum fmt) {
+  switch (fmt) {
+  case IL_LUMINANCE:       return 1;
+  case IL_LUMINANCE_ALPHA: return 2;
+  case IL_RGB: case IL_BGR: return 3;
+  default:                 return 4;
+  }
+}
+
+/* run a pair's kernel over n pixels */
+static void convert_run(const convert_pair *p, const void *src, void *dst, size_t n) {
+  if (p->src_fmt != p->dst_fmt || p->src_type == p->dst_type)
+    (*p->fn)(src, dst, n, p->swap);
+  else
+    (*p->fn)(src, dst, n * p->channels, 0);
+}
+
+/* on the thread running DevIL: compare a pair with ilConvertImage */
+static int convert_check(convert_pair *p) {
+  enum { N = 256 };
+  int channels = convert_channels(p->src_fmt),
+      fsize = p->src_type == IL_FLOAT ? sizeof(ILfloat) : 1,
+      tsize = p->dst_type == IL_FLOAT ? sizeof(ILfloat) : 1;
+  /* four bands of N pixels for floats, one for bytes */
+  size_t pixels = fsize == 1 ? N : 4 * N,
+         count = pixels * channels,
+         out = pixels * p->channels * tsize,
+         i, k;
+  void *src = malloc(count * fsize),
+       *dst = malloc(out);
+  ILuint name;
+  int ok = 0;
+
+  if (!src || !dst)
+    goto done;
+
+  /*
+   * Each channel runs through every byte value, offset per channel so
+   * swapped channels show.  Floats go through exact steps, half steps,
+   * [-0.5, 1.5) and [-32, 32), each band in every channel.
+   */
+  for (i = 0; i < count; i++) {
+    k = (i / channels + i % channels * N) % pixels;
+    if (fsize == 1)
+      ((ILubyte *) src)[i] = (i / channels + i % channels * 85) & 255;
+    else if (k < N)
+      ((ILfloat *) src)[i] = k / 255.0f;
+    else if (k < 2 * N)
+      ((ILfloat *) src)[i] = (k - N + 0.5f) / 255.0f;
+    else if (k < 3 * N)
+      ((ILfloat *) src)[i] = -0.5f + (k - 2 * N) * 2 / (ILfloat) N;
+    else
+      ((ILfloat *) src)[i] = ((ILfloat) k - 3 * N - N / 2) / 4;
+  }
+
+  ilGenImages(1, &name);
+  ilBindImage(name);
+  if (ilTexImage(pixels, 1, 1, channels, p->src_fmt, p->src_type, src) &&
+      ilConvertImage(p->dst_fmt, p->dst_type) &&
+      ilGetInteger(IL_IMAGE_SIZE_OF_DATA) == (ILint) out) {
+    convert_run(p, src, dst, pixels);
+    ok = !memcmp(ilGetData(), dst, out);
+  }
+  ilDeleteImages(1, &name);
+  ilBindImage(devil_bound);
+  while (ilGetError() != IL_NO_ERROR)
+    ;
+
+done:
+  free(src);
+  free(dst);
+  return ok ? 1 : -1;
+}
+
+/*
+ * On the thread running DevIL: convert the bound image with a kernel.
+ * Returns -1 when there is no kernel for the conversion (or it doesn't
+ * match DevIL, or the image has mipmaps, layers or frames, which
+ * ilConvertImage converts too), otherwise whether it worked.
+ */
+static int convert_fast(ILenum fmt, ILenum type) {
+  convert_pair *p = NULL;
+  ILint w, h, d, origin, sfmt, stype;
+  size_t n;
+  void *data;
+  int i;
+  ILboolean ok;
+
+  /* the binding is needed again after a check; active_* leave it unknown */
+  if (!convert_enabled || devil_bound == BIND_NONE)
+    return -1;
+
+  sfmt = ilGetInteger(IL_IMAGE_FORMAT);
+  stype = ilGetInteger(IL_IMAGE_TYPE);
+  for (i = 0; i < CONVERT_PAIRS; i++)
+    if (convert_pairs[i].src_fmt == (ILenum) sfmt && convert_pairs[i].src_type == (ILenum) stype &&
+        convert_pairs[i].dst_fmt == fmt && convert_pairs[i].dst_type == type)
+      p = &convert_pairs[i];
+
+  if (!p || ilGetInteger(IL_NUM_MIPMAPS) || ilGetInteger(IL_NUM_LAYERS) || ilGetInteger(IL_NUM_IMAGES))
+    return -1;
+  if (!p->checked)
+    p->checked = convert_check(p);
+  if (p->checked < 0)
+    return -1;
+
+  w = ilGetInteger(IL_IMAGE_WIDTH);
+  h = ilGetInteger(IL_IMAGE_HEIGHT);
+  d = ilGetInteger(IL_IMAGE_DEPTH);
+  origin = ilGetInteger(IL_IMAGE_ORIGIN);
+  n = (size_t) w * h * d;
+
+  if (!(data = malloc(n * p->channels * (type == IL_FLOAT ? sizeof(ILfloat) : 1))))
+    return -1;
+
+  convert_run(p, ilGetData(), data, n);
+  ok = ilTexImage(w, h, d, p->channels, fmt, type, data);
+  free(data);
+  if (ok)
+    ilRegisterOrigin(origin);
+
+  return ok;
+}
+
+/* on the thread running DevIL: convert_image, through a kernel if there is one */
+static ILboolean devil_convert(ILenum fmt, ILenum type) {
+  int ret = convert_fast(fmt, type);
+  return ret < 0 ? ilConvertImage(fmt, type) : ret;
+}
+
+/*
+ * Turn the convert_image fast paths on or off; with them off every
+ * conversion goes through ilConvertImage.
+ *
+ * Aliases:
+ *   DevIL::IL::set_fast_convert
+ *   DevIL::IL::SetFastConvert
+ *
+ * Examples:
+ *   DevIL::IL::set_fast_convert false
+ *   DevIL::IL::SetFastConvert false
+ *
+ */
+static VALUE il_set_fast_convert(VALUE self, VALUE flag) {
+  devil_sync();
+  convert_enabled = RTEST(flag);
+  return Qnil;
+}
+
+/**************/
+/* resampling */
+/**************/
+
+/*
+ * A separable resampler for DevIL::ILU.resample.  Kernel weights are
+ * computed once per axis.  The output is cut into horizontal strips,
+ * spread over the helper threads; each strip resamples the source rows
+ * it needs horizontally into a ring of as many rows as the vertical
+ * kernel has taps (small enough to stay in cache), then sums the ring
+ * vertically into each output row.  Pixels are worked on as floats,
+ * with SSE/AVX for the multiply-accumulate where the CPU has it.
+ * Edges repeat the outermost pixel.
+ */
+typedef struct {
+  int taps;
+  long *start;          /* first source pixel per output pixel */
+  int *count;           /* taps used, start + count <= source size */
+  float *weight;        /* taps weights per output pixel */
+} resample_axis;
+
+typedef struct {
+  resample_axis x, y;
+  const ILubyte *src;
+  ILubyte *dst;
+  ILenum type;
+  long src_w, src_h,
+       dst_w, dst_h,
+       strip;           /* output rows per strip */
+  int channels;
+  volatile int failed;
+} resample_job;
+
+typedef void (*resample_sum_fn)(float *out, const float *row, float w, long n);
+
+static resample_sum_fn resample_sum, resample_add;
+
+static double filter_box(double x) {
+  return x >= -0.5 && x < 0.5;
+}
+
+static double filter_triangle(double x) {
+  x = fabs(x);
+  return x < 1 ? 1 - x : 0;
+}
+
+/* Mitchell-Netravali, B = C = 1/3 */
+static double filter_mitchell(double x) {
+  x = fabs(x);
+  if (x < 1)
+    return (7 * x * x * x - 12 * x * x + 16.0 / 3) / 6;
+  if (x < 2)
+    return (-7.0 / 3 * x * x * x + 12 * x * x - 20 * x + 32.0 / 3) / 6;
+  return 0;
+}
+
+static double filter_lanczos3(double x) {
+  if (x == 0)
+    return 1;
+  if (x <= -3 || x >= 3)
+    return 0;
+  x *= M_PI;
+  return 3 * sin(x) * sin(x / 3) / (x * x);
+}
+
+static void resample_axis_free(resample_axis *a) {
+  free(a->start);
+  free(a->count);
+  free(a->weight);
+}
+
+/* weights for scaling src pixels to dst along one axis; 0 if out of memory */
+static int resample_axis_init(resample_axis *a, long src, long dst, double (*f)(double), double support) {
+  double scale = (double) dst / src,
+         fscale = scale < 1 ? scale : 1,
+         radius = support / fscale,
+         center, sum;
+  long i, j, lo, k;
+  float *w;
+
+  a->taps = (int) ceil(radius * 2) + 1;
+  a->start = malloc(dst * sizeof(long));
+  a->count = malloc(dst * sizeof(int));
+  a->weight = calloc((size_t) dst * a->taps, sizeof(float));
+  if (!a->start || !a->count || !a->weight)
+    return 0;
+
+  for (i = 0; i < dst; i++) {
+    center = (i + 0.5) / scale;
+    lo = (long) floor(center - radius);
+    a->start[i] = lo < 0 ? 0 : lo;
+    a->count[i] = (int) ((lo + a->taps < src ? lo + a->taps : src) - a->start[i]);
+    w = a->weight + (size_t) i * a->taps;
+
+    /* taps past the edges fall on the edge pixels */
+    sum = 0;
+    for (j = lo; j < lo + a->taps; j++) {
+      double v = f((j + 0.5 - center) * fscale);
+      k = j < 0 ? 0 : j >= src ? src - 1 : j;
+      w[k - a->start[i]] += v;
+      sum += v;
+    }
+    for (k = 0; k < a->count[i]; k++)
+      w[k] /= sum;
+  }
+
+  return 1;
+}
+
+static void sum_c(float *out, const float *row, float w, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    out[i] = row[i] * w;
+}
+
+static void add_c(float *out, const float *row, float w, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    out[i] += row[i] * w;
+}
+
+#ifdef CONVERT_X86
+#ifdef __SSE2__
+static void sum_sse(float *out, const float *row, float w, long n) {
+  __m128 k = _mm_set1_ps(w);
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(row + i), k));
+  sum_c(out + i, row + i, w, n - i);
+}
+
+static void add_sse(float *out, const float *row, float w, long n) {
+  __m128 k = _mm_set1_ps(w);
+  long i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(row + i), k)));
+  add_c(out + i, row + i, w, n - i);
+}
+#endif
+
+__attribute__((target("avx2")))
+static void sum_avx2(float *out, const float *row, float w, long n) {
+  __m256 k = _mm256_set1_ps(w);
+  long i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(row + i), k));
+  sum_c(out + i, row + i, w, n - i);
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(float *out, const float *row, float w, long n) {
+  __m256 k = _mm256_set1_ps(w);
+  long i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(_mm256_loadu_ps(row + i), k)));
+  add_c(out + i, row + i, w, n - i);
+}
+#endif
+
+static void resample_init(void) {
+  resample_sum = sum_c;
+  resample_add = add_c;
+
+#ifdef CONVERT_X86
+#ifdef __SSE2__
+  resample_sum = sum_sse;
+  resample_add = add_sse;
+#endif
+  if (__builtin_cpu_supports("avx2")) {
+    resample_sum = sum_avx2;
+    resample_add = add_avx2;
+  }
+#endif
+}
+
+/* source row y as floats */
+static void resample_load(const resample_job *job, long y, float *out) {
+  long i, n = job->src_w * job->channels;
+
+  switch (job->type) {
+  case IL_UNSIGNED_BYTE: {
+    const ILubyte *s = job->src + y * n;
+    for (i = 0; i < n; i++)
+      out[i] = s[i];
+    break;
+  }
+  case IL_UNSIGNED_SHORT: {
+    const ILushort *s = (const ILushort *) job->src + y * n;
+    for (i = 0; i < n; i++)
+      out[i] = s[i];
+    break;
+  }
+  default:
+    memcpy(out, (const ILfloat *) job->src + y * n, n * sizeof(float));
+  }
+}
+
+/* output row y from floats, rounded and clamped to the pixel type */
+static void resample_store(const resample_job *job, long y, const float *in) {
+  long i, n = job->dst_w * job->channels;
+  float v;
+
+  switch (job->type) {
+  case IL_UNSIGNED_BYTE: {
+    ILubyte *d = job->dst + y * n;
+    for (i = 0; i < n; i++) {
+      v = in[i] + 0.5f;
+      d[i] = v <= 0 ? 0 : v >= 255 ? 255 : (ILubyte) v;
+    }
+    break;
+  }
+  case IL_UNSIGNED_SHORT: {
+    ILushort *d = (ILushort *) job->dst + y * n;
+    for (i = 0; i < n; i++) {
+      v = in[i] + 0.5f;
+      d[i] = v <= 0 ? 0 : v >= 65535 ? 65535 : (ILushort) v;
+    }
+    break;
+  }
+  default:
+    memcpy((ILfloat *) job->dst + y * n, in, n * sizeof(float));
+  }
+}
+
+/* horizontal pass over one row */
+static void resample_row(const resample_job *job, const float *in, float *out) {
+  const resample_axis *a = &job->x;
+  const float *w, *s;
+  int c = job->channels, k;
+  long i;
+
+  for (i = 0; i < job->dst_w; i++, out += c) {
+    w = a->weight + (size_t) i * a->taps;
+    s = in + a->start[i] * c;
+
+#if defined(CONVERT_X86) && defined(__SSE2__)
+    if (c == 4) {
+      __m128 acc = _mm_setzero_ps();
+      for (k = 0; k < a->count[i]; k++)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(s + k * 4), _mm_set1_ps(w[k])));
+      _mm_storeu_ps(out, acc);
+      continue;
+    }
+#endif
+    {
+      float acc[4] = { 0, 0, 0, 0 };
+      int j;
+
+      for (k = 0; k < a->count[i]; k++)
+        for (j = 0; j < c; j++)
+          acc[j] += s[k * c + j] * w[k];
+      for (j = 0; j < c; j++)
+        out[j] = acc[j];
+    }
+  }
+}
+
+/* one strip of output rows, on any thread */
+static void resample_strip(void *ptr, long strip) {
+  resample_job *job = ptr;
+  const resample_axis *a = &job->y;
+  long y0 = strip * job->strip,
+       y1 = y0 + job->strip < job->dst_h ? y0 + job->strip : job->dst_h,
+       n = job->dst_w * job->channels,
+       have = -1,       /* source rows up to here are in the ring */
+       y, r;
+  float *line = malloc(job->src_w * job->channels * sizeof(float)),
+        *ring = malloc((size_t) a->taps * n * sizeof(float)),
+        *out = malloc(n * sizeof(float));
+  const float *w;
+  int k;
+
+  if (!line || !ring || !out) {
+    job->failed = 1;
+    goto done;
+  }
+
+  for (y = y0; y < y1; y++) {
+    w = a->weight + (size_t) y * a->taps;
+
+    /* start is non-decreasing, so the ring holds every row still needed */
+    r = a->start[y] > have + 1 ? a->start[y] : have + 1;
+    for (; r < a->start[y] + a->count[y]; r++) {
+      resample_load(job, r, line);
+      resample_row(job, line, ring + (r % a->taps) * n);
+    }
+    if (r - 1 > have)
+      have = r - 1;
+
+    resample_sum(out, ring + (a->start[y] % a->taps) * n, w[0], n);
+    for (k = 1; k < a->count[y]; k++)
+      resample_add(out, ring + ((a->start[y] + k) % a->taps) * n, w[k], n);
+    resample_store(job, y, out);
+  }
+
+done:
+  free(line);
+  free(ring);
+  free(out);
+}
+
+/* on the thread running DevIL: resample the bound image in place */
+static ILboolean devil_resample(ILuint width, ILuint height, ILenum filter) {
+  resample_job job;
+  double (*f)(double);
+  double support;
+  ILint origin, bpc;
+  long strips;
+  ILboolean ok = IL_FALSE;
+
+  switch (filter) {
+  case ILU_SCALE_BOX:      f = filter_box;      support = 0.5; break;
+  case ILU_BILINEAR:       f = filter_triangle; support = 1;   break;
+  case ILU_SCALE_MITCHELL: f = filter_mitchell; support = 2;   break;
+  case ILU_SCALE_LANCZOS3: f = filter_lanczos3; support = 3;   break;
+  default:
+    return IL_FALSE;
+  }
+
+  job.type = ilGetInteger(IL_IMAGE_TYPE);
+  job.channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  if (!width || !height || ilGetInteger(IL_IMAGE_DEPTH) != 1 ||
+      ilGetInteger(IL_IMAGE_FORMAT) == IL_COLOUR_INDEX || job.channels > 4 ||
+      (job.type != IL_UNSIGNED_BYTE && job.type != IL_UNSIGNED_SHORT && job.type != IL_FLOAT))
+    return IL_FALSE;
+
+  job.src = ilGetData();
+  job.src_w = ilGetInteger(IL_IMAGE_WIDTH);
+  job.src_h = ilGetInteger(IL_IMAGE_HEIGHT);
+  job.dst_w = width;
+  job.dst_h = height;
+  job.failed = 0;
+  bpc = ilGetInteger(IL_IMAGE_BPC);
+  origin = ilGetInteger(IL_IMAGE_ORIGIN);
+
+  memset(&job.x, 0, sizeof(job.x));
+  memset(&job.y, 0, sizeof(job.y));
+  job.dst = malloc((size_t) job.dst_w * job.dst_h * job.channels * bpc);
+  if (!job.dst || !job.src ||
+      !resample_axis_init(&job.x, job.src_w, job.dst_w, f, support) ||
+      !resample_axis_init(&job.y, job.src_h, job.dst_h, f, support))
+    goto done;
+
+  /* a few strips per thread, to even out the load */
+  strips = par_threads() * 4;
+  job.strip = (job.dst_h + strips - 1) / strips;
+  if (job.strip < 8)
+    job.strip = 8;
+  par_for((job.dst_h + job.strip - 1) / job.strip, resample_strip, &job);
+
+  if (!job.failed &&
+      (ok = ilTexImage(width, height, 1, job.channels, ilGetInteger(IL_IMAGE_FORMAT), job.type, job.dst)))
+    ilRegisterOrigin(origin);
+
+done:
+  free(job.dst);
+  resample_axis_free(&job.x);
+  resample_axis_free(&job.y);
+  return ok;
+}
+
+/*
+ * iluScale through the native resampler when ILU_FILTER selects one of
+ * the filters it implements.  Anything else -- the default ILU_NEAREST,
+ * 3D targets, palette images -- is left to iluScale.
+ */
+static ILboolean devil_scale(ILuint width, ILuint height, ILuint depth) {
+  if (depth <= 1 && devil_resample(width, height, iluGetInteger(ILU_FILTER)))
+    return IL_TRUE;
+
+  return iluScale(width, height, depth);
+}
+
+/*****************/
+/* gaussian blur */
+/*****************/
+
+/*
+ * DevIL::ILU.blur(sigma) approximates a Gaussian with three box blurs
+ * whose widths add up to the Gaussian's variance.  Every box is a
+ * running sum, so the cost per pixel doesn't depend on sigma.  Rows are
+ * blurred into a float copy of the image; columns are then blurred in
+ * blocks of BLUR_BLOCK, each block copied out transposed so the passes
+ * run along contiguous memory, and stored back into the image.  Rows
+ * and column blocks are spread over the helper threads.
+ */
+#define BLUR_BLOCK 16
+#define BLUR_ROWS  16
+
+typedef struct {
+  ILubyte *data;
+  float *rows;          /* the image after the horizontal passes */
+  ILenum type;
+  long w, h,
+       radius[3];
+  int channels;
+  volatile int failed;
+} blur_job;
+
+/* widths of n box blurs approximating a gaussian of sigma (Kutskir) */
+static void blur_boxes(double sigma, long *radius, int n) {
+  double ideal = sqrt(12 * sigma * sigma / n + 1);
+  long wl = (long) floor(ideal),
+       m;
+  int i;
+
+  if (!(wl & 1))
+    wl--;
+  m = lround((12 * sigma * sigma - n * wl * wl - 4 * n * wl - 3 * n) / (-4.0 * wl - 4));
+  for (i = 0; i < n; i++)
+    radius[i] = ((i < m ? wl : wl + 2) - 1) / 2;
+}
+
+/* box blur of radius r along a line of n pixels, edges repeated */
+static void blur_line(const float *in, float *out, long n, int c, long r) {
+  double acc[4], k = 1.0 / (2 * r + 1);
+  long i, lo, hi, far = r < n - 1 ? r : n - 1;
+  int j;
+
+  for (j = 0; j < c; j++) {
+    acc[j] = (r + 1) * (double) in[j] + (r - far) * (double) in[(n - 1) * c + j];
+    for (i = 1; i <= far; i++)
+      acc[j] += in[i * c + j];
+  }
+
+  for (i = 0; i < n; i++) {
+    hi = i + r + 1 < n ? i + r + 1 : n - 1;
+    lo = i - r > 0 ? i - r : 0;
+    for (j = 0; j < c; j++) {
+      out[i * c + j] = (float) (acc[j] * k);
+      acc[j] += in[hi * c + j] - in[lo * c + j];
+    }
+  }
+}
+
+/* the three boxes over line, using tmp; the result ends up in line */
+static void blur_boxes_line(const blur_job *job, float *line, float *tmp, long n) {
+  blur_line(line, tmp, n, job->channels, job->radius[0]);
+  blur_line(tmp, line, n, job->channels, job->radius[1]);
+  blur_line(line, tmp, n, job->channels, job->radius[2]);
+  memcpy(line, tmp, n * job->channels * sizeof(float));
+}
+
+/* horizontal passes over a group of rows */
+static void blur_rows(void *ptr, long group) {
+  blur_job *job = ptr;
+  long n = job->w * job->channels,
+       y = group * BLUR_ROWS,
+       end = y + BLUR_ROWS < job->h ? y + BLUR_ROWS : job->h,
+       i;
+  float *tmp = malloc(n * sizeof(float)),
+        *row;
+
+  if (!tmp) {
+    job->failed = 1;
+    return;
+  }
+
+  for (; y < end; y++) {
+    row = job->rows + y * n;
+    switch (job->type) {
+    case IL_UNSIGNED_BYTE:
+      for (i = 0; i < n; i++)
+        row[i] = job->data[y * n + i];
+      break;
+    case IL_UNSIGNED_SHORT:
+      for (i = 0; i < n; i++)
+        row[i] = ((ILushort *) job->data)[y * n + i];
+      break;
+    default:
+      memcpy(row, (ILfloat *) job->data + y * n, n * sizeof(float));
+    }
+    blur_boxes_line(job, row, tmp, job->w);
+  }
+
+  free(tmp);
+}
+
+/* vertical passes over a block of columns, stored back into the image */
+static void blur_columns(void *ptr, long block) {
+  blur_job *job = ptr;
+  int c = job->channels;
+  long x0 = block * BLUR_BLOCK,
+       bw = x0 + BLUR_BLOCK < job->w ? BLUR_BLOCK : job->w - x0,
+       n = job->h * c,
+       stride = job->w * c,
+       x, y, i, at;
+  float *cols = malloc((bw + 1) * n * sizeof(float)),
+        *tmp = cols + bw * n,
+        v;
+
+  if (!cols) {
+    job->failed = 1;
+    return;
+  }
+
+  /* transpose the block: column x becomes line x - x0 */
+  for (y = 0; y < job->h; y++)
+    for (x = 0; x < bw; x++)
+      memcpy(cols + x * n + y * c, job->rows + y * stride + (x0 + x) * c, c * sizeof(float));
+
+  for (x = 0; x < bw; x++)
+    blur_boxes_line(job, cols + x * n, tmp, job->h);
+
+  for (y = 0; y < job->h; y++)
+    for (x = 0; x < bw; x++)
+      for (i = 0; i < c; i++) {
+        at = y * stride + (x0 + x) * c + i;
+        v = cols[x * n + y * c + i];
+        switch (job->type) {
+        case IL_UNSIGNED_BYTE:
+          v += 0.5f;
+          job->data[at] = v <= 0 ? 0 : v >= 255 ? 255 : (ILubyte) v;
+          break;
+        case IL_UNSIGNED_SHORT:
+          v += 0.5f;
+          ((ILushort *) job->data)[at] = v <= 0 ? 0 : v >= 65535 ? 65535 : (ILushort) v;
+          break;
+        default:
+          ((ILfloat *) job->data)[at] = v;
+        }
+      }
+
+  free(cols);
+}
+
+/* on the thread running DevIL: blur the bound image */
+static ILboolean devil_blur(ILfloat sigma) {
+  blur_job job;
+
+  job.type = ilGetInteger(IL_IMAGE_TYPE);
+  job.channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  if (!(sigma >= 0) || ilGetInteger(IL_IMAGE_DEPTH) != 1 ||
+      ilGetInteger(IL_IMAGE_FORMAT) == IL_COLOUR_INDEX || job.channels > 4 ||
+      (job.type != IL_UNSIGNED_BYTE && job.type != IL_UNSIGNED_SHORT && job.type != IL_FLOAT))
+    return IL_FALSE;
+  if (sigma == 0)
+    return IL_TRUE;
+
+  job.data = ilGetData();
+  job.w = ilGetInteger(IL_IMAGE_WIDTH);
+  job.h = ilGetInteger(IL_IMAGE_HEIGHT);
+  job.failed = 0;
+  blur_boxes(sigma, job.radius, 3);
+
+  if (!job.data || !(job.rows = malloc((size_t) job.w * job.h * job.channels * sizeof(float))))
+    return IL_FALSE;
+
+  par_for((job.h + BLUR_ROWS - 1) / BLUR_ROWS, blur_rows, &job);
+  if (!job.failed)
+    par_for((job.w + BLUR_BLOCK - 1) / BLUR_BLOCK, blur_columns, &job);
+
+  free(job.rows);
+  return !job.failed;
+}
+
+/**************/
+/* mip chains */
+/**************/
+
+/*
+ * DevIL::ILU.mipmap_chain builds every mip level of the bound image
+ * into one buffer.  Each level is the 2x2 box average of the one
+ * before, kept in linear float between levels so rounding doesn't add
+ * up down the chain.  In sRGB mode colour channels are averaged as
+ * linear light and alpha as is; the sRGB encode uses a MIP_LUT entry
+ * table.  The rows of each level are spread over the helper threads,
+ * and four channel levels after the first average with SSE.
+ */
+#define MIP_LUT    16384
+#define MIP_PIXELS 16384        /* minimum pixels per par_for index */
+
+typedef struct {
+  const ILubyte *bsrc;          /* the previous level: the image... */
+  const float *fsrc;            /* ...or floats */
+  float *dst;                   /* this level as floats, or NULL for the last one */
+  ILubyte *out;
+  long sw, sh,
+       dw, dh,
+       rows;                    /* rows per par_for index */
+  int channels,
+      srgb[4];                  /* channels to treat as sRGB */
+} mip_job;
+
+static float mip_decode[256],
+             mip_linear[256];
+static ILubyte mip_encode[MIP_LUT + 1];
+
+static void mip_init(void) {
+  double v, s;
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    v = i / 255.0;
+    mip_decode[i] = v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+    mip_linear[i] = v;
+  }
+  for (i = 0; i <= MIP_LUT; i++) {
+    v = (double) i / MIP_LUT;
+    s = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - 0.055;
+    mip_encode[i] = lround(s * 255);
+  }
+}
+
+static inline ILubyte mip_store(const mip_job *job, float v, int c) {
+  if (job->srgb[c])
+    return mip_encode[(int) (v * MIP_LUT + 0.5f)];
+  return (ILubyte) (v * 255 + 0.5f);
+}
+
+/* rows [i * job->rows, (i + 1) * job->rows) of a level */
+static void mip_rows(void *arg, long i) {
+  const mip_job *job = arg;
+  const float *decode[4];
+  long y = i * job->rows,
+       end = y + job->rows < job->dh ? y + job->rows : job->dh,
+       c = job->channels,
+       x, x0, x1, r0, r1, o;
+  int ch;
+  float v;
+
+  for (ch = 0; ch < 4; ch++)
+    decode[ch] = job->srgb[ch] ? mip_decode : mip_linear;
+
+  for (; y < end; y++) {
+    r0 = 2 * y * job->sw * c;
+    r1 = (2 * y + 1 < job->sh ? 2 * y + 1 : job->sh - 1) * job->sw * c;
+    o = y * job->dw * c;
+    x = 0;
+
+#ifdef CONVERT_X86
+    /* floats and four channels: a pixel is one vector */
+    if (job->fsrc && c == 4 && job->dst) {
+      const __m128 quarter = _mm_set1_ps(0.25f);
+
+      for (; x < job->dw && 2 * x + 1 < job->sw; x++) {
+        __m128 s = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(job->fsrc + r0 + 8 * x),
+                                         _mm_loadu_ps(job->fsrc + r0 + 8 * x + 4)),
+                              _mm_add_ps(_mm_loadu_ps(job->fsrc + r1 + 8 * x),
+                                         _mm_loadu_ps(job->fsrc + r1 + 8 * x + 4)));
+
+        s = _mm_mul_ps(s, quarter);
+        _mm_storeu_ps(job->dst + o + 4 * x, s);
+        for (ch = 0; ch < 4; ch++)
+          job->out[o + 4 * x + ch] = mip_store(job, job->dst[o + 4 * x + ch], ch);
+      }
+    }
+#endif
+
+    for (; x < job->dw; x++) {
+      x0 = 2 * x * c;
+      x1 = (2 * x + 1 < job->sw ? 2 * x + 1 : job->sw - 1) * c;
+      for (ch = 0; ch < c; ch++) {
+        if (job->fsrc)
+          v = job->fsrc[r0 + x0 + ch] + job->fsrc[r0 + x1 + ch] +
+              job->fsrc[r1 + x0 + ch] + job->fsrc[r1 + x1 + ch];
+        else
+          v = decode[ch][job->bsrc[r0 + x0 + ch]] + decode[ch][job->bsrc[r0 + x1 + ch]] +
+              decode[ch][job->bsrc[r1 + x0 + ch]] + decode[ch][job->bsrc[r1 + x1 + ch]];
+        v *= 0.25f;
+        if (job->dst)
+          job->dst[o + x * c + ch] = v;
+        job->out[o + x * c + ch] = mip_store(job, v, ch);
+      }
+    }
+  }
+}
+
+/* the number of levels of a w x h chain, and their offsets into the buffer */
+static int mip_levels(long w, long h, int c, size_t *offset) {
+  int n = 0;
+
+  offset[0] = 0;
+  for (;;) {
+    offset[n + 1] = offset[n] + (size_t) w * h * c;
+    n++;
+    if (w == 1 && h == 1)
+      return n;
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+  }
+}
+
+typedef struct {
+  ILubyte *out;
+  size_t *offset;
+  long w, h;
+  int channels,
+      format,
+      srgb,
+      levels;
+} mip_chain_arg;
+
+/* on the thread running DevIL: fill m->out from the bound image */
+static ILboolean devil_mipmap_chain(mip_chain_arg *m) {
+  const ILubyte *data = ilGetData();
+  float *buf[2];
+  mip_job job;
+  int level, ch;
+
+  /* the layout was read before the buffer was allocated */
+  if (!data || ilGetInteger(IL_IMAGE_WIDTH) != m->w || ilGetInteger(IL_IMAGE_HEIGHT) != m->h ||
+      ilGetInteger(IL_IMAGE_DEPTH) != 1 || ilGetInteger(IL_IMAGE_CHANNELS) != m->channels ||
+      ilGetInteger(IL_IMAGE_FORMAT) != m->format || ilGetInteger(IL_IMAGE_TYPE) != IL_UNSIGNED_BYTE)
+    return IL_FALSE;
+
+  memcpy(m->out, data, m->offset[1]);
+  if (m->levels == 1)
+    return IL_TRUE;
+
+  /* levels alternate between two float buffers, sized for levels 1 and 2 */
+  buf[0] = malloc((m->offset[2] - m->offset[1]) * sizeof(float));
+  buf[1] = malloc((m->levels > 2 ? m->offset[3] - m->offset[2] : 1) * sizeof(float));
+  if (!buf[0] || !buf[1]) {
+    free(buf[0]);
+    free(buf[1]);
+    return IL_FALSE;
+  }
+
+  job.channels = m->channels;
+  for (ch = 0; ch < 4; ch++)
+    job.srgb[ch] = m->srgb;
+  if (m->format == IL_RGBA || m->format == IL_BGRA)
+    job.srgb[3] = 0;
+  else if (m->format == IL_LUMINANCE_ALPHA)
+    job.srgb[1] = 0;
+
+  job.bsrc = data;
+  job.fsrc = NULL;
+  job.sw = m->w;
+  job.sh = m->h;
+  for (level = 1; level < m->levels; level++) {
+    job.dw = job.sw > 1 ? job.sw / 2 : 1;
+    job.dh = job.sh > 1 ? job.sh / 2 : 1;
+    job.dst = level + 1 < m->levels ? buf[(level - 1) & 1] : NULL;
+    job.out = m->out + m->offset[level];
+    job.rows = (MIP_PIXELS + job.dw - 1) / job.dw;
+    par_for((job.dh + job.rows - 1) / job.rows, mip_rows, &job);
+
+    job.fsrc = job.dst;
+    job.sw = job.dw;
+    job.sh = job.dh;
+  }
+
+  free(buf[0]);
+  free(buf[1]);
+  return IL_TRUE;
+}
+
+/*****************/
+/* image metrics */
+/*****************/
+
+/*
+ * DevIL::ILU.compare measures how far the bound image is from another
+ * of the same layout: mean and largest absolute channel difference,
+ * PSNR, SSIM and the number of pixels with a channel off by more than
+ * a tolerance, and can draw the differences into a heatmap image.
+ * Rows are split into strips of METRIC_ROWS over the helper threads;
+ * each strip keeps its own sums, which are added up in order at the
+ * end, so results don't depend on the thread count.  Byte images are
+ * diffed 16 or 32 bytes at a time with SSE2 or AVX2.  SSIM is the mean,
+ * over the colour channels, of 8x8 windows placed every 4 pixels.
+ */
+#define METRIC_ROWS 16
+#define SSIM_WINDOW 8
+#define SSIM_STEP   4
+
+typedef struct {
+  uint64_t sum, sq,     /* absolute and squared differences */
+           differ;      /* pixels off by more than the tolerance */
+  unsigned max;
+} metric_bytes;
+
+typedef struct {
+  double sum, sq,
+         max;
+  uint64_t differ;
+} metric_acc;
+
+typedef struct {
+  const ILubyte *a, *b;
+  ILubyte *heat;        /* RGB heatmap, or NULL */
+  ILenum type;
+  long w, h;
+  int channels,
+      colour;           /* leading channels SSIM looks at (not alpha) */
+  double tol,
+         scale,         /* a channel's full scale: 255, 65535 or 1 */
+         heat_max;
+  metric_acc *strips;
+  double *ssim;         /* sum of each row of windows */
+} metric_job;
+
+typedef void (*metric_ub_fn)(const ILubyte *a, const ILubyte *b, long pixels, int c, int tol,
+                             metric_bytes *r);
+
+static metric_ub_fn metric_ub;
+
+/* pixels of a byte row with a channel off by more than tol */
+static uint64_t metric_count_ub(const ILubyte *a, const ILubyte *b, long pixels, int c, int tol) {
+  uint64_t n = 0;
+  long i;
+  int j, d;
+
+  for (i = 0; i < pixels; i++, a += c, b += c)
+    for (j = 0; j < c; j++) {
+      d = a[j] - b[j];
+      if (d > tol || -d > tol) {
+        n++;
+        break;
+      }
+    }
+
+  return n;
+}
+
+static void metric_bytes_c(const ILubyte *a, const ILubyte *b, long n, metric_bytes *r) {
+  unsigned d;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    r->sum += d;
+    r->sq += d * d;
+    if (d > r->max)
+      r->max = d;
+  }
+}
+
+static void metric_ub_c(const ILubyte *a, const ILubyte *b, long pixels, int c, int tol,
+                        metric_bytes *r) {
+  metric_bytes_c(a, b, pixels * c, r);
+  r->differ += metric_count_ub(a, b, pixels, c, tol);
+}
+
+#ifdef CONVERT_X86
+/* squares are summed in 32 bit lanes and folded every METRIC_FOLD bytes */
+#define METRIC_FOLD 8192
+
+#ifdef __SSE2__
+static void metric_ub_sse2(const ILubyte *a, const ILubyte *b, long pixels, int c, int tol,
+                           metric_bytes *r) {
+  const __m128i zero = _mm_setzero_si128(),
+                ones = _mm_set1_epi32(-1),
+                t = _mm_set1_epi8((char) tol);
+  __m128i ad, sum = zero, max = zero, sq;
+  uint64_t sums[2];
+  uint32_t lanes[4];
+  ILubyte maxes[16];
+  long n = pixels * c, i = 0, end;
+  int k;
+
+  while (i + 16 <= n) {
+    sq = zero;
+    for (end = n - i > METRIC_FOLD ? i + METRIC_FOLD : n; i + 16 <= end; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *) (a + i)),
+              vb = _mm_loadu_si128((const __m128i *) (b + i)),
+              lo, hi;
+
+      ad = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(ad, zero));
+      max = _mm_max_epu8(max, ad);
+      lo = _mm_unpacklo_epi8(ad, zero);
+      hi = _mm_unpackhi_epi8(ad, zero);
+      sq = _mm_add_epi32(sq, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+
+      /* four whole pixels: count those with a byte past the tolerance */
+      if (c == 4)
+        r->differ += __builtin_popcount(~_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_cmpeq_epi8(_mm_subs_epu8(ad, t), zero), ones))) & 0xf);
+    }
+    _mm_storeu_si128((__m128i *) lanes, sq);
+    r->sq += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  _mm_storeu_si128((__m128i *) sums, sum);
+  _mm_storeu_si128((__m128i *) maxes, max);
+  r->sum += sums[0] + sums[1];
+  for (k = 0; k < 16; k++)
+    if (maxes[k] > r->max)
+      r->max = maxes[k];
+
+  metric_bytes_c(a + i, b + i, n - i, r);
+  if (c == 4)
+    r->differ += metric_count_ub(a + i, b + i, (n - i) / 4, 4, tol);
+  else
+    r->differ += metric_count_ub(a, b, pixels, c, tol);
+}
+#endif
+
+__attribute__((target("avx2")))
+static void metric_ub_avx2(const ILubyte *a, const ILubyte *b, long pixels, int c, int tol,
+                           metric_bytes *r) {
+  const __m256i zero = _mm256_setzero_si256(),
+                ones = _mm256_set1_epi32(-1),
+                t = _mm256_set1_epi8((char) tol);
+  __m256i ad, sum = zero, max = zero, sq;
+  uint64_t sums[4];
+  uint32_t lanes[8];
+  ILubyte maxes[32];
+  long n = pixels * c, i = 0, end;
+  int k;
+
+  while (i + 32 <= n) {
+    sq = zero;
+    for (end = n - i > METRIC_FOLD ? i + METRIC_FOLD : n; i + 32 <= end; i += 32) {
+      __m256i va = _mm256_loadu_si256((const __m256i *) (a + i)),
+              vb = _mm256_loadu_si256((const __m256i *) (b + i)),
+              lo, hi;
+
+      ad = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+      sum = _mm256_add_epi64(sum, _mm256_sad_epu8(ad, zero));
+      max = _mm256_max_epu8(max, ad);
+      lo = _mm256_unpacklo_epi8(ad, zero);
+      hi = _mm256_unpackhi_epi8(ad, zero);
+      sq = _mm256_add_epi32(sq, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+
+      if (c == 4)
+        r->differ += __builtin_popcount(~_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(_mm256_cmpeq_epi8(_mm256_subs_epu8(ad, t), zero), ones))) & 0xff);
+    }
+    _mm256_storeu_si256((__m256i *) lanes, sq);
+    for (k = 0; k < 8; k++)
+      r->sq += lanes[k];
+  }
+
+  _mm256_storeu_si256((__m256i *) sums, sum);
+  _mm256_storeu_si256((__m256i *) maxes, max);
+  r->sum += sums[0] + sums[1] + sums[2] + sums[3];
+  for (k = 0; k < 32; k++)
+    if (maxes[k] > r->max)
+      r->max = maxes[k];
+
+  metric_bytes_c(a + i, b + i, n - i, r);
+  if (c == 4)
+    r->differ += metric_count_ub(a + i, b + i, (n - i) / 4, 4, tol);
+  else
+    r->differ += metric_count_ub(a, b, pixels, c, tol);
+}
+#endif
+
+static void metric_init(void) {
+  metric_ub = metric_ub_c;
+
+#ifdef CONVERT_X86
+#ifdef __SSE2__
+  metric_ub = metric_ub_sse2;
+#endif
+  if (__builtin_cpu_supports("avx2"))
+    metric_ub = metric_ub_avx2;
+#endif
+}
+
+static inline double metric_value(ILenum type, const ILubyte *p, long i) {
+  switch (type) {
+  case IL_UNSIGNED_BYTE:  return p[i];
+  case IL_UNSIGNED_SHORT: return ((const ILushort *) p)[i];
+  default:                return ((const ILfloat *) p)[i];
+  }
+}
+
+/* sums over strip s */
+static void metric_strip(void *ptr, long s) {
+  metric_job *job = ptr;
+  metric_acc *acc = &job->strips[s];
+  metric_bytes r;
+  long n = job->w * job->channels,
+       y = s * METRIC_ROWS,
+       end = y + METRIC_ROWS < job->h ? y + METRIC_ROWS : job->h,
+       i;
+  double d;
+  int j, off;
+
+  memset(acc, 0, sizeof(metric_acc));
+
+  if (job->type == IL_UNSIGNED_BYTE) {
+    memset(&r, 0, sizeof(r));
+    for (; y < end; y++)
+      metric_ub(job->a + y * n, job->b + y * n, job->w, job->channels, (int) job->tol, &r);
+    acc->sum = r.sum;
+    acc->sq = r.sq;
+    acc->max = r.max;
+    acc->differ = r.differ;
+    return;
+  }
+
+  for (i = y * n; i < end * n; i += job->channels) {
+    off = 0;
+    for (j = 0; j < job->channels; j++) {
+      d = fabs(metric_value(job->type, job->a, i + j) - metric_value(job->type, job->b, i + j));
+      acc->sum += d;
+      acc->sq += d * d;
+      if (d > acc->max)
+        acc->max = d;
+      off |= d > job->tol;
+    }
+    acc->differ += off;
+  }
+}
+
+/* heatmap rows of strip s: black within the tolerance, then red to yellow to white */
+static void metric_heat(void *ptr, long s) {
+  metric_job *job = ptr;
+  long y = s * METRIC_ROWS,
+       end = y + METRIC_ROWS < job->h ? y + METRIC_ROWS : job->h,
+       i, p;
+  ILubyte *out;
+  double d, m, t;
+  int j;
+
+  for (p = y * job->w; p < end * job->w; p++) {
+    m = 0;
+    for (j = 0; j < job->channels; j++) {
+      i = p * job->channels + j;
+      d = fabs(metric_value(job->type, job->a, i) - metric_value(job->type, job->b, i));
+      if (d > m)
+        m = d;
+    }
+
+    out = job->heat + p * 3;
+    t = m > job->tol && job->heat_max > 0 ? 3 * m / job->heat_max : 0;
+    out[0] = t >= 1 ? 255 : (ILubyte) (t * 255);
+    out[1] = t >= 2 ? 255 : t > 1 ? (ILubyte) ((t - 1) * 255) : 0;
+    out[2] = t >= 3 ? 255 : t > 2 ? (ILubyte) ((t - 2) * 255) : 0;
+  }
+}
+
+/* SSIM summed over the windows of window row wy */
+static void metric_ssim_row(void *ptr, long wy) {
+  metric_job *job = ptr;
+  long ww = job->w < SSIM_WINDOW ? job->w : SSIM_WINDOW,
+       wh = job->h < SSIM_WINDOW ? job->h : SSIM_WINDOW,
+       y0 = wy * SSIM_STEP,
+       x0, x, y, i;
+  double c1 = 0.01 * job->scale * 0.01 * job->scale,
+         c2 = 0.03 * job->scale * 0.03 * job->scale,
+         k = (double) ww * wh,
+         sa, sb, saa, sbb, sab, va, vb, ma, mb,
+         sum = 0;
+  int j;
+
+  for (x0 = 0; x0 + ww <= job->w; x0 += SSIM_STEP)
+    for (j = 0; j < job->colour; j++) {
+      sa = sb = saa = sbb = sab = 0;
+      for (y = y0; y < y0 + wh; y++)
+        for (x = x0; x < x0 + ww; x++) {
+          i = (y * job->w + x) * job->channels + j;
+          va = metric_value(job->type, job->a, i);
+          vb = metric_value(job->type, job->b, i);
+          sa += va;
+          sb += vb;
+          saa += va * va;
+          sbb += vb * vb;
+          sab += va * vb;
+        }
+      ma = sa / k;
+      mb = sb / k;
+      sum += ((2 * ma * mb + c1) * (2 * (sab / k - ma * mb) + c2)) /
+             ((ma * ma + mb * mb + c1) * (saa / k - ma * ma + sbb / k - mb * mb + c2));
+    }
+
+  job->ssim[wy] = sum;
+}
+
+typedef struct {
+  ILuint other;
+  double tol;
+  int heatmap;
+  /* results */
+  double mae, max, psnr, ssim;
+  uint64_t differ;
+  ILuint heat;
+} metric_arg;
+
+/* on the thread running DevIL: compare the bound image with m->other */
+static ILboolean devil_compare(metric_arg *m) {
+  ILuint cur = devil_bound != BIND_NONE ? devil_bound : (ILuint) ilGetInteger(IL_CUR_IMAGE);
+  metric_job job;
+  metric_acc total;
+  long strips, wx, wy, i;
+  ILenum format;
+  ILint bpp;
+  double n;
+  int same;
+
+  job.a = ilGetData();
+  job.w = ilGetInteger(IL_IMAGE_WIDTH);
+  job.h = ilGetInteger(IL_IMAGE_HEIGHT);
+  job.channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  job.type = ilGetInteger(IL_IMAGE_TYPE);
+  bpp = ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL);
+  format = ilGetInteger(IL_IMAGE_FORMAT);
+  if (!job.a || job.w < 1 || job.h < 1 || ilGetInteger(IL_IMAGE_DEPTH) != 1 ||
+      format == IL_COLOUR_INDEX || job.channels < 1 || job.channels > 4 ||
+      (job.type != IL_UNSIGNED_BYTE && job.type != IL_UNSIGNED_SHORT && job.type != IL_FLOAT) ||
+      !devil_is_image(m->other))
+    return IL_FALSE;
+
+  devil_select(m->other);
+  job.b = ilGetData();
+  same = job.b && ilGetInteger(IL_IMAGE_WIDTH) == job.w && ilGetInteger(IL_IMAGE_HEIGHT) == job.h &&
+         ilGetInteger(IL_IMAGE_DEPTH) == 1 && ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL) == bpp &&
+         ilGetInteger(IL_IMAGE_FORMAT) == (ILint) format && ilGetInteger(IL_IMAGE_TYPE) == (ILint) job.type;
+  devil_select(cur);
+  if (!same)
+    return IL_FALSE;
+
+  job.scale = job.type == IL_UNSIGNED_BYTE ? 255 : job.type == IL_UNSIGNED_SHORT ? 65535 : 1;
+  job.tol = m->tol < 0 ? 0 : m->tol;
+  if (job.type == IL_UNSIGNED_BYTE)
+    job.tol = job.tol > 255 ? 255 : floor(job.tol);
+  job.colour = format == IL_RGBA || format == IL_BGRA ? 3 :
+               format == IL_LUMINANCE_ALPHA ? 1 : job.channels;
+  job.heat = NULL;
+
+  strips = (job.h + METRIC_ROWS - 1) / METRIC_ROWS;
+  wy = job.h < SSIM_WINDOW ? 1 : (job.h - SSIM_WINDOW) / SSIM_STEP + 1;
+  wx = job.w < SSIM_WINDOW ? 1 : (job.w - SSIM_WINDOW) / SSIM_STEP + 1;
+  job.strips = malloc(strips * sizeof(metric_acc));
+  job.ssim = malloc(wy * sizeof(double));
+  if (!job.strips || !job.ssim) {
+    free(job.strips);
+    free(job.ssim);
+    return IL_FALSE;
+  }
+
+  par_for(strips, metric_strip, &job);
+  par_for(wy, metric_ssim_row, &job);
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < strips; i++) {
+    total.sum += job.strips[i].sum;
+    total.sq += job.strips[i].sq;
+    total.differ += job.strips[i].differ;
+    if (job.strips[i].max > total.max)
+      total.max = job.strips[i].max;
+  }
+  for (i = 0, m->ssim = 0; i < wy; i++)
+    m->ssim += job.ssim[i];
+  free(job.strips);
+  free(job.ssim);
+
+  n = (double) job.w * job.h * job.channels;
+  m->mae = total.sum / n;
+  m->max = total.max;
+  m->psnr = total.sq > 0 ? 10 * log10(job.scale * job.scale / (total.sq / n)) : INFINITY;
+  m->ssim /= (double) wx * wy * job.colour;
+  m->differ = total.differ;
+  m->heat = 0;
+
+  if (m->heatmap) {
+    if (!(m->heat = devil_reuse()))
+      ilGenImages(1, &m->heat);
+    devil_select(m->heat);
+    if (ilTexImage(job.w, job.h, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, NULL) && (job.heat = ilGetData())) {
+      job.heat_max = total.max;
+      par_for(strips, metric_heat, &job);
+    } else {
+      /* no room for the heatmap: give the image back, report none */
+      devil_delete_images(1, &m->heat);
+      m->heat = 0;
+    }
+    devil_select(cur);
+  }
+
+  return IL_TRUE;
+}
+
+/********************/
+/* image statistics */
+/********************/
+
+/*
+ * DevIL::ILU.histogram and .stats read the bound image in one pass,
+ * split into chunks over the helper threads.  Every chunk counts into
+ * its own histogram (and, for UNSIGNED_SHORT and FLOAT, its own sums),
+ * and the partials are added up once the pass is done.  Statistics of
+ * byte images come straight from their 256 bin histogram.
+ *
+ * ILU.colors_used counts distinct colours natively: a shared bitset of
+ * every possible colour for pixels of up to three bytes, and hash sets
+ * for wider ones, each hash set owning one sixteenth of the hash space
+ * so the threads never share one.  Like the convert kernels, the
+ * counter is checked against iluColorsUsed the first time a layout is
+ * seen, both on whole pixels and on their first three bytes; a layout
+ * matching neither is left to DevIL.
+ */
+#define HIST_CHUNKS 64
+#define HIST_BUDGET (16 << 20)  /* bytes of partial histograms */
+#define COLOR_PARTS 16
+#define COLOR_CHECKS 32
+
+typedef struct {
+  const ILubyte *data;
+  ILenum type;
+  size_t pixels;
+  int channels,
+      bins,                     /* 0 for sums only */
+      sums,
+      chunks;
+  uint64_t *counts;             /* chunks x channels x bins */
+  double *sum, *sq,             /* chunks x channels */
+         *min, *max;
+  uint64_t *seen;               /* chunks x channels, values counted in the sums */
+} hist_job;
+
+static inline double hist_value(ILenum type, const ILubyte *p, size_t i) {
+  switch (type) {
+  case IL_UNSIGNED_BYTE:  return p[i];
+  case IL_UNSIGNED_SHORT: return ((const ILushort *) p)[i];
+  default:                return ((const ILfloat *) p)[i];
+  }
+}
+
+static inline int hist_bin(ILenum type, int bins, double v) {
+  switch (type) {
+  case IL_UNSIGNED_BYTE:  return (int) (v * bins / 256);
+  case IL_UNSIGNED_SHORT: return (int) (v * bins / 65536);
+  }
+  v = v < 0 ? 0 : v > 1 ? 1 : v;
+  return v * bins >= bins ? bins - 1 : (int) (v * bins);
+}
+
+static void hist_chunk(void *ptr, long k) {
+  hist_job *job = ptr;
+  int c = job->channels,
+      bins = job->bins,
+      j;
+  size_t i = job->pixels * k / job->chunks,
+         end = job->pixels * (k + 1) / job->chunks;
+  uint64_t *counts = job->counts + (size_t) k * c * bins;
+  double *sum = job->sum + k * c, *sq = job->sq + k * c,
+         *min = job->min + k * c, *max = job->max + k * c,
+         v;
+  uint64_t *seen = job->seen + k * c;
+  const ILubyte *p;
+
+  memset(counts, 0, (size_t) c * bins * sizeof(uint64_t));
+  for (j = 0; j < c; j++) {
+    sum[j] = sq[j] = 0;
+    min[j] = INFINITY;
+    max[j] = -INFINITY;
+    seen[j] = 0;
+  }
+
+  /* the common case: a byte histogram is a plain count of each value */
+  if (job->type == IL_UNSIGNED_BYTE && bins == 256 && !job->sums) {
+    for (p = job->data + i * c; i < end; i++)
+      for (j = 0; j < c; j++)
+        counts[j * 256 + *p++]++;
+    return;
+  }
+
+  for (; i < end; i++)
+    for (j = 0; j < c; j++) {
+      v = hist_value(job->type, job->data, i * c + j);
+      if (v != v)
+        continue;
+      if (bins)
+        counts[j * bins + hist_bin(job->type, bins, v)]++;
+      if (job->sums) {
+        sum[j] += v;
+        sq[j] += v * v;
+        if (v < min[j])
+          min[j] = v;
+        if (v > max[j])
+          max[j] = v;
+        seen[j]++;
+      }
+    }
+}
+
+typedef struct {
+  int channels,
+      bins,                     /* 0 for stats */
+      format,
+      type;
+  uint64_t *counts;             /* channels x bins */
+  double *mean, *stddev,        /* channels each */
+         *min, *max;
+  size_t pixels;
+} hist_arg;
+
+/* on the thread running DevIL: histogram or statistics of the bound image */
+static ILboolean devil_histogram(hist_arg *h) {
+  hist_job job;
+  uint64_t n, *bytes = NULL;
+  double *part, mean;
+  int j, b, k;
+
+  job.data = ilGetData();
+  job.type = ilGetInteger(IL_IMAGE_TYPE);
+  job.channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  if (!job.data || job.channels != h->channels || (int) job.type != h->type ||
+      ilGetInteger(IL_IMAGE_FORMAT) != h->format)
+    return IL_FALSE;
+
+  job.pixels = ilGetInteger(IL_IMAGE_SIZE_OF_DATA) / ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL);
+  job.sums = !h->bins && job.type != IL_UNSIGNED_BYTE;
+  job.bins = h->bins ? h->bins : job.type == IL_UNSIGNED_BYTE ? 256 : 0;
+  job.chunks = job.bins ? HIST_BUDGET / (job.channels * job.bins * sizeof(uint64_t)) : HIST_CHUNKS;
+  job.chunks = job.chunks < 1 ? 1 : job.chunks > HIST_CHUNKS ? HIST_CHUNKS : job.chunks;
+  if ((size_t) job.chunks > job.pixels)
+    job.chunks = job.pixels ? job.pixels : 1;
+
+  job.counts = malloc((size_t) job.chunks * job.channels * (job.bins ? job.bins : 1) * sizeof(uint64_t));
+  part = malloc((size_t) job.chunks * job.channels * 4 * sizeof(double));
+  job.seen = malloc((size_t) job.chunks * job.channels * sizeof(uint64_t));
+  if (!job.counts || !part || !job.seen) {
+    free(job.counts);
+    free(part);
+    free(job.seen);
+    return IL_FALSE;
+  }
+  job.sum = part;
+  job.sq = job.sum + job.chunks * job.channels;
+  job.min = job.sq + job.chunks * job.channels;
+  job.max = job.min + job.chunks * job.channels;
+
+  par_for(job.chunks, hist_chunk, &job);
+
+  /* add up the partials, in chunk order */
+  if (h->bins) {
+    memset(h->counts, 0, (size_t) job.channels * job.bins * sizeof(uint64_t));
+    for (k = 0; k < job.chunks; k++)
+      for (j = 0; j < job.channels * job.bins; j++)
+        h->counts[j] += job.counts[(size_t) k * job.channels * job.bins + j];
+  } else if (job.bins) {
+    bytes = job.counts;
+    for (k = 1; k < job.chunks; k++)
+      for (j = 0; j < job.channels * 256; j++)
+        bytes[j] += job.counts[(size_t) k * job.channels * 256 + j];
+  }
+
+  h->pixels = job.pixels;
+  for (j = 0; j < job.channels && !h->bins; j++) {
+    h->mean[j] = h->stddev[j] = 0;
+    h->min[j] = h->max[j] = NAN;
+
+    if (bytes) {
+      for (b = 0, n = 0; b < 256; b++) {
+        if (!bytes[j * 256 + b])
+          continue;
+        if (!n++)
+          h->min[j] = b;
+        h->max[j] = b;
+        h->mean[j] += (double) b * bytes[j * 256 + b];
+        h->stddev[j] += (double) b * b * bytes[j * 256 + b];
+      }
+      n = job.pixels;
+    } else {
+      for (k = 0, n = 0; k < job.chunks; k++) {
+        h->mean[j] += job.sum[k * job.channels + j];
+        h->stddev[j] += job.sq[k * job.channels + j];
+        n += job.seen[k * job.channels + j];
+        if (!(job.min[k * job.channels + j] >= h->min[j]))
+          h->min[j] = job.min[k * job.channels + j];
+        if (!(job.max[k * job.channels + j] <= h->max[j]))
+          h->max[j] = job.max[k * job.channels + j];
+      }
+      if (!n)
+        h->min[j] = h->max[j] = NAN;
+    }
+
+    if (n) {
+      mean = h->mean[j] / n;
+      h->mean[j] = mean;
+      h->stddev[j] = sqrt(fmax(h->stddev[j] / n - mean * mean, 0));
+    } else {
+      h->mean[j] = h->stddev[j] = NAN;
+    }
+  }
+
+  free(job.counts);
+  free(part);
+  free(job.seen);
+  return IL_TRUE;
+}
+
+typedef struct {
+  const ILubyte *data;
+  size_t pixels;
+  int bpp,
+      key;                      /* leading bytes of a pixel making up its colour */
+  uint64_t *bits;               /* for keys of up to three bytes */
+  size_t words;
+  uint64_t counts[HIST_CHUNKS];
+  volatile int failed;
+} colors_job;
+
+static inline uint32_t colors_small_key(const ILubyte *p, int n) {
+  return p[0] | (n > 1 ? p[1] << 8 : 0) | (n > 2 ? p[2] << 16 : 0);
+}
+
+static void colors_mark(void *ptr, long k) {
+  colors_job *job = ptr;
+  size_t i = job->pixels * k / HIST_CHUNKS,
+         end = job->pixels * (k + 1) / HIST_CHUNKS;
+  const ILubyte *p = job->data + i * job->bpp;
+  uint64_t bit, *word;
+  uint32_t key;
+
+  for (; i < end; i++, p += job->bpp) {
+    key = colors_small_key(p, job->key);
+    word = &job->bits[key >> 6];
+    bit = 1ULL << (key & 63);
+    /* most pixels repeat a colour already seen: skip the atomic */
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+      __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+  }
+}
+
+static void colors_popcount(void *ptr, long k) {
+  colors_job *job = ptr;
+  size_t i = job->words * k / HIST_CHUNKS,
+         end = job->words * (k + 1) / HIST_CHUNKS;
+  uint64_t n = 0;
+
+  for (; i < end; i++)
+    n += __builtin_popcountll(job->bits[i]);
+  job->counts[k] = n;
+}
+
+static inline uint64_t colors_hash(const ILubyte *p, int n) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL * (n + 1),
+           w;
+  int i;
+
+  for (i = 0; i < n; i += 8) {
+    w = 0;
+    memcpy(&w, p + i, n - i < 8 ? n - i : 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+
+  return h;
+}
+
+/* count the colours whose hash falls in part, in a set of pixel indices */
+static void colors_part(void *ptr, long part) {
+  colors_job *job = ptr;
+  size_t cap = 4096, used = 0, i, slot, *set, *grown, n;
+  const ILubyte *p;
+  uint64_t h;
+
+  if (!(set = calloc(cap, sizeof(size_t)))) {
+    job->failed = 1;
+    return;
+  }
+
+  for (i = 0, p = job->data; i < job->pixels; i++, p += job->bpp) {
+    h = colors_hash(p, job->key);
+    if ((long) (h >> 60) != part)
+      continue;
+
+    /* slots hold pixel index + 1 of the colour's first pixel */
+    for (slot = h & (cap - 1); set[slot]; slot = (slot + 1) & (cap - 1))
+      if (!memcmp(job->data + (set[slot] - 1) * job->bpp, p, job->key))
+        break;
+    if (set[slot])
+      continue;
+    set[slot] = i + 1;
+
+    if (++used * 2 > cap) {
+      if (!(grown = calloc(cap * 2, sizeof(size_t)))) {
+        job->failed = 1;
+        break;
+      }
+      for (n = 0; n < cap; n++) {
+        if (!set[n])
+          continue;
+        h = colors_hash(job->data + (set[n] - 1) * job->bpp, job->key);
+        for (slot = h & (cap * 2 - 1); grown[slot]; slot = (slot + 1) & (cap * 2 - 1))
+          ;
+        grown[slot] = set[n];
+      }
+      free(set);
+      set = grown;
+      cap *= 2;
+    }
+  }
+
+  free(set);
+  job->counts[part] = used;
+}
+
+/* distinct colours of the bound image, keyed on its first key bytes; -1 on failure */
+static int64_t colors_count(int key) {
+  colors_job job;
+  int64_t n = 0;
+  int k, parts;
+
+  job.data = ilGetData();
+  job.bpp = ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL);
+  if (!job.data || job.bpp < 1 || key > job.bpp)
+    return -1;
+  job.pixels = ilGetInteger(IL_IMAGE_SIZE_OF_DATA) / job.bpp;
+  job.key = key;
+  job.failed = 0;
+  job.bits = NULL;
+
+  if (key <= 3) {
+    job.words = ((size_t) 1 << (8 * key)) / 64;
+    job.words = job.words ? job.words : 1;
+    if (!(job.bits = calloc(job.words, sizeof(uint64_t))))
+      return -1;
+    par_for(HIST_CHUNKS, colors_mark, &job);
+    par_for(HIST_CHUNKS, colors_popcount, &job);
+    parts = HIST_CHUNKS;
+  } else {
+    par_for(COLOR_PARTS, colors_part, &job);
+    parts = COLOR_PARTS;
+  }
+
+  for (k = 0; k < parts; k++)
+    n += job.counts[k];
+  free(job.bits);
+
+  return job.failed ? -1 : n;
+}
+
+static struct {
+  ILenum format, type;
+  int key;                      /* bytes to key on, or 0 to use DevIL */
+} colors_checks[COLOR_CHECKS];
+static int colors_nchecks;
+
+/*
+ * On the thread running DevIL: find which key (whole pixels or their
+ * first three bytes) makes colors_count agree with iluColorsUsed for a
+ * layout, on an image whose first three bytes take 61 values and whose
+ * other bytes 7 more.  Returns the key, or 0 if neither agrees.
+ */
+static int colors_check(ILenum format, ILenum type) {
+  enum { N = 1024 };
+  ILuint name;
+  ILubyte *data = NULL;
+  int64_t ours;
+  ILuint theirs = 0;
+  int channels, bpp = 0, key = 0, k, m;
+  size_t i;
+
+  ilGenImages(1, &name);
+  ilBindImage(name);
+  channels = convert_channels(format);
+#ifdef IL_ALPHA
+  if (format == IL_ALPHA)
+    channels = 1;
+#endif
+  if (ilTexImage(N, 1, 1, channels, format, type, NULL)) {
+    bpp = ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL);
+    data = ilGetData();
+  }
+  if (data && bpp > 0) {
+    for (i = 0; i < (size_t) N; i++)
+      for (k = 0; k < bpp; k++) {
+        m = i % 61;
+        data[i * bpp + k] = k < 3 ? (m * 37 + 11 + k * 101) & 255 : (i % 7) * 40 + k;
+      }
+    theirs = iluColorsUsed();
+    if ((ours = colors_count(bpp)) >= 0 && (ILuint) ours == theirs)
+      key = bpp;
+    else if (bpp > 3 && (ours = colors_count(3)) >= 0 && (ILuint) ours == theirs)
+      key = 3;
+  }
+  ilDeleteImages(1, &name);
+  ilBindImage(devil_bound);
+  while (ilGetError() != IL_NO_ERROR)
+    ;
+
+  return key;
+}
+
+/* on the thread running DevIL: iluColorsUsed, natively where it matches */
+static ILuint devil_colors_used(void) {
+  ILenum format, type;
+  int64_t n;
+  int i, key = 0;
+
+  /* the binding is needed again after a check */
+  if (devil_bound == BIND_NONE || ilGetInteger(IL_IMAGE_FORMAT) == IL_COLOUR_INDEX)
+    return iluColorsUsed();
+
+  format = ilGetInteger(IL_IMAGE_FORMAT);
+  type = ilGetInteger(IL_IMAGE_TYPE);
+  for (i = 0; i < colors_nchecks; i++)
+    if (colors_checks[i].format == format && colors_checks[i].type == type)
+      break;
+  if (i == colors_nchecks) {
+    if (i == COLOR_CHECKS)
+      return iluColorsUsed();
+    colors_checks[i].format = format;
+    colors_checks[i].type = type;
+    colors_checks[i].key = colors_check(format, type);
+    colors_nchecks++;
+  }
+  key = colors_checks[i].key;
+
+  if (!key || (n = colors_count(key)) < 0)
+    return iluColorsUsed();
+  return (ILuint) n;
+}
+
+/*******************/
+/* DXTC compressor */
+/*******************/
+
+/*
+ * DevIL::IL.get_dxtc_data compresses DXT1, DXT3, DXT5, ATI1N (BC4: red,
+ * or luminance) and 3DC (BC5: red then green, for normal maps) itself,
+ * for 2D UNSIGNED_BYTE images; anything else goes to DevIL.  Rows of 4x4
+ * blocks are spread over the helper threads and written straight into
+ * the caller's buffer.  Fast mode takes the colour endpoints from the
+ * block's bounding box, inset by 1/16 (van Waveren).  High quality mode
+ * also fits them along the principal axis of the block's colours and
+ * refines the best fit by least squares; alpha blocks try both the 8 and
+ * the 6 value modes.
+ */
+#define DXTC_BLOCKS 1024        /* minimum blocks per par_for index */
+
+typedef struct {
+  const ILubyte *data;
+  ILubyte *out;
+  long w, h,
+       bw, bh,
+       rows;                    /* block rows per par_for index */
+  int channels,
+      order[4],                 /* source channel of r, g, b, a; -1 for none */
+      flip,                     /* lower left origin: rows run bottom up */
+      rgba,                     /* RGBA pixels, copied as they are */
+      format,
+      block,                    /* bytes per block */
+      high;
+} dxtc_job;
+
+static void dxtc_put16(ILubyte *p, unsigned v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static unsigned dxtc_565(const float *c) {
+  int r = (int) (c[0] * 31 / 255 + 0.5f),
+      g = (int) (c[1] * 63 / 255 + 0.5f),
+      b = (int) (c[2] * 31 / 255 + 0.5f);
+
+  return r << 11 | g << 5 | b;
+}
+
+static void dxtc_unpack(unsigned c, int *rgb) {
+  rgb[0] = (c >> 11) << 3 | (c >> 13);
+  rgb[1] = ((c >> 5) & 63) << 2 | ((c >> 9) & 3);
+  rgb[2] = (c & 31) << 3 | ((c >> 2) & 7);
+}
+
+/*
+ * A block's pixels, as RGBA bytes and as float planes of r, g and b for
+ * the distance search.
+ */
+typedef struct {
+  ILubyte px[16][4];
+  float plane[3][16];
+} dxtc_block;
+
+/* the colour block for endpoints c0, c1 (4 colour mode); returns the error */
+static long dxtc_color_fit(const dxtc_block *blk, unsigned c0, unsigned c1, ILubyte *out) {
+  int pal[4][3], idx[16], n = c0 == c1 ? 1 : 4, i, j, k;
+  float dist[16];
+  unsigned tmp, bits = 0;
+  long err = 0;
+
+  if (c0 < c1) {
+    tmp = c0;
+    c0 = c1;
+    c1 = tmp;
+  }
+  dxtc_unpack(c0, pal[0]);
+  dxtc_unpack(c1, pal[1]);
+  for (k = 0; k < 3; k++) {
+    pal[2][k] = (2 * pal[0][k] + pal[1][k]) / 3;
+    pal[3][k] = (pal[0][k] + 2 * pal[1][k]) / 3;
+  }
+
+#ifdef CONVERT_X86
+  {
+    __m128 best[4], sel[4], d, e, lt, jj, p[3];
+    int q;
+
+    for (q = 0; q < 4; q++) {
+      best[q] = _mm_set1_ps(1e9f);
+      sel[q] = _mm_setzero_ps();
+    }
+    for (j = 0; j < n; j++) {
+      for (k = 0; k < 3; k++)
+        p[k] = _mm_set1_ps(pal[j][k]);
+      jj = _mm_set1_ps(j);
+      for (q = 0; q < 4; q++) {
+        e = _mm_sub_ps(_mm_loadu_ps(blk->plane[0] + 4 * q), p[0]);
+        d = _mm_mul_ps(e, e);
+        e = _mm_sub_ps(_mm_loadu_ps(blk->plane[1] + 4 * q), p[1]);
+        d = _mm_add_ps(d, _mm_mul_ps(e, e));
+        e = _mm_sub_ps(_mm_loadu_ps(blk->plane[2] + 4 * q), p[2]);
+        d = _mm_add_ps(d, _mm_mul_ps(e, e));
+        lt = _mm_cmplt_ps(d, best[q]);
+        best[q] = _mm_min_ps(d, best[q]);
+        sel[q] = _mm_or_ps(_mm_and_ps(lt, jj), _mm_andnot_ps(lt, sel[q]));
+      }
+    }
+    for (q = 0; q < 4; q++) {
+      _mm_storeu_ps(dist + 4 * q, best[q]);
+      _mm_storeu_si128((__m128i *) (idx + 4 * q), _mm_cvtps_epi32(sel[q]));
+    }
+  }
+#else
+  for (i = 0; i < 16; i++) {
+    dist[i] = 1e9f;
+    idx[i] = 0;
+    for (j = 0; j < n; j++) {
+      float e = 0, d;
+
+      for (k = 0; k < 3; k++) {
+        d = blk->plane[k][i] - pal[j][k];
+        e += d * d;
+      }
+      if (e < dist[i]) {
+        dist[i] = e;
+        idx[i] = j;
+      }
+    }
+  }
+#endif
+
+  for (i = 0; i < 16; i++) {
+    bits |= (unsigned) idx[i] << (2 * i);
+    err += (long) dist[i];
+  }
+
+  dxtc_put16(out, c0);
+  dxtc_put16(out + 2, c1);
+  dxtc_put16(out + 4, bits);
+  dxtc_put16(out + 6, bits >> 16);
+  return err;
+}
+
+/* bounding box of the block's colours, inset by 1/16 */
+static long dxtc_color_box(const dxtc_block *blk, ILubyte *out) {
+  const ILubyte (*px)[4] = blk->px;
+  float lo[3], hi[3], inset;
+  int i, k;
+
+#ifdef CONVERT_X86
+  __m128i mn = _mm_loadu_si128((const __m128i *) px[0]),
+          mx = mn, v;
+
+  for (i = 4; i < 16; i += 4) {
+    v = _mm_loadu_si128((const __m128i *) px[i]);
+    mn = _mm_min_epu8(mn, v);
+    mx = _mm_max_epu8(mx, v);
+  }
+  mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, 0x4e));
+  mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, 0x4e));
+  mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, 0xb1));
+  mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, 0xb1));
+  i = _mm_cvtsi128_si32(mn);
+  k = _mm_cvtsi128_si32(mx);
+  lo[0] = i & 255;
+  lo[1] = (i >> 8) & 255;
+  lo[2] = (i >> 16) & 255;
+  hi[0] = k & 255;
+  hi[1] = (k >> 8) & 255;
+  hi[2] = (k >> 16) & 255;
+#else
+  for (k = 0; k < 3; k++)
+    lo[k] = hi[k] = px[0][k];
+  for (i = 1; i < 16; i++)
+    for (k = 0; k < 3; k++) {
+      if (px[i][k] < lo[k])
+        lo[k] = px[i][k];
+      if (px[i][k] > hi[k])
+        hi[k] = px[i][k];
+    }
+#endif
+
+  for (k = 0; k < 3; k++) {
+    inset = (hi[k] - lo[k]) / 16;
+    lo[k] += inset;
+    hi[k] -= inset;
+  }
+
+  return dxtc_color_fit(blk, dxtc_565(hi), dxtc_565(lo), out);
+}
+
+/* endpoints along the principal axis of the block's colours */
+static long dxtc_color_pca(const dxtc_block *blk, ILubyte *out) {
+  const ILubyte (*px)[4] = blk->px;
+  float mean[3] = { 0, 0, 0 },
+        cov[6] = { 0, 0, 0, 0, 0, 0 },
+        axis[3] = { 1, 1, 1 },
+        v[3], d[3], t, lo = 0, hi = 0, len;
+  int i, k;
+
+  for (i = 0; i < 16; i++)
+    for (k = 0; k < 3; k++)
+      mean[k] += px[i][k] / 16.0f;
+  for (i = 0; i < 16; i++) {
+    for (k = 0; k < 3; k++)
+      d[k] = px[i][k] - mean[k];
+    cov[0] += d[0] * d[0];
+    cov[1] += d[0] * d[1];
+    cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1];
+    cov[4] += d[1] * d[2];
+    cov[5] += d[2] * d[2];
+  }
+
+  /* power iteration */
+  for (i = 0; i < 8; i++) {
+    v[0] = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    v[1] = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    v[2] = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    if (len < 1e-6f)
+      break;
+    for (k = 0; k < 3; k++)
+      axis[k] = v[k] / len;
+  }
+
+  for (i = 0; i < 16; i++) {
+    t = (px[i][0] - mean[0]) * axis[0] + (px[i][1] - mean[1]) * axis[1] +
+        (px[i][2] - mean[2]) * axis[2];
+    if (t < lo)
+      lo = t;
+    if (t > hi)
+      hi = t;
+  }
+
+  for (k = 0; k < 3; k++) {
+    v[k] = mean[k] + axis[k] * hi;
+    d[k] = mean[k] + axis[k] * lo;
+    v[k] = v[k] < 0 ? 0 : v[k] > 255 ? 255 : v[k];
+    d[k] = d[k] < 0 ? 0 : d[k] > 255 ? 255 : d[k];
+  }
+
+  return dxtc_color_fit(blk, dxtc_565(v), dxtc_565(d), out);
+}
+
+/* refit the endpoints of block by least squares, given its indices */
+static long dxtc_color_refine(const dxtc_block *blk, const ILubyte *block, ILubyte *out) {
+  const ILubyte (*px)[4] = blk->px;
+  static const float weight[4] = { 1, 0, 2 / 3.0f, 1 / 3.0f };
+  unsigned bits = block[4] | block[5] << 8 | block[6] << 16 | (unsigned) block[7] << 24;
+  float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 },
+        a, b, det, e0[3], e1[3];
+  int i, k;
+
+  for (i = 0; i < 16; i++) {
+    a = weight[(bits >> (2 * i)) & 3];
+    b = 1 - a;
+    aa += a * a;
+    ab += a * b;
+    bb += b * b;
+    for (k = 0; k < 3; k++) {
+      ax[k] += a * px[i][k];
+      bx[k] += b * px[i][k];
+    }
+  }
+
+  det = aa * bb - ab * ab;
+  if (fabsf(det) < 1e-6f)
+    return LONG_MAX;
+
+  for (k = 0; k < 3; k++) {
+    e0[k] = (bb * ax[k] - ab * bx[k]) / det;
+    e1[k] = (aa * bx[k] - ab * ax[k]) / det;
+    e0[k] = e0[k] < 0 ? 0 : e0[k] > 255 ? 255 : e0[k];
+    e1[k] = e1[k] < 0 ? 0 : e1[k] > 255 ? 255 : e1[k];
+  }
+
+  return dxtc_color_fit(blk, dxtc_565(e0), dxtc_565(e1), out);
+}
+
+static void dxtc_color(dxtc_block *blk, ILubyte *out, int high) {
+  ILubyte block[8];
+  long err, e;
+  int i, k;
+
+  for (i = 0; i < 16; i++)
+    for (k = 0; k < 3; k++)
+      blk->plane[k][i] = blk->px[i][k];
+
+  err = dxtc_color_box(blk, out);
+  if (!high || !err)
+    return;
+
+  if ((e = dxtc_color_pca(blk, block)) < err) {
+    err = e;
+    memcpy(out, block, 8);
+  }
+  for (i = 0; i < 2 && err; i++) {
+    if ((e = dxtc_color_refine(blk, out, block)) >= err)
+      break;
+    err = e;
+    memcpy(out, block, 8);
+  }
+}
+
+/* an 8 byte alpha block for a0, a1; returns the error */
+static long dxtc_alpha_fit(const ILubyte *v, int a0, int a1, ILubyte *out) {
+  int pal[8], i, j;
+  uint64_t bits = 0;
+  long err = 0;
+
+  pal[0] = a0;
+  pal[1] = a1;
+  if (a0 > a1) {
+    for (i = 1; i < 7; i++)
+      pal[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+  } else {
+    for (i = 1; i < 5; i++)
+      pal[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+    pal[6] = 0;
+    pal[7] = 255;
+  }
+
+#ifdef CONVERT_X86
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *) v),
+            best = _mm_set1_epi8(-1),
+            sel = _mm_setzero_si128(),
+            p, d, lt, lo, hi, zero = _mm_setzero_si128();
+    ILubyte idx[16];
+
+    for (j = 0; j < 8; j++) {
+      p = _mm_set1_epi8(pal[j]);
+      d = _mm_or_si128(_mm_subs_epu8(x, p), _mm_subs_epu8(p, x));
+      lt = _mm_andnot_si128(_mm_cmpeq_epi8(d, best), _mm_cmpeq_epi8(_mm_min_epu8(d, best), d));
+      best = _mm_min_epu8(d, best);
+      sel = _mm_or_si128(_mm_and_si128(lt, _mm_set1_epi8(j)), _mm_andnot_si128(lt, sel));
+    }
+
+    lo = _mm_unpacklo_epi8(best, zero);
+    hi = _mm_unpackhi_epi8(best, zero);
+    d = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+    d = _mm_add_epi32(d, _mm_shuffle_epi32(d, 0x4e));
+    d = _mm_add_epi32(d, _mm_shuffle_epi32(d, 0xb1));
+    err = _mm_cvtsi128_si32(d);
+
+    _mm_storeu_si128((__m128i *) idx, sel);
+    for (i = 0; i < 16; i++)
+      bits |= (uint64_t) idx[i] << (3 * i);
+  }
+#else
+  for (i = 0; i < 16; i++) {
+    long min = LONG_MAX;
+    int best = 0, d;
+
+    for (j = 0; j < 8; j++) {
+      d = v[i] - pal[j];
+      if (d * d < min) {
+        min = d * d;
+        best = j;
+      }
+    }
+    bits |= (uint64_t) best << (3 * i);
+    err += min;
+  }
+#endif
+
+  out[0] = a0;
+  out[1] = a1;
+  for (i = 0; i < 6; i++)
+    out[2 + i] = bits >> (8 * i);
+  return err;
+}
+
+static void dxtc_alpha(const ILubyte *v, ILubyte *out, int high) {
+  ILubyte block[8];
+  int lo = 255, hi = 0, lo6 = 255, hi6 = 0, i;
+  long err;
+
+  for (i = 0; i < 16; i++) {
+    if (v[i] < lo)
+      lo = v[i];
+    if (v[i] > hi)
+      hi = v[i];
+    if (v[i] != 0 && v[i] < lo6)
+      lo6 = v[i];
+    if (v[i] != 255 && v[i] > hi6)
+      hi6 = v[i];
+  }
+
+  /* a0 > a1 selects 8 values; equal ones give a single value */
+  err = dxtc_alpha_fit(v, hi, lo, out);
+  if (high && err && lo6 <= hi6 && dxtc_alpha_fit(v, lo6, hi6, block) < err)
+    memcpy(out, block, 8);
+}
+
+/* block rows [i * job->rows, (i + 1) * job->rows) */
+static void dxtc_rows(void *arg, long i) {
+  const dxtc_job *job = arg;
+  long by = i * job->rows,
+       end = by + job->rows < job->bh ? by + job->rows : job->bh,
+       bx, y, x, sy;
+  dxtc_block blk;
+  ILubyte v[16], *out;
+  const ILubyte *src;
+  int j, k;
+
+  for (; by < end; by++)
+    for (bx = 0; bx < job->bw; bx++) {
+      /* the block as RGBA, edge pixels repeated */
+      if (job->rgba && bx * 4 + 3 < job->w && by * 4 + 3 < job->h) {
+        for (j = 0; j < 4; j++) {
+          sy = job->flip ? job->h - 1 - (by * 4 + j) : by * 4 + j;
+          memcpy(blk.px[j * 4], job->data + (sy * job->w + bx * 4) * 4, 16);
+        }
+      } else for (j = 0; j < 16; j++) {
+        y = by * 4 + j / 4;
+        x = bx * 4 + j % 4;
+        sy = y < job->h ? y : job->h - 1;
+        if (job->flip)
+          sy = job->h - 1 - sy;
+        src = job->data + (sy * job->w + (x < job->w ? x : job->w - 1)) * job->channels;
+        for (k = 0; k < 4; k++)
+          blk.px[j][k] = job->order[k] >= 0 ? src[job->order[k]] : 255;
+      }
+
+      out = job->out + (by * job->bw + bx) * job->block;
+      switch (job->format) {
+      case IL_DXT1:
+        dxtc_color(&blk, out, job->high);
+        break;
+      case IL_DXT3:
+        for (j = 0; j < 8; j++)
+          out[j] = (blk.px[2 * j][3] * 15 + 127) / 255 | ((blk.px[2 * j + 1][3] * 15 + 127) / 255) << 4;
+        dxtc_color(&blk, out + 8, job->high);
+        break;
+      case IL_DXT5:
+        for (j = 0; j < 16; j++)
+          v[j] = blk.px[j][3];
+        dxtc_alpha(v, out, job->high);
+        dxtc_color(&blk, out + 8, job->high);
+        break;
+      case IL_ATI1N:
+      case IL_3DC:
+        for (k = 0; k < job->block / 8; k++) {
+          for (j = 0; j < 16; j++)
+            v[j] = blk.px[j][k];
+          dxtc_alpha(v, out + 8 * k, job->high);
+        }
+        break;
+      }
+    }
+}
+
+/*
+ * On the thread running DevIL: compress the bound image into out.
+ * Returns the size of the data, 0 if out is too small (it is then left
+ * alone, and out may be NULL to ask for the size), or -1 if DevIL's
+ * compressor has to do it.
+ */
+static long devil_dxtc(ILubyte *out, size_t len, ILenum format, int high) {
+  dxtc_job job;
+  size_t size;
+
+  job.format = format;
+  job.high = high;
+  job.channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  job.w = ilGetInteger(IL_IMAGE_WIDTH);
+  job.h = ilGetInteger(IL_IMAGE_HEIGHT);
+  job.flip = ilGetInteger(IL_IMAGE_ORIGIN) == IL_ORIGIN_LOWER_LEFT;
+
+  switch (format) {
+  case IL_DXT1:
+  case IL_ATI1N:
+    job.block = 8;
+    break;
+  case IL_DXT3:
+  case IL_DXT5:
+  case IL_3DC:
+    job.block = 16;
+    break;
+  default:
+    return -1;
+  }
+
+  switch (ilGetInteger(IL_IMAGE_FORMAT)) {
+  case IL_RGB:             job.order[0] = 0; job.order[1] = 1; job.order[2] = 2; job.order[3] = -1; break;
+  case IL_RGBA:            job.order[0] = 0; job.order[1] = 1; job.order[2] = 2; job.order[3] = 3;  break;
+  case IL_BGR:             job.order[0] = 2; job.order[1] = 1; job.order[2] = 0; job.order[3] = -1; break;
+  case IL_BGRA:            job.order[0] = 2; job.order[1] = 1; job.order[2] = 0; job.order[3] = 3;  break;
+  case IL_LUMINANCE:       job.order[0] = 0; job.order[1] = 0; job.order[2] = 0; job.order[3] = -1; break;
+  case IL_LUMINANCE_ALPHA: job.order[0] = 0; job.order[1] = 0; job.order[2] = 0; job.order[3] = 1;  break;
+  default:
+    return -1;
+  }
+
+  if (ilGetInteger(IL_IMAGE_TYPE) != IL_UNSIGNED_BYTE || ilGetInteger(IL_IMAGE_DEPTH) != 1 ||
+      job.w < 1 || job.h < 1 || !(job.data = ilGetData()))
+    return -1;
+  job.rgba = ilGetInteger(IL_IMAGE_FORMAT) == IL_RGBA && job.channels == 4;
+
+  job.bw = (job.w + 3) / 4;
+  job.bh = (job.h + 3) / 4;
+  size = (size_t) job.bw * job.bh * job.block;
+  if (!out || len < size)
+    return out ? 0 : (long) size;
+
+  job.out = out;
+  job.rows = (DXTC_BLOCKS + job.bw - 1) / job.bw;
+  par_for((job.bh + job.rows - 1) / job.rows, dxtc_rows, &job);
+
+  return size;
+}
+
+/**********/
+/* codecs */
+/**********/
+
+/*
+ * Formats added with register_load/register_save or load_plugin live in
+ * a table keyed by lower case extension.  DevIL calls codec_load and
+ * codec_save for all of them, on the thread running DevIL; a plugin's
+ * function runs right there, a Ruby proc through devil_call_ruby.
+ * Looking an extension up allocates nothing.  Entries are never freed,
+ * only emptied, so a probe never has to step over a hole.
+ */
+#define CODEC_SLOTS 64
+#define CODEC_EXT   16
+
+typedef struct {
+  char ext[CODEC_EXT];          /* "" for a free slot */
+  devil_codec_fn load,
+                 save;
+  VALUE load_proc,              /* kept alive by load_procs/save_procs */
+        save_proc;
+} codec_entry;
+
+typedef struct {
+  VALUE proc;
+  const char *path;
+  ILenum ret;
+} codec_call_arg;
+
+static codec_entry codecs[CODEC_SLOTS];
+static ID id_call;
+
+/* the entry for ext, optionally adding it; NULL if there is none */
+static codec_entry *codec_slot(const char *ext, int add) {
+  char key[CODEC_EXT];
+  unsigned hash = 2166136261u;
+  codec_entry *e;
+  size_t len = strlen(ext), i;
+
+  if (!len || len >= CODEC_EXT)
+    return NULL;
+  for (i = 0; i <= len; i++) {
+    key[i] = tolower((unsigned char) ext[i]);
+    hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+  }
+
+  for (i = 0; i < CODEC_SLOTS; i++) {
+    e = &codecs[(hash + i) % CODEC_SLOTS];
+    if (!strcmp(e->ext, key))
+      return e;
+    if (!e->ext[0]) {
+      if (!add)
+        return NULL;
+      memcpy(e->ext, key, len + 1);
+      e->load_proc = e->save_proc = Qnil;
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static void *codec_call_proc(void *ptr) {
+  codec_call_arg *c = ptr;
+  VALUE ret = rb_funcall(c->proc, id_call, 1, rb_str_new_cstr(c->path));
+
+  if (FIXNUM_P(ret))
+    c->ret = FIX2INT(ret);
+  else
+    c->ret = RTEST(ret) ? IL_NO_ERROR : IL_INTERNAL_ERROR;
+
+  return c;
+}
+
+static ILenum codec_run(const char *path, int save) {
+  const char *ext = get_ext(path);
+  codec_entry *e = ext ? codec_slot(ext, 0) : NULL;
+  codec_call_arg c;
+  ILuint cur;
+
+  if (!e)
+    return IL_FORMAT_NOT_SUPPORTED;
+  if (save ? e->save : e->load)
+    return save ? e->save(path) : e->load(path);
+
+  c.proc = save ? e->save_proc : e->load_proc;
+  c.path = path;
+  if (NIL_P(c.proc))
+    return IL_FORMAT_NOT_SUPPORTED;
+
+  /* DevIL carries on with the bound image once the proc returns */
+  cur = ilGetInteger(IL_CUR_IMAGE);
+  if (!devil_call_ruby(codec_call_proc, &c))
+    c.ret = IL_INTERNAL_ERROR;
+  if ((ILuint) ilGetInteger(IL_CUR_IMAGE) != cur) {
+    ilBindImage(cur);
+    devil_bound = cur;
+  }
+
+  return c.ret;
+}
+
+static ILenum ILAPIENTRY codec_load(ILconst_string path) {
+  return codec_run(path, 0);
+}
+
+static ILenum ILAPIENTRY codec_save(ILconst_string path) {
+  return codec_run(path, 1);
+}
+
+/* set the loader (save = 0) or saver for an entry; fn or proc */
+static ILboolean codec_set(codec_entry *e, int save, devil_codec_fn fn, VALUE proc) {
+  VALUE key = rb_obj_freeze(rb_str_new_cstr(e->ext));
+
+  if (save) {
+    e->save = fn;
+    e->save_proc = proc;
+  } else {
+    e->load = fn;
+    e->load_proc = proc;
+  }
+
+  if (NIL_P(proc))
+    rb_hash_delete(save ? save_procs : load_procs, key);
+  else
+    rb_hash_aset(save ? save_procs : load_procs, key, proc);
+
+  if (!fn && NIL_P(proc))
+    return save ? ilRemoveSave(e->ext) : ilRemoveLoad(e->ext);
+  return save ? ilRegisterSave(e->ext, (IL_SAVEPROC) codec_save)
+              : ilRegisterLoad(e->ext, (IL_LOADPROC) codec_load);
+}
+
+static VALUE codec_register(VALUE ext, VALUE proc, int save) {
+  codec_entry *e;
+
+  if (!rb_respond_to(proc, id_call))
+    rb_raise(rb_eTypeError, "%"PRIsVALUE" does not respond to call", rb_obj_class(proc));
+
+  devil_sync();
+  if (!(e = codec_slot(StringValueCStr(ext), 1)))
+    rb_raise(rb_eArgError, "cannot register extension %s", RSTRING_PTR(ext));
+
+  return codec_set(e, save, NULL, proc) ? Qtrue : Qfalse;
+}
+
+static VALUE codec_remove(VALUE ext, int save) {
+  codec_entry *e;
+
+  devil_sync();
+  if ((e = codec_slot(StringValueCStr(ext), 0)))
+    return codec_set(e, save, NULL, Qnil) ? Qtrue : Qfalse;
+
+  return (save ? ilRemoveSave(RSTRING_PTR(ext)) : ilRemoveLoad(RSTRING_PTR(ext))) ? Qtrue : Qfalse;
+}
+
+/*
+ * Load the codec plugin at path (see devil_plugin.h) and register it
+ * for its extensions.  Returns the codec's name.
+ *
+ * Aliases:
+ *   DevIL::IL::load_plugin
+ *   DevIL::IL::LoadPlugin
+ *
+ * Examples:
+ *   DevIL::IL::load_plugin '/usr/lib/devil/libsprite.so'
+ *   DevIL::IL::load_image 'hero.sprite'
+ *
+ */
+static VALUE il_load_plugin(VALUE self, VALUE path) {
+  const char *const *ext;
+  const devil_codec *codec;
+  devil_plugin_init_fn init;
+  codec_entry *e;
+  void *lib;
+
+  FilePathValue(path);
+  if (!(lib = dlopen(StringValueCStr(path), RTLD_NOW | RTLD_LOCAL)))
+    rb_raise(rb_eLoadError, "%s", dlerror());
+
+  init = (devil_plugin_init_fn) dlsym(lib, DEVIL_PLUGIN_ENTRY);
+  if (!init || !(codec = init(DEVIL_PLUGIN_ABI)) || codec->abi != DEVIL_PLUGIN_ABI ||
+      codec->size < sizeof(devil_codec)) {
+    dlclose(lib);
+    rb_raise(rb_eLoadError, "%s: not a DevIL codec plugin for ABI %d", RSTRING_PTR(path), DEVIL_PLUGIN_ABI);
+  }
+
+  devil_sync();
+  for (ext = codec->extensions; ext && *ext; ext++) {
+    if (!(e = codec_slot(*ext, 1)))
+      rb_raise(rb_eArgError, "cannot register extension %s", *ext);
+    if (codec->load)
+      codec_set(e, 0, codec->load, Qnil);
+    if (codec->save)
+      codec_set(e, 1, codec->save, Qnil);
+  }
+
+  return rb_str_new_cstr(codec->name ? codec->name : "");
+}
+
+/*
+ * Set the active image.
+ *
+ * Aliases:
+ *   DevIL::IL::active_image
+ *   DevIL::IL::ActiveImage
+ *
+ * Examples:
+ *   DevIL::IL::active_image im_id
+ *   DevIL::IL::ActiveImage im_id
+ * 
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00008.htm
+ * 
+ */
+static VALUE il_active_im(VALUE self, VALUE num) {
+  devil_sync();
+  devil_bound = BIND_NONE;
+  return ilActiveImage(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the active layer.
+ *
+ * Aliases:
+ *   DevIL::IL::active_layer
+ *   DevIL::IL::ActiveLayer
+ *
+ * Examples:
+ *   DevIL::IL::active_layer layer_id
+ *   DevIL::IL::ActiveLayer layer_id
+ *
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00190.htm
+ * 
+ */
+static VALUE il_active_layer(VALUE self, VALUE num) {
+  devil_sync();
+  devil_bound = BIND_NONE;
+  return ilActiveLayer(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the active mipmap.
+ *
+ * Aliases:
+ *   DevIL::IL::active_mipmap
+ *   DevIL::IL::ActiveMipmap
+ *
+ * Examples:
+ *   DevIL::IL::active_mipmap mm_id
+ *   DevIL::IL::ActiveMipmap mm_id
+ * 
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00009.htm
+ * 
+ */
+static VALUE il_active_mipmap(VALUE self, VALUE num) {
+  devil_sync();
+  devil_bound = BIND_NONE;
+  return ilActiveMipmap(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Apply pal to current image.
+ *
+ * Aliases:
+ *   DevIL::IM::apply_pal
+ *   DevIL::IM::ApplyPal
+ *
+ * Examples:
+ *   DevIL::IL::apply_path path/to/pal
+ *   DevIL::IL::ApplyPath path/to/pal
+ *
+ */
+DEVIL_JOB(job_apply_pal, ilApplyPal(a[0].p))
+
+static VALUE il_apply_pal(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return devil_run(job_apply_pal, a) ? Qtrue : Qfalse;
+}
+
+/*
+ * Apply color profile to current image.
+ *
+ * Aliases:
+ *   DevIL::IL::apply_profile
+ *   DevIL::IL::ApplyProfile
+ *
+ * Examples:
+ *   DevIL::IL::apply_profile in_p, out_p
+ *   DevIL::IL::ApplyProfile in_p, out_p
+ *   
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00208.htm
+ *
+ */
+DEVIL_JOB(job_apply_profile, ilApplyProfile(a[0].p, a[1].p))
+
+static VALUE il_apply_profile(VALUE self, VALUE in, VALUE out) {
+  devil_arg a[2];
+  a[0].p = StringValueCStr(in);
+  a[1].p = StringValueCStr(out);
+  return devil_run(job_apply_profile, a) ? Qtrue : Qfalse;
+}
+
+/*
+ * Select the image to work on.
+ *
+ * Aliases:
+ *   DevIL::IL::bind_image
+ *   DevIL::IL::BindImage
+ *
+ * Examples:
+ *   DevIL::IL::bind_image 4
+ *   DevIL::IL::BindImage 4
+ *
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00013.htm
+ *
+ */
+static VALUE il_bind_im(VALUE self, VALUE num) {
+  devil_sync();
+  devil_select(NUM2UINT(num));
+  return Qnil;
+}
+
+/*
+ * Blit (copy) from one image to another.
+ *
+ * Aliases:
+ *   DevIL::IL::blit
+ *   DevIL::IL::Blit
+ *
+ * Example:
+ *   DevIL::IL::blit src_im, dest_x, dest_y,
+ *                   src_x, src_y, src_z,
+ *                   width, height, depth
+ *
+ */
+DEVIL_JOB(job_blit, ilBlit(a[0].u, a[1].i, a[2].i, a[3].i, a[4].u, a[5].u, a[6].u, a[7].u, a[8].u, a[9].u))
+
+static VALUE il_blit(VALUE self, VALUE source, VALUE dest_x, VALUE dest_y, VALUE dest_z, VALUE src_x, VALUE src_y, VALUE src_z, VALUE width, VALUE height, VALUE depth) {
+  devil_arg a[10];
+  a[0].u = NUM2INT(source);
+  a[1].i = NUM2INT(dest_x);
+  a[2].i = NUM2INT(dest_y);
+  a[3].i = NUM2INT(dest_z);
+  a[4].u = NUM2INT(src_x);
+  a[5].u = NUM2INT(src_y);
+  a[6].u = NUM2INT(src_z);
+  a[7].u = NUM2INT(width);
+  a[8].u = NUM2INT(height);
+  a[9].u = NUM2INT(depth);
+  return devil_run(job_blit, a) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the current clearing color
+ *
+ * Aliases:
+ *   DevIL::IL::clear_color
+ *   DevIL::IL::ClearColor
+ *   DevIL::IL::clear_colour
+ *   DevIL::IL::ClearColour
+ *
+ * Example:
+ *   DevIL::IL::clear_color 128, 128, 128, 128
+ *
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00124.htm
+ *
+ */
+static VALUE il_clear_color(VALUE self, VALUE red, VALUE blue, VALUE green, VALUE alpha) {
+  devil_sync();
+  ilClearColor(NUM2DBL(red), NUM2DBL(blue), NUM2DBL(green), NUM2DBL(alpha));
+  return Qnil;
+}
+
+/* 
+ * Clear the current image.
+ * 
+ * Aliases:
+ *   DevIL::IL::clear_image
+ *   DevIL::IL::ClearImage
+ *
+ * Example:
+ *   DevIL::IL::clear_image
+ * 
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00014.htm
+ *
+ */
+DEVIL_JOB(job_clear_im, ilClearImage())
+
+static VALUE il_clear_im(VALUE self) {
+  return devil_run(job_clear_im, NULL) ? Qtrue : Qfalse;
+}
+
+/* 
+ * Clone (copy) the current image.
+ * 
+ * Aliases:
+ *   DevIL::IL::clone_image
+ *   DevIL::IL::CloneImage
+ *
+ * Example:
+ *   new_im = DevIL::IL::clone_image
+ * 
+ * See Also:
+ *   http://openil.sourceforge.net/docs/il/f00192.htm
+ *
+ */
+DEVIL_JOB(job_clone_cur_im, ilCloneCurImage())
+
+static VALUE il_clone_cur_im(VALUE self) {
+  return UINT2NUM((size_t) devil_run(job_clone_cur_im, NULL));
+}
+
+static VALUE il_compress_func(VALUE self, VALUE num) {
+  devil_sync();
+  return ilCompressFunc(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_convert_im, devil_convert(a[0].u, a[1].u))
+
+static VALUE il_convert_im(VALUE self, VALUE dest_fmt, VALUE dest_type) {
+  devil_arg a[2];
+  a[0].u = NUM2INT(dest_fmt);
+  a[1].u = NUM2INT(dest_type);
+  return devil_run(job_convert_im, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_convert_pal, ilConvertPal(a[0].u))
+
+static VALUE il_convert_pal(VALUE self, VALUE dest_fmt) {
+  devil_arg a[1];
+  a[0].u = NUM2INT(dest_fmt);
+  return devil_run(job_convert_pal, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_copy_im, ilCopyImage(a[0].u))
+
+static VALUE il_copy_im(VALUE self, VALUE src) {
+  devil_arg a[1];
+  a[0].u = NUM2INT(src);
+  return devil_run(job_copy_im, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_copy_pixels, ilCopyPixels(a[0].u, a[1].u, a[2].u, a[3].u, a[4].u, a[5].u, a[6].u, a[7].u, a[8].p))
+
+static VALUE il_copy_pixels(VALUE self, VALUE xo, VALUE yo, VALUE zo, VALUE w, VALUE h, VALUE d, VALUE fmt, VALUE type, VALUE data) {
+  devil_arg a[9];
+  size_t ret;
+
+  a[0].u = NUM2INT(xo);
+  a[1].u = NUM2INT(yo);
+  a[2].u = NUM2INT(zo);
+  a[3].u = NUM2INT(w);
+  a[4].u = NUM2INT(h);
+  a[5].u = NUM2INT(d);
+  a[6].u = NUM2INT(fmt);
+  a[7].u = NUM2INT(type);
+  StringValue(data);
+  rb_str_modify(data);
+  a[8].p = RSTRING_PTR(data);
+
+  rb_str_locktmp(data);
+  ret = (size_t) devil_run(job_copy_pixels, a);
+  rb_str_unlocktmp(data);
+
+  return UINT2NUM(ret);
+}
+
+static VALUE il_create_sub_im(VALUE self, VALUE type, VALUE num) {
+  devil_sync();
+  return INT2FIX(ilCreateSubImage(NUM2INT(type), NUM2INT(num)));
+}
+
+DEVIL_JOB(job_default_im, ilDefaultImage())
+
+static VALUE il_default_im(VALUE self) {
+  return devil_run(job_default_im, NULL) ? Qtrue : Qfalse;
+}
+
+/*
+ * Delete images, given as names or Arrays of names.  Unless the image
+ * pool is full the images are kept for reuse by gen_images and
+ * checkout_image (see set_image_pool).
+ *
+ * Aliases:
+ *   DevIL::IL::delete_images
+ *   DevIL::IL::DeleteImages
+ *
+ * Examples:
+ *   DevIL::IL::delete_images(*names)
+ *
+ */
+static VALUE il_delete_ims(int argc, VALUE *argv, VALUE self) {
+  VALUE names = rb_ary_new4(argc, argv);
+  ILuint buf[16], *ims = buf;
+  long i, n;
+
+  names = rb_funcall(names, rb_intern("flatten"), 0);
+  if (!(n = RARRAY_LEN(names)))
+    return Qnil;
+  for (i = 0; i < n; i++)
+    NUM2UINT(RARRAY_PTR(names)[i]);
+
+  if (n > 16)
+    ims = ALLOC_N(ILuint, n);
+  for (i = 0; i < n; i++)
+    ims[i] = NUM2UINT(RARRAY_PTR(names)[i]);
+
+  devil_sync();
+  devil_release_views();
+  devil_delete_images(n, ims);
+  if (ims != buf)
+    xfree(ims);
+
+  return Qnil;
+}
+
+static VALUE il_disable(VALUE self, VALUE num) {
+  devil_sync();
+  return ilDisable(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_enable(VALUE self, VALUE num) {
+  devil_sync();
+  return ilEnable(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_format_func(VALUE self, VALUE num) {
+  devil_sync();
+  return ilFormatFunc(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+static void *job_gen_ims(void *ptr) {
+  devil_arg *a = ptr;
+  ILuint *ims = a[1].p;
+  ILsizei i = 0;
+
+  while (i < a[0].i && (ims[i] = devil_reuse()))
+    i++;
+  if (i < a[0].i)
+    ilGenImages(a[0].i - i, ims + i);
+
+  return ims;
+}
+
+/*
+ * Generate count (default 1) image names, reusing deleted images where
+ * possible, and return them as an Array.
+ *
+ * Aliases:
+ *   DevIL::IL::gen_images
+ *   DevIL::IL::GenImages
+ *
+ * Examples:
+ *   a, b = DevIL::IL::gen_images 2
+ *
+ */
+static VALUE il_gen_ims(int argc, VALUE *argv, VALUE self) {
+  VALUE count, ret;
+  devil_arg a[2];
+  ILuint buf[16];
+  int i, n;
+
+  rb_scan_args(argc, argv, "01", &count);
+  n = NIL_P(count) ? 1 : NUM2INT(count);
+  if (n < 0)
+    rb_raise(rb_eArgError, "negative count");
+
+  a[0].i = n;
+  a[1].p = (n > 16) ? ALLOC_N(ILuint, n) : buf;
+  devil_run(job_gen_ims, a);
+
+  ret = rb_ary_new2(n);
+  for (i = 0; i < n; i++)
+    rb_ary_push(ret, UINT2NUM(((ILuint*) a[1].p)[i]));
+  if (a[1].p != buf)
+    xfree(a[1].p);
+
+  return ret;
+}
+
+/* find a recycled image with this layout, or any, or a new one */
+static void *job_checkout_im(void *ptr) {
+  devil_arg *a = ptr;
+  recycled_image *img;
+  ILuint name = 0;
+  long i;
+
+  for (i = recycle.len - 1; i >= 0; i--) {
+    img = &recycle.images[i];
+    if (img->width == a[0].u && img->height == a[1].u && img->depth == a[2].u &&
+        img->channels == a[3].u && img->format == a[4].u && img->type == a[5].u) {
+      name = recycle_take(i);
+      devil_select(name);
+      return (void*) (size_t) name;
+    }
+  }
+
+  if (recycle.len)
+    name = recycle_take(recycle.len - 1);
+  else
+    ilGenImages(1, &name);
+
+  devil_select(name);
+  if (!ilTexImage(a[0].u, a[1].u, a[2].u, a[3].u, a[4].u, a[5].u, NULL)) {
+    devil_delete_images(1, &name);
+    return NULL;
+  }
+
+  return (void*) (size_t) name;
+}
+
+/*
+ * Get a bound image of the given layout, as tex_image with no data
+ * would make, and return its name.  A recycled image which already has
+ * this layout is handed out as it is, keeping its pixel buffer; the
+ * pixel contents are undefined either way.  Returns nil on failure.
+ *
+ * Aliases:
+ *   DevIL::IL::checkout_image
+ *   DevIL::IL::CheckoutImage
+ *
+ * Examples:
+ *   name = DevIL::IL::checkout_image 640, 480, 1, 4, DevIL::IL::RGBA, DevIL::IL::UNSIGNED_BYTE
+ *
+ */
+static VALUE il_checkout_im(VALUE self, VALUE w, VALUE h, VALUE d, VALUE bpp, VALUE format, VALUE type) {
+  devil_arg a[6];
+  void *ret;
+
+  a[0].u = NUM2UINT(w);
+  a[1].u = NUM2UINT(h);
+  a[2].u = NUM2UINT(d);
+  a[3].u = NUM2UINT(bpp);
+  a[4].u = NUM2UINT(format);
+  a[5].u = NUM2UINT(type);
+  ret = devil_run(job_checkout_im, a);
+
+  return ret ? UINT2NUM((size_t) ret) : Qnil;
+}
+
+/*
+ * Set how many deleted images are kept for reuse (default 32), and
+ * optionally how many bytes of pixel data they may hold between them
+ * (default 64 MB; images past that are kept shrunk to 1x1).  Zero
+ * disables recycling.  Images beyond the new limits are deleted.
+ *
+ * Aliases:
+ *   DevIL::IL::set_image_pool
+ *   DevIL::IL::SetImagePool
+ *
+ * Examples:
+ *   DevIL::IL::set_image_pool 256
+ *   DevIL::IL::set_image_pool 64, 512 << 20
+ *
+ */
+static VALUE il_set_im_pool(int argc, VALUE *argv, VALUE self) {
+  recycled_image *images = NULL;
+  VALUE limit, max_bytes;
+  ILuint name;
+  long n;
+
+  rb_scan_args(argc, argv, "11", &limit, &max_bytes);
+  n = NUM2LONG(limit);
+  if (n < 0)
+    rb_raise(rb_eArgError, "negative limit");
+
+  devil_sync();
+  if (!NIL_P(max_bytes))
+    recycle.max_bytes = NUM2SIZET(max_bytes);
+  while (recycle.len > n || recycle.bytes > recycle.max_bytes) {
+    name = recycle_take(recycle.len - 1);
+    ilDeleteImages(1, &name);
+    devil_bound = BIND_NONE;
+  }
+
+  if (n && !(images = realloc(recycle.images, n * sizeof(recycled_image))))
+    rb_memerror();
+  if (!n)
+    free(recycle.images);
+  recycle.images = images;
+  recycle.limit = n;
+
+  return Qnil;
+}
+
+static VALUE il_get_alpha(VALUE self, VALUE type) {
+  int t = NUM2INT(type); 
+  VALUE ret = Qnil;
+  ILubyte *a_ret;
+
+  devil_sync();
+
+  a_ret = ilGetAlpha(t);
+  switch (t) {
+    case IL_BYTE:
+    case IL_UNSIGNED_BYTE:
+    case IL_SHORT:
+    case IL_UNSIGNED_SHORT:
+    case IL_INT:
+    case IL_UNSIGNED_INT:
+      /* is this correct? */
+      ret = NUM2INT(*a_ret);
+      break;
+    case IL_FLOAT:
+    case IL_DOUBLE:
+      ret = rb_float_new(*a_ret);
+      break;
+    default:
+      rb_raise(rb_eException, "Invalid type: %d.", t);
+  }
+
+  return ret;
+}
+
+static VALUE il_get_bool(VALUE self, VALUE num) {
+  devil_sync();
+  return ilGetBoolean(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Get a read-only view of the current image's pixels.
+ *
+ * The view is backed directly by the image data (no copy), and is only
+ * valid until the image is changed or deleted.  On rubies with IO::Buffer
+ * an IO::Buffer is returned, and it is released automatically before the
+ * next operation that could change the image; elsewhere a frozen String
+ * is returned, which must not be used after the image changes.
+ *
+ * Aliases:
+ *   DevIL::IL::get_data
+ *   DevIL::IL::GetData
+ *
+ * Examples:
+ *   pixels = DevIL::IL::get_data
+ *   pixels = DevIL::IL::GetData
+ *
+ */
+static VALUE il_get_data(VALUE self) {
+  ILubyte *data;
+  ILint size;
+  VALUE ret;
+
+  devil_sync();
+  if ((data = ilGetData()) == NULL)
+    return Qnil;
+  size = ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
+
+#if defined(HAVE_RB_IO_BUFFER_NEW)
+  ret = rb_io_buffer_new(data, size, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+  rb_ary_push(data_views, ret);
+#elif defined(HAVE_RB_STR_NEW_STATIC)
+  ret = rb_str_new_static((char*) data, size);
+#else
+  ret = rb_str_new((char*) data, size);
+#endif
+
+  return rb_obj_freeze(ret);
+}
+
+/*
+ * Compress the current image to format (DXT1-5, ATI1N or ATI2N) into the
+ * String buf, resizing it if it is too small, and return the size of
+ * the data.  With a nil buf just returns the size.  DXT1, DXT3, DXT5,
+ * ATI1N and ATI2N of 2D UNSIGNED_BYTE images are compressed on
+ * DevIL.threads threads, in high quality mode if high_quality is true;
+ * the rest go to DevIL.
+ *
+ * Aliases:
+ *   DevIL::IL::get_dxtc_data
+ *   DevIL::IL::GetDXTCData
+ *
+ * Examples:
+ *   buf = ''
+ *   DevIL::IL::get_dxtc_data buf, DevIL::IL::DXT5
+ *   DevIL::IL::GetDXTCData buf, DevIL::IL::ATI2N, true
+ *
+ */
+static void *job_get_dxtc_data(void *ptr) {
+  devil_arg *a = ptr;
+  long size = devil_dxtc(a[0].p, a[1].u, a[2].u, a[3].i);
+
+  if (size < 0)
+    size = ilGetDXTCData(a[0].p, a[1].u, a[2].u);
+
+  return (void *) (size_t) size;
+}
+
+static VALUE il_get_dxtc_data(int argc, VALUE *argv, VALUE self) {
+  VALUE buf, fmt, high;
+  devil_arg a[4];
+  size_t size;
+
+  rb_scan_args(argc, argv, "21", &buf, &fmt, &high);
+  a[0].p = NULL;
+  a[1].u = 0;
+  a[2].u = NUM2INT(fmt);
+  a[3].i = RTEST(high);
+
+  size = (size_t) devil_run(job_get_dxtc_data, a);
+  if (NIL_P(buf) || !size)
+    return SIZET2NUM(size);
+
+  StringValue(buf);
+  rb_str_modify(buf);
+  if ((size_t) RSTRING_LEN(buf) < size)
+    rb_str_resize(buf, size);
+  a[0].p = RSTRING_PTR(buf);
+  a[1].u = RSTRING_LEN(buf);
+
+  rb_str_locktmp(buf);
+  size = (size_t) devil_run(job_get_dxtc_data, a);
+  rb_str_unlocktmp(buf);
+
+  return SIZET2NUM(size);
+}
+
+static VALUE il_get_err(VALUE self) {
+  devil_sync();
+  return NUM2INT(ilGetError());
+}
+
+static VALUE il_get_int(VALUE self, VALUE num) {
+  devil_sync();
+  return INT2NUM(ilGetInteger(NUM2INT(num)));
+}
+
+static VALUE il_get_lump_pos(VALUE self) {
+  devil_sync();
+  return NUM2INT(ilGetLumpPos());
+}
+
+static VALUE il_get_palette(VALUE self) {
+  /* TODO: finish this function */
+  return Qnil;
+}
+
+static VALUE il_get_string(VALUE self, VALUE num) {
+  devil_sync();
+  return rb_str_new2(ilGetString(NUM2INT(num)));
+}
+
+static VALUE il_hint(VALUE self, VALUE target, VALUE mode) {
+  devil_sync();
+  ilHint(NUM2INT(target), NUM2INT(mode));
+  return Qnil;
+}
+
+static VALUE il_is_disabled(VALUE self, VALUE mode) {
+  devil_sync();
+  return ilIsDisabled(NUM2INT(mode)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_is_enabled(VALUE self, VALUE mode) {
+  devil_sync();
+  return ilIsEnabled(NUM2INT(mode)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_is_im(VALUE self, VALUE im) {
+  devil_sync();
+  return devil_is_image(NUM2INT(im)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_is_valid(VALUE self, VALUE type, VALUE path) {
+  devil_sync();
+  return ilIsValid(NUM2INT(type), RSTRING_PTR(path)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Streaming IO for load_f/save_f.
+ *
+ * DevIL reads and writes files a few bytes at a time through the
+ * callbacks installed with ilSetRead/ilSetWrite.  The callbacks below
+ * run on the worker thread and serve those requests from a native
+ * chunk of IO_CHUNK bytes; only when a chunk is exhausted (or a write
+ * chunk fills up) do they ask the waiting Ruby thread to call
+ * IO#read/IO#write/IO#seek.  Reads land directly in a locked String
+ * which the callbacks read from, so a load holds one chunk of the file
+ * at a time rather than the whole file.  Seekable IOs are left just
+ * past the bytes DevIL consumed; pipes and sockets are read with
+ * IO#readpartial so a load never waits on data it does not need.
+ */
+#define IO_CHUNK (1 << 20)
+
+typedef struct {
+  VALUE io,
+        str;                  /* read chunk, filled by IO#read */
+  const ILubyte *rbuf;
+  ILubyte *wbuf;
+  long len,                   /* bytes in chunk */
+       pos,                   /* read position in chunk */
+       off,                   /* stream offset of chunk */
+       seek_to;
+  int whence,
+      eof,
+      locked,
+      seekable;
+} io_handle;
+
+static ID id_read, id_readpartial, id_write, id_seek, id_tell;
+
+static VALUE io_tell_body(VALUE io) {
+  return rb_funcall(io, id_tell, 0);
+}
+
+/* current stream position, or -1 for unseekable streams */
+static long io_tell_safe(VALUE io) {
+  VALUE pos;
+  int state = 0;
+
+  pos = rb_protect(io_tell_body, io, &state);
+  if (state) {
+    rb_set_errinfo(Qnil);
+    return -1;
+  }
+
+  return NUM2LONG(pos);
+}
+
+static VALUE io_readpartial_body(VALUE ptr) {
+  io_handle *h = (io_handle*) ptr;
+  return rb_funcall(h->io, id_readpartial, 2, LONG2NUM(IO_CHUNK), h->str);
+}
+
+static VALUE io_readpartial_eof(VALUE ptr, VALUE err) {
+  UNUSED(ptr);
+  UNUSED(err);
+  return Qnil;
+}
+
+/* next chunk of the stream into h->str, or nil at end of stream */
+static VALUE io_read_chunk(io_handle *h) {
+  if (h->seekable)
+    return rb_funcall(h->io, id_read, 2, LONG2NUM(IO_CHUNK), h->str);
+
+  /* take what a pipe or socket has rather than waiting for a full chunk */
+  return rb_rescue2(io_readpartial_body, (VALUE) h,
+                    io_readpartial_eof, Qnil, rb_eEOFError, (VALUE) 0);
+}
+
+/* ruby side of a read-ahead: refill the chunk */
+static void *io_fill(void *ptr) {
+  io_handle *h = ptr;
+
+  if (h->locked) {
+    rb_str_unlocktmp(h->str);
+    h->locked = 0;
+  }
+
+  h->off += h->len;
+  h->len = h->pos = 0;
+  if (NIL_P(io_read_chunk(h))) {
+    h->eof = 1;
+    return h;
+  }
+
+  rb_str_locktmp(h->str);
+  h->locked = 1;
+  h->rbuf = (ILubyte*) RSTRING_PTR(h->str);
+  h->len = RSTRING_LEN(h->str);
+
+  return h;
+}
+
+/* ruby side of a write-behind: flush the chunk */
+static void *io_flush(void *ptr) {
+  io_handle *h = ptr;
+
+  if (h->len)
+    rb_funcall(h->io, id_write, 1, rb_str_new((char*) h->wbuf, h->len));
+  h->off += h->len;
+  h->len = 0;
+
+  return h;
+}
+
+/* ruby side of a seek outside the current chunk */
+static void *io_seek(void *ptr) {
+  io_handle *h = ptr;
+
+  if (h->wbuf)
+    io_flush(h);
+
+  rb_funcall(h->io, id_seek, 2, LONG2NUM(h->seek_to), INT2FIX(h->whence));
+  h->off = NUM2LONG(rb_funcall(h->io, id_tell, 0));
+  h->len = h->pos = 0;
+  h->eof = 0;
+
+  return h;
+}
+
+/* make sure there is unread data in the chunk; 0 at end of stream */
+static int io_ready(io_handle *h) {
+  if (h->pos < h->len)
+    return 1;
+  if (h->eof || !devil_call_ruby(io_fill, h))
+    return 0;
+  return h->pos < h->len;
+}
+
+static ILHANDLE ILAPIENTRY io_open(ILconst_string path) {
+  UNUSED(path);
+  return NULL;
+}
+
+static void ILAPIENTRY io_close(ILHANDLE ptr) {
+  UNUSED(ptr);
+}
+
+static ILboolean ILAPIENTRY io_eof(ILHANDLE ptr) {
+  return !io_ready((io_handle*) ptr);
+}
+
+static ILint ILAPIENTRY io_getc(ILHANDLE ptr) {
+  io_handle *h = ptr;
+  return io_ready(h) ? h->rbuf[h->pos++] : -1;
+}
+
+static ILint ILAPIENTRY io_read(void *dst, ILuint size, ILuint count, ILHANDLE ptr) {
+  io_handle *h = ptr;
+  size_t want = (size_t) size * count,
+         got = 0,
+         n;
+
+  while (got < want && io_ready(h)) {
+    n = h->len - h->pos;
+    if (n > want - got)
+      n = want - got;
+    memcpy((ILubyte*) dst + got, h->rbuf + h->pos, n);
+    h->pos += n;
+    got += n;
+  }
+
+  return size ? got / size : 0;
+}
+
+static ILint ILAPIENTRY io_seek_r(ILHANDLE ptr, ILint offset, ILint whence) {
+  io_handle *h = ptr;
+  long to = offset;
+
+  if (whence == SEEK_CUR)
+    to += h->off + h->pos;
+
+  /* seeks within the chunk (header rewinds, etc) stay native */
+  if (whence != SEEK_END && to >= h->off && to <= h->off + h->len) {
+    h->pos = to - h->off;
+    return 0;
+  }
+
+  h->seek_to = (whence == SEEK_END) ? offset : to;
+  h->whence = (whence == SEEK_END) ? SEEK_END : SEEK_SET;
+  return devil_call_ruby(io_seek, h) ? 0 : -1;
+}
+
+static ILint ILAPIENTRY io_tell_r(ILHANDLE ptr) {
+  io_handle *h = ptr;
+  return h->off + h->pos;
+}
+
+static ILint ILAPIENTRY io_write(const void *src, ILuint size, ILuint count, ILHANDLE ptr) {
+  io_handle *h = ptr;
+  size_t want = (size_t) size * count,
+         put = 0,
+         n;
+
+  while (put < want) {
+    if (h->len == IO_CHUNK && !devil_call_ruby(io_flush, h))
+      break;
+    n = IO_CHUNK - h->len;
+    if (n > want - put)
+      n = want - put;
+    memcpy(h->wbuf + h->len, (const ILubyte*) src + put, n);
+    h->len += n;
+    put += n;
+  }
+
+  return size ? put / size : 0;
+}
+
+static ILint ILAPIENTRY io_putc(ILubyte c, ILHANDLE ptr) {
+  return (io_write(&c, 1, 1, ptr) == 1) ? c : -1;
+}
+
+static ILint ILAPIENTRY io_seek_w(ILHANDLE ptr, ILint offset, ILint whence) {
+  io_handle *h = ptr;
+
+  h->seek_to = offset;
+  h->whence = whence;
+  if (whence == SEEK_CUR) {
+    h->seek_to += h->off + h->len;
+    h->whence = SEEK_SET;
+  }
+
+  return devil_call_ruby(io_seek, h) ? 0 : -1;
+}
+
+static ILint ILAPIENTRY io_tell_w(ILHANDLE ptr) {
+  io_handle *h = ptr;
+  return h->off + h->len;
+}
+
+static void io_handle_init(io_handle *h, VALUE io, int writing) {
+  memset(h, 0, sizeof(io_handle));
+  h->io = io;
+  h->str = rb_str_buf_new(IO_CHUNK);
+  h->off = io_tell_safe(io);
+  if ((h->seekable = h->off >= 0) == 0)
+    h->off = 0;
+  if (writing)
+    h->wbuf = ALLOC_N(ILubyte, IO_CHUNK);
+}
+
+static VALUE io_rewind_body(VALUE ptr) {
+  io_handle *h = (io_handle*) ptr;
+  return rb_funcall(h->io, id_seek, 2, LONG2NUM(h->off + h->pos), INT2FIX(SEEK_SET));
+}
+
+static VALUE io_handle_free(VALUE ptr) {
+  io_handle *h = (io_handle*) ptr;
+  VALUE err;
+  int state = 0;
+
+  /* give back the read-ahead DevIL did not consume */
+  if (!h->wbuf && h->seekable && h->len) {
+    err = rb_errinfo();
+    rb_protect(io_rewind_body, ptr, &state);
+    if (state)
+      rb_set_errinfo(err);
+  }
+
+  if (h->locked)
+    rb_str_unlocktmp(h->str);
+  h->locked = 0;
+  if (h->wbuf)
+    xfree(h->wbuf);
+  h->wbuf = NULL;
+
+  return Qnil;
+}
+
+/*
+ * Arguments for a streaming job: the IO handle plus the DevIL call's
+ * own arguments.
+ */
+typedef struct {
+  io_handle h;
+  devil_arg a[5];
+  void *(*func)(void *);
+  void *ret;
+} io_job;
+
+static void *job_io_read(void *ptr) {
+  io_job *job = ptr;
+
+  ilSetRead(io_open, io_close, io_eof, io_getc, io_read, io_seek_r, io_tell_r);
+  job->ret = job->func(job);
+  ilResetRead();
+
+  return job->ret;
+}
+
+static void *job_io_write(void *ptr) {
+  io_job *job = ptr;
+
+  ilSetWrite(io_open, io_close, io_putc, io_seek_w, io_tell_w, io_write);
+  job->ret = job->func(job);
+  ilResetWrite();
+  devil_call_ruby(io_flush, &job->h);
+
+  return job->ret;
+}
+
+static VALUE io_job_run(VALUE ptr) {
+  io_job *job = (io_job*) ptr;
+  return (VALUE) devil_run(job->h.wbuf ? job_io_write : job_io_read, job);
+}
+
+/* run a streaming job, releasing the chunk buffers even if IO raises */
+static void *io_job_start(io_job *job, VALUE io, int writing, void *(*func)(void *)) {
+  long start;
+
+  io_handle_init(&job->h, io, writing);
+  job->func = func;
+  job->ret = NULL;
+  start = job->h.off;
+
+  rb_ensure(io_job_run, (VALUE) job, io_handle_free, (VALUE) &job->h);
+  RB_GC_GUARD(job->h.str);
+
+  if (writing)
+    STATS_OUT(job->h.off - start);
+  else
+    STATS_IN(job->h.off + job->h.pos - start);
+
+  return job->ret;
+}
+
+static void *io_is_valid(void *ptr) {
+  io_job *job = ptr;
+  return (void*) (size_t) ilIsValidF(job->a[0].u, &job->h);
+}
+
+/*
+ * Check whether an IO holds a valid image of the given type.
+ *
+ * Aliases:
+ *   DevIL::IL::is_valid_f
+ *   DevIL::IL::IsValidF
+ *   DevIL::IL::is_valid_f?
+ *   DevIL::IL::IsValidF?
+ *
+ * Examples:
+ *   File.open('foo.png', 'rb') { |io| DevIL::IL::is_valid_f DevIL::IL::PNG, io }
+ *
+ */
+static VALUE il_is_valid_f(VALUE self, VALUE type, VALUE file) {
+  io_job job;
+
+  job.a[0].u = NUM2INT(type);
+  return io_job_start(&job, file, 0, io_is_valid) ? Qtrue : Qfalse;
+}
+
+static VALUE il_is_valid_l(VALUE self, VALUE type, VALUE buf) {
+  devil_sync();
+  /* TODO: finish this method */
+  return ilIsValidL(NUM2INT(type), RSTRING_PTR(buf), RSTRING_LEN(buf)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_key_color(VALUE self, VALUE red, VALUE green, VALUE blue, VALUE alpha) {
+  devil_sync();
+  ilKeyColor(NUM2DBL(red), NUM2DBL(green), NUM2DBL(blue), NUM2DBL(alpha));
+  return Qnil;
+}
+
+DEVIL_JOB(job_load, ilLoad(a[0].u, a[1].p))
+
+static VALUE il_load(VALUE self, VALUE type, VALUE path) {
+  devil_arg a[2];
+  a[0].u = NUM2INT(type);
+  a[1].p = StringValueCStr(path);
+  if (!devil_run(job_load, a))
+    return Qfalse;
+
+  STATS_IN(stats_file_size(RSTRING_PTR(path)));
+  return Qtrue;
+}
+
+static void *io_load(void *ptr) {
+  io_job *job = ptr;
+  return (void*) (size_t) ilLoadF(job->a[0].u, &job->h);
+}
+
+/*
+ * Load an image from an IO (File, Socket, pipe, StringIO, ...).  The
+ * IO is read in large chunks as DevIL needs the data, so the whole file
+ * is never held in memory at once.
+ *
+ * Aliases:
+ *   DevIL::IL::load_f
+ *   DevIL::IL::LoadF
+ *
+ * Examples:
+ *   File.open('foo.tif', 'rb') { |io| DevIL::IL::load_f DevIL::IL::TIF, io }
+ *
+ */
+static VALUE il_load_f(VALUE self, VALUE type, VALUE file) {
+  io_job job;
+
+  job.a[0].u = NUM2INT(type);
+  return io_job_start(&job, file, 0, io_load) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_load_l, ilLoadL(a[0].u, a[1].p, a[2].u))
+
+static VALUE il_load_l(VALUE self, VALUE type, VALUE buf) {
+  devil_arg a[3];
+  void *ret;
+
+  a[0].u = NUM2INT(type);
+  StringValue(buf);
+  a[1].p = RSTRING_PTR(buf);
+  a[2].u = RSTRING_LEN(buf);
+
+  rb_str_locktmp(buf);
+  ret = devil_run(job_load_l, a);
+  rb_str_unlocktmp(buf);
+  STATS_IN(a[2].u);
+
+  return ret ? Qtrue : Qfalse;
+}
+
+/*
+ * Map the file, decode it straight from the mapping and unmap it, all
+ * on the worker.  a[2] carries errno back out when the file cannot be
+ * opened or mapped, and a[3] the size of the file.
+ */
+static void *job_load_mmap(void *ptr) {
+  devil_arg *a = ptr;
+  struct stat st;
+  void *map;
+  int fd;
+  ILboolean ret = IL_FALSE;
+
+  a[2].i = 0;
+  a[3].u = 0;
+  if ((fd = open(a[1].p, O_RDONLY)) < 0) {
+    a[2].i = errno;
+    return NULL;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    a[2].i = errno;
+  } else if (st.st_size > 0 && (ILuint) st.st_size == st.st_size) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      a[2].i = errno;
+    } else {
+#ifdef MADV_SEQUENTIAL
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+      ret = ilLoadL(a[0].u, map, st.st_size);
+      a[3].u = st.st_size;
+      munmap(map, st.st_size);
+    }
+  }
+
+  close(fd);
+  return ret ? a : NULL;
+}
+
+/*
+ * Load an image by mapping the file into memory and decoding it in
+ * place, without reading it into a heap buffer first.  Repeat loads of
+ * the same file are served from the page cache.  Raises SystemCallError
+ * if the file cannot be opened or mapped.
+ *
+ * Aliases:
+ *   DevIL::IL::load_mmap
+ *   DevIL::IL::LoadMmap
+ *
+ * Examples:
+ *   DevIL::IL::load_mmap DevIL::IL::PNG, 'foo.png'
+ *
+ */
+static VALUE il_load_mmap(VALUE self, VALUE type, VALUE path) {
+  devil_arg a[4];
+  void *ret;
+
+  a[0].u = NUM2INT(type);
+  a[1].p = StringValueCStr(path);
+  ret = devil_run(job_load_mmap, a);
+  STATS_IN(a[3].u);
+
+  if (a[2].i) {
+    errno = a[2].i;
+    rb_sys_fail(RSTRING_PTR(path));
+  }
+  RB_GC_GUARD(path);
+
+  return ret ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_load_im, ilLoadImage(a[0].p))
+
+static VALUE il_load_im(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return devil_run(job_load_im, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_load_pal, ilLoadPal(a[0].p))
+
+static VALUE il_load_pal(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return devil_run(job_load_pal, a) ? Qtrue : Qfalse;
+}
+
+static VALUE il_origin_func(VALUE self, VALUE mode) {
+  devil_sync();
+  return ilOriginFunc(NUM2INT(mode)) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_overlay_im, ilOverlayImage(a[0].u, a[1].i, a[2].i, a[3].i))
+
+static VALUE il_overlay_im(VALUE self, VALUE src, VALUE x, VALUE y, VALUE z) {
+  devil_arg a[4];
+  a[0].u = NUM2INT(src);
+  a[1].i = NUM2INT(x);
+  a[2].i = NUM2INT(y);
+  a[3].i = NUM2INT(z);
+  return devil_run(job_overlay_im, a) ? Qtrue : Qfalse;
+}
+
+static VALUE il_pop_attrib(VALUE self) {
+  devil_sync();
+  ilPopAttrib();
+  return Qnil;
+}
+
+static VALUE il_push_attrib(VALUE self, VALUE bits) {
+  devil_sync();
+  ilPushAttrib(NUM2INT(bits));
+  return Qnil;
+}
+
+static VALUE il_register_format(VALUE self, VALUE fmt) {
+  devil_sync();
+  ilRegisterFormat(NUM2INT(fmt));
+  return Qnil;
+}
+
+/*
+ * Register proc to load files with the extension ext.  DevIL calls it
+ * with the path, with the image to load into bound, and it returns
+ * IL_NO_ERROR or an IL error code (true and false work too).
+ *
+ * Aliases:
+ *   DevIL::IL::register_load
+ *   DevIL::IL::RegisterLoad
+ *
+ * Examples:
+ *   DevIL::IL::register_load 'raw', proc { |path| DevIL::IL::tex_image(...) ? 0 : DevIL::IL::INTERNAL_ERROR }
+ *
+ */
+static VALUE il_register_load(VALUE self, VALUE ext, VALUE proc) {
+  return codec_register(ext, proc, 0);
+}
+
+static VALUE il_register_mipnum(VALUE self, VALUE num) {
+  devil_sync();
+  return ilRegisterMipnum(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_register_num_ims(VALUE self, VALUE num) {
+  devil_sync();
+  return ilRegisterNumImages(NUM2INT(num)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_register_origin(VALUE self, VALUE num) {
+  devil_sync();
+  ilRegisterOrigin(NUM2INT(num));
+  return Qnil;
+}
+
+static VALUE il_register_pal(VALUE self, VALUE buf, VALUE type) {
+  devil_sync();
+  ilRegisterPal(RSTRING_PTR(buf), RSTRING_LEN(buf), NUM2INT(type));
+  return Qnil;
+}
+
+/*
+ * Register proc to save files with the extension ext, like
+ * register_load.
+ *
+ * Aliases:
+ *   DevIL::IL::register_save
+ *   DevIL::IL::RegisterSave
+ *
+ */
+static VALUE il_register_save(VALUE self, VALUE ext, VALUE proc) {
+  return codec_register(ext, proc, 1);
+}
+
+static VALUE il_register_type(VALUE self, VALUE num) {
+  devil_sync();
+  ilRegisterType(NUM2INT(num));
+  return Qnil;
+}
+
+static VALUE il_remove_load(VALUE self, VALUE ext) {
+  return codec_remove(ext, 0);
+}
+
+static VALUE il_remove_save(VALUE self, VALUE ext) {
+  return codec_remove(ext, 1);
+}
+
+static VALUE il_reset_mem(VALUE self) {
+  devil_sync();
+  if (mem.installed && mem.live)
+    rb_raise(rb_eRuntimeError, "pool allocator still owns %lu bytes", (unsigned long) mem.live);
+  ilResetMemory();
+  mem.installed = 0;
+  return Qnil;
+}
+
+static VALUE il_reset_read(VALUE self) {
+  devil_sync();
+  ilResetRead();
+  return Qnil;
+}
+
+static VALUE il_reset_write(VALUE self) {
+  devil_sync();
+  ilResetWrite();
+  return Qnil;
+}
+
+DEVIL_JOB(job_save, ilSave(a[0].u, a[1].p))
+
+static VALUE il_save(VALUE self, VALUE type, VALUE path) {
+  devil_arg a[2];
+  a[0].u = NUM2INT(type);
+  a[1].p = StringValueCStr(path);
+  if (!devil_run(job_save, a))
+    return Qfalse;
+
+  STATS_OUT(stats_file_size(RSTRING_PTR(path)));
+  return Qtrue;
+}
+
+static void *io_save(void *ptr) {
+  io_job *job = ptr;
+  return (void*) (size_t) ilSaveF(job->a[0].u, &job->h);
+}
+
+/*
+ * Save the current image to an IO.  Output is buffered in large chunks
+ * and written with IO#write; formats which patch their headers after
+ * writing need a seekable IO.  Returns the number of bytes written.
+ *
+ * Aliases:
+ *   DevIL::IL::save_f
+ *   DevIL::IL::SaveF
+ *
+ * Examples:
+ *   File.open('foo.png', 'wb') { |io| DevIL::IL::save_f DevIL::IL::PNG, io }
+ *
+ */
+static VALUE il_save_f(VALUE self, VALUE type, VALUE file) {
+  io_job job;
+
+  job.a[0].u = NUM2INT(type);
+  return UINT2NUM((size_t) io_job_start(&job, file, 1, io_save));
+}
+
+DEVIL_JOB(job_save_im, ilSaveImage(a[0].p))
+
+static VALUE il_save_im(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return devil_run(job_save_im, a) ? Qtrue : Qfalse;
+}
+
+/*
+ * Per-thread encode buffer for save_l.  Images are encoded straight
+ * into the buffer, which is only grown (and the encode repeated) when
+ * DevIL runs out of room.  The buffer is kept at the size of the
+ * largest of the last SAVE_POOL_HISTORY outputs, so steady-state
+ * encodes reuse it without reallocating; it shrinks again once the
+ * recent outputs are much smaller than its capacity.  Batch, Pool and
+ * Cache encode into save_scratch, used only by the thread running
+ * DevIL, and copy the result out.
+ */
+#define SAVE_POOL_HISTORY 16
+#define SAVE_POOL_ALIGN   (64 * 1024)
+
+typedef struct {
+  ILubyte *buf;
+  size_t cap,
+         recent[SAVE_POOL_HISTORY];
+  int pos;
+} save_pool;
+
+static save_pool save_scratch;
+
+static pthread_key_t save_pool_key;
+
+static void save_pool_free(void *ptr) {
+  save_pool *pool = ptr;
+
+  free(pool->buf);
+  free(pool);
+}
+
+static save_pool *save_pool_get(void) {
+  save_pool *pool;
+
+  if ((pool = pthread_getspecific(save_pool_key)) == NULL) {
+    if ((pool = calloc(1, sizeof(save_pool))) == NULL)
+      rb_memerror();
+    pthread_setspecific(save_pool_key, pool);
+  }
+
+  return pool;
+}
+
+static int save_pool_grow(save_pool *pool, size_t size) {
+  ILubyte *buf;
+
+  size = (size + SAVE_POOL_ALIGN - 1) & ~((size_t) SAVE_POOL_ALIGN - 1);
+  if ((buf = realloc(pool->buf, size)) == NULL)
+    return 0;
+  pool->buf = buf;
+  pool->cap = size;
+
+  return 1;
+}
+
+/* note an output of size bytes, shrinking the buffer if it's far too big */
+static void save_pool_note(save_pool *pool, size_t size) {
+  size_t want = size;
+  int i;
+
+  pool->recent[pool->pos] = size;
+  pool->pos = (pool->pos + 1) % SAVE_POOL_HISTORY;
+  for (i = 0; i < SAVE_POOL_HISTORY; i++)
+    if (pool->recent[i] > want)
+      want = pool->recent[i];
+
+  if (pool->cap > want * 2)
+    save_pool_grow(pool, want);
+}
+
+/*
+ * On the thread running DevIL: encode the bound image as type into the
+ * pool's buffer.  A lump too small for the output makes DevIL raise
+ * IL_FILE_WRITE_ERROR, and only then is the buffer grown and the image
+ * encoded again.  Returns the encoded size, or 0 with the DevIL error
+ * left on the stack.
+ */
+static ILuint save_encode(save_pool *pool, ILenum type) {
+  size_t raw = ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
+  ILenum err, other;
+  ILuint len;
+
+  /* a first guess which holds nearly every encode of the image */
+  if (!pool->cap && !save_pool_grow(pool, raw + raw / 8 + SAVE_POOL_ALIGN))
+    return 0;
+
+  for (;;) {
+    while (ilGetError() != IL_NO_ERROR)
+      ;
+    len = ilSaveL(type, pool->buf, pool->cap > UINT_MAX ? UINT_MAX : pool->cap);
+
+    other = IL_NO_ERROR;
+    while ((err = ilGetError()) != IL_NO_ERROR && err != IL_FILE_WRITE_ERROR)
+      other = err;
+    if (err != IL_FILE_WRITE_ERROR) {
+      if (other != IL_NO_ERROR)
+        ilSetError(other);
+      break;
+    }
+
+    while (ilGetError() != IL_NO_ERROR)
+      ;
+    if (pool->cap >= UINT_MAX ||
+        !save_pool_grow(pool, pool->cap * 2 > raw ? pool->cap * 2 : raw + SAVE_POOL_ALIGN)) {
+      ilSetError(IL_OUT_OF_MEMORY);
+      return 0;
+    }
+  }
+
+  if (len)
+    save_pool_note(pool, len);
+  return len;
+}
+
+typedef struct {
+  ILenum type;
+  save_pool *pool;
+  ILuint size;
+} save_l_job;
+
+static void *job_save_l_pool(void *ptr) {
+  save_l_job *job = ptr;
+
+  job->size = save_encode(job->pool, job->type);
+  return job->size ? job : NULL;
+}
+
+DEVIL_JOB(job_save_l, ilSaveL(a[0].u, a[1].p, a[2].u))
+
+typedef struct {
+  save_l_job job;
+  save_pool *home,
+            own;
+} save_l_async;
+
+static VALUE save_l_pool_run(VALUE ptr) {
+  save_l_job *job = (save_l_job*) ptr;
+
+  job->size = 0;
+  if (!devil_run(job_save_l_pool, job) || !job->size)
+    return Qnil;
+
+  STATS_OUT(job->size);
+  return rb_str_new((char*) job->pool->buf, job->size);
+}
+
+/* hand an async save's buffer back to its thread, unless another save did first */
+static VALUE save_l_async_done(VALUE ptr) {
+  save_l_async *s = (save_l_async*) ptr;
+
+  if (s->home->buf)
+    free(s->own.buf);
+  else
+    *s->home = s->own;
+
+  return Qnil;
+}
+
+/*
+ * Save the current image to memory.
+ *
+ * With only a type, the image is encoded into a reusable per-thread
+ * buffer and returned as a String (nil on failure).  With a buffer,
+ * the image is encoded into buf and the number of bytes written is
+ * returned.
+ *
+ * Aliases:
+ *   DevIL::IL::save_l
+ *   DevIL::IL::SaveL
+ *
+ * Examples:
+ *   png = DevIL::IL::save_l DevIL::IL::PNG
+ *   len = DevIL::IL::save_l DevIL::IL::PNG, buf
+ *
+ */
+static VALUE il_save_l(int argc, VALUE *argv, VALUE self) {
+  VALUE type, buf;
+  devil_arg a[3];
+  save_l_async s;
+  size_t ret;
+
+  rb_scan_args(argc, argv, "11", &type, &buf);
+
+  if (NIL_P(buf)) {
+    s.job.type = NUM2INT(type);
+    s.home = save_pool_get();
+    if (!devil_async) {
+      s.job.pool = s.home;
+      return save_l_pool_run((VALUE) &s.job);
+    }
+
+    /* other fibers may save while this one waits: take the buffer along */
+    s.own = *s.home;
+    memset(s.home, 0, sizeof(save_pool));
+    s.job.pool = &s.own;
+    return rb_ensure(save_l_pool_run, (VALUE) &s.job, save_l_async_done, (VALUE) &s);
+  }
+
+  a[0].u = NUM2INT(type);
+  StringValue(buf);
+  rb_str_modify(buf);
+  if ((unsigned long) RSTRING_LEN(buf) > 0xffffffffUL)
+    rb_raise(rb_eRangeError, "buffer too large: %ld bytes", RSTRING_LEN(buf));
+  a[1].p = RSTRING_PTR(buf);
+  a[2].u = RSTRING_LEN(buf);
+
+  rb_str_locktmp(buf);
+  ret = (size_t) devil_run(job_save_l, a);
+  rb_str_unlocktmp(buf);
+  STATS_OUT(ret);
+
+  return UINT2NUM(ret);
+}
+
+DEVIL_JOB(job_save_pal, ilSavePal(a[0].p))
+
+static VALUE il_save_pal(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return devil_run(job_save_pal, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_set_data, ilSetData(a[0].p))
+
+static VALUE il_set_data(VALUE self, VALUE buf) {
+  devil_arg a[1];
+  void *ret;
+
+  StringValue(buf);
+  a[0].p = RSTRING_PTR(buf);
+
+  rb_str_locktmp(buf);
+  ret = devil_run(job_set_data, a);
+  rb_str_unlocktmp(buf);
+
+  return ret ? Qtrue : Qfalse;
+}
+
+static VALUE il_set_duration(VALUE self, VALUE dur) {
+  devil_sync();
+  return ilSetDuration(NUM2INT(dur)) ? Qtrue : Qfalse;
+}
+
+static VALUE il_set_int(VALUE self, VALUE mode, VALUE val) {
+  devil_sync();
+  ilSetInteger(NUM2INT(mode), NUM2INT(val));
+  return Qnil;
+}
+
+static void *job_set_mem(void *ptr) {
+  UNUSED(ptr);
+  ilSetMemory(mem_alloc, mem_free);
+  return NULL;
+}
+
+/*
+ * Use the built-in pool allocator for DevIL image memory.
+ *
+ * Once installed, the pool stays in place (blocks already handed to
+ * DevIL must come back through it); passing false stops caching freed
+ * blocks and releases the cache.  With trim set, large cached blocks
+ * give their pages back to the kernel (madvise MADV_DONTNEED).
+ * cache_limit bounds the bytes kept on the free lists (default 256 MB).
+ *
+ * Aliases:
+ *   DevIL::IL::set_memory
+ *   DevIL::IL::SetMemory
+ *
+ * Examples:
+ *   DevIL::IL::set_memory true
+ *   DevIL::IL::set_memory true, true, 64 * 1024 * 1024
+ *   DevIL::IL::SetMemory false
+ *
+ */
+static VALUE il_set_mem(int argc, VALUE *argv, VALUE self) {
+  VALUE enable, trim, limit;
+
+  rb_scan_args(argc, argv, "03", &enable, &trim, &limit);
+
+  pthread_mutex_lock(&mem.mutex);
+  mem.enabled = (argc < 1) || RTEST(enable);
+  mem.trim = RTEST(trim);
+  if (!NIL_P(limit))
+    mem.cache_limit = NUM2SIZET(limit);
+  pthread_mutex_unlock(&mem.mutex);
+
+  if (!mem.enabled)
+    mem_trim();
+
+  if (!mem.installed) {
+    devil_run(job_set_mem, NULL);
+    mem.installed = 1;
+  }
+
+  return Qnil;
+}
+
+/*
+ * Get allocation statistics for the pool allocator as a Hash: live
+ * and peak bytes handed to DevIL, bytes cached on the free lists, and
+ * counts of allocations, frees, free list hits and system allocations.
+ *
+ * Aliases:
+ *   DevIL::IL::memory_stats
+ *   DevIL::IL::MemoryStats
+ *
+ * Examples:
+ *   DevIL::IL::memory_stats[:peak_bytes]
+ *
+ */
+static VALUE il_mem_stats(VALUE self) {
+  VALUE ret = rb_hash_new();
+
+  pthread_mutex_lock(&mem.mutex);
+  rb_hash_aset(ret, ID2SYM(rb_intern("enabled")), mem.enabled ? Qtrue : Qfalse);
+  rb_hash_aset(ret, ID2SYM(rb_intern("live_bytes")), SIZET2NUM(mem.live));
+  rb_hash_aset(ret, ID2SYM(rb_intern("peak_bytes")), SIZET2NUM(mem.peak));
+  rb_hash_aset(ret, ID2SYM(rb_intern("cached_bytes")), SIZET2NUM(mem.cached));
+  rb_hash_aset(ret, ID2SYM(rb_intern("cache_limit")), SIZET2NUM(mem.cache_limit));
+  rb_hash_aset(ret, ID2SYM(rb_intern("allocs")), ULONG2NUM(mem.allocs));
+  rb_hash_aset(ret, ID2SYM(rb_intern("frees")), ULONG2NUM(mem.frees));
+  rb_hash_aset(ret, ID2SYM(rb_intern("hits")), ULONG2NUM(mem.hits));
+  rb_hash_aset(ret, ID2SYM(rb_intern("sys_allocs")), ULONG2NUM(mem.sys_allocs));
+  pthread_mutex_unlock(&mem.mutex);
+
+  return ret;
+}
+
+/*
+ * Release the blocks cached by the pool allocator and reset the peak
+ * byte count.  Returns the number of bytes released.
+ *
+ * Aliases:
+ *   DevIL::IL::trim_memory
+ *   DevIL::IL::TrimMemory
+ *
+ */
+static VALUE il_trim_mem(VALUE self) {
+  size_t ret = mem_trim();
+
+  pthread_mutex_lock(&mem.mutex);
+  mem.peak = mem.live;
+  pthread_mutex_unlock(&mem.mutex);
+
+  return SIZET2NUM(ret);
+}
+
+static void *job_set_pixels(void *ptr) {
+  devil_arg *a = ptr;
+  ilSetPixels(a[0].i, a[1].i, a[2].i, a[3].u, a[4].u, a[5].u, a[6].u, a[7].u, a[8].p);
+  return NULL;
+}
+
+static VALUE il_set_pixels(VALUE self, VALUE xo, VALUE yo, VALUE zo, VALUE w, VALUE h, VALUE d, VALUE fmt, VALUE type, VALUE data) {
+  devil_arg a[9];
+
+  a[0].i = NUM2INT(xo);
+  a[1].i = NUM2INT(yo);
+  a[2].i = NUM2INT(zo);
+  a[3].u = NUM2INT(w);
+  a[4].u = NUM2INT(h);
+  a[5].u = NUM2INT(d);
+  a[6].u = NUM2INT(fmt);
+  a[7].u = NUM2INT(type);
+  StringValue(data);
+  a[8].p = RSTRING_PTR(data);
+
+  rb_str_locktmp(data);
+  devil_run(job_set_pixels, a);
+  rb_str_unlocktmp(data);
+
+  return Qnil;
+}
+
+static VALUE il_set_read(VALUE self, VALUE o, VALUE c, VALUE p, VALUE t, VALUE w) {
+  /* TODO: this! */
+  return Qnil;
+}
+
+static VALUE il_set_string(VALUE self, VALUE mode, VALUE str) {
+  devil_sync();
+  ilSetString(NUM2INT(mode), RSTRING_PTR(str));
+  return Qnil;
+}
+
+static VALUE il_set_write(VALUE self, VALUE o, VALUE c, VALUE p, VALUE t, VALUE w) {
+  /* TODO: this! */
+  return Qnil;
+}
+
+static VALUE il_shutdown(VALUE self) {
+  devil_sync();
+  devil_release_views();
+  ilShutDown();
+  devil_bound = BIND_NONE;
+  recycle.len = 0;
+  recycle.bytes = 0;
+  return Qnil;
+}
+
+DEVIL_JOB(job_tex_im, ilTexImage(a[0].u, a[1].u, a[2].u, a[3].u, a[4].u, a[5].u, a[6].p))
+
+static VALUE il_tex_im(VALUE self, VALUE w, VALUE h, VALUE d, VALUE bpp, VALUE fmt, VALUE type, VALUE data) {
+  devil_arg a[7];
+  void *ret;
+
+  a[0].u = NUM2INT(w);
+  a[1].u = NUM2INT(h);
+  a[2].u = NUM2INT(d);
+  a[3].u = NUM2INT(bpp);
+  a[4].u = NUM2INT(fmt);
+  a[5].u = NUM2INT(type);
+  a[6].p = NULL;
+  if (!NIL_P(data)) {
+    StringValue(data);
+    a[6].p = RSTRING_PTR(data);
+    rb_str_locktmp(data);
+  }
+
+  ret = devil_run(job_tex_im, a);
+  if (!NIL_P(data))
+    rb_str_unlocktmp(data);
+
+  return ret ? Qtrue : Qfalse;
+}
+
+static VALUE il_type_func(VALUE self, VALUE mode) {
+  devil_sync();
+  return ilTypeFunc(NUM2INT(mode)) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_load_data, ilLoadData(a[0].p, a[1].u, a[2].u, a[3].u, a[4].u))
+
+static VALUE il_load_data(VALUE self, VALUE path, VALUE w, VALUE h, VALUE d, VALUE bpp) {
+  devil_arg a[5];
+  a[0].p = StringValueCStr(path);
+  a[1].u = NUM2INT(w);
+  a[2].u = NUM2INT(h);
+  a[3].u = NUM2INT(d);
+  a[4].u = NUM2INT(bpp);
+  return devil_run(job_load_data, a) ? Qtrue : Qfalse;
+}
+
+static void *io_load_data(void *ptr) {
+  io_job *job = ptr;
+  return (void*) (size_t) ilLoadDataF(&job->h, job->a[0].u, job->a[1].u, job->a[2].u, job->a[3].u);
+}
+
+static VALUE il_load_data_f(VALUE self, VALUE file, VALUE w, VALUE h, VALUE d, VALUE bpp) {
+  io_job job;
+
+  job.a[0].u = NUM2INT(w);
+  job.a[1].u = NUM2INT(h);
+  job.a[2].u = NUM2INT(d);
+  job.a[3].u = NUM2INT(bpp);
+  return io_job_start(&job, file, 0, io_load_data) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_load_data_l, ilLoadDataL(a[0].p, a[1].u, a[2].u, a[3].u, a[4].u, a[5].u))
+
+static VALUE il_load_data_l(VALUE self, VALUE buf, VALUE w, VALUE h, VALUE d, VALUE bpp) {
+  devil_arg a[6];
+  void *ret;
+
+  StringValue(buf);
+  a[0].p = RSTRING_PTR(buf);
+  a[1].u = RSTRING_LEN(buf);
+  a[2].u = NUM2INT(w);
+  a[3].u = NUM2INT(h);
+  a[4].u = NUM2INT(d);
+  a[5].u = NUM2INT(bpp);
+
+  rb_str_locktmp(buf);
+  ret = devil_run(job_load_data_l, a);
+  rb_str_unlocktmp(buf);
+
+  return ret ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_save_data, ilSaveData(a[0].p))
+
+static VALUE il_save_data(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return devil_run(job_save_data, a) ? Qtrue : Qfalse;
+}
+
+/**********************/
+/* define ILU methods */
+/**********************/
+DEVIL_JOB(job_alienify, iluAlienify())
+
+static VALUE ilu_alienify(VALUE self) {
+  return devil_run(job_alienify, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_blur_avg, iluBlurAvg(a[0].u))
+
+static VALUE ilu_blur_avg(VALUE self, VALUE iter) {
+  devil_arg a[1];
+  a[0].u = NUM2INT(iter);
+  return devil_run(job_blur_avg, a) ? Qtrue : Qfalse;
+}
+
+/*
+ * Gaussian blur of the current image with standard deviation sigma, in
+ * pixels.  Unlike blur_gaussian the time taken doesn't grow with the
+ * amount of blur.  Works on 2D images of UNSIGNED_BYTE, UNSIGNED_SHORT
+ * or FLOAT pixels, spread over DevIL.threads threads.
+ *
+ * Aliases:
+ *   DevIL::ILU::blur
+ *   DevIL::ILU::Blur
+ *
+ * Examples:
+ *   DevIL::ILU::blur 40
+ *   DevIL::ILU::Blur 2.5
+ *
+ */
+DEVIL_JOB(job_blur, devil_blur(a[0].f))
+
+static VALUE ilu_blur(VALUE self, VALUE sigma) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(sigma);
+  return devil_run(job_blur, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_blur_gaussian, iluBlurGaussian(a[0].u))
+
+static VALUE ilu_blur_gaussian(VALUE self, VALUE iter) {
+  devil_arg a[1];
+  a[0].u = NUM2INT(iter);
+  return devil_run(job_blur_gaussian, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_build_mipmaps, iluBuildMipmaps())
+
+static VALUE ilu_build_mipmaps(VALUE self) {
+  return devil_run(job_build_mipmaps, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_colors_used, devil_colors_used())
+
+/*
+ * Count the distinct colours of the current image.  Gives the same
+ * answer as iluColorsUsed, counted natively over DevIL.threads threads
+ * for layouts where the native counter has been seen to agree with it.
+ *
+ * Aliases:
+ *   DevIL::ILU::colors_used
+ *   DevIL::ILU::ColorsUsed
+ *   DevIL::ILU::colours_used
+ *   DevIL::ILU::ColoursUsed
+ *
+ */
+static VALUE ilu_colors_used(VALUE self) {
+  return UINT2NUM((size_t) devil_run(job_colors_used, NULL));
+}
+
+static void *job_histogram(void *ptr) {
+  return (void *) (size_t) devil_histogram(ptr);
+}
+
+/* layout of the current image for histogram and stats; 0 if unsupported */
+static int hist_layout(hist_arg *h) {
+  devil_sync();
+  h->channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  h->format = ilGetInteger(IL_IMAGE_FORMAT);
+  h->type = ilGetInteger(IL_IMAGE_TYPE);
+
+  return ilGetData() && h->format != IL_COLOUR_INDEX && h->channels >= 1 && h->channels <= 4 &&
+         (h->type == IL_UNSIGNED_BYTE || h->type == IL_UNSIGNED_SHORT || h->type == IL_FLOAT);
+}
+
+/*
+ * Per-channel histograms of the current image, as an Array of one Array
+ * of bins counts (default 256) per channel.  Bins split the channel's
+ * range (0-255, 0-65535, or 0.0-1.0 for FLOAT, out of range floats
+ * going to the end bins) evenly.  Works on UNSIGNED_BYTE,
+ * UNSIGNED_SHORT and FLOAT images, spread over DevIL.threads threads;
+ * returns nil for anything else.
+ *
+ * Examples:
+ *   r, g, b = DevIL::ILU::histogram
+ *   coarse = DevIL::ILU::histogram 16
+ *
+ */
+static VALUE ilu_histogram(int argc, VALUE *argv, VALUE self) {
+  VALUE bins, tmp, ret, ch;
+  hist_arg h;
+  int j, b;
+
+  rb_scan_args(argc, argv, "01", &bins);
+  h.bins = NIL_P(bins) ? 256 : NUM2INT(bins);
+  if (h.bins < 1 || h.bins > 65536)
+    rb_raise(rb_eArgError, "bins must be between 1 and 65536");
+  if (!hist_layout(&h))
+    return Qnil;
+
+  h.counts = ALLOCV_N(uint64_t, tmp, (size_t) h.channels * h.bins);
+  if (!devil_run(job_histogram, &h)) {
+    ALLOCV_END(tmp);
+    return Qnil;
+  }
+
+  ret = rb_ary_new_capa(h.channels);
+  for (j = 0; j < h.channels; j++) {
+    ch = rb_ary_new_capa(h.bins);
+    for (b = 0; b < h.bins; b++)
+      rb_ary_push(ch, ULL2NUM(h.counts[j * h.bins + b]));
+    rb_ary_push(ret, ch);
+  }
+  ALLOCV_END(tmp);
+
+  return ret;
+}
+
+static VALUE hist_floats(const double *v, int n) {
+  VALUE ret = rb_ary_new_capa(n);
+  int i;
+
+  for (i = 0; i < n; i++)
+    rb_ary_push(ret, rb_float_new(v[i]));
+
+  return ret;
+}
+
+/*
+ * Per-channel statistics of the current image, as a Hash of Arrays
+ * with one entry per channel (:min, :max, :mean, :stddev) plus the
+ * number of :pixels.  Values are in channel units; NaNs in FLOAT images
+ * are skipped.  Works on the same images as histogram.
+ *
+ * Examples:
+ *   s = DevIL::ILU::stats
+ *   lo, hi = s[:min][0], s[:max][0]
+ *
+ */
+static VALUE ilu_stats(VALUE self) {
+  double v[16];
+  VALUE hash;
+  hist_arg h;
+
+  if (!hist_layout(&h))
+    return Qnil;
+
+  h.bins = 0;
+  h.mean = v;
+  h.stddev = v + 4;
+  h.min = v + 8;
+  h.max = v + 12;
+  if (!devil_run(job_histogram, &h))
+    return Qnil;
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("pixels")), SIZET2NUM(h.pixels));
+  rb_hash_aset(hash, ID2SYM(rb_intern("min")), hist_floats(h.min, h.channels));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max")), hist_floats(h.max, h.channels));
+  rb_hash_aset(hash, ID2SYM(rb_intern("mean")), hist_floats(h.mean, h.channels));
+  rb_hash_aset(hash, ID2SYM(rb_intern("stddev")), hist_floats(h.stddev, h.channels));
+
+  return hash;
+}
+
+static void *job_compare(void *ptr) {
+  return (void *) (size_t) devil_compare(ptr);
+}
+
+/*
+ * Compare the current image with another image (a name or a
+ * DevIL::Image) of the same layout, and return a Hash of metrics:
+ *
+ *   :mae          mean absolute channel difference
+ *   :max_delta    largest absolute channel difference
+ *   :psnr         peak signal to noise ratio in dB (Infinity if equal)
+ *   :ssim         structural similarity of the colour channels (1.0 if equal)
+ *   :diff_pixels  pixels with a channel off by more than tolerance
+ *   :heatmap      with heatmap true, the name of a new RGB image of the
+ *                 differences (black where within tolerance), else nil
+ *
+ * Differences are in channel units (0-255, 0-65535 or 0.0-1.0).  Works
+ * on 2D UNSIGNED_BYTE, UNSIGNED_SHORT or FLOAT images, spread over
+ * DevIL.threads threads; returns nil for anything else, or if the
+ * layouts differ.
+ *
+ * Examples:
+ *   m = DevIL::ILU::compare expected, 2
+ *   m[:psnr] > 40 && m[:diff_pixels] == 0
+ *
+ *   m = DevIL::ILU::compare expected, 0, true
+ *   DevIL::IL::bind_image m[:heatmap]
+ *
+ */
+static VALUE ilu_compare(int argc, VALUE *argv, VALUE self) {
+  VALUE other, tol, heatmap, hash;
+  metric_arg m;
+
+  rb_scan_args(argc, argv, "12", &other, &tol, &heatmap);
+  if (rb_obj_is_kind_of(other, cImage))
+    other = rb_funcall(other, rb_intern("name"), 0);
+  m.other = NUM2UINT(other);
+  m.tol = NIL_P(tol) ? 0 : NUM2DBL(tol);
+  m.heatmap = RTEST(heatmap);
+
+  if (!devil_run(job_compare, &m))
+    return Qnil;
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("mae")), rb_float_new(m.mae));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max_delta")), rb_float_new(m.max));
+  rb_hash_aset(hash, ID2SYM(rb_intern("psnr")), rb_float_new(m.psnr));
+  rb_hash_aset(hash, ID2SYM(rb_intern("ssim")), rb_float_new(m.ssim));
+  rb_hash_aset(hash, ID2SYM(rb_intern("diff_pixels")), ULL2NUM(m.differ));
+  rb_hash_aset(hash, ID2SYM(rb_intern("heatmap")), m.heat ? UINT2NUM(m.heat) : Qnil);
+
+  return hash;
+}
+
+DEVIL_JOB(job_compare_im, iluCompareImage(a[0].u))
+
+static VALUE ilu_compare_im(VALUE self, VALUE comp) {
+  devil_arg a[1];
+  a[0].u = NUM2INT(comp);
+  return devil_run(job_compare_im, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_contrast, iluContrast(a[0].f))
+
+static VALUE ilu_contrast(VALUE self, VALUE contrast) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(contrast);
+  return devil_run(job_contrast, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_crop, iluCrop(a[0].u, a[1].u, a[2].u, a[3].u, a[4].u, a[5].u))
+
+static VALUE ilu_crop(VALUE self, VALUE xo, VALUE yo, VALUE zo, VALUE w, VALUE h, VALUE d) {
+  devil_arg a[6];
+  a[0].u = NUM2INT(xo);
+  a[1].u = NUM2INT(yo);
+  a[2].u = NUM2INT(zo);
+  a[3].u = NUM2INT(w);
+  a[4].u = NUM2INT(h);
+  a[5].u = NUM2INT(d);
+  return devil_run(job_crop, a) ? Qtrue : Qfalse;
+}
+
+static VALUE ilu_delete_im(VALUE self, VALUE id) {
+  devil_sync();
+  devil_release_views();
+  iluDeleteImage(NUM2INT(id));
+  devil_bound = BIND_NONE;
+  return Qnil;
+}
+
+DEVIL_JOB(job_edge_detect_e, iluEdgeDetectE())
+
+static VALUE ilu_edge_detect_e(VALUE self) {
+  return devil_run(job_edge_detect_e, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_edge_detect_p, iluEdgeDetectP())
+
+static VALUE ilu_edge_detect_p(VALUE self) {
+  return devil_run(job_edge_detect_p, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_edge_detect_s, iluEdgeDetectS())
+
+static VALUE ilu_edge_detect_s(VALUE self) {
+  return devil_run(job_edge_detect_s, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_emboss, iluEmboss())
+
+static VALUE ilu_emboss(VALUE self) {
+  return devil_run(job_emboss, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_enlarge_canvas, iluEnlargeCanvas(a[0].u, a[1].u, a[2].u))
+
+static VALUE ilu_enlarge_canvas(VALUE self, VALUE w, VALUE h, VALUE d) {
+  devil_arg a[3];
+  a[0].u = NUM2INT(w);
+  a[1].u = NUM2INT(h);
+  a[2].u = NUM2INT(d);
+  return devil_run(job_enlarge_canvas, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_enlarge_im, iluEnlargeImage(a[0].f, a[1].f, a[2].f))
+
+static VALUE ilu_enlarge_im(VALUE self, VALUE x, VALUE y, VALUE z) {
+  devil_arg a[3];
+  a[0].f = NUM2DBL(x);
+  a[1].f = NUM2DBL(y);
+  a[2].f = NUM2DBL(z);
+  return devil_run(job_enlarge_im, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_equalize, iluEqualize())
+
+static VALUE ilu_equalize(VALUE self) {
+  return devil_run(job_equalize, NULL) ? Qtrue : Qfalse;
+}
+
+static VALUE ilu_error_string(VALUE self, VALUE err) {
+  devil_sync();
+  return rb_str_new2(iluErrorString(NUM2INT(err)));
+}
+
+DEVIL_JOB(job_flip_im, iluFlipImage())
+
+static VALUE ilu_flip_im(VALUE self) {
+  return devil_run(job_flip_im, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_gamma_correct, iluGammaCorrect(a[0].f))
+
+static VALUE ilu_gamma_correct(VALUE self, VALUE gamma) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(gamma);
+  return devil_run(job_gamma_correct, a) ? Qtrue : Qfalse;
+}
+
+static VALUE ilu_gen_im(VALUE self) {
+  devil_sync();
+  devil_bound = iluGenImage();
+  return UINT2NUM(devil_bound);
+}
+
+/*
+ * Information about the current image, as a Hash of the ILinfo fields
+ * (but the data and palette pointers).
+ *
+ * Aliases:
+ *   DevIL::ILU::get_image_info
+ *   DevIL::ILU::GetImageInfo
+ *
+ * Examples:
+ *   info = DevIL::ILU::get_image_info
+ *   info[:width]
+ *
+ */
+static VALUE ilu_get_im_info(VALUE self) {
+  ILinfo info;
+  VALUE hash = rb_hash_new();
+
+  devil_sync();
+  iluGetImageInfo(&info);
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("id")), UINT2NUM(info.Id));
+  rb_hash_aset(hash, ID2SYM(rb_intern("width")), UINT2NUM(info.Width));
+  rb_hash_aset(hash, ID2SYM(rb_intern("height")), UINT2NUM(info.Height));
+  rb_hash_aset(hash, ID2SYM(rb_intern("depth")), UINT2NUM(info.Depth));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bpp")), UINT2NUM(info.Bpp));
+  rb_hash_aset(hash, ID2SYM(rb_intern("size_of_data")), UINT2NUM(info.SizeOfData));
+  rb_hash_aset(hash, ID2SYM(rb_intern("format")), INT2NUM(info.Format));
+  rb_hash_aset(hash, ID2SYM(rb_intern("type")), INT2NUM(info.Type));
+  rb_hash_aset(hash, ID2SYM(rb_intern("origin")), INT2NUM(info.Origin));
+  rb_hash_aset(hash, ID2SYM(rb_intern("palette_type")), INT2NUM(info.PalType));
+  rb_hash_aset(hash, ID2SYM(rb_intern("palette_size")), UINT2NUM(info.PalSize));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cube_flags")), INT2NUM(info.CubeFlags));
+  rb_hash_aset(hash, ID2SYM(rb_intern("num_next")), UINT2NUM(info.NumNext));
+  rb_hash_aset(hash, ID2SYM(rb_intern("num_mips")), UINT2NUM(info.NumMips));
+  rb_hash_aset(hash, ID2SYM(rb_intern("num_layers")), UINT2NUM(info.NumLayers));
+
+  return hash;
+}
+
+static VALUE ilu_get_int(VALUE self, VALUE mode) {
+  devil_sync();
+  return INT2FIX(iluGetInteger(NUM2INT(mode)));
+}
+
+static VALUE ilu_get_string(VALUE self, VALUE num) {
+  devil_sync();
+  return rb_str_new2(iluGetString(NUM2INT(num)));
+}
+
+static VALUE ilu_im_parameter(VALUE self, VALUE name, VALUE param) {
+  devil_sync();
+  iluImageParameter(NUM2INT(name), NUM2INT(param));
+  return Qnil;
+}
+
+DEVIL_JOB(job_invert_alpha, iluInvertAlpha())
+
+static VALUE ilu_invert_alpha(VALUE self) {
+  return devil_run(job_invert_alpha, NULL) ? Qtrue : Qfalse;
+}
+
+static void *job_ilu_load_im(void *ptr) {
+  devil_arg *a = ptr;
+  ILuint name = iluLoadImage(a[0].p);
+
+  devil_bound = name ? name : BIND_NONE;
+  return (void*) (size_t) name;
+}
+
+static VALUE ilu_load_im(VALUE self, VALUE path) {
+  devil_arg a[1];
+  a[0].p = StringValueCStr(path);
+  return UINT2NUM((size_t) devil_run(job_ilu_load_im, a));
+}
+
+/*
+ * Build the whole mip chain of the current image, from the image itself
+ * down to 1x1, and return it as [data, levels]: data holds every level
+ * back to back in the image's format, and levels is an Array of
+ * [offset, width, height] for each.  Unless srgb is false, colour
+ * channels are averaged as sRGB-encoded light.  Works on 2D UNSIGNED_BYTE
+ * images, spread over DevIL.threads threads; returns nil for anything
+ * else.  The image itself is left as it is.
+ *
+ * Aliases:
+ *   DevIL::ILU::mipmap_chain
+ *   DevIL::ILU::MipmapChain
+ *
+ * Examples:
+ *   data, levels = DevIL::ILU::mipmap_chain
+ *   levels.each { |offset, w, h| upload(w, h, data.byteslice(offset, w * h * 4)) }
+ *
+ */
+static void *job_mipmap_chain(void *ptr) {
+  return (void *) (size_t) devil_mipmap_chain(ptr);
+}
+
+static VALUE ilu_mipmap_chain(int argc, VALUE *argv, VALUE self) {
+  size_t offset[34];            /* levels + 1 */
+  mip_chain_arg m;
+  VALUE srgb, data, levels;
+  long w, h;
+  int i;
+
+  rb_scan_args(argc, argv, "01", &srgb);
+
+  devil_sync();
+  m.w = ilGetInteger(IL_IMAGE_WIDTH);
+  m.h = ilGetInteger(IL_IMAGE_HEIGHT);
+  m.channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  m.format = ilGetInteger(IL_IMAGE_FORMAT);
+  if (m.w < 1 || m.h < 1 || ilGetInteger(IL_IMAGE_DEPTH) != 1 ||
+      ilGetInteger(IL_IMAGE_TYPE) != IL_UNSIGNED_BYTE || m.format == IL_COLOUR_INDEX ||
+      m.channels < 1 || m.channels > 4)
+    return Qnil;
+
+  m.srgb = NIL_P(srgb) || RTEST(srgb);
+  m.offset = offset;
+  m.levels = mip_levels(m.w, m.h, m.channels, offset);
+  data = rb_str_new(NULL, offset[m.levels]);
+  m.out = (ILubyte *) RSTRING_PTR(data);
+
+  rb_str_locktmp(data);
+  i = (int) (size_t) devil_run(job_mipmap_chain, &m);
+  rb_str_unlocktmp(data);
+  if (!i)
+    return Qnil;
+
+  levels = rb_ary_new_capa(m.levels);
+  for (i = 0, w = m.w, h = m.h; i < m.levels; i++) {
+    rb_ary_push(levels, rb_ary_new3(3, SIZET2NUM(offset[i]), LONG2NUM(w), LONG2NUM(h)));
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+  }
+
+  return rb_assoc_new(data, levels);
+}
+
+DEVIL_JOB(job_mirror, iluMirror())
+
+static VALUE ilu_mirror(VALUE self) {
+  return devil_run(job_mirror, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_negative, iluNegative())
+
+static VALUE ilu_negative(VALUE self) {
+  return devil_run(job_negative, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_noisify, iluNoisify(a[0].f))
+
+static VALUE ilu_noisify(VALUE self, VALUE tol) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(tol);
+  return devil_run(job_noisify, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_pixelize, iluPixelize(a[0].u))
+
+static VALUE ilu_pixelize(VALUE self, VALUE size) {
+  devil_arg a[1];
+  a[0].u = NUM2INT(size);
+  return devil_run(job_pixelize, a) ? Qtrue : Qfalse;
+}
+
+static VALUE ilu_region_fv(VALUE self, VALUE points) {
+  /* TODO: this function! */
+  return Qnil;
+}
+
+static VALUE ilu_region_iv(VALUE self, VALUE points) {
+  /* TODO: this function! */
+  return Qnil;
+}
+
+DEVIL_JOB(job_replace_color, iluReplaceColor(a[0].u, a[1].u, a[2].u, a[3].f))
+
+static VALUE ilu_replace_color(VALUE self, VALUE r, VALUE g, VALUE b, VALUE tol) {
+  devil_arg a[4];
+  a[0].u = NUM2INT(r);
+  a[1].u = NUM2INT(g);
+  a[2].u = NUM2INT(b);
+  a[3].f = NUM2DBL(tol);
+  return devil_run(job_replace_color, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_resample, devil_resample(a[0].u, a[1].u, a[2].u))
+
+/*
+ * Scale the current image to width x height with the native resampler
+ * instead of iluScale: filter is one of ILU::SCALE_BOX, ILU::BILINEAR,
+ * ILU::SCALE_MITCHELL or ILU::SCALE_LANCZOS3 (the default).  Works on
+ * 2D images of UNSIGNED_BYTE, UNSIGNED_SHORT or FLOAT pixels, spread
+ * over DevIL.threads threads.  ILU.scale takes the same path when
+ * ILU::FILTER is set to one of these filters.
+ *
+ * Aliases:
+ *   DevIL::ILU::resample
+ *   DevIL::ILU::Resample
+ *
+ * Examples:
+ *   DevIL::ILU::resample 640, 480
+ *   DevIL::ILU::Resample 640, 480, DevIL::ILU::SCALE_MITCHELL
+ *
+ */
+static VALUE ilu_resample(int argc, VALUE *argv, VALUE self) {
+  VALUE w, h, filter;
+  devil_arg a[3];
+
+  rb_scan_args(argc, argv, "21", &w, &h, &filter);
+  a[0].u = NUM2INT(w);
+  a[1].u = NUM2INT(h);
+  a[2].u = NIL_P(filter) ? ILU_SCALE_LANCZOS3 : NUM2INT(filter);
+  return devil_run(job_resample, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_rotate, iluRotate(a[0].f))
+
+static VALUE ilu_rotate(VALUE self, VALUE angle) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(angle);
+  return devil_run(job_rotate, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_rotate_3d, iluRotate3D(a[0].f, a[1].f, a[2].f, a[3].f))
+
+static VALUE ilu_rotate_3d(VALUE self, VALUE x, VALUE y, VALUE z, VALUE angle) {
+  devil_arg a[4];
+  a[0].f = NUM2DBL(x);
+  a[1].f = NUM2DBL(y);
+  a[2].f = NUM2DBL(z);
+  a[3].f = NUM2DBL(angle);
+  return devil_run(job_rotate_3d, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_saturate_1f, iluSaturate1f(a[0].f))
+
+static VALUE ilu_saturate_1f(VALUE self, VALUE sat) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(sat);
+  return devil_run(job_saturate_1f, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_saturate_4f, iluSaturate4f(a[0].f, a[1].f, a[2].f, a[3].f))
+
+static VALUE ilu_saturate_4f(VALUE self, VALUE r, VALUE g, VALUE b, VALUE sat) {
+  devil_arg a[4];
+  a[0].f = NUM2DBL(r);
+  a[1].f = NUM2DBL(g);
+  a[2].f = NUM2DBL(b);
+  a[3].f = NUM2DBL(sat);
+  return devil_run(job_saturate_4f, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_scale, devil_scale(a[0].u, a[1].u, a[2].u))
+
+static VALUE ilu_scale(VALUE self, VALUE w, VALUE h, VALUE d) {
+  devil_arg a[3];
+  a[0].u = NUM2INT(w);
+  a[1].u = NUM2INT(h);
+  a[2].u = NUM2INT(d);
+  return devil_run(job_scale, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_scale_colors, iluScaleColors(a[0].f, a[1].f, a[2].f))
+
+static VALUE ilu_scale_colors(VALUE self, VALUE r, VALUE g, VALUE b) {
+  devil_arg a[3];
+  a[0].f = NUM2DBL(r);
+  a[1].f = NUM2DBL(g);
+  a[2].f = NUM2DBL(b);
+  return devil_run(job_scale_colors, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_sharpen, iluSharpen(a[0].f, a[1].u))
+
+static VALUE ilu_sharpen(VALUE self, VALUE factor, VALUE iter) {
+  devil_arg a[2];
+  a[0].f = NUM2DBL(factor);
+  a[1].u = NUM2INT(iter);
+  return devil_run(job_sharpen, a) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_swap_colors, iluSwapColors())
+
+static VALUE ilu_swap_colors(VALUE self) {
+  return devil_run(job_swap_colors, NULL) ? Qtrue : Qfalse;
+}
+
+DEVIL_JOB(job_wave, iluWave(a[0].f))
+
+static VALUE ilu_wave(VALUE self, VALUE angle) {
+  devil_arg a[1];
+  a[0].f = NUM2DBL(angle);
+  return devil_run(job_wave, a) ? Qtrue : Qfalse;
+}
+
+/*
+ * Inputs to the batch calls are paths or Strings of image data.  Binary
+ * Strings (as from File.binread or save_l) are image data and any other
+ * encoding is a path; a call's :data option decides instead when not
+ * nil.
+ */
+static int devil_is_data(VALUE str, VALUE data) {
+  if (!NIL_P(data))
+    return RTEST(data);
+  return rb_enc_get_index(str) == rb_ascii8bit_encindex();
+}
+
+/*
+ * Take a trailing options Hash off argv and return its :data entry, for
+ * the calls whose positional arguments never include a Hash.
+ */
+static VALUE devil_data_opt(int *argc, VALUE *argv) {
+  if (*argc < 1 || !RB_TYPE_P(argv[*argc - 1], T_HASH))
+    return Qnil;
+
+  return rb_hash_aref(argv[--*argc], ID2SYM(rb_intern("data")));
+}
+
+/******************/
+/* async bindings */
+/******************/
+
+/*
+ * Fiber::Scheduler aware variants of the slow calls.  Each one runs the
+ * plain binding with devil_async set, so its job hands the calling
+ * fiber to the scheduler (see devil_run) and other fibers keep running
+ * while DevIL works.  Outside a non-blocking fiber they behave exactly
+ * like the plain calls.
+ *
+ * Jobs still run one at a time in the order they were queued, but other
+ * fibers may bind other images in between, so the DevIL::Image versions
+ * are the ones to use when several fibers share the IL state.
+ */
+typedef VALUE (*async_fn)();
+
+typedef struct {
+  async_fn fn;
+  VALUE self;
+  int argc;
+  VALUE *argv;
+} async_call_arg;
+
+static VALUE async_apply(VALUE ptr) {
+  async_call_arg *c = (async_call_arg*) ptr;
+  VALUE *v = c->argv;
+
+  devil_async = 1;
+  switch (c->argc) {
+  case 2: return c->fn(c->self, v[0], v[1]);
+  case 3: return c->fn(c->self, v[0], v[1], v[2]);
+  }
+
+  return c->fn(c->argc, v, c->self);
+}
+
+/* argument errors must not leave the next call async */
+static VALUE async_reset(VALUE ptr) {
+  devil_async = 0;
+  return Qnil;
+}
+
+static VALUE async_call(VALUE self, async_fn fn, int arity, int argc, VALUE *argv) {
+  async_call_arg c;
+
+  if (arity >= 0)
+    rb_check_arity(argc, arity, arity);
+
+  c.fn = fn;
+  c.self = self;
+  c.argc = arity >= 0 ? arity : argc;
+  c.argv = argv;
+
+  return rb_ensure(async_apply, (VALUE) &c, async_reset, Qnil);
+}
+
+/*
+ * Define <fn>_async, running the binding fn (of the given arity, -1 for
+ * variadic) through the scheduler.
+ */
+#define ASYNC_METH(fn, arity)                                   \
+  static VALUE fn##_async(int argc, VALUE *argv, VALUE self) {  \
+    return async_call(self, (async_fn) fn, arity, argc, argv);  \
+  }
+
+/*
+ * Load, save and scale without blocking other fibers.
+ *
+ * Examples:
+ *   Async do
+ *     DevIL::IL.load_l_async DevIL::IL::JPG, body
+ *     DevIL::ILU.scale_async 320, 240, 1
+ *     png = DevIL::IL.save_l_async DevIL::IL::PNG
+ *   end
+ *
+ */
+ASYNC_METH(il_load, 2)
+ASYNC_METH(il_load_l, 2)
+ASYNC_METH(il_save, 2)
+ASYNC_METH(il_save_l, -1)
+ASYNC_METH(ilu_scale, 3)
+
+/***************/
+/* image probe */
+/***************/
+
+/*
+ * DevIL::IL.probe reads just enough of a file's headers to tell its
+ * format, size and layout, without DevIL and without decoding any
+ * pixels.  Files are read through a small window with pread, so
+ * walking JPEG markers, GIF blocks or TIFF directories only touches the
+ * bytes it needs.
+ */
+#define PROBE_WINDOW 4096
+
+typedef struct {
+  const ILubyte *data;  /* the whole input, or NULL to read from fd */
+  int fd;
+  uint64_t len,
+           win_off;
+  size_t win_len;
+  ILubyte win[PROBE_WINDOW];
+} probe_src;
+
+typedef struct {
+  ILenum format;
+  uint32_t width, height, depth,
+           channels,
+           bit_depth,   /* bits per channel, or per index for palette images */
+           frames;
+} probe_info;
+
+/* n (at most PROBE_WINDOW) bytes at off; NULL past the end */
+static const ILubyte *probe_at(probe_src *s, uint64_t off, size_t n) {
+  ssize_t got;
+
+  if (off > s->len || n > s->len - off)
+    return NULL;
+  if (s->data)
+    return s->data + off;
+
+  if (off < s->win_off || off + n > s->win_off + s->win_len) {
+    do
+      got = pread(s->fd, s->win, PROBE_WINDOW, off);
+    while (got < 0 && errno == EINTR);
+    if (got < (ssize_t) n)
+      return NULL;
+    s->win_off = off;
+    s->win_len = got;
+  }
+
+  return s->win + (off - s->win_off);
+}
+
+static uint32_t probe_be16(const ILubyte *p) { return p[0] << 8 | p[1]; }
+static uint32_t probe_le16(const ILubyte *p) { return p[0] | p[1] << 8; }
+static uint32_t probe_be32(const ILubyte *p) { return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+static uint32_t probe_le32(const ILubyte *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; }
+
+static int probe_png(probe_src *s, probe_info *info) {
+  static const ILubyte channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+  const ILubyte *p = probe_at(s, 0, 29);
+  uint64_t off;
+
+  if (!p || memcmp(p, "\211PNG\r\n\032\n", 8) || memcmp(p + 12, "IHDR", 4) || p[25] > 6)
+    return 0;
+
+  info->format = IL_PNG;
+  info->width = probe_be32(p + 16);
+  info->height = probe_be32(p + 20);
+  info->bit_depth = p[24];
+  info->channels = channels[p[25]];
+
+  /* animated PNGs have an acTL chunk before the image data */
+  for (off = 8; (p = probe_at(s, off, 12)); off += 12 + (uint64_t) probe_be32(p)) {
+    if (!memcmp(p + 4, "acTL", 4)) {
+      info->frames = probe_be32(p + 8);
+      break;
+    }
+    if (!memcmp(p + 4, "IDAT", 4) || !memcmp(p + 4, "IEND", 4))
+      break;
+  }
+
+  return 1;
+}
+
+static int probe_jpeg(probe_src *s, probe_info *info) {
+  const ILubyte *p = probe_at(s, 0, 3);
+  uint64_t off = 2;
+  int marker;
+
+  if (!p || p[0] != 0xff || p[1] != 0xd8 || p[2] != 0xff)
+    return 0;
+
+  while ((p = probe_at(s, off, 2))) {
+    if (p[0] != 0xff)
+      return 0;
+    if ((marker = p[1]) == 0xff) {
+      off++;    /* fill byte */
+      continue;
+    }
+    off += 2;
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8))
+      continue;
+    if (marker == 0xd9 || marker == 0xda || !(p = probe_at(s, off, 2)))
+      return 0;
+
+    /* start of frame, any coding but DHT/JPG/DAC */
+    if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+      if (!(p = probe_at(s, off, 8)))
+        return 0;
+      info->format = IL_JPG;
+      info->bit_depth = p[2];
+      info->height = probe_be16(p + 3);
+      info->width = probe_be16(p + 5);
+      info->channels = p[7];
+      return 1;
+    }
+    off += probe_be16(p);
+  }
+
+  return 0;
+}
+
+/* skip a run of GIF sub-blocks; 0 at the end of the input */
+static uint64_t probe_gif_blocks(probe_src *s, uint64_t off) {
+  const ILubyte *p;
+
+  while ((p = probe_at(s, off, 1)) && *p)
+    off += 1 + *p;
+  return p ? off + 1 : 0;
+}
+
+static int probe_gif(probe_src *s, probe_info *info) {
+  const ILubyte *p = probe_at(s, 0, 13);
+  uint64_t off;
+
+  if (!p || (memcmp(p, "GIF87a", 6) && memcmp(p, "GIF89a", 6)))
+    return 0;
+
+  info->format = IL_GIF;
+  info->width = probe_le16(p + 6);
+  info->height = probe_le16(p + 8);
+  info->channels = 1;
+  info->bit_depth = 8;
+  info->frames = 0;
+  off = 13 + (p[10] & 0x80 ? 3 << ((p[10] & 7) + 1) : 0);
+
+  while ((p = probe_at(s, off, 1)) && *p != 0x3b) {
+    if (*p == 0x2c) {
+      if (!(p = probe_at(s, off, 11)))
+        break;
+      info->frames++;
+      off += 10 + (p[9] & 0x80 ? 3 << ((p[9] & 7) + 1) : 0) + 1;  /* and the LZW code size */
+    } else if (*p == 0x21) {
+      off += 2;
+    } else {
+      break;
+    }
+    if (!(off = probe_gif_blocks(s, off)))
+      break;
+  }
+
+  if (!info->frames)
+    info->frames = 1;
+  return 1;
+}
+
+static int probe_bmp(probe_src *s, probe_info *info) {
+  const ILubyte *p = probe_at(s, 0, 26);
+  uint32_t bpp;
+  int32_t height;
+
+  if (!p || p[0] != 'B' || p[1] != 'M')
+    return 0;
+
+  if (probe_le32(p + 14) == 12) {
+    info->width = probe_le16(p + 18);
+    info->height = probe_le16(p + 20);
+    bpp = probe_le16(p + 24);
+  } else {
+    if (!(p = probe_at(s, 0, 30)))
+      return 0;
+    info->width = probe_le32(p + 18);
+    height = (int32_t) probe_le32(p + 22);
+    info->height = height < 0 ? -height : height;   /* top-down */
+    bpp = probe_le16(p + 28);
+  }
+
+  info->format = IL_BMP;
+  info->channels = bpp == 32 ? 4 : bpp > 8 ? 3 : 1;
+  info->bit_depth = bpp == 16 ? 5 : bpp > 8 ? 8 : bpp;
+  return 1;
+}
+
+static int probe_dds(probe_src *s, probe_info *info) {
+  const ILubyte *p = probe_at(s, 0, 128);
+  uint32_t flags, pf_flags, bits;
+
+  if (!p || memcmp(p, "DDS ", 4) || probe_le32(p + 4) != 124)
+    return 0;
+
+  flags = probe_le32(p + 8);
+  pf_flags = probe_le32(p + 80);
+  bits = probe_le32(p + 88);
+
+  info->format = IL_DDS;
+  info->height = probe_le32(p + 12);
+  info->width = probe_le32(p + 16);
+  info->depth = flags & 0x800000 && probe_le32(p + 24) ? probe_le32(p + 24) : 1;
+  info->frames = probe_le32(p + 112) & 0x200 ? 6 : 1;     /* cube map faces */
+  info->bit_depth = 8;
+
+  if (pf_flags & 0x4)                       /* FourCC: compressed, decoded to RGBA */
+    info->channels = 4;
+  else if (pf_flags & 0x20000)              /* luminance */
+    info->channels = pf_flags & 0x1 ? 2 : 1;
+  else if (pf_flags & 0x2)                  /* alpha only */
+    info->channels = 1;
+  else
+    info->channels = pf_flags & 0x1 ? 4 : 3;
+  if (!(pf_flags & 0x4) && info->channels)
+    info->bit_depth = bits / info->channels;
+
+  return 1;
+}
+
+/* first value of a SHORT or LONG TIFF field; 0 if it can't be read */
+static uint32_t probe_tiff_value(probe_src *s, int big, const ILubyte *entry) {
+  uint32_t (*u16)(const ILubyte *) = big ? probe_be16 : probe_le16,
+           (*u32)(const ILubyte *) = big ? probe_be32 : probe_le32,
+           type = u16(entry + 2),
+           count = u32(entry + 4);
+  const ILubyte *p = entry + 8;
+
+  if (type != 3 && type != 4)
+    return 0;
+  /* values that don't fit in four bytes are stored elsewhere */
+  if (count * (type == 3 ? 2 : 4) > 4 && !(p = probe_at(s, u32(entry + 8), 4)))
+    return 0;
+  return type == 3 ? u16(p) : u32(p);
+}
+
+static int probe_tiff(probe_src *s, probe_info *info) {
+  const ILubyte *p = probe_at(s, 0, 8);
+  uint32_t (*u16)(const ILubyte *), (*u32)(const ILubyte *),
+           n, i;
+  ILubyte entry[12];
+  uint64_t ifd;
+  int big;
+
+  if (!p)
+    return 0;
+  if (!memcmp(p, "II*\0", 4))
+    big = 0;
+  else if (!memcmp(p, "MM\0*", 4))
+    big = 1;
+  else
+    return 0;
+  u16 = big ? probe_be16 : probe_le16;
+  u32 = big ? probe_be32 : probe_le32;
+
+  info->format = IL_TIF;
+  info->channels = 1;
+  info->bit_depth = 1;
+  info->frames = 0;
+
+  /* one directory per frame; the cap guards against loops */
+  for (ifd = u32(p + 4); ifd && info->frames < 65536; ifd = u32(p)) {
+    if (!(p = probe_at(s, ifd, 2)))
+      break;
+    n = u16(p);
+    info->frames++;
+
+    for (i = 0; info->frames == 1 && i < n; i++) {
+      if (!(p = probe_at(s, ifd + 2 + i * 12, 12)))
+        return 0;
+      /* reading a value may move the window */
+      memcpy(entry, p, 12);
+
+      switch (u16(entry)) {
+      case 256: info->width = probe_tiff_value(s, big, entry); break;
+      case 257: info->height = probe_tiff_value(s, big, entry); break;
+      case 258: info->bit_depth = probe_tiff_value(s, big, entry); break;
+      case 277: info->channels = probe_tiff_value(s, big, entry); break;
+      }
+    }
+
+    if (!(p = probe_at(s, ifd + 2 + (uint64_t) n * 12, 4)))
+      break;
+  }
+
+  return info->frames > 0;
+}
+
+/* TGA has no magic number, so this one goes last and checks the header */
+static int probe_tga(probe_src *s, probe_info *info) {
+  const ILubyte *p = probe_at(s, 0, 18);
+  int type;
+
+  if (!p || p[1] > 1)
+    return 0;
+  type = p[2] & ~8;     /* bit 3 is RLE */
+  if ((type != 1 && type != 2 && type != 3) || (p[2] & ~11) ||
+      (p[16] != 8 && p[16] != 15 && p[16] != 16 && p[16] != 24 && p[16] != 32) ||
+      (type == 1) != (p[1] == 1))
+    return 0;
+
+  info->format = IL_TGA;
+  info->width = probe_le16(p + 12);
+  info->height = probe_le16(p + 14);
+  if (type == 1) {
+    info->channels = 1;
+    info->bit_depth = p[16];
+  } else if (type == 3) {
+    info->channels = p[16] == 16 ? 2 : 1;
+    info->bit_depth = 8;
+  } else {
+    info->channels = p[16] == 32 || (p[16] == 16 && (p[17] & 15)) ? 4 : 3;
+    info->bit_depth = p[16] < 24 ? 5 : 8;
+  }
+
+  return info->width && info->height;
+}
+
+static int probe_image(probe_src *s, probe_info *info) {
+  static int (* const probes[])(probe_src *, probe_info *) = {
+    probe_png, probe_jpeg, probe_gif, probe_bmp, probe_dds, probe_tiff, probe_tga
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+    memset(info, 0, sizeof(*info));
+    info->depth = info->frames = 1;
+    if (probes[i](s, info))
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Find out the type and layout of an image from its headers alone,
+ * without loading it.  The argument is a path or, if it is a binary
+ * String, the image data; :data => true or false overrides the guess
+ * from the encoding.  Knows PNG (including APNG frame counts), JPEG,
+ * GIF, BMP, DDS, TIFF and TGA, and returns a Hash with :format (an IL
+ * type constant), :width, :height, :depth, :channels (as stored, so 1
+ * for palette images), :bit_depth (per channel or palette index) and
+ * :frames, or nil if the input isn't one of those.
+ *
+ * Aliases:
+ *   DevIL::IL::probe
+ *   DevIL::IL::Probe
+ *
+ * Examples:
+ *   info = DevIL::IL::probe "path/to/image.png"
+ *   too_big = info[:width] * info[:height] > 50_000_000 if info
+ *   info = DevIL::IL::probe header_bytes, data: true
+ *
+ */
+static VALUE il_probe(int argc, VALUE *argv, VALUE self) {
+  probe_src s;
+  probe_info info;
+  struct stat st;
+  VALUE input, hash, data = devil_data_opt(&argc, argv);
+  int ok, e;
+
+  rb_scan_args(argc, argv, "1", &input);
+  StringValue(input);
+  s.win_off = s.win_len = 0;
+  s.fd = -1;
+
+  if (devil_is_data(input, data)) {
+    s.data = (const ILubyte *) RSTRING_PTR(input);
+    s.len = RSTRING_LEN(input);
+  } else {
+    s.data = NULL;
+    if ((s.fd = open(StringValueCStr(input), O_RDONLY | O_CLOEXEC)) < 0 || fstat(s.fd, &st)) {
+      e = errno;
+      if (s.fd >= 0)
+        close(s.fd);
+      errno = e;
+      rb_sys_fail(RSTRING_PTR(input));
+    }
+    s.len = st.st_size;
+  }
+
+  ok = probe_image(&s, &info);
+  if (s.fd >= 0)
+    close(s.fd);
+  RB_GC_GUARD(input);
+
+  if (!ok)
+    return Qnil;
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("format")), INT2NUM(info.format));
+  rb_hash_aset(hash, ID2SYM(rb_intern("width")), UINT2NUM(info.width));
+  rb_hash_aset(hash, ID2SYM(rb_intern("height")), UINT2NUM(info.height));
+  rb_hash_aset(hash, ID2SYM(rb_intern("depth")), UINT2NUM(info.depth));
+  rb_hash_aset(hash, ID2SYM(rb_intern("channels")), UINT2NUM(info.channels));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bit_depth")), UINT2NUM(info.bit_depth));
+  rb_hash_aset(hash, ID2SYM(rb_intern("frames")), UINT2NUM(info.frames));
+  return hash;
+}
+
+/******************/
+/* batch pipeline */
+/******************/
+enum { FIT_CONTAIN, FIT_COVER, FIT_FILL };
+
+typedef struct {
+  const char *path;           /* NULL for in-memory input */
+  const void *data;
+  ILuint len;
+  void *out;
+  ILuint out_len;
+  const char *err;
+} batch_item;
+
+typedef struct {
+  batch_item *items;
+  long n;
+  VALUE inputs;
+  ILuint width, height;
+  ILenum in_type, out_type;
+  int fit;
+} batch_job;
+
+static const char *devil_error(const char *what) {
+  ILenum err = ilGetError();
+  return (err != IL_NO_ERROR) ? iluErrorString(err) : what;
+}
+
+/* scale the bound image for one item according to the fit mode */
+static ILboolean batch_scale(batch_job *job) {
+  ILuint sw = ilGetInteger(IL_IMAGE_WIDTH),
+         sh = ilGetInteger(IL_IMAGE_HEIGHT),
+         d = ilGetInteger(IL_IMAGE_DEPTH),
+         tw = job->width,
+         th = job->height;
+  double sx = (double) job->width / sw,
+         sy = (double) job->height / sh,
+         f;
+
+  if (job->fit != FIT_FILL) {
+    f = (job->fit == FIT_CONTAIN) ? (sx < sy ? sx : sy) : (sx > sy ? sx : sy);
+    tw = sw * f + 0.5;
+    th = sh * f + 0.5;
+    if (!tw) tw = 1;
+    if (!th) th = 1;
+  }
+
+  if ((tw != sw || th != sh) && !devil_scale(tw, th, d))
+    return IL_FALSE;
+
+  if (job->fit == FIT_COVER && (tw > job->width || th > job->height))
+    return iluCrop((tw - job->width) / 2, (th - job->height) / 2, 0,
+                   job->width, job->height, d);
+
+  return IL_TRUE;
+}
+
+/*
+ * The whole batch runs as a single worker job: one image name is
+ * generated and reused for every input, and the GVL stays released
+ * until the last item is encoded.
+ */
+static void *job_batch(void *ptr) {
+  batch_job *job = ptr;
+  batch_item *item;
+  ILuint name,
+         prev = ilGetInteger(IL_CUR_IMAGE);
+  ILboolean ok;
+  long i;
+
+  ilGenImages(1, &name);
+
+  for (i = 0; i < job->n; i++) {
+    item = &job->items[i];
+    ilBindImage(name);
+    while (ilGetError() != IL_NO_ERROR)
+      ;
+
+    ok = item->path ? ilLoad(job->in_type, item->path)
+                    : ilLoadL(job->in_type, item->data, item->len);
+    if (!ok) {
+      item->err = devil_error("could not load image");
+      continue;
+    }
+
+    if (!batch_scale(job)) {
+      item->err = devil_error("could not scale image");
+      continue;
+    }
+
+    if (!(item->out_len = save_encode(&save_scratch, job->out_type))) {
+      item->err = devil_error("could not encode image");
+      continue;
+    }
+
+    if (!(item->out = malloc(item->out_len))) {
+      item->out_len = 0;
+      item->err = strerror(ENOMEM);
+      continue;
+    }
+    memcpy(item->out, save_scratch.buf, item->out_len);
+  }
+
+  ilDeleteImages(1, &name);
+  ilBindImage(prev);
+  devil_bound = BIND_NONE;
+
+  return job;
+}
+
+static VALUE batch_run(VALUE ptr) {
+  batch_job *job = (batch_job*) ptr;
+  VALUE outputs = rb_ary_new2(job->n),
+        errors = rb_ary_new2(job->n);
+  batch_item *item;
+  long i;
+
+  devil_run(job_batch, job);
+
+  for (i = 0; i < job->n; i++) {
+    item = &job->items[i];
+    STATS_IN(item->len);
+    STATS_OUT(item->out_len);
+    if (item->err) {
+      rb_ary_push(outputs, Qnil);
+      rb_ary_push(errors, rb_str_new2(item->err));
+    } else {
+      rb_ary_push(outputs, rb_str_new(item->out, item->out_len));
+      rb_ary_push(errors, Qnil);
+    }
+  }
+
+  return rb_assoc_new(outputs, errors);
+}
+
+static VALUE batch_free(VALUE ptr) {
+  batch_job *job = (batch_job*) ptr;
+  long i;
+
+  for (i = 0; i < job->n; i++)
+    free(job->items[i].out);
+  xfree(job->items);
+
+  return Qnil;
+}
+
+static VALUE batch_opt(VALUE opts, const char *key, int required) {
+  VALUE val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+
+  if (required && NIL_P(val))
+    rb_raise(rb_eArgError, "missing keyword: %s", key);
+
+  return val;
+}
+
+/*
+ * Load, scale and encode many images in one call.  Each input is either
+ * a path or a binary String holding an encoded image; :data => true or
+ * false treats every input as one or the other regardless of encoding.
+ * The fit option selects how the image is brought to width x height:
+ *
+ *   :contain - keep the aspect ratio and fit inside the box (default)
+ *   :cover   - keep the aspect ratio, fill the box and crop the overflow
+ *   :fill    - stretch to exactly width x height
+ *
+ * The input type defaults to DevIL::IL::TYPE_UNKNOWN.  Scaling uses the
+ * current ILU filter.  Returns [outputs, errors]: for each input, either
+ * the encoded String and nil, or nil and an error message.  The currently
+ * bound image is left untouched.
+ *
+ * Examples:
+ *   thumbs, errors = DevIL::Batch.thumbnail(paths, :width => 128, :height => 128,
+ *                                            :format => DevIL::IL::JPG, :fit => :cover)
+ *
+ */
+static VALUE batch_thumbnail(int argc, VALUE *argv, VALUE self) {
+  VALUE inputs, opts, fit, type, data, str;
+  batch_job job;
+  long i;
+
+  rb_scan_args(argc, argv, "11", &inputs, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  job.width = NUM2UINT(batch_opt(opts, "width", 1));
+  job.height = NUM2UINT(batch_opt(opts, "height", 1));
+  job.out_type = NUM2UINT(batch_opt(opts, "format", 1));
+  type = batch_opt(opts, "type", 0);
+  job.in_type = NIL_P(type) ? IL_TYPE_UNKNOWN : NUM2UINT(type);
+  data = batch_opt(opts, "data", 0);
+  if (!job.width || !job.height)
+    rb_raise(rb_eArgError, "width and height must be positive");
+
+  fit = batch_opt(opts, "fit", 0);
+  if (NIL_P(fit) || SYM2ID(fit) == rb_intern("contain"))
+    job.fit = FIT_CONTAIN;
+  else if (SYM2ID(fit) == rb_intern("cover"))
+    job.fit = FIT_COVER;
+  else if (SYM2ID(fit) == rb_intern("fill"))
+    job.fit = FIT_FILL;
+  else
+    rb_raise(rb_eArgError, "unknown fit mode");
+
+  /* frozen private copies so the inputs can't change under the worker */
+  job.inputs = rb_ary_dup(rb_Array(inputs));
+  job.n = RARRAY_LEN(job.inputs);
+  for (i = 0; i < job.n; i++) {
+    str = rb_ary_entry(job.inputs, i);
+    StringValue(str);
+    rb_ary_store(job.inputs, i, rb_str_new_frozen(str));
+  }
+
+  job.items = ALLOC_N(batch_item, job.n);
+  MEMZERO(job.items, batch_item, job.n);
+  for (i = 0; i < job.n; i++) {
+    str = RARRAY_PTR(job.inputs)[i];
+    if (devil_is_data(str, data)) {
+      if ((unsigned long) RSTRING_LEN(str) > 0xffffffffUL) {
+        xfree(job.items);
+        rb_raise(rb_eRangeError, "input %ld is too large", i);
+      }
+      job.items[i].data = RSTRING_PTR(str);
+      job.items[i].len = RSTRING_LEN(str);
+    } else {
+      str = rb_str_new(RSTRING_PTR(str), RSTRING_LEN(str));
+      rb_ary_store(job.inputs, i, str);
+      job.items[i].path = RSTRING_PTR(str);
+    }
+  }
+
+  inputs = rb_ensure(batch_run, (VALUE) &job, batch_free, (VALUE) &job);
+  RB_GC_GUARD(job.inputs);
+
+  return inputs;
+}
+
+/********************/
+/* operation chains */
+/********************/
+
+/*
+ * An operation chain is an Array of [name, args...] steps naming the
+ * ILU (and a few IL) methods, e.g.
+ *
+ *   [[:scale, 640, 480, 1], [:contrast, 1.2], [:convert_image, DevIL::IL::RGB, DevIL::IL::UNSIGNED_BYTE]]
+ *
+ * Chains are parsed once into a flat native form which can be applied
+ * to the bound image from any thread that may call DevIL, and which is
+ * plain data, so it can be copied to another process or hashed.
+ */
+#define OP_MAX  64
+#define OP_ARGS 6
+
+enum {
+  OP_ALIENIFY, OP_BLUR, OP_BLUR_AVG, OP_BLUR_GAUSSIAN, OP_CONTRAST,
+  OP_CONVERT_IMAGE, OP_CROP, OP_EDGE_DETECT_E, OP_EDGE_DETECT_P,
+  OP_EDGE_DETECT_S, OP_EMBOSS, OP_ENLARGE_CANVAS, OP_ENLARGE_IMAGE,
+  OP_EQUALIZE, OP_FLIP_IMAGE, OP_GAMMA_CORRECT, OP_IMAGE_PARAMETER,
+  OP_INVERT_ALPHA, OP_MIRROR, OP_NEGATIVE, OP_NOISIFY, OP_PIXELIZE,
+  OP_REPLACE_COLOR, OP_RESAMPLE, OP_ROTATE, OP_ROTATE_3D, OP_SATURATE_1F,
+  OP_SATURATE_4F, OP_SCALE, OP_SCALE_COLORS, OP_SHARPEN, OP_SWAP_COLORS,
+  OP_WAVE
+};
+
+static const struct {
+  const char *name;
+  int argc;
+} op_table[] = {
+  { "alienify", 0 },       { "blur", 1 },           { "blur_avg", 1 },
+  { "blur_gaussian", 1 },  { "contrast", 1 },       { "convert_image", 2 },
+  { "crop", 6 },           { "edge_detect_e", 0 },  { "edge_detect_p", 0 },
+  { "edge_detect_s", 0 },  { "emboss", 0 },         { "enlarge_canvas", 3 },
+  { "enlarge_image", 3 },  { "equalize", 0 },       { "flip_image", 0 },
+  { "gamma_correct", 1 },  { "image_parameter", 2 },{ "invert_alpha", 0 },
+  { "mirror", 0 },         { "negative", 0 },       { "noisify", 1 },
+  { "pixelize", 1 },       { "replace_color", 4 },  { "resample", 3 },
+  { "rotate", 1 },         { "rotate_3d", 4 },      { "saturate_1f", 1 },
+  { "saturate_4f", 4 },    { "scale", 3 },          { "scale_colors", 3 },
+  { "sharpen", 2 },        { "swap_colors", 0 },    { "wave", 1 }
+};
+
+#define OP_COUNT ((int) (sizeof(op_table) / sizeof(op_table[0])))
+
+typedef struct {
+  int op;
+  double arg[OP_ARGS];
+} devil_op;
+
+/* parse a Ruby operation chain into ops; returns the number of steps */
+static int op_parse(VALUE chain, devil_op *ops) {
+  VALUE step, name;
+  const char *str;
+  long i, j;
+  int op;
+
+  if (NIL_P(chain))
+    return 0;
+
+  chain = rb_Array(chain);
+  if (RARRAY_LEN(chain) > OP_MAX)
+    rb_raise(rb_eArgError, "too many operations (max %d)", OP_MAX);
+
+  for (i = 0; i < RARRAY_LEN(chain); i++) {
+    step = rb_Array(rb_ary_entry(chain, i));
+    name = rb_ary_entry(step, 0);
+    str = SYMBOL_P(name) ? rb_id2name(SYM2ID(name)) : StringValueCStr(name);
+
+    for (op = 0; op < OP_COUNT; op++)
+      if (!strcmp(op_table[op].name, str))
+        break;
+    if (op == OP_COUNT)
+      rb_raise(rb_eArgError, "unknown operation: %s", str);
+    if (RARRAY_LEN(step) - 1 != op_table[op].argc)
+      rb_raise(rb_eArgError, "wrong number of arguments for %s (%ld for %d)",
+               str, RARRAY_LEN(step) - 1, op_table[op].argc);
+
+    memset(&ops[i], 0, sizeof(devil_op));
+    ops[i].op = op;
+    for (j = 0; j < op_table[op].argc; j++)
+      ops[i].arg[j] = NUM2DBL(rb_ary_entry(step, j + 1));
+  }
+
+  return RARRAY_LEN(chain);
+}
+
+/* apply one step to the bound image */
+static ILboolean op_apply(const devil_op *op) {
+  const double *a = op->arg;
+
+  switch (op->op) {
+  case OP_ALIENIFY:        return iluAlienify();
+  case OP_BLUR:            return devil_blur(a[0]);
+  case OP_BLUR_AVG:        return iluBlurAvg(a[0]);
+  case OP_BLUR_GAUSSIAN:   return iluBlurGaussian(a[0]);
+  case OP_CONTRAST:        return iluContrast(a[0]);
+  case OP_CONVERT_IMAGE:   return devil_convert(a[0], a[1]);
+  case OP_CROP:            return iluCrop(a[0], a[1], a[2], a[3], a[4], a[5]);
+  case OP_EDGE_DETECT_E:   return iluEdgeDetectE();
+  case OP_EDGE_DETECT_P:   return iluEdgeDetectP();
+  case OP_EDGE_DETECT_S:   return iluEdgeDetectS();
+  case OP_EMBOSS:          return iluEmboss();
+  case OP_ENLARGE_CANVAS:  return iluEnlargeCanvas(a[0], a[1], a[2]);
+  case OP_ENLARGE_IMAGE:   return iluEnlargeImage(a[0], a[1], a[2]);
+  case OP_EQUALIZE:        return iluEqualize();
+  case OP_FLIP_IMAGE:      return iluFlipImage();
+  case OP_GAMMA_CORRECT:   return iluGammaCorrect(a[0]);
+  case OP_IMAGE_PARAMETER: iluImageParameter(a[0], a[1]); return IL_TRUE;
+  case OP_INVERT_ALPHA:    return iluInvertAlpha();
+  case OP_MIRROR:          return iluMirror();
+  case OP_NEGATIVE:        return iluNegative();
+  case OP_NOISIFY:         return iluNoisify(a[0]);
+  case OP_PIXELIZE:        return iluPixelize(a[0]);
+  case OP_REPLACE_COLOR:   return iluReplaceColour(a[0], a[1], a[2], a[3]);
+  case OP_RESAMPLE:        return devil_resample(a[0], a[1], a[2]);
+  case OP_ROTATE:          return iluRotate(a[0]);
+  case OP_ROTATE_3D:       return iluRotate3D(a[0], a[1], a[2], a[3]);
+  case OP_SATURATE_1F:     return iluSaturate1f(a[0]);
+  case OP_SATURATE_4F:     return iluSaturate4f(a[0], a[1], a[2], a[3]);
+  case OP_SCALE:           return devil_scale(a[0], a[1], a[2]);
+  case OP_SCALE_COLORS:    return iluScaleColours(a[0], a[1], a[2]);
+  case OP_SHARPEN:         return iluSharpen(a[0], a[1]);
+  case OP_SWAP_COLORS:     return iluSwapColours();
+  case OP_WAVE:            return iluWave(a[0]);
+  }
+
+  return IL_FALSE;
+}
+
+/*
+ * Point operation fusion.  Each per-pixel ILU call makes its own pass
+ * over the image.  A run of them on an unsigned byte image is instead
+ * applied to a 256 pixel ramp of the same format, which gives a lookup
+ * table per channel for the whole run, and the tables are applied in
+ * one (parallel) pass.  Running the real ILU calls on the ramp keeps
+ * the result exactly what they would give on the image, whatever their
+ * arithmetic.  Only ops where each output value depends on nothing but
+ * the same channel's input value qualify; saturation mixes channels
+ * and runs as its own step.
+ */
+#define FUSE_CHUNK 65536        /* pixels per par_for index */
+
+typedef struct {
+  ILubyte lut[4][256],
+          *data;
+  long len;                     /* pixels */
+  int channels;
+} fuse_job;
+
+static int op_pointwise(int op) {
+  switch (op) {
+  case OP_CONTRAST:
+  case OP_GAMMA_CORRECT:
+  case OP_INVERT_ALPHA:
+  case OP_NEGATIVE:
+  case OP_SCALE_COLORS:
+    return 1;
+  }
+
+  return 0;
+}
+
+static void fuse_chunk(void *arg, long i) {
+  fuse_job *job = arg;
+  ILubyte *p = job->data + i * FUSE_CHUNK * job->channels;
+  long n = job->len - i * FUSE_CHUNK, k;
+
+  if (n > FUSE_CHUNK)
+    n = FUSE_CHUNK;
+
+  switch (job->channels) {
+  case 1:
+    for (k = 0; k < n; k++)
+      p[k] = job->lut[0][p[k]];
+    break;
+  case 2:
+    for (k = 0; k < n; k++, p += 2) {
+      p[0] = job->lut[0][p[0]];
+      p[1] = job->lut[1][p[1]];
+    }
+    break;
+  case 3:
+    for (k = 0; k < n; k++, p += 3) {
+      p[0] = job->lut[0][p[0]];
+      p[1] = job->lut[1][p[1]];
+      p[2] = job->lut[2][p[2]];
+    }
+    break;
+  case 4:
+    for (k = 0; k < n; k++, p += 4) {
+      p[0] = job->lut[0][p[0]];
+      p[1] = job->lut[1][p[1]];
+      p[2] = job->lut[2][p[2]];
+      p[3] = job->lut[3][p[3]];
+    }
+    break;
+  }
+}
+
+/* apply a run of point ops to the bound image in one pass; 0 if it can't be */
+static int op_fuse(const devil_op *ops, int n) {
+  ILuint cur = ilGetInteger(IL_CUR_IMAGE),
+         ramp;
+  ILint format = ilGetInteger(IL_IMAGE_FORMAT),
+        channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  ILubyte values[256 * 4], *data;
+  fuse_job job;
+  int ok, i, c;
+
+  if (ilGetInteger(IL_IMAGE_TYPE) != IL_UNSIGNED_BYTE || format == IL_COLOUR_INDEX ||
+      channels < 1 || channels > 4)
+    return 0;
+#ifdef IL_ACTIVE_MIPMAP
+  /* rebinding below would lose the active sub-image */
+  if (ilGetInteger(IL_ACTIVE_IMAGE) || ilGetInteger(IL_ACTIVE_MIPMAP) ||
+      ilGetInteger(IL_ACTIVE_LAYER))
+    return 0;
+#endif
+
+  for (i = 0; i < 256 * channels; i++)
+    values[i] = i / channels;
+
+  ilGenImages(1, &ramp);
+  ilBindImage(ramp);
+  ok = ilTexImage(256, 1, 1, channels, format, IL_UNSIGNED_BYTE, values);
+  for (i = 0; ok && i < n; i++)
+    ok = op_apply(&ops[i]);
+  ok = ok && ilGetInteger(IL_IMAGE_WIDTH) == 256 && ilGetInteger(IL_IMAGE_HEIGHT) == 1 &&
+       ilGetInteger(IL_IMAGE_FORMAT) == format && ilGetInteger(IL_IMAGE_CHANNELS) == channels &&
+       ilGetInteger(IL_IMAGE_TYPE) == IL_UNSIGNED_BYTE && (data = ilGetData());
+  if (ok)
+    for (i = 0; i < 256; i++)
+      for (c = 0; c < channels; c++)
+        job.lut[c][i] = data[i * channels + c];
+  ilDeleteImages(1, &ramp);
+  ilBindImage(cur);
+
+  if (!ok) {
+    /* the ops run one by one instead, and report their own errors */
+    while (ilGetError() != IL_NO_ERROR)
+      ;
+    return 0;
+  }
+
+  job.data = ilGetData();
+  job.channels = channels;
+  job.len = ilGetInteger(IL_IMAGE_SIZE_OF_DATA) / channels;
+  par_for((job.len + FUSE_CHUNK - 1) / FUSE_CHUNK, fuse_chunk, &job);
+
+  return 1;
+}
+
+/*
+ * Apply a parsed chain, fusing runs of point ops; returns the index of
+ * the failing step or -1.
+ */
+static int op_apply_chain(const devil_op *ops, int n) {
+  int i, j;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i; j < n && op_pointwise(ops[j].op); j++)
+      ;
+    if (j - i > 1 && op_fuse(ops + i, j - i))
+      continue;
+
+    if (j == i)
+      j++;
+    for (; i < j; i++)
+      if (!op_apply(&ops[i]))
+        return i;
+  }
+
+  return -1;
+}
+
+/****************/
+/* process pool */
+/****************/
+
+/*
+ * DevIL works on one global bound image, so a single process can only
+ * ever decode one image at a time.  DevIL::Pool forks worker processes,
+ * each with its own ilInit/iluInit and image, and hands them jobs over
+ * a SOCK_SEQPACKET socket.  Job inputs given as data and all outputs
+ * travel through shared memory: the sender fills a memfd and passes
+ * the descriptor along with the message, and the receiver maps it, so
+ * the socket only ever carries the small fixed-size headers below.
+ *
+ * Workers never return to Ruby; they run pool_serve until their socket
+ * is closed.  A worker that dies (say, crashing on a corrupt file) only
+ * fails the job it was running and is respawned.
+ */
+enum { POOL_LOAD, POOL_SAVE };
+
+typedef struct {
+  int kind;
+  ILenum type;                /* output type for POOL_SAVE */
+  int nops;
+  uint64_t len;               /* size of the data fd, 0 for a path */
+  devil_op ops[OP_MAX];
+  char path[PATH_MAX];
+} pool_req;
+
+typedef struct {
+  int ok;
+  ILuint width, height, depth, format, type;
+  uint64_t len;
+  char err[128];
+} pool_rep;
+
+typedef struct {
+  pid_t pid;
+  int fd,
+      busy;
+} pool_worker;
+
+typedef struct {
+  pool_worker *workers;
+  int n,
+      closed;
+  pid_t owner;
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+} devil_pool;
+
+typedef struct {
+  pool_req req;
+  pool_rep rep;
+  const char *data;           /* input bytes, NULL for a path */
+  int out;                    /* output memfd from the worker */
+} pool_item;
+
+/* an anonymous shared memory file of len bytes */
+static int pool_shm(uint64_t len) {
+  int fd, e;
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create("devil", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/devil-XXXXXX";
+  if ((fd = mkstemp(path)) >= 0)
+    unlink(path);
+#endif
+
+  if (fd >= 0 && ftruncate(fd, len) < 0) {
+    e = errno;
+    close(fd);
+    errno = e;
+    fd = -1;
+  }
+
+  return fd;
+}
+
+static int pool_send(int sock, const void *msg, size_t len, int fd) {
+  struct msghdr mh;
+  struct iovec iov;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cm;
+  struct cmsghdr *c;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = (void*) msg;
+  iov.iov_len = len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+
+  if (fd >= 0) {
+    memset(&cm, 0, sizeof(cm));
+    mh.msg_control = cm.buf;
+    mh.msg_controllen = sizeof(cm.buf);
+    c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+
+  return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t) len;
+}
+
+/* receive one message and the descriptor sent with it (-1 if none) */
+static int pool_recv(int sock, void *msg, size_t len, int *fd) {
+  struct msghdr mh;
+  struct iovec iov;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cm;
+  struct cmsghdr *c;
+  ssize_t got;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = msg;
+  iov.iov_len = len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cm.buf;
+  mh.msg_controllen = sizeof(cm.buf);
+
+  *fd = -1;
+  do {
+    got = recvmsg(sock, &mh, 0);
+  } while (got < 0 && errno == EINTR);
+
+  for (c = CMSG_FIRSTHDR(&mh); got > 0 && c; c = CMSG_NXTHDR(&mh, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(c), sizeof(int));
+
+  if (got != (ssize_t) len) {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+    return 0;
+  }
+
+  return 1;
+}
+
+static void pool_fail(pool_rep *rep, const char *what) {
+  rep->ok = 0;
+  strncpy(rep->err, devil_error(what), sizeof(rep->err) - 1);
+}
+
+/* run one job on the worker's image; returns the output memfd or -1 */
+static int pool_job(pool_req *req, int in, pool_rep *rep) {
+  ILboolean ok;
+  void *map;
+  int out, step;
+
+  memset(rep, 0, sizeof(pool_rep));
+  while (ilGetError() != IL_NO_ERROR)
+    ;
+
+  if (in >= 0) {
+    map = mmap(NULL, req->len, PROT_READ, MAP_SHARED, in, 0);
+    ok = (map != MAP_FAILED) && ilLoadL(IL_TYPE_UNKNOWN, map, req->len);
+    if (map != MAP_FAILED)
+      munmap(map, req->len);
+  } else {
+    ok = ilLoad(IL_TYPE_UNKNOWN, req->path);
+  }
+
+  if (!ok) {
+    pool_fail(rep, "could not load image");
+    return -1;
+  }
+
+  if ((step = op_apply_chain(req->ops, req->nops)) >= 0) {
+    snprintf(rep->err, sizeof(rep->err), "%s: %s", op_table[req->ops[step].op].name,
+             devil_error("operation failed"));
+    return -1;
+  }
+
+  rep->width = ilGetInteger(IL_IMAGE_WIDTH);
+  rep->height = ilGetInteger(IL_IMAGE_HEIGHT);
+  rep->depth = ilGetInteger(IL_IMAGE_DEPTH);
+  rep->format = ilGetInteger(IL_IMAGE_FORMAT);
+  rep->type = ilGetInteger(IL_IMAGE_TYPE);
+  rep->len = (req->kind == POOL_SAVE) ? save_encode(&save_scratch, req->type)
+                                      : (ILuint) ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
+  if (!rep->len) {
+    pool_fail(rep, "could not encode image");
+    return -1;
+  }
+
+  if ((out = pool_shm(rep->len)) < 0 ||
+      (map = mmap(NULL, rep->len, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0)) == MAP_FAILED) {
+    if (out >= 0)
+      close(out);
+    strcpy(rep->err, strerror(errno));
+    return -1;
+  }
+
+  memcpy(map, req->kind == POOL_SAVE ? save_scratch.buf : ilGetData(), rep->len);
+  munmap(map, rep->len);
+
+  rep->ok = 1;
+  return out;
+}
+
+/* close every inherited descriptor but the worker's socket */
+static void pool_close_fds(int keep) {
+  DIR *dir;
+  struct dirent *ent;
+  int fd, max;
+
+  if ((dir = opendir("/proc/self/fd"))) {
+    while ((ent = readdir(dir)))
+      if ((fd = atoi(ent->d_name)) > 2 && fd != keep && fd != dirfd(dir))
+        close(fd);
+    closedir(dir);
+    return;
+  }
+
+  max = sysconf(_SC_OPEN_MAX);
+  if (max < 0 || max > 65536)
+    max = 65536;
+  for (fd = 3; fd < max; fd++)
+    if (fd != keep)
+      close(fd);
+}
+
+/* worker process main loop */
+static void pool_serve(int sock) {
+  static pool_req req;
+  pool_rep rep;
+  sigset_t set;
+  ILuint name;
+  int in, out;
+
+  /* the parent's (ruby's) handlers are meaningless here */
+  signal(SIGINT, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGSEGV, SIG_DFL);
+  signal(SIGBUS, SIG_DFL);
+  sigemptyset(&set);
+  pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+  pool_close_fds(sock);
+
+  ilInit();
+  iluInit();
+  ilGenImages(1, &name);
+  devil_bound = BIND_NONE;
+
+  while (pool_recv(sock, &req, sizeof(req), &in)) {
+    devil_select(name);
+    out = pool_job(&req, in, &rep);
+    if (in >= 0)
+      close(in);
+    if (!pool_send(sock, &rep, sizeof(rep), out))
+      break;
+    if (out >= 0)
+      close(out);
+  }
+
+  _exit(0);
+}
+
+static int pool_spawn(pool_worker *w) {
+  int sv[2];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+    return 0;
+
+  if ((pid = fork()) < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+  }
+
+  if (!pid)
+    pool_serve(sv[1]);
+
+  close(sv[1]);
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  w->pid = pid;
+  w->fd = sv[0];
+
+  return 1;
 }
 
-static VALUE il_convert_im(VALUE self, VALUE dest_fmt, VALUE dest_type) {
-  return ilConvertImage(NUM2INT(dest_fmt), NUM2INT(dest_type)) ? Qtrue : Qfalse;
+static void pool_reap(pool_worker *w) {
+  if (w->fd >= 0)
+    close(w->fd);
+  if (w->pid > 0)
+    waitpid(w->pid, NULL, 0);
+  w->fd = -1;
+  w->pid = 0;
 }
 
-static VALUE il_convert_pal(VALUE self, VALUE dest_fmt) {
-  return ilConvertPal(NUM2INT(dest_fmt)) ? Qtrue : Qfalse;
-}
+static void pool_free(void *ptr) {
+  devil_pool *pool = ptr;
+  int i;
 
-static VALUE il_copy_im(VALUE self, VALUE src) {
-  return ilCopyImage(NUM2INT(src)) ? Qtrue : Qfalse;
+  if (!pool->closed && pool->owner == getpid())
+    for (i = 0; i < pool->n; i++)
+      pool_reap(&pool->workers[i]);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->idle);
+  xfree(pool->workers);
+  xfree(pool);
 }
 
-static VALUE il_copy_pixels(VALUE self, VALUE xo, VALUE yo, VALUE zo, VALUE w, VALUE h, VALUE d, VALUE fmt, VALUE type, VALUE data) {
-  return INT2FIX(ilCopyPixels(NUM2INT(xo), NUM2INT(yo), NUM2INT(zo), NUM2INT(w), NUM2INT(h), NUM2INT(d), NUM2INT(fmt), NUM2INT(type), RSTRING(data)->ptr));
+static size_t pool_memsize(const void *ptr) {
+  const devil_pool *pool = ptr;
+  return sizeof(devil_pool) + pool->n * sizeof(pool_worker);
 }
 
-static VALUE il_create_sub_im(VALUE self, VALUE type, VALUE num) {
-  return INT2FIX(ilCreateSubImage(NUM2INT(type), NUM2INT(num)));
+static const rb_data_type_t pool_type = {
+  "DevIL::Pool",
+  { NULL, pool_free, pool_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE pool_alloc(VALUE klass) {
+  devil_pool *pool;
+  VALUE obj = TypedData_Make_Struct(klass, devil_pool, &pool_type, pool);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->closed = 1;
+
+  return obj;
 }
 
-static VALUE il_default_im(VALUE self) {
-  return ilDefaultImage() ? Qtrue : Qfalse;
+static devil_pool *pool_get(VALUE self) {
+  devil_pool *pool;
+
+  TypedData_Get_Struct(self, devil_pool, &pool_type, pool);
+  if (pool->closed)
+    rb_raise(rb_eIOError, "closed pool");
+  if (pool->owner != getpid())
+    rb_raise(rb_eRuntimeError, "pool belongs to process %d", (int) pool->owner);
+
+  return pool;
 }
 
-static VALUE il_delete_ims(int argc, VALUE *argv, VALUE self) {
-  ILuint *ims;
+/*
+ * Start a pool of worker processes, one per CPU by default.
+ *
+ * Examples:
+ *   pool = DevIL::Pool.new(:workers => 8)
+ *
+ */
+static VALUE pool_init(int argc, VALUE *argv, VALUE self) {
+  devil_pool *pool;
+  VALUE opt;
+  long n;
   int i;
 
-  if (!argc)
-    return;
-  if ((ims = malloc(sizeof(ILuint) * argc)) == NULL)
-    return;
-
-  for (i = 0; i < argc; i++)
-    ims[i] = NUM2INT(argv[i]);
+  TypedData_Get_Struct(self, devil_pool, &pool_type, pool);
+  if (pool->workers)
+    rb_raise(rb_eRuntimeError, "pool already initialized");
+
+  rb_scan_args(argc, argv, "01", &opt);
+  if (RB_TYPE_P(opt, T_HASH))
+    opt = rb_hash_aref(opt, ID2SYM(rb_intern("workers")));
+  n = NIL_P(opt) ? sysconf(_SC_NPROCESSORS_ONLN) : NUM2LONG(opt);
+  if (n < 1 || n > 1024)
+    rb_raise(rb_eArgError, "invalid number of workers: %ld", n);
+
+  /* the workers start from a copy of DevIL's state; let it settle */
+  devil_sync();
+  pool->workers = ALLOC_N(pool_worker, n);
+  pool->owner = getpid();
+  for (i = 0; i < n; i++) {
+    pool->workers[i].busy = 0;
+    if (!pool_spawn(&pool->workers[i])) {
+      while (--i >= 0)
+        pool_reap(&pool->workers[i]);
+      rb_sys_fail("DevIL::Pool worker");
+    }
+  }
+  pool->n = n;
+  pool->closed = 0;
 
-  ilDeleteImages(argc, ims);
-  free(ims);
+  return self;
 }
 
-static VALUE il_disable(VALUE self, VALUE num) {
-  return ilDisable(NUM2INT(num)) ? Qtrue : Qfalse;
-}
+/*
+ * Hand an item to a worker; the input data goes through a memfd.
+ * Returns 1 if sent, 0 if the worker is gone, or -1 (with errno set)
+ * if the memfd could not be set up here.
+ */
+static int pool_start(pool_worker *w, pool_item *item) {
+  void *map;
+  int in = -1,
+      ok, e;
+
+  if (item->data) {
+    if ((in = pool_shm(item->req.len)) < 0)
+      return -1;
+    map = mmap(NULL, item->req.len, PROT_READ | PROT_WRITE, MAP_SHARED, in, 0);
+    if (map == MAP_FAILED) {
+      e = errno;
+      close(in);
+      errno = e;
+      return -1;
+    }
+    memcpy(map, item->data, item->req.len);
+    munmap(map, item->req.len);
+  }
 
-static VALUE il_enable(VALUE self, VALUE num) {
-  return ilEnable(NUM2INT(num)) ? Qtrue : Qfalse;
+  ok = pool_send(w->fd, &item->req, sizeof(pool_req), in);
+  if (in >= 0)
+    close(in);
+
+  return ok;
 }
 
-static VALUE il_format_func(VALUE self, VALUE num) {
-  return ilFormatFunc(NUM2INT(num)) ? Qtrue : Qfalse;
+static void pool_died(pool_worker *w, pool_item *item) {
+  item->rep.ok = 0;
+  strcpy(item->rep.err, "worker process died");
+  pool_reap(w);
 }
 
-static VALUE il_gen_ims(int argc, VALUE *argv, VALUE self) {
-  ILuint *ims;
-  int i;
+typedef struct {
+  devil_pool *pool;
+  pool_item *items;
+  long n;
+  int wake[2],                /* self-pipe written on interrupt */
+      interrupted;
+} pool_exec_arg;
 
-  if (!argc)
-    return;
-  if ((ims = malloc(sizeof(ILuint) * argc)) == NULL)
-    return;
+/*
+ * Unblocking function for pool_exec: Thread#raise, Timeout and Ctrl-C
+ * land here.  Wakes the wait for a free worker and the poll.
+ */
+static void pool_exec_unblock(void *ptr) {
+  pool_exec_arg *arg = ptr;
+  char c = 0;
+  ssize_t n;
 
-  for (i = 0; i < argc; i++)
-    ims[i] = NUM2INT(argv[i]);
+  pthread_mutex_lock(&arg->pool->lock);
+  __atomic_store_n(&arg->interrupted, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&arg->pool->idle);
+  pthread_mutex_unlock(&arg->pool->lock);
 
-  ilGenImages(argc, ims);
-  free(ims);
+  n = write(arg->wake[1], &c, 1);
+  UNUSED(n);
 }
 
-static VALUE il_get_alpha(VALUE self, VALUE type) {
-  int t = NUM2INT(type); 
-  VALUE ret = Qnil;
-  ILubyte *a_ret;
+/* stop a worker in the middle of a job; it is respawned when next needed */
+static void pool_kill(pool_worker *w, pool_item *item) {
+  item->rep.ok = 0;
+  strcpy(item->rep.err, "interrupted");
+  if (w->pid > 0)
+    kill(w->pid, SIGKILL);
+  pool_reap(w);
+}
 
-  a_ret = ilGetAlpha(t);
-  switch (t) {
-    case IL_BYTE:
-    case IL_UNSIGNED_BYTE:
-    case IL_SHORT:
-    case IL_UNSIGNED_SHORT:
-    case IL_INT:
-    case IL_UNSIGNED_INT:
-      /* is this correct? */
-      ret = NUM2INT(*a_ret);
-      break;
-    case IL_FLOAT:
-    case IL_DOUBLE:
-      ret = rb_float_new(*a_ret);
+/*
+ * Run items on every worker that is free, keeping each one busy until
+ * all items are done or the call is interrupted.  Called without the
+ * GVL.
+ */
+static void *pool_exec(void *ptr) {
+  pool_exec_arg *arg = ptr;
+  devil_pool *pool = arg->pool;
+  pool_worker **mine;
+  struct pollfd *pfd;
+  long *job,
+       next = 0,
+       done = 0;
+  int i, k, m = 0;
+
+  mine = malloc(pool->n * sizeof(pool_worker*));
+  job = malloc(pool->n * sizeof(long));
+  pfd = malloc((pool->n + 1) * sizeof(struct pollfd));
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->closed && !arg->interrupted) {
+    for (i = 0; i < pool->n && m < arg->n; i++)
+      if (!pool->workers[i].busy) {
+        pool->workers[i].busy = 1;
+        job[m] = -1;
+        mine[m++] = &pool->workers[i];
+      }
+    if (m)
       break;
-    default:
-      rb_raise(rb_eException, "Invalid type: %d.", t);
+    pthread_cond_wait(&pool->idle, &pool->lock);
   }
+  pthread_mutex_unlock(&pool->lock);
 
-  return ret;
-}
+  if (!m) {
+    for (; next < arg->n; next++)
+      strcpy(arg->items[next].rep.err, arg->interrupted ? "interrupted" : "closed pool");
+    done = arg->n;
+  }
 
-static VALUE il_get_bool(VALUE self, VALUE num) {
-  return ilGetBoolean(NUM2INT(num)) ? Qtrue : Qfalse;
-}
+  while (done < arg->n && !__atomic_load_n(&arg->interrupted, __ATOMIC_ACQUIRE)) {
+    for (i = 0; i < m && next < arg->n; i++) {
+      if (job[i] >= 0)
+        continue;
+      if (mine[i]->fd < 0 && !pool_spawn(mine[i])) {
+        strcpy(arg->items[next].rep.err, strerror(errno));
+        next++;
+        done++;
+        continue;
+      }
+      switch (pool_start(mine[i], &arg->items[next])) {
+      case 1:
+        job[i] = next++;
+        break;
+      case 0:
+        pool_died(mine[i], &arg->items[next++]);
+        done++;
+        break;
+      default:
+        /* our own failure; the worker is fine */
+        strcpy(arg->items[next++].rep.err, strerror(errno));
+        done++;
+      }
+    }
 
-static VALUE il_get_data(VALUE self) {
-  /* TODO: finish this function */
-  return Qnil;
-}
+    for (i = k = 0; i < m; i++)
+      if (job[i] >= 0) {
+        pfd[k].fd = mine[i]->fd;
+        pfd[k].events = POLLIN;
+        pfd[k++].revents = 0;
+      }
+    if (!k)
+      continue;
+    pfd[k].fd = arg->wake[0];
+    pfd[k].events = POLLIN;
+    pfd[k].revents = 0;
+    if (poll(pfd, k + 1, -1) < 0)
+      continue;
+
+    for (i = k = 0; i < m; i++) {
+      if (job[i] < 0)
+        continue;
+      if (pfd[k++].revents) {
+        pool_item *item = &arg->items[job[i]];
+        if (!pool_recv(mine[i]->fd, &item->rep, sizeof(pool_rep), &item->out))
+          pool_died(mine[i], item);
+        job[i] = -1;
+        done++;
+      }
+    }
+  }
 
-static VALUE il_get_dxtc_data(VALUE self, VALUE buf, VALUE fmt) {
-  return NUM2INT(ilGetDXTCData(RSTRING(buf)->ptr, RSTRING(buf)->len, NUM2INT(fmt)));
-}
+  /* interrupted: give up on whatever is still running or queued */
+  for (i = 0; i < m; i++)
+    if (job[i] >= 0)
+      pool_kill(mine[i], &arg->items[job[i]]);
+  for (; next < arg->n; next++)
+    strcpy(arg->items[next].rep.err, "interrupted");
 
-static VALUE il_get_err(VALUE self) {
-  return NUM2INT(ilGetError());
-}
+  pthread_mutex_lock(&pool->lock);
+  for (i = 0; i < m; i++)
+    mine[i]->busy = 0;
+  pthread_cond_broadcast(&pool->idle);
+  pthread_mutex_unlock(&pool->lock);
 
-static VALUE il_get_int(VALUE self, VALUE num) {
-  return NUM2INT(ilGetInteger(INT2FIX(num)));
-}
+  free(mine);
+  free(job);
+  free(pfd);
 
-static VALUE il_get_lump_pos(VALUE self) {
-  return NUM2INT(ilGetLumpPos());
+  return NULL;
 }
 
-static VALUE il_get_palette(VALUE self) {
-  /* TODO: finish this function */
-  return Qnil;
+typedef struct {
+  devil_pool *pool;
+  pool_item *items;
+  long n;
+  VALUE inputs,
+        type,
+        data,
+        keep;
+  devil_op *ops;
+  int kind,
+      nops;
+} pool_batch;
+
+/* fill in an item from a Ruby input (path or image data) and op chain */
+static void pool_item_init(pool_batch *b, long i, VALUE input, int kind, VALUE type, devil_op *ops, int nops) {
+  pool_item *item = &b->items[i];
+
+  input = rb_str_new_frozen(StringValue(input));
+  rb_ary_push(b->keep, input);
+
+  item->req.kind = kind;
+  item->req.type = NIL_P(type) ? 0 : NUM2UINT(type);
+  item->req.nops = nops;
+  MEMCPY(item->req.ops, ops, devil_op, nops);
+  item->out = -1;
+
+  if (devil_is_data(input, b->data)) {
+    item->data = RSTRING_PTR(input);
+    item->req.len = RSTRING_LEN(input);
+  } else {
+    if (RSTRING_LEN(input) >= PATH_MAX)
+      rb_raise(rb_eArgError, "path too long");
+    memcpy(item->req.path, RSTRING_PTR(input), RSTRING_LEN(input));
+  }
 }
 
-static VALUE il_get_string(VALUE self, VALUE num) {
-  return rb_str_new2(ilGetString(NUM2INT(num)));
+static VALUE pool_result(pool_item *item, int kind) {
+  VALUE data, hash;
+  void *map;
+
+  map = mmap(NULL, item->rep.len, PROT_READ, MAP_SHARED, item->out, 0);
+  if (map == MAP_FAILED)
+    rb_sys_fail("mmap");
+  data = rb_str_new(map, item->rep.len);
+  munmap(map, item->rep.len);
+
+  if (kind == POOL_SAVE)
+    return data;
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("width")), UINT2NUM(item->rep.width));
+  rb_hash_aset(hash, ID2SYM(rb_intern("height")), UINT2NUM(item->rep.height));
+  rb_hash_aset(hash, ID2SYM(rb_intern("depth")), UINT2NUM(item->rep.depth));
+  rb_hash_aset(hash, ID2SYM(rb_intern("format")), UINT2NUM(item->rep.format));
+  rb_hash_aset(hash, ID2SYM(rb_intern("type")), UINT2NUM(item->rep.type));
+  rb_hash_aset(hash, ID2SYM(rb_intern("data")), data);
+
+  return hash;
+}
+
+static VALUE pool_batch_run(VALUE ptr) {
+  pool_batch *b = (pool_batch*) ptr;
+  pool_exec_arg arg;
+  VALUE results = rb_ary_new2(b->n),
+        errors = rb_ary_new2(b->n);
+  long i;
+
+  for (i = 0; i < b->n; i++)
+    pool_item_init(b, i, rb_ary_entry(b->inputs, i), b->kind, b->type, b->ops, b->nops);
+
+  arg.pool = b->pool;
+  arg.items = b->items;
+  arg.n = b->n;
+  arg.interrupted = 0;
+  if (pipe2(arg.wake, O_CLOEXEC | O_NONBLOCK) < 0)
+    rb_sys_fail("pipe");
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(pool_exec, &arg, pool_exec_unblock, &arg);
+#else
+  pool_exec(&arg);
+#endif
+  close(arg.wake[0]);
+  close(arg.wake[1]);
+
+  /* raise whatever interrupted the wait; the ensure closes the outputs */
+  if (arg.interrupted)
+    rb_thread_check_ints();
+
+  for (i = 0; i < b->n; i++) {
+    STATS_IN(b->items[i].req.len);
+    if (b->items[i].rep.ok && b->items[i].out >= 0) {
+      STATS_OUT(b->items[i].rep.len);
+      rb_ary_push(results, pool_result(&b->items[i], b->items[i].req.kind));
+      rb_ary_push(errors, Qnil);
+    } else {
+      rb_ary_push(results, Qnil);
+      rb_ary_push(errors, rb_str_new2(b->items[i].rep.err[0] ? b->items[i].rep.err : "unknown error"));
+    }
+  }
+
+  return rb_assoc_new(results, errors);
 }
 
-static VALUE il_hint(VALUE self, VALUE target, VALUE mode) {
-  ilHint(NUM2INT(target), NUM2INT(mode));
+static VALUE pool_batch_free(VALUE ptr) {
+  pool_batch *b = (pool_batch*) ptr;
+  long i;
+
+  for (i = 0; i < b->n; i++)
+    if (b->items[i].out >= 0)
+      close(b->items[i].out);
+  xfree(b->items);
+
   return Qnil;
 }
 
-static VALUE il_is_disabled(VALUE self, VALUE mode) {
-  return ilIsDisabled(NUM2INT(mode)) ? Qtrue : Qfalse;
-}
+/* run inputs through the pool, returning [results, errors] */
+static VALUE pool_run(VALUE self, VALUE inputs, VALUE chain, int kind, VALUE type, VALUE data) {
+  devil_op ops[OP_MAX];
+  pool_batch b;
+  long i;
 
-static VALUE il_is_enabled(VALUE self, VALUE mode) {
-  return ilIsEnabled(NUM2INT(mode)) ? Qtrue : Qfalse;
-}
+  b.pool = pool_get(self);
+  b.nops = op_parse(chain, ops);
+  b.ops = ops;
+  b.kind = kind;
+  b.type = type;
+  b.data = data;
+  b.inputs = rb_Array(inputs);
+  b.n = RARRAY_LEN(b.inputs);
+  b.keep = rb_ary_new2(b.n);
 
-static VALUE il_is_im(VALUE self, VALUE im) {
-  return ilIsImage(NUM2INT(im)) ? Qtrue : Qfalse;
-}
+  /* items are filled in under the ensure, as a bad input raises */
+  b.items = ALLOC_N(pool_item, b.n);
+  MEMZERO(b.items, pool_item, b.n);
+  for (i = 0; i < b.n; i++)
+    b.items[i].out = -1;
 
-static VALUE il_is_valid(VALUE self, VALUE type, VALUE path) {
-  return ilIsValid(NUM2INT(type), RSTRING(path)->ptr) ? Qtrue : Qfalse;
-}
+  inputs = rb_ensure(pool_batch_run, (VALUE) &b, pool_batch_free, (VALUE) &b);
+  RB_GC_GUARD(b.inputs);
+  RB_GC_GUARD(b.keep);
 
-static VALUE il_is_valid_f(VALUE self, VALUE type, VALUE file) {
-  /* TODO: finish this method */
-  return Qnil;
+  return inputs;
 }
 
-static VALUE il_is_valid_l(VALUE self, VALUE type, VALUE buf) {
-  /* TODO: finish this method */
-  return ilIsValidL(NUM2INT(type), RSTRING(buf)->ptr, RSTRING(buf)->len) ? Qtrue : Qfalse;
-}
+static VALUE pool_one(VALUE self, VALUE input, VALUE chain, int kind, VALUE type, VALUE data) {
+  VALUE ret = pool_run(self, rb_ary_new3(1, input), chain, kind, type, data),
+        err = RARRAY_PTR(RARRAY_PTR(ret)[1])[0];
 
-static VALUE il_key_color(VALUE self, VALUE red, VALUE green, VALUE blue, VALUE alpha) {
-  ilKeyColor(NUM2DBL(red), NUM2DBL(green), NUM2DBL(blue), NUM2DBL(alpha));
-  return Qnil;
-}
+  if (!NIL_P(err))
+    rb_raise(rb_eRuntimeError, "%s", StringValueCStr(err));
 
-static VALUE il_load(VALUE self, VALUE type, VALUE path) {
-  return ilLoad(NUM2INT(type), RSTRING(path)->ptr) ? Qtrue : Qfalse;
+  return RARRAY_PTR(RARRAY_PTR(ret)[0])[0];
 }
 
-static VALUE il_load_f(VALUE self, VALUE type, VALUE path) {
-  /* TODO: finish this method */
-  return Qnil;
-}
+/*
+ * Decode an image (a path or a binary String of image data) on a worker,
+ * applying an optional operation chain.  Returns a Hash with :width,
+ * :height, :depth, :format, :type and the pixel :data.  Like the other
+ * pool calls it takes :data => true or false to say whether inputs are
+ * image data or paths, whatever their encoding.
+ *
+ * Examples:
+ *   pool.load('foo.jpg', [[:scale, 256, 256, 1]])[:data]
+ *   pool.load(bytes, data: true)
+ *
+ */
+static VALUE pool_load(int argc, VALUE *argv, VALUE self) {
+  VALUE input, chain, data = devil_data_opt(&argc, argv);
 
-static VALUE il_load_l(VALUE self, VALUE type, VALUE buf) {
-  return ilLoadL(NUM2INT(type), RSTRING(buf)->ptr, RSTRING(buf)->len) ? Qtrue : Qfalse;
+  rb_scan_args(argc, argv, "11", &input, &chain);
+  return pool_one(self, input, chain, POOL_LOAD, Qnil, data);
 }
 
-static VALUE il_load_im(VALUE self, VALUE path) {
-  return ilLoadImage(RSTRING(path)->ptr) ? Qtrue : Qfalse;
-}
+/*
+ * Decode an image on a worker, apply an optional operation chain and
+ * encode the result as type.  Returns the encoded String.
+ *
+ * Examples:
+ *   png = pool.save('foo.jpg', DevIL::IL::PNG, [[:mirror]])
+ *
+ */
+static VALUE pool_save(int argc, VALUE *argv, VALUE self) {
+  VALUE input, type, chain, data = devil_data_opt(&argc, argv);
 
-static VALUE il_load_pal(VALUE self, VALUE path) {
-  return ilLoadPal(RSTRING(path)->ptr) ? Qtrue : Qfalse;
+  rb_scan_args(argc, argv, "21", &input, &type, &chain);
+  return pool_one(self, input, chain, POOL_SAVE, type, data);
 }
 
-static VALUE il_origin_func(VALUE self, VALUE mode) {
-  return ilOriginFunc(NUM2INT(mode)) ? Qtrue : Qfalse;
+/*
+ * Run many inputs through the pool, spread over every free worker.
+ * With a type the results are encoded Strings as for save, otherwise
+ * pixel Hashes as for load.  Returns [results, errors], with either a
+ * result or an error message for each input.
+ *
+ * Examples:
+ *   pngs, errors = pool.map(paths, [[:scale, 128, 128, 1]], DevIL::IL::PNG)
+ *
+ */
+static VALUE pool_map(int argc, VALUE *argv, VALUE self) {
+  VALUE inputs, chain, type, data = devil_data_opt(&argc, argv);
+
+  rb_scan_args(argc, argv, "12", &inputs, &chain, &type);
+  return pool_run(self, inputs, chain, NIL_P(type) ? POOL_LOAD : POOL_SAVE, type, data);
 }
 
-static VALUE il_overlay_im(VALUE self, VALUE src, VALUE x, VALUE y, VALUE z) {
-  return ilOverlayImage(NUM2INT(src), NUM2INT(x), NUM2INT(y), NUM2INT(z)) ? Qtrue : Qfalse;
+static VALUE pool_size(VALUE self) {
+  return INT2FIX(pool_get(self)->n);
 }
 
-static VALUE il_pop_attrib(VALUE self) {
-  ilPopAttrib();
-  return Qnil;
+typedef struct {
+  devil_pool *pool;
+  int interrupted;
+} pool_close_arg;
+
+static void pool_close_unblock(void *ptr) {
+  pool_close_arg *arg = ptr;
+
+  pthread_mutex_lock(&arg->pool->lock);
+  arg->interrupted = 1;
+  pthread_cond_broadcast(&arg->pool->idle);
+  pthread_mutex_unlock(&arg->pool->lock);
 }
 
-static VALUE il_push_attrib(VALUE self, VALUE bits) {
-  ilPushAttrib(NUM2INT(bits));
-  return Qnil;
+static void *pool_wait_idle(void *ptr) {
+  pool_close_arg *arg = ptr;
+  devil_pool *pool = arg->pool;
+  int i, busy;
+
+  pthread_mutex_lock(&pool->lock);
+  do {
+    for (i = busy = 0; i < pool->n; i++)
+      busy |= pool->workers[i].busy;
+    if (busy && arg->interrupted) {
+      /* leave the pool open; close can be called again */
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    if (busy)
+      pthread_cond_wait(&pool->idle, &pool->lock);
+  } while (busy);
+  pool->closed = 1;
+  pthread_cond_broadcast(&pool->idle);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->n; i++)
+    pool_reap(&pool->workers[i]);
+
+  return NULL;
 }
 
-static VALUE il_register_format(VALUE self, VALUE fmt) {
-  ilRegisterFormat(NUM2INT(fmt));
+/*
+ * Wait for running jobs, then stop the worker processes.
+ */
+static VALUE pool_close(VALUE self) {
+  pool_close_arg arg;
+
+  TypedData_Get_Struct(self, devil_pool, &pool_type, arg.pool);
+  if (arg.pool->closed || arg.pool->owner != getpid())
+    return Qnil;
+
+  arg.interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(pool_wait_idle, &arg, pool_close_unblock, &arg);
+#else
+  pool_wait_idle(&arg);
+#endif
+  if (arg.interrupted)
+    rb_thread_check_ints();
+
   return Qnil;
 }
 
-static ILenum load_cb(const ILstring *str) {
-  char *ext;
-  VALUE proc;
-  static ID id = 0;
-  
-  if (!id)
-    id = rb_intern("Proc::call");
+/****************/
+/* output cache */
+/****************/
+
+/*
+ * DevIL::Cache keeps the encoded results of load -> operation chain ->
+ * save in a directory.  An entry is named after a SHA-256 of the output
+ * type, the parsed operation chain and the input bytes, and lives in a
+ * fan-out directory named after its first two hex digits.  Misses are
+ * encoded straight into a temporary file, which is renamed into place
+ * once complete.  Hits just map the file: they never reach the DevIL
+ * worker.
+ *
+ * An entry's mtime is its last use.  Once the directory grows past
+ * max_size, the least recently used entries are removed until it is
+ * back under 90% of max_size.  Several processes can share a
+ * directory; each keeps its own estimate of its size.
+ */
+#define CACHE_VERSION "DevIL::Cache 1"
+#define CACHE_KEY_LEN 64
+
+typedef struct {
+  char *dir;
+  uint64_t max,
+           used;
+  unsigned long hits,
+                misses;
+  int trimming;
+} devil_cache;
+
+typedef struct {
+  devil_cache *cache;
+  devil_op ops[OP_MAX];
+  int nops;
+  ILenum type;
+  const void *data;         /* the input: a mapped file or a frozen String */
+  size_t len;
+  int mapped,
+      fd;                   /* temporary file of a miss, or -1 */
+  VALUE keep;
+  char key[CACHE_KEY_LEN + 1],
+       path[PATH_MAX],
+       tmp[PATH_MAX];
+  void *out;                /* the entry, mapped */
+  size_t out_len;
+  const char *err;
+  int step;                 /* failing operation, or -1 */
+} cache_fetch_arg;
+
+typedef struct {
+  char name[CACHE_KEY_LEN + 2];
+  time_t mtime;
+  uint64_t size;
+} cache_entry;
+
+static void cache_free(void *ptr) {
+  devil_cache *cache = ptr;
+
+  xfree(cache->dir);
+  xfree(cache);
+}
+
+static const rb_data_type_t cache_type = {
+  "DevIL::Cache",
+  { NULL, cache_free, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE cache_alloc(VALUE klass) {
+  devil_cache *cache;
+  return TypedData_Make_Struct(klass, devil_cache, &cache_type, cache);
+}
+
+static devil_cache *cache_get(VALUE self) {
+  devil_cache *cache;
+
+  TypedData_Get_Struct(self, devil_cache, &cache_type, cache);
+  if (!cache->dir)
+    rb_raise(rb_eRuntimeError, "uninitialized cache");
+
+  return cache;
+}
+
+static void cache_put_u64(sha256_ctx *c, uint64_t v) {
+  unsigned char b[8];
+  int i;
 
-  if ((ext = get_ext((char*) str)) != NULL) {
-    if ((proc = rb_hash_get(load_procs, rb_str_new2(ext))) != Qnil) {
-      VALUE ary;
-      ary = rb_ary_new();
-      rb_ary_push(ary, rb_str_new2((char*) str));
-      return NUM2INT(rb_func_call(proc, id, 1, ary));
+  for (i = 0; i < 8; i++)
+    b[i] = v >> (i * 8);
+  sha256_update(c, b, 8);
+}
+
+/* the entry name: type, chain and input, in a fixed byte order */
+static void *cache_key(void *ptr) {
+  cache_fetch_arg *f = ptr;
+  unsigned char digest[32];
+  sha256_ctx c;
+  uint64_t bits;
+  int i, j;
+
+  sha256_init(&c);
+  sha256_update(&c, CACHE_VERSION, sizeof(CACHE_VERSION));
+  cache_put_u64(&c, f->type);
+  cache_put_u64(&c, f->nops);
+  for (i = 0; i < f->nops; i++) {
+    const char *name = op_table[f->ops[i].op].name;
+
+    sha256_update(&c, name, strlen(name) + 1);
+    for (j = 0; j < op_table[f->ops[i].op].argc; j++) {
+      memcpy(&bits, &f->ops[i].arg[j], sizeof(bits));
+      cache_put_u64(&c, bits);
     }
   }
+  cache_put_u64(&c, f->len);
+  sha256_update(&c, f->data, f->len);
+  sha256_final(&c, digest);
 
-  return 0;
+  for (i = 0; i < 32; i++)
+    sprintf(f->key + i * 2, "%02x", digest[i]);
+
+  return NULL;
 }
 
-static VALUE il_register_load(VALUE self, VALUE ext, VALUE proc) {
-  rb_hash_set(load_procs, ext, proc);
-  return ilRegisterLoad((ILstring) RSTRING(ext)->ptr, (IL_LOADPROC) load_cb) ? Qtrue : Qfalse;
+static int cache_entry_cmp(const void *a, const void *b) {
+  const cache_entry *x = a, *y = b;
+  return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
 }
 
-static VALUE il_register_mipnum(VALUE self, VALUE num) {
-  return ilRegisterMipnum(NUM2INT(num)) ? Qtrue : Qfalse;
+/*
+ * Total the entries, and remove the oldest ones while the total is over
+ * limit.  Leftover temporary files older than an hour go too.  Returns
+ * the new total.  Runs without the GVL.
+ */
+static uint64_t cache_scan(const char *dir, uint64_t limit) {
+  cache_entry *entries = NULL, *grown;
+  size_t n = 0, capa = 0, i;
+  uint64_t total = 0;
+  char path[PATH_MAX];
+  struct dirent *top, *ent;
+  struct stat st;
+  DIR *d, *sub;
+  time_t now = time(NULL);
+
+  if (!(d = opendir(dir)))
+    return 0;
+
+  while ((top = readdir(d))) {
+    if (strlen(top->d_name) != 2 || !isxdigit((unsigned char) top->d_name[0]) ||
+        !isxdigit((unsigned char) top->d_name[1]))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, top->d_name);
+    if (!(sub = opendir(path)))
+      continue;
+
+    while ((ent = readdir(sub))) {
+      if (ent->d_name[0] == '.' && strncmp(ent->d_name, ".tmp-", 5))
+        continue;
+      if (fstatat(dirfd(sub), ent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+        continue;
+      if (ent->d_name[0] == '.') {
+        if (now - st.st_mtime > 3600)
+          unlinkat(dirfd(sub), ent->d_name, 0);
+        continue;
+      }
+      if (strlen(ent->d_name) != CACHE_KEY_LEN - 2)
+        continue;
+
+      if (n == capa) {
+        capa = capa ? capa * 2 : 256;
+        if (!(grown = realloc(entries, capa * sizeof(cache_entry))))
+          break;
+        entries = grown;
+      }
+      snprintf(entries[n].name, sizeof(entries[n].name), "%s/%s", top->d_name, ent->d_name);
+      entries[n].mtime = st.st_mtime;
+      entries[n].size = st.st_size;
+      total += st.st_size;
+      n++;
+    }
+    closedir(sub);
+  }
+  closedir(d);
+
+  if (total > limit) {
+    qsort(entries, n, sizeof(cache_entry), cache_entry_cmp);
+    for (i = 0; i < n && total > limit; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+      if (!unlink(path) || errno == ENOENT)
+        total -= entries[i].size;
+    }
+  }
+
+  free(entries);
+  return total;
 }
 
-static VALUE il_register_num_ims(VALUE self, VALUE num) {
-  return ilRegisterNumImages(NUM2INT(num)) ? Qtrue : Qfalse;
+typedef struct {
+  devil_cache *cache;
+  uint64_t limit,
+           total;
+} cache_scan_arg;
+
+static void *cache_scan_nogvl(void *ptr) {
+  cache_scan_arg *a = ptr;
+  a->total = cache_scan(a->cache->dir, a->limit);
+  return NULL;
 }
 
-static VALUE il_register_origin(VALUE self, VALUE num) {
-  ilRegisterOrigin(NUM2INT(num));
-  return Qnil;
+static void cache_trim(devil_cache *cache, uint64_t limit) {
+  cache_scan_arg a;
+
+  if (cache->trimming)
+    return;
+
+  a.cache = cache;
+  a.limit = limit;
+  cache->trimming = 1;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(cache_scan_nogvl, &a, NULL, NULL);
+#else
+  cache_scan_nogvl(&a);
+#endif
+  cache->trimming = 0;
+  cache->used = a.total;
+}
+
+/* the result for a mapped entry; the mapping is handed over */
+static VALUE cache_result(void *map, size_t len) {
+  VALUE ret;
+
+#if defined(HAVE_RB_IO_BUFFER_NEW)
+  ret = rb_io_buffer_new(map, len, RB_IO_BUFFER_MAPPED | RB_IO_BUFFER_READONLY);
+#else
+  ret = rb_str_new(map, len);
+  munmap(map, len);
+#endif
+
+  return rb_obj_freeze(ret);
+}
+
+/* map the entry at f->path and mark it used; 0 on a miss */
+static void *cache_lookup(void *ptr) {
+  cache_fetch_arg *f = ptr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(f->path, O_RDONLY | O_CLOEXEC)) < 0)
+    return NULL;
+
+  map = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size > 0) {
+    futimens(fd, NULL);
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  f->out = map;
+  f->out_len = st.st_size;
+  return f;
+}
+
+/* on the DevIL worker: decode, run the chain and encode into f->fd */
+static void *job_cache_fill(void *ptr) {
+  cache_fetch_arg *f = ptr;
+  ILuint name,
+         prev = ilGetInteger(IL_CUR_IMAGE),
+         len = 0;
+  void *map;
+
+  ilGenImages(1, &name);
+  ilBindImage(name);
+  while (ilGetError() != IL_NO_ERROR)
+    ;
+
+  if (!ilLoadL(IL_TYPE_UNKNOWN, f->data, f->len))
+    f->err = devil_error("could not load image");
+  else if ((f->step = op_apply_chain(f->ops, f->nops)) >= 0)
+    f->err = devil_error("operation failed");
+  else if (!(len = save_encode(&save_scratch, f->type)))
+    f->err = devil_error("could not encode image");
+  else if (ftruncate(f->fd, len) ||
+           (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0)) == MAP_FAILED)
+    f->err = strerror(errno);
+  else {
+    memcpy(map, save_scratch.buf, len);
+    munmap(map, len);
+  }
+
+  if (f->err)
+    len = 0;
+  f->out_len = len;
+
+  ilDeleteImages(1, &name);
+  ilBindImage(prev);
+  devil_bound = BIND_NONE;
+
+  return f;
 }
 
-static VALUE il_register_pal(VALUE self, VALUE buf, VALUE type) {
-  ilRegisterPal(RSTRING(buf)->ptr, RSTRING(buf)->len, NUM2INT(type));
-  return Qnil;
+static void cache_nogvl(void *(*func)(void *), cache_fetch_arg *f) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(func, f, NULL, NULL);
+#else
+  func(f);
+#endif
 }
 
-static ILenum save_cb(const ILstring *str) {
-  char *ext;
-  VALUE proc;
-  static ID id = 0;
-  
-  if (!id)
-    id = rb_intern("Proc::call");
+static VALUE cache_key_run(VALUE ptr) {
+  cache_fetch_arg *f = (cache_fetch_arg *) ptr;
 
-  if ((ext = get_ext((char*) str)) != NULL) {
-    if ((proc = rb_hash_get(save_procs, rb_str_new2(ext))) != Qnil) {
-      VALUE ary;
-      ary = rb_ary_new();
-      rb_ary_push(ary, rb_str_new2((char*) str));
-      return NUM2INT(rb_func_call(proc, id, 1, ary));
-    }
+  cache_nogvl(cache_key, f);
+  return rb_str_new(f->key, CACHE_KEY_LEN);
+}
+
+static VALUE cache_fetch_run(VALUE ptr) {
+  cache_fetch_arg *f = (cache_fetch_arg *) ptr;
+  devil_cache *cache = f->cache;
+  const char *dir = cache->dir;
+  void *map;
+  VALUE ret;
+
+  cache_nogvl(cache_key, f);
+  snprintf(f->path, sizeof(f->path), "%s/%.2s/%s", dir, f->key, f->key + 2);
+
+  STATS_IN(f->len);
+  f->out = NULL;
+  cache_nogvl(cache_lookup, f);
+  if (f->out) {
+    cache->hits++;
+    STATS_OUT(f->out_len);
+    return cache_result(f->out, f->out_len);
+  }
+  cache->misses++;
+
+  snprintf(f->tmp, sizeof(f->tmp), "%s/%.2s", dir, f->key);
+  if (mkdir(f->tmp, 0777) && errno != EEXIST)
+    rb_sys_fail(f->tmp);
+  snprintf(f->tmp, sizeof(f->tmp), "%s/%.2s/.tmp-XXXXXX", dir, f->key);
+  if ((f->fd = mkstemp(f->tmp)) < 0) {
+    f->tmp[0] = 0;
+    rb_sys_fail(dir);
   }
 
-  return 0;
-}
+  devil_run(job_cache_fill, f);
+  if (f->err && f->step >= 0)
+    rb_raise(rb_eRuntimeError, "%s: %s", op_table[f->ops[f->step].op].name, f->err);
+  if (f->err)
+    rb_raise(rb_eRuntimeError, "%s", f->err);
+
+  if ((map = mmap(NULL, f->out_len, PROT_READ, MAP_SHARED, f->fd, 0)) == MAP_FAILED)
+    rb_sys_fail(f->tmp);
+  fchmod(f->fd, 0644);
+  if (rename(f->tmp, f->path)) {
+    munmap(map, f->out_len);
+    rb_sys_fail(f->path);
+  }
+  f->tmp[0] = 0;
 
-static VALUE il_register_save(VALUE self, VALUE ext, VALUE proc) {
-  rb_hash_set(save_procs, ext, proc);
-  return ilRegisterSave((ILstring) RSTRING(ext)->ptr, (IL_SAVEPROC) save_cb) ? Qtrue : Qfalse;
+  ret = cache_result(map, f->out_len);
+  STATS_OUT(f->out_len);
+  if ((cache->used += f->out_len) > cache->max)
+    cache_trim(cache, cache->max / 10 * 9);
+
+  return ret;
 }
 
-static VALUE il_register_type(VALUE self, VALUE num) {
-  ilRegisterType(NUM2INT(num));
+static VALUE cache_fetch_done(VALUE ptr) {
+  cache_fetch_arg *f = (cache_fetch_arg *) ptr;
+
+  if (f->fd >= 0)
+    close(f->fd);
+  if (f->tmp[0])
+    unlink(f->tmp);
+  if (f->mapped)
+    munmap((void *) f->data, f->len);
+  xfree(f);
+
   return Qnil;
 }
 
-static VALUE il_remove_load(VALUE self, VALUE ext) {
-  /* TODO: rb_hash_set(save_procs, ext, proc); */
-  return ilRemoveLoad((ILstring) RSTRING(ext)->ptr) ? Qtrue : Qfalse;
-}
+/* parse the arguments and get at the input, then run func */
+static VALUE cache_call(VALUE self, int argc, VALUE *argv, VALUE (*func)(VALUE)) {
+  cache_fetch_arg *f;
+  devil_cache *cache = cache_get(self);
+  VALUE input, type, chain, keep = Qnil,
+        is_data = devil_data_opt(&argc, argv);
+  const void *data = NULL;
+  struct stat st;
+  size_t len;
+  int fd, nops, mapped = 0;
+  devil_op ops[OP_MAX];
+
+  rb_scan_args(argc, argv, "21", &input, &type, &chain);
+  nops = op_parse(chain, ops);
+  StringValue(input);
+
+  if (devil_is_data(input, is_data)) {
+    keep = rb_str_new_frozen(input);
+    data = RSTRING_PTR(keep);
+    len = RSTRING_LEN(keep);
+  } else {
+    if ((fd = open(StringValueCStr(input), O_RDONLY | O_CLOEXEC)) < 0)
+      rb_sys_fail(RSTRING_PTR(input));
+    if (fstat(fd, &st)) {
+      close(fd);
+      rb_sys_fail(RSTRING_PTR(input));
+    }
+    len = st.st_size;
+    if (len && (data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      rb_sys_fail(RSTRING_PTR(input));
+    }
+    close(fd);
+    if (len) {
+      madvise((void *) data, len, MADV_SEQUENTIAL);
+      mapped = 1;
+    }
+  }
 
-static VALUE il_remove_save(VALUE self, VALUE ext) {
-  /* TODO: rb_hash_set(save_procs, ext, proc); */
-  return ilRemoveSave((ILstring) RSTRING(ext)->ptr) ? Qtrue : Qfalse;
+  f = ALLOC(cache_fetch_arg);
+  f->cache = cache;
+  memcpy(f->ops, ops, sizeof(ops));
+  f->nops = nops;
+  f->type = NUM2INT(type);
+  f->data = data;
+  f->len = len;
+  f->mapped = mapped;
+  f->fd = -1;
+  f->keep = keep;
+  f->tmp[0] = 0;
+  f->err = NULL;
+  f->step = -1;
+
+  if (len > UINT_MAX) {
+    cache_fetch_done((VALUE) f);
+    rb_raise(rb_eArgError, "input too large");
+  }
+
+  input = rb_ensure(func, (VALUE) f, cache_fetch_done, (VALUE) f);
+  RB_GC_GUARD(keep);
+
+  return input;
 }
 
-static VALUE il_reset_mem(VALUE self) {
-  ilResetMemory();
-  return Qnil;
+/*
+ * Open (creating it if needed) a cache in the directory dir, holding up
+ * to max_size bytes of entries (1 GB by default).
+ *
+ * Examples:
+ *   cache = DevIL::Cache.new('/var/cache/thumbs', :max_size => 10 << 30)
+ *
+ */
+static VALUE cache_init(int argc, VALUE *argv, VALUE self) {
+  devil_cache *cache;
+  VALUE dir, opt;
+
+  TypedData_Get_Struct(self, devil_cache, &cache_type, cache);
+  if (cache->dir)
+    rb_raise(rb_eRuntimeError, "cache already initialized");
+
+  rb_scan_args(argc, argv, "11", &dir, &opt);
+  if (RB_TYPE_P(opt, T_HASH))
+    opt = rb_hash_aref(opt, ID2SYM(rb_intern("max_size")));
+  cache->max = NIL_P(opt) ? (uint64_t) 1 << 30 : NUM2ULL(opt);
+
+  FilePathValue(dir);
+  if (RSTRING_LEN(dir) > PATH_MAX - CACHE_KEY_LEN - 16)
+    rb_raise(rb_eArgError, "cache directory name too long");
+  if (mkdir(StringValueCStr(dir), 0777) && errno != EEXIST)
+    rb_sys_fail(RSTRING_PTR(dir));
+
+  cache->dir = ALLOC_N(char, RSTRING_LEN(dir) + 1);
+  memcpy(cache->dir, RSTRING_PTR(dir), RSTRING_LEN(dir) + 1);
+  cache_trim(cache, cache->max);
+
+  return self;
 }
 
-static VALUE il_reset_read(VALUE self) {
-  ilResetRead();
-  return Qnil;
+/*
+ * Load input (a path or, if it is a binary String or :data => true is
+ * given, image data), apply the operation chain and encode the result
+ * as type, or fetch the result of doing so earlier.  Returns the encoded image as a frozen
+ * IO::Buffer mapping the cache entry (a String on rubies without
+ * IO::Buffer).
+ *
+ * Examples:
+ *   png = cache.fetch('foo.jpg', DevIL::IL::PNG, [[:scale, 256, 256, 1]])
+ *
+ */
+static VALUE cache_fetch(int argc, VALUE *argv, VALUE self) {
+  return cache_call(self, argc, argv, cache_fetch_run);
 }
 
-static VALUE il_reset_write(VALUE self) {
-  ilResetWrite();
-  return Qnil;
+/*
+ * The name of the cache entry for the same arguments as fetch.
+ */
+static VALUE cache_key_m(int argc, VALUE *argv, VALUE self) {
+  return cache_call(self, argc, argv, cache_key_run);
 }
 
-static VALUE il_save(VALUE self, VALUE type, VALUE path) {
-  return ilSave(NUM2INT(type), RSTRING(path)->ptr) ? Qtrue : Qfalse;
+/*
+ * Remove every entry.
+ */
+static VALUE cache_clear(VALUE self) {
+  cache_trim(cache_get(self), 0);
+  return self;
 }
 
-static VALUE il_save_f(VALUE self, VALUE file) {
-  /* TODO: me! */
-  return Qnil;
+static VALUE cache_dir(VALUE self) {
+  return rb_str_new2(cache_get(self)->dir);
 }
 
-static VALUE il_save_im(VALUE self, VALUE path) {
-  return ilSaveImage(RSTRING(path)->ptr) ? Qtrue : Qfalse;
+static VALUE cache_size(VALUE self) {
+  return ULL2NUM(cache_get(self)->used);
 }
 
-static VALUE il_save_l(VALUE self, VALUE type, VALUE buf) {
-  return NUM2INT(ilSaveL(NUM2INT(type), RSTRING(buf)->ptr, RSTRING(buf)->len));
+static VALUE cache_max_size(VALUE self) {
+  return ULL2NUM(cache_get(self)->max);
 }
 
-static VALUE il_save_pal(VALUE self, VALUE path) {
-  return ilSavePal(RSTRING(path)->ptr) ? Qtrue : Qfalse;
+static VALUE cache_hits(VALUE self) {
+  return ULONG2NUM(cache_get(self)->hits);
 }
 
-static VALUE il_set_data(VALUE self, VALUE buf) {
-  return ilSetData(RSTRING(buf)->ptr) ? Qtrue : Qfalse;
+static VALUE cache_misses(VALUE self) {
+  return ULONG2NUM(cache_get(self)->misses);
 }
 
-static VALUE il_set_duration(VALUE self, VALUE dur) {
-  return ilSetDuration(NUM2INT(dur)) ? Qtrue : Qfalse;
-}
+/*****************/
+/* pixel buffers */
+/*****************/
 
-static VALUE il_set_int(VALUE self, VALUE mode, VALUE val) {
-  ilSetInteger(NUM2INT(mode), NUM2INT(val));
-  return Qnil;
-}
+/*
+ * DevIL::PixelBuffer is a frozen snapshot of an image's pixels and
+ * layout, taken with DevIL::IL.pixel_buffer or Image#pixel_buffer.
+ * Buffers are Ractor-shareable: they go between Ractors by reference,
+ * and their readers are the extension's only Ractor-safe methods (the
+ * IL/ILU bindings share DevIL's global state and stay on the main
+ * Ractor).  The pixels live in a reference counted store, so rows()
+ * views and the buffer's IO::Buffer views share it without copying;
+ * the last one collected, in whichever Ractor, frees it.
+ */
+typedef struct {
+  long refs;                /* updated atomically */
+  size_t len;
+  ILubyte data[];
+} pixbuf_store;
 
-static VALUE il_set_mem(VALUE self, VALUE m_alloc, VALUE m_free) {
-  /* TODO: ilSetMemory(); */
-  return Qnil;
-}
+typedef struct {
+  pixbuf_store *store;
+  ILubyte *data;            /* first byte of this view */
+  size_t len;
+  ILuint width, height, depth,
+         channels,
+         bpp,               /* bytes per pixel */
+         format, type;
+} devil_pixbuf;
 
-static VALUE il_set_pixels(VALUE self, VALUE xo, VALUE yo, VALUE zo, VALUE w, VALUE h, VALUE d, VALUE fmt, VALUE type, VALUE data) {
-  ilSetPixels(NUM2INT(xo), NUM2INT(yo), NUM2INT(zo), NUM2INT(w), NUM2INT(h), NUM2INT(d), NUM2INT(fmt), NUM2INT(type), RSTRING(data)->ptr);
-  return Qnil;
+static VALUE cPixelBuffer;
+
+/* rubies without Ractors have no shareable flag */
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#define PIXBUF_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#define PIXBUF_SHAREABLE 0
+#endif
+
+static void pixbuf_free(void *ptr) {
+  devil_pixbuf *pb = ptr;
+
+  if (pb->store && !__atomic_sub_fetch(&pb->store->refs, 1, __ATOMIC_ACQ_REL))
+    free(pb->store);
+  xfree(pb);
 }
 
-static VALUE il_set_read(VALUE self, VALUE o, VALUE c, VALUE p, VALUE t, VALUE w) {
-  /* TODO: this! */
-  return Qnil;
+static size_t pixbuf_memsize(const void *ptr) {
+  const devil_pixbuf *pb = ptr;
+  return sizeof(devil_pixbuf) + pb->len;
 }
 
-static VALUE il_set_string(VALUE self, VALUE mode, VALUE str) {
-  ilSetString(NUM2INT(mode), RSTRING(str)->ptr);
-  return Qnil;
+static const rb_data_type_t pixbuf_type = {
+  "DevIL::PixelBuffer",
+  { NULL, pixbuf_free, pixbuf_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | PIXBUF_SHAREABLE
+};
+
+static devil_pixbuf *pixbuf_get(VALUE self) {
+  devil_pixbuf *pb;
+
+  TypedData_Get_Struct(self, devil_pixbuf, &pixbuf_type, pb);
+  return pb;
 }
 
-static VALUE il_set_write(VALUE self, VALUE o, VALUE c, VALUE p, VALUE t, VALUE w) {
-  /* TODO: this! */
-  return Qnil;
+/* wrap a filled in buffer (taking its store reference) and freeze it */
+static VALUE pixbuf_wrap(const devil_pixbuf *src) {
+  devil_pixbuf *pb;
+  VALUE obj = TypedData_Make_Struct(cPixelBuffer, devil_pixbuf, &pixbuf_type, pb);
+
+  *pb = *src;
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+  return rb_ractor_make_shareable(obj);
+#else
+  return rb_obj_freeze(obj);
+#endif
 }
 
-static VALUE il_shutdown(VALUE self) {
-  ilShutdown();
-  return Qnil;
+/* on the worker: copy the bound image into a new store */
+static void *job_pixbuf(void *ptr) {
+  devil_pixbuf *pb = ptr;
+  ILubyte *data;
+
+  if ((data = ilGetData()) == NULL)
+    return NULL;
+
+  pb->width = ilGetInteger(IL_IMAGE_WIDTH);
+  pb->height = ilGetInteger(IL_IMAGE_HEIGHT);
+  pb->depth = ilGetInteger(IL_IMAGE_DEPTH);
+  pb->channels = ilGetInteger(IL_IMAGE_CHANNELS);
+  pb->bpp = ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL);
+  pb->format = ilGetInteger(IL_IMAGE_FORMAT);
+  pb->type = ilGetInteger(IL_IMAGE_TYPE);
+  pb->len = ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
+
+  if ((pb->store = malloc(sizeof(pixbuf_store) + pb->len)) == NULL)
+    return NULL;
+  pb->store->refs = 1;
+  pb->store->len = pb->len;
+  pb->data = pb->store->data;
+  memcpy(pb->data, data, pb->len);
+
+  return pb;
 }
 
-static VALUE il_tex_im(VALUE self, VALUE w, VALUE h, VALUE d, VALUE bpp, VALUE fmt, VALUE type, VALUE data) {
-  return ilTexImage(NUM2INT(w), NUM2INT(h), NUM2INT(d), NUM2INT(bpp), NUM2INT(fmt), NUM2INT(type), RSTRING(data)->ptr) ? Qtrue : Qfalse;
+/*
+ * Snapshot the current image's pixels into a frozen, Ractor-shareable
+ * DevIL::PixelBuffer.  This is the one copy; the buffer can then be
+ * sent to any number of Ractors without copying.  Returns nil if no
+ * image is bound.
+ *
+ * Examples:
+ *   DevIL::IL.load DevIL::IL::PNG, 'foo.png'
+ *   pixels = DevIL::IL.pixel_buffer
+ *   Ractor.new(pixels) { |px| px.rows(0, 16).get_bytes(0, 64) }
+ *
+ */
+static VALUE il_pixel_buffer(VALUE self) {
+  devil_pixbuf pb;
+
+  memset(&pb, 0, sizeof(pb));
+  if (!devil_run(job_pixbuf, &pb)) {
+    if (pb.len)
+      rb_memerror();
+    return Qnil;
+  }
+
+  return pixbuf_wrap(&pb);
 }
 
-static VALUE il_type_func(VALUE self, VALUE mode) {
-  return lType(NUM2INT(mode)) ? Qtrue : Qfalse;
+static VALUE pixbuf_width(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->width);
 }
 
-static VALUE il_load_data(VALUE self, VALUE path, VALUE w, VALUE h, VALUE d, VALUE bpp) {
-  return ilLoadData(RSTRING(path)->ptr, NUM2INT(w), NUM2INT(h), NUM2INT(d), NUM2INT(bpp)) ? Qtrue : Qfalse;
+static VALUE pixbuf_height(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->height);
 }
 
-static VALUE il_load_data_f(VALUE self, VALUE file, VALUE w, VALUE h, VALUE d, VALUE bpp) {
-  /* TODO: return ilLoadDataF(???, NUM2INT(w), NUM2INT(h), NUM2INT(d), NUM2INT(bpp)) ? Qtrue : Qfalse; */
-return Qnil;
+static VALUE pixbuf_depth(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->depth);
 }
 
-static VALUE il_load_data_l(VALUE self, VALUE buf, VALUE w, VALUE h, VALUE d, VALUE bpp) {
-  return ilLoadDataL(RSTRING(buf)->ptr, RSTRING(buf)->len, NUM2INT(w), NUM2INT(h), NUM2INT(d), NUM2INT(bpp)) ? Qtrue : Qfalse;
+static VALUE pixbuf_channels(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->channels);
 }
 
-static VALUE il_save_data(VALUE self, VALUE path) {
-  return ilSaveData(RSTRING(path)->ptr) ? Qtrue : Qfalse;
+static VALUE pixbuf_bpp(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->bpp);
 }
 
-/**********************/
-/* define ILU methods */
-/**********************/
-static VALUE ilu_alienify(VALUE self) {
-  return iluAlienify() ? Qtrue : Qfalse;
+static VALUE pixbuf_format(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->format);
 }
 
-static VALUE ilu_blur_avg(VALUE self, VALUE iter) {
-  return iluBlurAvg(NUM2INT(iter)) ? Qtrue : Qfalse;
+static VALUE pixbuf_pixel_type(VALUE self) {
+  return UINT2NUM(pixbuf_get(self)->type);
 }
 
-static VALUE ilu_blur_gaussian(VALUE self, VALUE iter) {
-  return iluBlurGaussian(NUM2INT(iter)) ? Qtrue : Qfalse;
+static VALUE pixbuf_bytesize(VALUE self) {
+  return SIZET2NUM(pixbuf_get(self)->len);
 }
 
-static VALUE ilu_build_mipmaps(VALUE self) {
-  return iluBuildMipmaps() ? Qtrue : Qfalse;
+/* buffers are immutable, so copies are the buffer itself */
+static VALUE pixbuf_self(VALUE self) {
+  return self;
 }
 
-static VALUE ilu_colors_used(VALUE self) {
-  return INT2FIX(iluColorsUsed());
+static VALUE pixbuf_clone(int argc, VALUE *argv, VALUE self) {
+  return self;
 }
 
-static VALUE ilu_compare_im(VALUE self, VALUE comp) {
-  return iluCompareImage(NUM2INT(comp)) ? Qtrue : Qfalse;
+/* a copy of the pixels as a String */
+static VALUE pixbuf_to_s(VALUE self) {
+  devil_pixbuf *pb = pixbuf_get(self);
+  return rb_str_new((char*) pb->data, pb->len);
 }
 
-static VALUE ilu_contrast(VALUE self, VALUE contrast) {
-  return iluContrast(NUM2DBL(contrast)) ? Qtrue : Qfalse;
+/*
+ * Copy len bytes starting at offset into a String.
+ *
+ * Examples:
+ *   first = pixels.get_bytes(0, pixels.bpp)
+ *
+ */
+static VALUE pixbuf_get_bytes(VALUE self, VALUE offset, VALUE len) {
+  devil_pixbuf *pb = pixbuf_get(self);
+  size_t off = NUM2SIZET(offset),
+         n = NUM2SIZET(len);
+
+  if (off > pb->len || n > pb->len - off)
+    rb_raise(rb_eArgError, "range outside buffer: %zu bytes at %zu", n, off);
+
+  return rb_str_new((char*) pb->data + off, n);
 }
 
-static VALUE ilu_crop(VALUE self, VALUE xo, VALUE yo, VALUE zo, VALUE w, VALUE h, VALUE d) {
-  return iluCrop(NUM2INT(xo), NUM2INT(yo), NUM2INT(zo), NUM2INT(w), NUM2INT(h), NUM2INT(d)) ? Qtrue : Qfalse;
+/*
+ * A read-only view of the pixels, without copying.  On rubies with
+ * IO::Buffer an IO::Buffer is returned, elsewhere a frozen String; the
+ * view keeps the pixel store alive.
+ */
+static VALUE pixbuf_get_data(VALUE self) {
+  devil_pixbuf *pb = pixbuf_get(self);
+  VALUE ret;
+
+#if defined(HAVE_RB_IO_BUFFER_NEW)
+  ret = rb_io_buffer_new(pb->data, pb->len, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+#elif defined(HAVE_RB_STR_NEW_STATIC)
+  ret = rb_str_new_static((char*) pb->data, pb->len);
+#else
+  ret = rb_str_new((char*) pb->data, pb->len);
+#endif
+  rb_ivar_set(ret, rb_intern("@pixel_buffer"), self);
+
+  return rb_obj_freeze(ret);
 }
 
-static VALUE ilu_delete_im(VALUE self, VALUE id) {
-  iluDeleteImage(NUM2INT(id));
-  return Qnil;
+/*
+ * A buffer of count rows starting at row y, sharing this buffer's
+ * pixels.  Handy for handing strips of a frame to different Ractors.
+ * Only 2D images can be split this way.
+ *
+ * Examples:
+ *   strips = (0...pixels.height).step(64).map { |y| pixels.rows(y, 64) }
+ *
+ */
+static VALUE pixbuf_rows(VALUE self, VALUE y, VALUE count) {
+  devil_pixbuf *pb = pixbuf_get(self),
+               view;
+  long first = NUM2LONG(y),
+       n = NUM2LONG(count);
+  size_t stride;
+
+  if (pb->depth != 1)
+    rb_raise(rb_eArgError, "rows of a %u deep image", pb->depth);
+  if (first < 0 || first > pb->height)
+    rb_raise(rb_eArgError, "row %ld outside image", first);
+  if (n < 0)
+    rb_raise(rb_eArgError, "negative row count");
+  if (n > pb->height - first)
+    n = pb->height - first;
+
+  stride = pb->height ? pb->len / pb->height : 0;
+  view = *pb;
+  view.data = pb->data + first * stride;
+  view.len = n * stride;
+  view.height = n;
+  __atomic_add_fetch(&pb->store->refs, 1, __ATOMIC_RELAXED);
+
+  return pixbuf_wrap(&view);
 }
 
-static VALUE ilu_edge_detect_e(VALUE self) {
-  return iluEdgeDetectE() ? Qtrue : Qfalse;
+static VALUE pixbuf_inspect(VALUE self) {
+  devil_pixbuf *pb = pixbuf_get(self);
+
+  return rb_sprintf("#<%"PRIsVALUE" %ux%ux%u bpp=%u format=0x%x type=0x%x>",
+                    rb_obj_class(self), pb->width, pb->height, pb->depth,
+                    pb->bpp, pb->format, pb->type);
 }
 
-static VALUE ilu_edge_detect_p(VALUE self) {
-  return iluEdgeDetectP() ? Qtrue : Qfalse;
+/*
+ * Create a DevIL::Image holding a copy of the pixels.  Palettes are
+ * not kept: a color-index buffer comes back as indices.
+ */
+static VALUE pixbuf_to_image(VALUE self) {
+  devil_pixbuf *pb = pixbuf_get(self);
+  VALUE image;
+  devil_arg a[7];
+
+  /* ilTexImage reads width * height * depth * bpp bytes */
+  if ((size_t) pb->width * pb->height * pb->depth * pb->bpp > pb->len)
+    rb_raise(rb_eRuntimeError, "pixel buffer is shorter than its layout");
+
+  image = rb_class_new_instance(0, NULL, cImage);
+  a[0].u = pb->width;
+  a[1].u = pb->height;
+  a[2].u = pb->depth;
+  a[3].u = pb->channels;
+  a[4].u = pb->format;
+  a[5].u = pb->type;
+  a[6].p = pb->data;
+
+  devil_want = NUM2UINT(rb_funcall(image, rb_intern("name"), 0));
+  if (!devil_run(job_tex_im, a))
+    rb_raise(rb_eRuntimeError, "could not create image");
+  RB_GC_GUARD(self);
+
+  return image;
 }
 
-static VALUE ilu_edge_detect_s(VALUE self) {
-  return iluEdgeDetectS() ? Qtrue : Qfalse;
+/*****************/
+/* image objects */
+/*****************/
+
+/*
+ * DevIL::Image owns one IL image name.  Its methods are the IL/ILU
+ * bindings of the same name, run against this image: each one marks
+ * the image as wanted (see devil_select) and calls the binding, so the
+ * image is bound inside the binding's own job, and only if it isn't
+ * bound already.
+ */
+typedef struct {
+  ILuint name;
+} devil_image;
+
+typedef VALUE (*image_fn)();
+
+static void image_free(void *ptr) {
+  devil_image *img = ptr;
+  ILuint *names;
+
+  if (img->name != BIND_NONE) {
+    pthread_mutex_lock(&worker.mutex);
+    if (dead.len == dead.capa) {
+      names = realloc(dead.names, (dead.capa ? dead.capa * 2 : 64) * sizeof(ILuint));
+      if (names) {
+        dead.names = names;
+        dead.capa = dead.capa ? dead.capa * 2 : 64;
+      }
+    }
+    if (dead.len < dead.capa)
+      dead.names[dead.len++] = img->name;
+    pthread_mutex_unlock(&worker.mutex);
+  }
+
+  xfree(img);
 }
 
-static VALUE ilu_emboss(VALUE self) {
-  return iluEmboss() ? Qtrue : Qfalse;
+static size_t image_memsize(const void *ptr) {
+  return sizeof(devil_image);
 }
 
-static VALUE ilu_enlarge_canvas(VALUE self, VALUE w, VALUE h, VALUE d) {
-  return iluEnlargeCanvas(NUM2INT(w), NUM2INT(h), NUM2INT(d)) ? Qtrue : Qfalse;
+static const rb_data_type_t image_type = {
+  "DevIL::Image",
+  { NULL, image_free, image_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE image_alloc(VALUE klass) {
+  devil_image *img;
+  VALUE obj = TypedData_Make_Struct(klass, devil_image, &image_type, img);
+
+  img->name = BIND_NONE;
+  return obj;
 }
 
-static VALUE ilu_enlarge_im(VALUE self, VALUE x, VALUE y, VALUE z) {
-  return iluEnlargeImage(NUM2DBL(x), NUM2DBL(y), NUM2DBL(z)) ? Qtrue : Qfalse;
+static devil_image *image_get(VALUE self) {
+  devil_image *img;
+
+  TypedData_Get_Struct(self, devil_image, &image_type, img);
+  if (img->name == BIND_NONE)
+    rb_raise(rb_eRuntimeError, "deleted image");
+
+  return img;
 }
 
-static VALUE ilu_equalize(VALUE self) {
-  return iluEqualize() ? Qtrue : Qfalse;
+/*
+ * Create a new image, optionally with the given layout (see
+ * DevIL::IL::checkout_image).
+ *
+ * Examples:
+ *   image = DevIL::Image.new
+ *   image.load DevIL::IL::PNG, 'foo.png'
+ *
+ *   canvas = DevIL::Image.new(640, 480, 1, 4, DevIL::IL::RGBA, DevIL::IL::UNSIGNED_BYTE)
+ *
+ */
+static VALUE image_init(int argc, VALUE *argv, VALUE self) {
+  devil_image *img;
+  devil_arg a[2];
+  VALUE name;
+
+  TypedData_Get_Struct(self, devil_image, &image_type, img);
+  if (img->name != BIND_NONE)
+    rb_raise(rb_eRuntimeError, "image already initialized");
+
+  if (argc) {
+    rb_check_arity(argc, 6, 6);
+    name = il_checkout_im(self, argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+    if (NIL_P(name))
+      rb_raise(rb_eRuntimeError, "could not create image");
+    img->name = NUM2UINT(name);
+  } else {
+    a[0].i = 1;
+    a[1].p = &img->name;
+    devil_run(job_gen_ims, a);
+  }
+
+  return self;
 }
 
-static VALUE ilu_error_string(VALUE self, VALUE err) {
-  return rb_str_new2(iluErrorString(NUM2INT(err)));
+static void *job_image_clone(void *ptr) {
+  ILuint *name = ptr;
+  *name = ilCloneCurImage();
+  return ptr;
 }
 
-static VALUE ilu_flip_im(VALUE self) {
-  return iluFlipImage() ? Qtrue : Qfalse;
+/* dup/clone copy the image data into a new IL image */
+static VALUE image_init_copy(VALUE self, VALUE orig) {
+  devil_image *img, *src;
+
+  TypedData_Get_Struct(self, devil_image, &image_type, img);
+  src = image_get(orig);
+  if (img->name != BIND_NONE)
+    rb_raise(rb_eRuntimeError, "image already initialized");
+
+  devil_want = src->name;
+  devil_run(job_image_clone, &img->name);
+  if (!img->name) {
+    img->name = BIND_NONE;
+    rb_raise(rb_eRuntimeError, "could not copy image");
+  }
+
+  return self;
 }
 
-static VALUE ilu_gamma_correct(VALUE self, VALUE gamma) {
-  return iluGammaCorrect(NUM2DBL(gamma)) ? Qtrue : Qfalse;
+static VALUE image_name(VALUE self) {
+  return UINT2NUM(image_get(self)->name);
 }
 
-static VALUE ilu_gen_im(VALUE self) {
-  return INT2FIX(iluGenImage());
+/* bind this image, for use with the DevIL::IL/ILU module functions */
+static VALUE image_bind(VALUE self) {
+  devil_image *img = image_get(self);
+
+  devil_sync();
+  devil_select(img->name);
+
+  return self;
 }
 
-static VALUE ilu_get_im_info(VALUE self) {
-  /* TODO: this func! */
+/*
+ * Delete the image now rather than when it is garbage collected.
+ */
+static VALUE image_delete(VALUE self) {
+  devil_image *img;
+
+  TypedData_Get_Struct(self, devil_image, &image_type, img);
+  if (img->name != BIND_NONE) {
+    devil_sync();
+    devil_release_views();
+    devil_delete_images(1, &img->name);
+    img->name = BIND_NONE;
+  }
+
   return Qnil;
 }
 
-static VALUE ilu_get_int(VALUE self, VALUE mode) {
-  return INT2FIX(iluGetInteger(NUM2INT(mode)));
-}
+static VALUE image_deleted_p(VALUE self) {
+  devil_image *img;
+
+  TypedData_Get_Struct(self, devil_image, &image_type, img);
+  return img->name == BIND_NONE ? Qtrue : Qfalse;
+}
+
+typedef struct {
+  VALUE self;
+  image_fn fn;
+  int argc;
+  VALUE *argv;
+} image_call_arg;
+
+static VALUE image_apply(VALUE ptr) {
+  image_call_arg *c = (image_call_arg*) ptr;
+  VALUE self = c->self,
+        *v = c->argv;
+
+  switch (c->argc) {
+  case -1: return c->fn((int) v[0], v + 1, self);
+  case 0:  return c->fn(self);
+  case 1:  return c->fn(self, v[0]);
+  case 2:  return c->fn(self, v[0], v[1]);
+  case 3:  return c->fn(self, v[0], v[1], v[2]);
+  case 4:  return c->fn(self, v[0], v[1], v[2], v[3]);
+  case 6:  return c->fn(self, v[0], v[1], v[2], v[3], v[4], v[5]);
+  case 7:  return c->fn(self, v[0], v[1], v[2], v[3], v[4], v[5], v[6]);
+  case 9:  return c->fn(self, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8]);
+  case 10: return c->fn(self, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9]);
+  }
 
-static VALUE ilu_get_string(VALUE self, VALUE num) {
-  return rb_str_new2(iluGetString(NUM2INT(num)));
+  rb_bug("image_apply: unsupported arity %d", c->argc);
+  return Qnil;
 }
 
-static VALUE ilu_im_parameter(VALUE self, VALUE name, VALUE param) {
-  iluImageParameter(NUM2INT(name), NUM2INT(param));
+static VALUE image_unselect(VALUE ptr) {
+  devil_want = BIND_NONE;
   return Qnil;
 }
 
-static VALUE ilu_invert_alpha(VALUE self) {
-  return iluInvertAlpha() ? Qtrue : Qfalse;
-}
+/* call a binding with this image selected */
+static VALUE image_call(VALUE self, image_fn fn, int arity, int argc, VALUE *argv) {
+  image_call_arg c;
+  VALUE args[11];
+
+  if (arity >= 0) {
+    rb_check_arity(argc, arity, arity);
+    c.argv = argv;
+  } else {
+    if (argc > 10)
+      rb_raise(rb_eArgError, "too many arguments");
+    args[0] = (VALUE) argc;
+    MEMCPY(args + 1, argv, VALUE, argc);
+    c.argv = args;
+  }
 
-static VALUE ilu_load_im(VALUE self, VALUE path) {
-  return INT2FIX(iluLoadImage(RSTRING(path)->ptr));
-}
+  c.self = self;
+  c.fn = fn;
+  c.argc = arity;
+  devil_want = image_get(self)->name;
 
-static VALUE ilu_mirror(VALUE self) {
-  return iluMirror() ? Qtrue : Qfalse;
+  return rb_ensure(image_apply, (VALUE) &c, image_unselect, Qnil);
 }
 
-static VALUE ilu_negative(VALUE self) {
-  return iluNegative() ? Qtrue : Qfalse;
-}
+/*
+ * Define image_<fn>, running the binding fn (of the given arity, -1 for
+ * variadic) against the image.
+ */
+#define IMAGE_METH(fn, arity)                                   \
+  static VALUE image_##fn(int argc, VALUE *argv, VALUE self) {  \
+    return image_call(self, (image_fn) fn, arity, argc, argv);  \
+  }
 
-static VALUE ilu_noisify(VALUE self, VALUE tol) {
-  return iluNoisify(NUM2DBL(tol)) ? Qtrue : Qfalse;
+IMAGE_METH(il_apply_pal, 1)
+IMAGE_METH(il_apply_profile, 2)
+IMAGE_METH(il_blit, 10)
+IMAGE_METH(il_clear_im, 0)
+IMAGE_METH(il_convert_im, 2)
+IMAGE_METH(il_convert_pal, 1)
+IMAGE_METH(il_copy_im, 1)
+IMAGE_METH(il_copy_pixels, 9)
+IMAGE_METH(il_default_im, 0)
+IMAGE_METH(il_get_data, 0)
+IMAGE_METH(il_get_dxtc_data, -1)
+IMAGE_METH(il_get_int, 1)
+IMAGE_METH(il_load, 2)
+IMAGE_METH(il_load_f, 2)
+IMAGE_METH(il_load_im, 1)
+IMAGE_METH(il_load_l, 2)
+IMAGE_METH(il_load_async, -1)
+IMAGE_METH(il_load_l_async, -1)
+IMAGE_METH(il_load_mmap, 2)
+IMAGE_METH(il_load_pal, 1)
+IMAGE_METH(il_overlay_im, 4)
+IMAGE_METH(il_pixel_buffer, 0)
+IMAGE_METH(il_save, 2)
+IMAGE_METH(il_save_f, 2)
+IMAGE_METH(il_save_im, 1)
+IMAGE_METH(il_save_l, -1)
+IMAGE_METH(il_save_async, -1)
+IMAGE_METH(il_save_l_async, -1)
+IMAGE_METH(il_save_pal, 1)
+IMAGE_METH(il_set_data, 1)
+IMAGE_METH(il_set_pixels, 9)
+IMAGE_METH(il_tex_im, 7)
+IMAGE_METH(ilu_alienify, 0)
+IMAGE_METH(ilu_blur, 1)
+IMAGE_METH(ilu_blur_avg, 1)
+IMAGE_METH(ilu_blur_gaussian, 1)
+IMAGE_METH(ilu_build_mipmaps, 0)
+IMAGE_METH(ilu_colors_used, 0)
+IMAGE_METH(ilu_compare, -1)
+IMAGE_METH(ilu_compare_im, 1)
+IMAGE_METH(ilu_contrast, 1)
+IMAGE_METH(ilu_crop, 6)
+IMAGE_METH(ilu_edge_detect_e, 0)
+IMAGE_METH(ilu_edge_detect_p, 0)
+IMAGE_METH(ilu_edge_detect_s, 0)
+IMAGE_METH(ilu_emboss, 0)
+IMAGE_METH(ilu_enlarge_canvas, 3)
+IMAGE_METH(ilu_enlarge_im, 3)
+IMAGE_METH(ilu_equalize, 0)
+IMAGE_METH(ilu_flip_im, 0)
+IMAGE_METH(ilu_gamma_correct, 1)
+IMAGE_METH(ilu_histogram, -1)
+IMAGE_METH(ilu_invert_alpha, 0)
+IMAGE_METH(ilu_mipmap_chain, -1)
+IMAGE_METH(ilu_mirror, 0)
+IMAGE_METH(ilu_negative, 0)
+IMAGE_METH(ilu_noisify, 1)
+IMAGE_METH(ilu_pixelize, 1)
+IMAGE_METH(ilu_replace_color, 4)
+IMAGE_METH(ilu_resample, -1)
+IMAGE_METH(ilu_rotate, 1)
+IMAGE_METH(ilu_rotate_3d, 4)
+IMAGE_METH(ilu_saturate_1f, 1)
+IMAGE_METH(ilu_saturate_4f, 4)
+IMAGE_METH(ilu_scale, 3)
+IMAGE_METH(ilu_scale_async, -1)
+IMAGE_METH(ilu_scale_colors, 3)
+IMAGE_METH(ilu_stats, 0)
+IMAGE_METH(ilu_sharpen, 2)
+IMAGE_METH(ilu_swap_colors, 0)
+IMAGE_METH(ilu_wave, 1)
+
+/* image properties, read inline */
+static VALUE image_int(VALUE self, ILenum mode) {
+  devil_want = image_get(self)->name;
+  devil_sync();
+  return INT2NUM(ilGetInteger(mode));
+}
+
+static VALUE image_width(VALUE self) {
+  return image_int(self, IL_IMAGE_WIDTH);
+}
+
+static VALUE image_height(VALUE self) {
+  return image_int(self, IL_IMAGE_HEIGHT);
+}
+
+static VALUE image_depth(VALUE self) {
+  return image_int(self, IL_IMAGE_DEPTH);
+}
+
+static VALUE image_bpp(VALUE self) {
+  return image_int(self, IL_IMAGE_BYTES_PER_PIXEL);
+}
+
+static VALUE image_format(VALUE self) {
+  return image_int(self, IL_IMAGE_FORMAT);
+}
+
+static VALUE image_pixel_type(VALUE self) {
+  return image_int(self, IL_IMAGE_TYPE);
 }
 
-static VALUE ilu_pixelize(VALUE self, VALUE size) {
-  return iluPixelize(NUM2INT(size)) ? Qtrue : Qfalse;
-}
+/*
+ * Load a new image from a file.
+ *
+ * Examples:
+ *   image = DevIL::Image.load('foo.png')
+ *
+ */
+static VALUE image_s_load(int argc, VALUE *argv, VALUE klass) {
+  VALUE args[2], obj = rb_class_new_instance(0, NULL, klass);
 
-static VALUE ilu_region_fv(VALUE self, VALUE points) {
-  /* TODO: this function! */
-  return Qnil;
-}
+  rb_scan_args(argc, argv, "11", &args[1], &args[0]);
+  if (NIL_P(args[0]))
+    args[0] = INT2FIX(IL_TYPE_UNKNOWN);
+  if (!RTEST(image_call(obj, (image_fn) il_load, 2, 2, args)))
+    rb_raise(rb_eRuntimeError, "could not load image: %s", StringValueCStr(args[1]));
 
-static VALUE ilu_region_iv(VALUE self, VALUE points) {
-  /* TODO: this function! */
-  return Qnil;
+  return obj;
 }
 
-static VALUE ilu_replace_color(VALUE self, VALUE r, VALUE g, VALUE b, VALUE tol) {
-  return iluReplaceColor(NUM2INT(r), NUM2INT(g), NUM2INT(b), NUM2DBL(tol)) ? Qtrue : Qfalse;
-}
+/************/
+/* pipeline */
+/************/
 
-static VALUE ilu_rotate(VALUE self, VALUE angle) {
-  return iluRotate(NUM2DBL(angle)) ? Qtrue : Qfalse;
+/*
+ * DevIL::Pipeline records operations on an image instead of running
+ * them, and runs the whole chain, with runs of point operations fused
+ * (see op_fuse), once the result is needed: at save, save_l or
+ * get_data, or an explicit run.  Each op of the operation chains
+ * (e.g. contrast, gamma_correct, scale) is a method taking the same
+ * arguments and returning the pipeline.
+ */
+typedef struct {
+  VALUE image;
+  devil_op ops[OP_MAX];
+  int nops;
+} devil_pipeline;
+
+typedef struct {
+  devil_op *ops;
+  int n,
+      step;
+  const char *err;
+} pipeline_run_arg;
+
+static void pipeline_mark(void *ptr) {
+  rb_gc_mark(((devil_pipeline *) ptr)->image);
 }
 
-static VALUE ilu_rotate_3d(VALUE self, VALUE x, VALUE y, VALUE z, VALUE a) {
-  return iluRotate3D(NUM2DBL(x), NUM2DBL(y), NUM2DBL(z), NUM2DBL(a)) ? Qtrue : Qfalse;
+static const rb_data_type_t pipeline_type = {
+  "DevIL::Pipeline",
+  { pipeline_mark, RUBY_TYPED_DEFAULT_FREE, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE pipeline_alloc(VALUE klass) {
+  devil_pipeline *pipe;
+  VALUE obj = TypedData_Make_Struct(klass, devil_pipeline, &pipeline_type, pipe);
+
+  pipe->image = Qnil;
+  return obj;
 }
 
-static VALUE ilu_saturate_1f(VALUE self, VALUE sat) {
-  return iluSaturate1f(NUM2DBL(sat)) ? Qtrue : Qfalse;
+static devil_pipeline *pipeline_get(VALUE self) {
+  devil_pipeline *pipe;
+
+  TypedData_Get_Struct(self, devil_pipeline, &pipeline_type, pipe);
+  if (NIL_P(pipe->image))
+    rb_raise(rb_eRuntimeError, "uninitialized pipeline");
+
+  return pipe;
 }
 
-static VALUE ilu_saturate_4f(VALUE self, VALUE r, VALUE g, VALUE b, VALUE sat) {
-  return iluSaturate4f(NUM2DBL(r), NUM2DBL(g), NUM2DBL(b), NUM2DBL(sat)) ? Qtrue : Qfalse;
+static void *job_pipeline(void *ptr) {
+  pipeline_run_arg *r = ptr;
+
+  if ((r->step = op_apply_chain(r->ops, r->n)) >= 0)
+    r->err = devil_error("operation failed");
+
+  return r;
 }
 
-static VALUE ilu_scale(VALUE self, VALUE w, VALUE h, VALUE d) {
-  return iluScale(NUM2INT(w), NUM2INT(h), NUM2INT(d)) ? Qtrue : Qfalse;
+/* run the recorded ops; they are dropped even if one fails */
+static void pipeline_flush(devil_pipeline *pipe) {
+  devil_op ops[OP_MAX];
+  pipeline_run_arg r;
+
+  if (!pipe->nops)
+    return;
+
+  r.n = pipe->nops;
+  r.ops = ops;
+  r.err = NULL;
+  memcpy(ops, pipe->ops, r.n * sizeof(devil_op));
+  pipe->nops = 0;
+
+  devil_want = image_get(pipe->image)->name;
+  devil_run(job_pipeline, &r);
+
+  if (r.err)
+    rb_raise(rb_eRuntimeError, "%s: %s", op_table[ops[r.step].op].name, r.err);
 }
 
-static VALUE ilu_scale_colors(VALUE self, VALUE r, VALUE g, VALUE b) {
-  return iluScale(NUM2INT(r), NUM2INT(g), NUM2INT(b)) ? Qtrue : Qfalse;
+/*
+ * Start a pipeline on image.  Like the Image methods, the operations
+ * change the image itself.
+ *
+ * Examples:
+ *   DevIL::Pipeline.new(image).contrast(1.2).gamma_correct(1.8).negative.save(DevIL::IL::PNG, 'out.png')
+ *
+ */
+static VALUE pipeline_init(VALUE self, VALUE image) {
+  devil_pipeline *pipe;
+
+  TypedData_Get_Struct(self, devil_pipeline, &pipeline_type, pipe);
+  if (!NIL_P(pipe->image))
+    rb_raise(rb_eRuntimeError, "pipeline already initialized");
+
+  image_get(image);
+  RB_OBJ_WRITE(self, &pipe->image, image);
+
+  return self;
 }
 
-static VALUE ilu_sharpen(VALUE self, VALUE factor, VALUE iter) {
-  return iluSharpen(NUM2DBL(factor), NUM2INT(iter)) ? Qtrue : Qfalse;
+/* record the op named after the method called */
+static VALUE pipeline_op(int argc, VALUE *argv, VALUE self) {
+  devil_pipeline *pipe = pipeline_get(self);
+  const char *name = rb_id2name(rb_frame_this_func());
+  devil_op *op;
+  int i;
+
+  if (pipe->nops == OP_MAX)
+    pipeline_flush(pipe);
+
+  op = &pipe->ops[pipe->nops];
+  memset(op, 0, sizeof(devil_op));
+  for (op->op = 0; op->op < OP_COUNT; op->op++)
+    if (!strcmp(op_table[op->op].name, name))
+      break;
+  if (op->op == OP_COUNT)
+    rb_raise(rb_eNotImpError, "%s is not an operation", name);
+
+  rb_check_arity(argc, op_table[op->op].argc, op_table[op->op].argc);
+  for (i = 0; i < argc; i++)
+    op->arg[i] = NUM2DBL(argv[i]);
+  pipe->nops++;
+
+  return self;
 }
 
-static VALUE ilu_swap_colors(VALUE self) {
-  return iluSwapColors() ? Qtrue : Qfalse;
+/*
+ * Run the recorded operations now, and return the image.
+ */
+static VALUE pipeline_run(VALUE self) {
+  devil_pipeline *pipe = pipeline_get(self);
+
+  pipeline_flush(pipe);
+  return pipe->image;
 }
 
-static VALUE ilu_wave(VALUE self, VALUE angle) {
-  return iluWave(NUM2DBL(angle)) ? Qtrue : Qfalse;
+/*
+ * The operations not yet run, as an operation chain.
+ */
+static VALUE pipeline_ops(VALUE self) {
+  devil_pipeline *pipe = pipeline_get(self);
+  VALUE chain = rb_ary_new_capa(pipe->nops), step;
+  int i, j;
+
+  for (i = 0; i < pipe->nops; i++) {
+    step = rb_ary_new_capa(op_table[pipe->ops[i].op].argc + 1);
+    rb_ary_push(step, ID2SYM(rb_intern(op_table[pipe->ops[i].op].name)));
+    for (j = 0; j < op_table[pipe->ops[i].op].argc; j++)
+      rb_ary_push(step, DBL2NUM(pipe->ops[i].arg[j]));
+    rb_ary_push(chain, step);
+  }
+
+  return chain;
 }
 
+static VALUE pipeline_image(VALUE self) {
+  return pipeline_get(self)->image;
+}
 
+/* run, then call the Image method of the same name */
+static VALUE pipeline_output(int argc, VALUE *argv, VALUE self) {
+  devil_pipeline *pipe = pipeline_get(self);
 
+  pipeline_flush(pipe);
+  return rb_funcallv(pipe->image, rb_frame_this_func(), argc, argv);
+}
 
 static void define_constants(void) {
   DEF_CONST(mIl, "IL", "COLOUR_INDEX", IL_COLOUR_INDEX);
@@ -990,6 +10126,8 @@ static void define_constants(void) {
   DEF_CONST(mIl, "IL", "DXT4", IL_DXT4);
   DEF_CONST(mIl, "IL", "DXT5", IL_DXT5);
   DEF_CONST(mIl, "IL", "DXT_NO_COMP", IL_DXT_NO_COMP);
+  DEF_CONST(mIl, "IL", "ATI1N", IL_ATI1N);
+  DEF_CONST(mIl, "IL", "ATI2N", IL_3DC);
   DEF_CONST(mIl, "IL", "KEEP_DXTC_DATA", IL_KEEP_DXTC_DATA);
   DEF_CONST(mIl, "IL", "DXTC_DATA_FORMAT", IL_DXTC_DATA_FORMAT);
 
@@ -1027,6 +10165,7 @@ static void define_constants(void) {
   DEF_CONST(mIl, "IL", "IMAGE_DURATION", IL_IMAGE_DURATION);
   DEF_CONST(mIl, "IL", "IMAGE_PLANESIZE", IL_IMAGE_PLANESIZE);
   DEF_CONST(mIl, "IL", "IMAGE_BPC", IL_IMAGE_BPC);
+  DEF_CONST(mIl, "IL", "IMAGE_CHANNELS", IL_IMAGE_CHANNELS);
   DEF_CONST(mIl, "IL", "IMAGE_OFFX", IL_IMAGE_OFFX);
   DEF_CONST(mIl, "IL", "IMAGE_OFFY", IL_IMAGE_OFFY);
   DEF_CONST(mIl, "IL", "IMAGE_CUBEFLAGS", IL_IMAGE_CUBEFLAGS);
@@ -1054,12 +10193,34 @@ static void define_constants(void) {
   DEF_CONST(mIlu, "ILU", "VERSION_NUM", ILU_VERSION_NUM);
 }
 
+static void *job_init(void *ptr) {
+  UNUSED(ptr);
+  ilInit();
+  iluInit();
+  return NULL;
+}
+
 void Init_devil(void) {
+  VALUE pool_limit;
+  int i;
+
   mDevil = rb_define_module("DevIL");
   rb_define_const(mDevil, "DEVIL_VERSION", rb_str_new2(DEVIL_VERSION));
+  rb_define_module_function(mDevil, "stats", devil_stats, 0);
+  rb_define_module_function(mDevil, "reset_stats", devil_reset_stats, 0);
+  rb_define_module_function(mDevil, "stats_enabled=", devil_set_stats, 1);
+  rb_define_module_function(mDevil, "stats_enabled?", devil_stats_p, 0);
+  rb_define_module_function(mDevil, "threads", devil_threads, 0);
+  rb_define_module_function(mDevil, "threads=", devil_set_threads, 1);
 
   mIl  = rb_define_module_under(mDevil, "IL");
   mIlu = rb_define_module_under(mDevil, "ILU");
+  mBatch = rb_define_module_under(mDevil, "Batch");
+  cPool = rb_define_class_under(mDevil, "Pool", rb_cObject);
+  cCache = rb_define_class_under(mDevil, "Cache", rb_cObject);
+  cImage = rb_define_class_under(mDevil, "Image", rb_cObject);
+  cPipeline = rb_define_class_under(mDevil, "Pipeline", rb_cObject);
+  cPixelBuffer = rb_define_class_under(mDevil, "PixelBuffer", rb_cObject);
 
   define_constants();
 
@@ -1110,14 +10271,18 @@ void Init_devil(void) {
   rb_define_method(mIl, "FormatFunc", il_format_func, 1);
   rb_define_method(mIl, "gen_images", il_gen_ims, -1);
   rb_define_method(mIl, "GenImages", il_gen_ims, -1);
+  rb_define_method(mIl, "checkout_image", il_checkout_im, 6);
+  rb_define_method(mIl, "CheckoutImage", il_checkout_im, 6);
+  rb_define_method(mIl, "set_image_pool", il_set_im_pool, -1);
+  rb_define_method(mIl, "SetImagePool", il_set_im_pool, -1);
   rb_define_method(mIl, "get_alpha", il_get_alpha, 1);
   rb_define_method(mIl, "GetAlpha", il_get_alpha, 1);
   rb_define_method(mIl, "get_boolean", il_get_bool, 1);
   rb_define_method(mIl, "GetBoolean", il_get_bool, 1);
   rb_define_method(mIl, "get_data", il_get_data, 0);
   rb_define_method(mIl, "GetData", il_get_data, 0);
-  rb_define_method(mIl, "get_dxtc_data", il_get_dxtc_data, 2);
-  rb_define_method(mIl, "GetDXTCData", il_get_dxtc_data, 2);
+  rb_define_method(mIl, "get_dxtc_data", il_get_dxtc_data, -1);
+  rb_define_method(mIl, "GetDXTCData", il_get_dxtc_data, -1);
   rb_define_method(mIl, "get_error", il_get_err, 0);
   rb_define_method(mIl, "GetError", il_get_err, 0);
   rb_define_method(mIl, "get_integer", il_get_int, 1);
@@ -1166,14 +10331,26 @@ void Init_devil(void) {
   rb_define_method(mIl, "LoadImage", il_load_im, 1);
   rb_define_method(mIl, "load_l", il_load_l, 2);
   rb_define_method(mIl, "LoadL", il_load_l, 2);
+  rb_define_method(mIl, "load_async", il_load_async, -1);
+  rb_define_method(mIl, "LoadAsync", il_load_async, -1);
+  rb_define_method(mIl, "load_l_async", il_load_l_async, -1);
+  rb_define_method(mIl, "LoadLAsync", il_load_l_async, -1);
+  rb_define_method(mIl, "load_mmap", il_load_mmap, 2);
+  rb_define_method(mIl, "LoadMmap", il_load_mmap, 2);
   rb_define_method(mIl, "load_pal", il_load_pal, 1);
   rb_define_method(mIl, "LoadPal", il_load_pal, 1);
+  rb_define_method(mIl, "load_plugin", il_load_plugin, 1);
+  rb_define_method(mIl, "LoadPlugin", il_load_plugin, 1);
   rb_define_method(mIl, "origin_func", il_origin_func, 1);
   rb_define_method(mIl, "OriginFunc", il_origin_func, 1);
   rb_define_method(mIl, "overlay_image", il_overlay_im, 4);
   rb_define_method(mIl, "OverlayImage", il_overlay_im, 4);
   rb_define_method(mIl, "pop_attrib", il_pop_attrib, 0);
   rb_define_method(mIl, "PopAttrib", il_pop_attrib, 0);
+  rb_define_method(mIl, "pixel_buffer", il_pixel_buffer, 0);
+  rb_define_method(mIl, "PixelBuffer", il_pixel_buffer, 0);
+  rb_define_method(mIl, "probe", il_probe, -1);
+  rb_define_method(mIl, "Probe", il_probe, -1);
   rb_define_method(mIl, "push_attrib", il_push_attrib, 1);
   rb_define_method(mIl, "PushAttrib", il_push_attrib, 1);
   rb_define_method(mIl, "register_format", il_register_format, 1);
@@ -1208,18 +10385,28 @@ void Init_devil(void) {
   rb_define_method(mIl, "SaveF", il_save_f, 2);
   rb_define_method(mIl, "save_image", il_save_im, 1);
   rb_define_method(mIl, "SaveImage", il_save_im, 1);
-  rb_define_method(mIl, "save_l", il_save_l, 2);
-  rb_define_method(mIl, "SaveL", il_save_l, 2);
+  rb_define_method(mIl, "save_l", il_save_l, -1);
+  rb_define_method(mIl, "SaveL", il_save_l, -1);
+  rb_define_method(mIl, "save_async", il_save_async, -1);
+  rb_define_method(mIl, "SaveAsync", il_save_async, -1);
+  rb_define_method(mIl, "save_l_async", il_save_l_async, -1);
+  rb_define_method(mIl, "SaveLAsync", il_save_l_async, -1);
   rb_define_method(mIl, "save_pal", il_save_pal, 1);
   rb_define_method(mIl, "SavePal", il_save_pal, 1);
   rb_define_method(mIl, "set_data", il_set_data, 1);
   rb_define_method(mIl, "SetData", il_set_data, 1);
   rb_define_method(mIl, "set_duration", il_set_duration, 1);
   rb_define_method(mIl, "SetDuration", il_set_duration, 1);
+  rb_define_method(mIl, "set_fast_convert", il_set_fast_convert, 1);
+  rb_define_method(mIl, "SetFastConvert", il_set_fast_convert, 1);
   rb_define_method(mIl, "set_integer", il_set_int, 2);
   rb_define_method(mIl, "SetInteger", il_set_int, 2);
-  rb_define_method(mIl, "set_memory", il_set_mem, 1);
-  rb_define_method(mIl, "SetMemory", il_set_mem, 1);
+  rb_define_method(mIl, "set_memory", il_set_mem, -1);
+  rb_define_method(mIl, "SetMemory", il_set_mem, -1);
+  rb_define_method(mIl, "memory_stats", il_mem_stats, 0);
+  rb_define_method(mIl, "MemoryStats", il_mem_stats, 0);
+  rb_define_method(mIl, "trim_memory", il_trim_mem, 0);
+  rb_define_method(mIl, "TrimMemory", il_trim_mem, 0);
   rb_define_method(mIl, "set_pixels", il_set_pixels, 9);
   rb_define_method(mIl, "SetPixels", il_set_pixels, 9);
   rb_define_method(mIl, "set_string", il_set_string, 2);
@@ -1253,6 +10440,8 @@ void Init_devil(void) {
   /***************/
   rb_define_method(mIlu, "alienify", ilu_alienify, 0);
   rb_define_method(mIlu, "Alienify", ilu_alienify, 0);
+  rb_define_method(mIlu, "blur", ilu_blur, 1);
+  rb_define_method(mIlu, "Blur", ilu_blur, 1);
   rb_define_method(mIlu, "blur_avg", ilu_blur_avg, 1);
   rb_define_method(mIlu, "BlurAvg", ilu_blur_avg, 1);
   rb_define_method(mIlu, "blur_gaussian", ilu_blur_gaussian, 1);
@@ -1263,6 +10452,8 @@ void Init_devil(void) {
   rb_define_method(mIlu, "ColorsUsed", ilu_colors_used, 0);
   rb_define_method(mIlu, "colours_used", ilu_colors_used, 0);
   rb_define_method(mIlu, "ColoursUsed", ilu_colors_used, 0);
+  rb_define_method(mIlu, "compare", ilu_compare, -1);
+  rb_define_method(mIlu, "Compare", ilu_compare, -1);
   rb_define_method(mIlu, "compare_image", ilu_compare_im, 1);
   rb_define_method(mIlu, "CompareImage", ilu_compare_im, 1);
   rb_define_method(mIlu, "contrast", ilu_contrast, 1);
@@ -1299,12 +10490,16 @@ void Init_devil(void) {
   rb_define_method(mIlu, "GetInteger", ilu_get_int, 1);
   rb_define_method(mIlu, "get_string", ilu_get_string, 1);
   rb_define_method(mIlu, "GetString", ilu_get_string, 1);
+  rb_define_method(mIlu, "histogram", ilu_histogram, -1);
+  rb_define_method(mIlu, "Histogram", ilu_histogram, -1);
   rb_define_method(mIlu, "image_parameter", ilu_im_parameter, 2);
   rb_define_method(mIlu, "ImageParameter", ilu_im_parameter, 2);
   rb_define_method(mIlu, "invert_alpha", ilu_invert_alpha, 0);
   rb_define_method(mIlu, "InvertAlpha", ilu_invert_alpha, 0);
   rb_define_method(mIlu, "load_image", ilu_load_im, 1);
   rb_define_method(mIlu, "LoadImage", ilu_load_im, 1);
+  rb_define_method(mIlu, "mipmap_chain", ilu_mipmap_chain, -1);
+  rb_define_method(mIlu, "MipmapChain", ilu_mipmap_chain, -1);
   rb_define_method(mIlu, "mirror", ilu_mirror, 0);
   rb_define_method(mIlu, "Mirror", ilu_mirror, 0);
   rb_define_method(mIlu, "negative", ilu_negative, 0);
@@ -1321,6 +10516,8 @@ void Init_devil(void) {
   rb_define_method(mIlu, "ReplaceColor", ilu_replace_color, 4);
   rb_define_method(mIlu, "replace_colour", ilu_replace_color, 4);
   rb_define_method(mIlu, "ReplaceColour", ilu_replace_color, 4);
+  rb_define_method(mIlu, "resample", ilu_resample, -1);
+  rb_define_method(mIlu, "Resample", ilu_resample, -1);
   rb_define_method(mIlu, "rotate", ilu_rotate, 1);
   rb_define_method(mIlu, "Rotate", ilu_rotate, 1);
   rb_define_method(mIlu, "rotate_3d", ilu_rotate_3d, 4);
@@ -1331,10 +10528,14 @@ void Init_devil(void) {
   rb_define_method(mIlu, "Saturate4f", ilu_saturate_4f, 4);
   rb_define_method(mIlu, "scale", ilu_scale, 3);
   rb_define_method(mIlu, "Scale", ilu_scale, 3);
+  rb_define_method(mIlu, "scale_async", ilu_scale_async, -1);
+  rb_define_method(mIlu, "ScaleAsync", ilu_scale_async, -1);
   rb_define_method(mIlu, "scale_colors", ilu_scale_colors, 3);
   rb_define_method(mIlu, "ScaleColors", ilu_scale_colors, 3);
   rb_define_method(mIlu, "scale_colours", ilu_scale_colors, 3);
   rb_define_method(mIlu, "ScaleColours", ilu_scale_colors, 3);
+  rb_define_method(mIlu, "stats", ilu_stats, 0);
+  rb_define_method(mIlu, "Stats", ilu_stats, 0);
   rb_define_method(mIlu, "swap_colors", ilu_swap_colors, 0);
   rb_define_method(mIlu, "SwapColors", ilu_swap_colors, 0);
   rb_define_method(mIlu, "swap_colours", ilu_swap_colors, 0);
@@ -1342,29 +10543,289 @@ void Init_devil(void) {
   rb_define_method(mIlu, "wave", ilu_wave, 1);
   rb_define_method(mIlu, "Wave", ilu_wave, 1);
 
+  /* allow DevIL::IL.foo as well as include DevIL::IL */
+  rb_extend_object(mIl, mIl);
+  rb_extend_object(mIlu, mIlu);
+
+  /* Batch methods */
+  rb_define_singleton_method(mBatch, "thumbnail", batch_thumbnail, -1);
+
+  /* Pool methods */
+  rb_define_alloc_func(cPool, pool_alloc);
+  rb_define_method(cPool, "initialize", pool_init, -1);
+  rb_define_method(cPool, "load", pool_load, -1);
+  rb_define_method(cPool, "save", pool_save, -1);
+  rb_define_method(cPool, "map", pool_map, -1);
+  rb_define_method(cPool, "size", pool_size, 0);
+  rb_define_method(cPool, "close", pool_close, 0);
+
+  /* Cache methods */
+  rb_define_alloc_func(cCache, cache_alloc);
+  rb_define_method(cCache, "initialize", cache_init, -1);
+  rb_define_method(cCache, "fetch", cache_fetch, -1);
+  rb_define_method(cCache, "key", cache_key_m, -1);
+  rb_define_method(cCache, "clear", cache_clear, 0);
+  rb_define_method(cCache, "dir", cache_dir, 0);
+  rb_define_method(cCache, "size", cache_size, 0);
+  rb_define_method(cCache, "max_size", cache_max_size, 0);
+  rb_define_method(cCache, "hits", cache_hits, 0);
+  rb_define_method(cCache, "misses", cache_misses, 0);
+
+  /* Image methods */
+  rb_define_alloc_func(cImage, image_alloc);
+  rb_define_singleton_method(cImage, "load", image_s_load, -1);
+  rb_define_method(cImage, "initialize", image_init, -1);
+  rb_define_method(cImage, "initialize_copy", image_init_copy, 1);
+  rb_define_method(cImage, "name", image_name, 0);
+  rb_define_method(cImage, "bind", image_bind, 0);
+  rb_define_method(cImage, "delete", image_delete, 0);
+  rb_define_method(cImage, "deleted?", image_deleted_p, 0);
+  rb_define_method(cImage, "width", image_width, 0);
+  rb_define_method(cImage, "height", image_height, 0);
+  rb_define_method(cImage, "depth", image_depth, 0);
+  rb_define_method(cImage, "bpp", image_bpp, 0);
+  rb_define_method(cImage, "format", image_format, 0);
+  rb_define_method(cImage, "pixel_type", image_pixel_type, 0);
+  rb_define_method(cImage, "apply_pal", image_il_apply_pal, -1);
+  rb_define_method(cImage, "apply_profile", image_il_apply_profile, -1);
+  rb_define_method(cImage, "blit", image_il_blit, -1);
+  rb_define_method(cImage, "clear_image", image_il_clear_im, -1);
+  rb_define_method(cImage, "convert_image", image_il_convert_im, -1);
+  rb_define_method(cImage, "convert_pal", image_il_convert_pal, -1);
+  rb_define_method(cImage, "copy_image", image_il_copy_im, -1);
+  rb_define_method(cImage, "copy_pixels", image_il_copy_pixels, -1);
+  rb_define_method(cImage, "default_image", image_il_default_im, -1);
+  rb_define_method(cImage, "get_data", image_il_get_data, -1);
+  rb_define_method(cImage, "get_dxtc_data", image_il_get_dxtc_data, -1);
+  rb_define_method(cImage, "get_integer", image_il_get_int, -1);
+  rb_define_method(cImage, "load", image_il_load, -1);
+  rb_define_method(cImage, "load_f", image_il_load_f, -1);
+  rb_define_method(cImage, "load_image", image_il_load_im, -1);
+  rb_define_method(cImage, "load_l", image_il_load_l, -1);
+  rb_define_method(cImage, "load_async", image_il_load_async, -1);
+  rb_define_method(cImage, "load_l_async", image_il_load_l_async, -1);
+  rb_define_method(cImage, "load_mmap", image_il_load_mmap, -1);
+  rb_define_method(cImage, "load_pal", image_il_load_pal, -1);
+  rb_define_method(cImage, "overlay_image", image_il_overlay_im, -1);
+  rb_define_method(cImage, "pixel_buffer", image_il_pixel_buffer, -1);
+  rb_define_method(cImage, "save", image_il_save, -1);
+  rb_define_method(cImage, "save_f", image_il_save_f, -1);
+  rb_define_method(cImage, "save_image", image_il_save_im, -1);
+  rb_define_method(cImage, "save_l", image_il_save_l, -1);
+  rb_define_method(cImage, "save_async", image_il_save_async, -1);
+  rb_define_method(cImage, "save_l_async", image_il_save_l_async, -1);
+  rb_define_method(cImage, "save_pal", image_il_save_pal, -1);
+  rb_define_method(cImage, "set_data", image_il_set_data, -1);
+  rb_define_method(cImage, "set_pixels", image_il_set_pixels, -1);
+  rb_define_method(cImage, "tex_image", image_il_tex_im, -1);
+  rb_define_method(cImage, "alienify", image_ilu_alienify, -1);
+  rb_define_method(cImage, "blur", image_ilu_blur, -1);
+  rb_define_method(cImage, "blur_avg", image_ilu_blur_avg, -1);
+  rb_define_method(cImage, "blur_gaussian", image_ilu_blur_gaussian, -1);
+  rb_define_method(cImage, "build_mipmaps", image_ilu_build_mipmaps, -1);
+  rb_define_method(cImage, "colors_used", image_ilu_colors_used, -1);
+  rb_define_method(cImage, "compare", image_ilu_compare, -1);
+  rb_define_method(cImage, "compare_image", image_ilu_compare_im, -1);
+  rb_define_method(cImage, "contrast", image_ilu_contrast, -1);
+  rb_define_method(cImage, "crop", image_ilu_crop, -1);
+  rb_define_method(cImage, "edge_detect_e", image_ilu_edge_detect_e, -1);
+  rb_define_method(cImage, "edge_detect_p", image_ilu_edge_detect_p, -1);
+  rb_define_method(cImage, "edge_detect_s", image_ilu_edge_detect_s, -1);
+  rb_define_method(cImage, "emboss", image_ilu_emboss, -1);
+  rb_define_method(cImage, "enlarge_canvas", image_ilu_enlarge_canvas, -1);
+  rb_define_method(cImage, "enlarge_image", image_ilu_enlarge_im, -1);
+  rb_define_method(cImage, "equalize", image_ilu_equalize, -1);
+  rb_define_method(cImage, "flip_image", image_ilu_flip_im, -1);
+  rb_define_method(cImage, "gamma_correct", image_ilu_gamma_correct, -1);
+  rb_define_method(cImage, "histogram", image_ilu_histogram, -1);
+  rb_define_method(cImage, "invert_alpha", image_ilu_invert_alpha, -1);
+  rb_define_method(cImage, "mipmap_chain", image_ilu_mipmap_chain, -1);
+  rb_define_method(cImage, "mirror", image_ilu_mirror, -1);
+  rb_define_method(cImage, "negative", image_ilu_negative, -1);
+  rb_define_method(cImage, "noisify", image_ilu_noisify, -1);
+  rb_define_method(cImage, "pixelize", image_ilu_pixelize, -1);
+  rb_define_method(cImage, "replace_color", image_ilu_replace_color, -1);
+  rb_define_method(cImage, "resample", image_ilu_resample, -1);
+  rb_define_method(cImage, "rotate", image_ilu_rotate, -1);
+  rb_define_method(cImage, "rotate_3d", image_ilu_rotate_3d, -1);
+  rb_define_method(cImage, "saturate_1f", image_ilu_saturate_1f, -1);
+  rb_define_method(cImage, "saturate_4f", image_ilu_saturate_4f, -1);
+  rb_define_method(cImage, "scale", image_ilu_scale, -1);
+  rb_define_method(cImage, "scale_async", image_ilu_scale_async, -1);
+  rb_define_method(cImage, "scale_colors", image_ilu_scale_colors, -1);
+  rb_define_method(cImage, "stats", image_ilu_stats, -1);
+  rb_define_method(cImage, "sharpen", image_ilu_sharpen, -1);
+  rb_define_method(cImage, "swap_colors", image_ilu_swap_colors, -1);
+  rb_define_method(cImage, "wave", image_ilu_wave, -1);
+
+  /* Pipeline methods */
+  rb_define_alloc_func(cPipeline, pipeline_alloc);
+  rb_define_method(cPipeline, "initialize", pipeline_init, 1);
+  for (i = 0; i < OP_COUNT; i++)
+    rb_define_method(cPipeline, op_table[i].name, pipeline_op, -1);
+  rb_define_method(cPipeline, "run", pipeline_run, 0);
+  rb_define_method(cPipeline, "ops", pipeline_ops, 0);
+  rb_define_method(cPipeline, "image", pipeline_image, 0);
+  rb_define_method(cPipeline, "save", pipeline_output, -1);
+  rb_define_method(cPipeline, "save_l", pipeline_output, -1);
+  rb_define_method(cPipeline, "get_data", pipeline_output, -1);
+
+  /*
+   * PixelBuffer methods.  Only these are Ractor-safe; everything else
+   * touches DevIL's global state and is left to the main Ractor.
+   */
+  rb_undef_alloc_func(cPixelBuffer);
+  rb_define_method(cPixelBuffer, "to_image", pixbuf_to_image, 0);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif
+  rb_define_method(cPixelBuffer, "width", pixbuf_width, 0);
+  rb_define_method(cPixelBuffer, "height", pixbuf_height, 0);
+  rb_define_method(cPixelBuffer, "depth", pixbuf_depth, 0);
+  rb_define_method(cPixelBuffer, "channels", pixbuf_channels, 0);
+  rb_define_method(cPixelBuffer, "bpp", pixbuf_bpp, 0);
+  rb_define_method(cPixelBuffer, "format", pixbuf_format, 0);
+  rb_define_method(cPixelBuffer, "pixel_type", pixbuf_pixel_type, 0);
+  rb_define_method(cPixelBuffer, "bytesize", pixbuf_bytesize, 0);
+  rb_define_method(cPixelBuffer, "dup", pixbuf_self, 0);
+  rb_define_method(cPixelBuffer, "clone", pixbuf_clone, -1);
+  rb_define_method(cPixelBuffer, "to_s", pixbuf_to_s, 0);
+  rb_define_method(cPixelBuffer, "get_bytes", pixbuf_get_bytes, 2);
+  rb_define_method(cPixelBuffer, "get_data", pixbuf_get_data, 0);
+  rb_define_method(cPixelBuffer, "rows", pixbuf_rows, 2);
+  rb_define_method(cPixelBuffer, "inspect", pixbuf_inspect, 0);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(false);
+#endif
+
 
   /***********************/
   /* initialize IL & ILU */
   /***********************/
-  ilInit();
-  iluInit();
+  pthread_key_create(&save_pool_key, save_pool_free);
+  recycle.max_bytes = RECYCLE_BYTES;
+  pool_limit = INT2FIX(32);
+  il_set_im_pool(1, &pool_limit, mIl);
+  convert_init();
+  resample_init();
+  mip_init();
+  metric_init();
+  pthread_atfork(NULL, NULL, devil_atfork_child);
+  if (rb_respond_to(rb_mProcess, rb_intern("_fork"))) {
+    VALUE hook = rb_define_module_under(mDevil, "ForkHook");
+    rb_define_method(hook, "_fork", devil_fork, 0);
+    rb_prepend_module(rb_singleton_class(rb_mProcess), hook);
+  }
+  pthread_atfork(NULL, NULL, par_atfork_child);
+  devil_worker_start();
+  devil_run(job_init, NULL);
 
   load_procs = rb_hash_new();
   save_procs = rb_hash_new();
+  rb_global_variable(&load_procs);
+  rb_global_variable(&save_procs);
+  id_call = rb_intern("call");
+
+  id_read = rb_intern("read");
+  id_readpartial = rb_intern("readpartial");
+  id_write = rb_intern("write");
+  id_seek = rb_intern("seek");
+  id_tell = rb_intern("pos");
+
+  data_views = rb_ary_new();
+  rb_global_variable(&data_views);
 }
 
 /*********************/
 /* UTILITY FUNCTIONS */
 /*********************/
-static char *get_ext(char *str) {
-  char *ext;
-  int len;
+/* the extension of a path, or NULL */
+static const char *get_ext(const char *str) {
+  const char *ext = str ? strrchr(str, '.') : NULL;
 
-  if (str && (len = strlen(str)) > 1)
-    for (ext = str + len; ext != str; ext--)
-      if (*ext == '.')
-        return strdup(ext + 1);
+  if (!ext || ext == str || !ext[1] || strchr(ext, '/'))
+    return NULL;
 
-  return NULL;
+  return ext + 1;
+}
+
+
+/* SHA-256 (FIPS 180-4), for content-addressed keys */
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(sha256_ctx *c, const unsigned char *p) {
+  uint32_t w[64], s[8], t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = (uint32_t) p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+  for (; i < 64; i++)
+    w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ w[i - 15] >> 3) +
+           w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+  memcpy(s, c->h, sizeof(s));
+  for (i = 0; i < 64; i++) {
+    t1 = s[7] + (ROR32(s[4], 6) ^ ROR32(s[4], 11) ^ ROR32(s[4], 25)) +
+         ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+    t2 = (ROR32(s[0], 2) ^ ROR32(s[0], 13) ^ ROR32(s[0], 22)) +
+         ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+    memmove(s + 1, s, 7 * sizeof(uint32_t));
+    s[4] += t1;
+    s[0] = t1 + t2;
+  }
+  for (i = 0; i < 8; i++)
+    c->h[i] += s[i];
+}
+
+static void sha256_init(sha256_ctx *c) {
+  static const uint32_t h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memcpy(c->h, h, sizeof(h));
+  c->len = 0;
+}
+
+static void sha256_update(sha256_ctx *c, const void *data, size_t len) {
+  const unsigned char *p = data;
+  size_t used = c->len % 64,
+         n;
+
+  c->len += len;
+  if (used) {
+    n = 64 - used < len ? 64 - used : len;
+    memcpy(c->buf + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64)
+      return;
+    sha256_block(c, c->buf);
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(c, p);
+  memcpy(c->buf, p, len);
 }
 
+static void sha256_final(sha256_ctx *c, unsigned char *out) {
+  uint64_t bits = c->len * 8;
+  unsigned char pad[72] = { 0x80 };
+  size_t n = (c->len % 64 < 56 ? 56 : 120) - c->len % 64;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    pad[n + i] = bits >> (56 - i * 8);
+  sha256_update(c, pad, n + 8);
+  for (i = 0; i < 32; i++)
+    out[i] = c->h[i / 4] >> (24 - i % 4 * 8);
+}
@@ -0,0 +1,40 @@
+/*
+ * Native codec plugins for DevIL-Ruby.
+ *
+ * A plugin is a shared object exporting
+ *
+ *   const devil_codec *devil_plugin_init(unsigned abi);
+ *
+ * which returns the description of its codec, or NULL if it wasn't
+ * built for plugin ABI version abi.  DevIL::IL.load_plugin(path) loads
+ * it and registers the codec for each of its extensions, replacing any
+ * earlier registration.  Plugins stay loaded for the life of the
+ * process.
+ *
+ * load and save are called like procs given to ilRegisterLoad and
+ * ilRegisterSave: on the thread running DevIL, with the image to load
+ * into or save bound, and return IL_NO_ERROR or an IL error code.  They
+ * may call IL and ILU but never Ruby.
+ */
+#ifndef DEVIL_PLUGIN_H
+#define DEVIL_PLUGIN_H
+
+#include <IL/il.h>
+
+#define DEVIL_PLUGIN_ABI   1
+#define DEVIL_PLUGIN_ENTRY "devil_plugin_init"
+
+typedef ILenum (*devil_codec_fn)(const char *path);
+
+typedef struct {
+  unsigned abi;                   /* DEVIL_PLUGIN_ABI */
+  unsigned size;                  /* sizeof(devil_codec) */
+  const char *name;
+  const char *const *extensions;  /* without the dot, NULL terminated */
+  devil_codec_fn load,            /* NULL if the codec can't load */
+                 save;            /* NULL if the codec can't save */
+} devil_codec;
+
+typedef const devil_codec *(*devil_plugin_init_fn)(unsigned abi);
+
+#endif
@@ -1,6 +1,27 @@
-
 require 'mkmf'
 
+# release the GVL around DevIL calls where the ruby API allows it
+have_header('ruby/thread.h') and
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# zero-copy pixel views for get_data
+have_header('ruby/io/buffer.h') and
+  have_func('rb_io_buffer_new', 'ruby/io/buffer.h')
+have_func('rb_str_new_static')
+# async bindings wait through the Fiber::Scheduler on an eventfd or pipe
+have_header('ruby/fiber/scheduler.h') and
+  have_func('rb_fiber_scheduler_io_wait', 'ruby/fiber/scheduler.h')
+have_header('sys/eventfd.h')
+# Ractor-shareable DevIL::PixelBuffer and Ractor-safe readers
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_header('ruby/ractor.h') and
+  have_func('rb_ractor_make_shareable', 'ruby/ractor.h')
+# shared memory for DevIL::Pool transfers
+have_func('memfd_create', 'sys/mman.h')
+# codec plugins; dlopen is in libc on newer glibc
+have_func('dlopen', 'dlfcn.h') or have_library('dl', 'dlopen', 'dlfcn.h')
+
+have_library('pthread', 'pthread_create') and
 have_library('IL', 'ilInit') and
 have_library('ILU', 'iluInit') and
   create_makefile('devil')